@@ -1,11 +1,30 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "beargit.h"
+#include "commitgraph.h"
+#include "commitlog.h"
+#include "config.h"
+#include "diff.h"
+#include "ignore.h"
+#include "index.h"
+#include "msgindex.h"
+#include "journal.h"
+#include "objects.h"
+#include "pack.h"
+#include "refs.h"
+#include "repo.h"
+#include "scan.h"
+#include "sparse.h"
+#include "state.h"
 #include "util.h"
+#include "workers.h"
 
 /* Implementation Notes:
  *
@@ -25,30 +44,36 @@
  *     needs to be large enough to hold that string.
  *  - You NEED to test your code. The autograder we provide does not contain the
  *    full set of tests that we will run on your code. See "Step 5" in the homework spec.
+ * - Every command is implemented against a repository handle (beargit_repo_*,
+ *   see repo.h); the beargit_* functions open a handle for just one command.
  */
 
 /* beargit init
  *
  * - Create .beargit directory
+ * - Create .beargit/objects directory for the object store
  * - Create empty .beargit/.index file
- * - Create .beargit/.prev file containing 0..0 commit id
+ * - Create .beargit/.refs with the master branch (see refs.h)
+ * - Create .beargit/.state on commit 0..0 of branch master (see state.h)
  *
  * Output (to stdout):
  * - None if successful
  */
 
 int beargit_init(void) {
+  // Forget the pack of a repository that may have been here before.
+  pack_close();
+
   fs_mkdir(".beargit");
+  fs_mkdir(OBJECTS_DIR);
 
   FILE* findex = fopen(".beargit/.index", "w");
   fclose(findex);
 
-  FILE* fbranches = fopen(".beargit/.branches", "w");
-  fprintf(fbranches, "%s\n", "master");
-  fclose(fbranches);
-   
-  write_string_to_file(".beargit/.prev", "0000000000000000000000000000000000000000");
-  write_string_to_file(".beargit/.current_branch", "master");
+  refs_init("0000000000000000000000000000000000000000");
+
+  repo_state state = { .head = "0000000000000000000000000000000000000000", .branch = "master" };
+  state_write(&state);
 
   return 0;
 }
@@ -67,60 +92,173 @@ int beargit_init(void) {
  */
 
 int beargit_add(const char* filename) {
-  FILE* findex = fopen(".beargit/.index", "r");
-  FILE *fnewindex = fopen(".beargit/.newindex", "w");
+  if (index_add_path(filename)) {
+    fprintf(stderr, "ERROR: File %s already added\n", filename);
+    return 3;
+  }
+
+  return 0;
+}
+
+/* beargit add <path> [<path> ...]
+ * beargit add --all
+ *
+ * - Add any number of files and directories in one go. Directories are scanned
+ *   recursively (in parallel) and every regular file below them whose name
+ *   doesn't start with '.' is added; "." (or --all) adds the whole working
+ *   directory.
+ * - Directory scans leave out what .beargitignore ignores (see ignore.h), and
+ *   don't descend into ignored directories. Files named explicitly are added
+ *   anyway.
+ * - Files found in a directory that are already tracked are skipped. The index
+ *   is read once and written once, however many files are added.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: File <filename> already added
+ *    (only for files named explicitly; all other files are still added)
+ * >> ERROR: No or invalid filename given
+ *    (for a path outside the working directory or inside .beargit; "." and
+ *    ".." are resolved first, so "d/../a.c" is "a.c")
+ *
+ * Output (to stdout):
+ * - None if successful
+ */
+
+int beargit_repo_add(beargit_repo_t* repo, int npaths, char* const* paths) {
+  // Until the index is in memory, a single file is added to the file in place.
+  if (npaths == 1 && !repo->index_loaded) {
+    char path[FILENAME_SIZE];
+    if (normalize_path(paths[0], path) == 0 && !fs_check_dir_exists(path))
+      return beargit_add(path);
+  }
+
+  beargit_index* index = beargit_repo_index(repo);
+  repo->index_changed = 1;
+
+  ignore_rules ignore;
+  int ignore_loaded = 0;
+
+  int ret = 0;
+  for (int i = 0; i < npaths; i++) {
+    char path[FILENAME_SIZE];
+    if (normalize_path(paths[i], path) != 0) {
+      fprintf(stderr, "ERROR: No or invalid filename given\n");
+      ret = 1;
+      continue;
+    }
 
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    if (strcmp(line, filename) == 0) {
-      fprintf(stderr, "ERROR: File %s already added\n", filename);
-      fclose(findex);
-      fclose(fnewindex);
-      fs_rm(".beargit/.newindex");
-      return 3;
+    if (fs_check_dir_exists(path)) {
+      if (!ignore_loaded) {
+        ignore_read(&ignore);
+        ignore_loaded = 1;
+      }
+      scan_result files = { 0 };
+      scan_directory(path, &ignore, &files);
+      for (int j = 0; j < files.count; j++) {
+        if (index_find(index, files.entries[j].path) >= 0)
+          continue;
+        index_entry* entry = index_add(index, files.entries[j].path);
+        index_entry_set_stat(entry, &files.entries[j].st);
+        beargit_repo_touch(repo, entry->path);
+      }
+      scan_result_free(&files);
+      continue;
     }
 
-    fprintf(fnewindex, "%s\n", line);
+    if (index_find(index, path) >= 0) {
+      fprintf(stderr, "ERROR: File %s already added\n", path);
+      ret = 3;
+      continue;
+    }
+
+    index_entry* entry = index_add(index, path);
+    struct stat s;
+    if (stat(path, &s) == 0)
+      index_entry_set_stat(entry, &s);
+    beargit_repo_touch(repo, path);
   }
 
-  fprintf(fnewindex, "%s\n", filename);
-  fclose(findex);
-  fclose(fnewindex);
+  if (ignore_loaded)
+    ignore_free(&ignore);
+  return ret;
+}
 
-  fs_mv(".beargit/.newindex", ".beargit/.index");
+int beargit_repo_add_all(beargit_repo_t* repo) {
+  char* all = ".";
+  return beargit_repo_add(repo, 1, &all);
+}
 
-  return 0;
+int beargit_add_all() {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_add_all(repo);
+  beargit_repo_close(repo);
+  return ret;
+}
+
+int beargit_add_paths(int npaths, char* const* paths) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_add(repo, npaths, paths);
+  beargit_repo_close(repo);
+  return ret;
 }
 
 /* beargit status
  *
  * - Read the file .beargit/.index and print a line for each tracked file. 
  * Unlike git status, beargit status should not print anything about untracked files.
+ * - If tracked files changed since they were last committed, list them in a
+ *   "Modified files" section after the total. Files whose stat data matches
+ *   the index are not read; files whose contents turn out to be unchanged get
+ *   their cached stat data refreshed. With a watch on the tracked files
+ *   (see repo.h), only the files that changed since they were last checked
+ *   are looked at.
  *
  * Output (to stdout):
  * - Always return 0 (indicate success)
  *
  */
 
-int beargit_status() {
+int beargit_repo_status(beargit_repo_t* repo) {
   /* COMPLETE THE REST */
+  beargit_index* index = beargit_repo_index(repo);
+
   fprintf(stdout, "Tracked files:\n\n");
-  FILE* findex = fopen(".beargit/.index", "r");
-  
-  int count = 0;
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    fprintf(stdout, "  %s\n", line);
-    ++count;
-  }
-  fprintf(stdout, "\n%d files total\n", count);
-  fclose(findex);
+  for (int i = 0; i < index->count; i++) {
+    fprintf(stdout, "  %s\n", index->entries[i].path);
+  }
+  fprintf(stdout, "\n%d files total\n", index->count);
+
+  beargit_repo_poll(repo);
+  int* positions;
+  int npositions = beargit_repo_dirty_entries(repo, &positions);
+  int modified = 0;
+  for (int k = 0; k < npositions; k++) {
+    index_entry* entry = &index->entries[positions[k]];
+    int state = beargit_repo_refresh(repo, entry);
+    if (state == ENTRY_REFRESHED) {
+      repo->index_changed = 1;
+    } else if (state == ENTRY_MODIFIED || state == ENTRY_MISSING) {
+      if (!modified)
+        fprintf(stdout, "\nModified files:\n\n");
+      fprintf(stdout, "  %s%s\n", entry->path,
+              state == ENTRY_MISSING ? " (deleted)" : "");
+      modified++;
+    }
+  }
+  free(positions);
+  if (modified)
+    fprintf(stdout, "\n%d files modified\n", modified);
 
   return 0;
 }
 
+int beargit_status() {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_status(repo);
+  beargit_repo_close(repo);
+  return ret;
+}
+
 /* beargit rm <filename>
  * 
  * The rm command in beargit takes in a single argument,
@@ -137,41 +275,113 @@ int beargit_status() {
 
 int beargit_rm(const char* filename) {
   /* COMPLETE THE REST */
-  FILE* findex = fopen(".beargit/.index", "r");
-  FILE *fnewindex = fopen(".beargit/.newindex", "w");
+  if (index_remove_path(filename)) {
+      fprintf(stderr, "ERROR: File %s not tracked\n", filename);
+      return 1;
+  }
 
-  char line[FILENAME_SIZE];
-  int hasfile = 0;
+  return 0;
+}
 
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    if (strcmp(line, filename) == 0) {
-      hasfile = 1;
-    } else {
-      fprintf(fnewindex, "%s\n", line);
+/* beargit rm <path> [<path> ...]
+ *
+ * - Remove any number of files from the index. A directory removes every
+ *   tracked file below it; "." removes all tracked files.
+ * - The index is read once and written once.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: File <filename> not tracked
+ *    (for a directory: if no tracked file is below it; all other paths are still removed)
+ * >> ERROR: No or invalid filename given
+ *    (as for add)
+ *
+ * Output (to stdout):
+ * - None if successful and Otherwise, return 1
+ */
+
+// The prefix of the paths below directory <dir>: "<dir>/", or "" for ".".
+static void dir_prefix(const char* dir, char* prefix) {
+  if (strcmp(dir, ".") == 0)
+    prefix[0] = '\0';
+  else
+    sprintf(prefix, "%s/", dir);
+}
+
+int beargit_repo_rm(beargit_repo_t* repo, int npaths, char* const* paths) {
+  // Until the index is in memory, a single file or directory is removed
+  // from the file in place.
+  if (npaths == 1 && !repo->index_loaded) {
+    char path[FILENAME_SIZE];
+    if (normalize_path(paths[0], path) == 0) {
+      if (!fs_check_dir_exists(path))
+        return beargit_rm(path);
+
+      char prefix[FILENAME_SIZE + 1];
+      dir_prefix(path, prefix);
+      if (index_remove_prefix(prefix) == 0) {
+        fprintf(stderr, "ERROR: File %s not tracked\n", path);
+        return 1;
+      }
+      return 0;
     }
   }
 
-  if (!hasfile) {
-      fprintf(stderr, "ERROR: File %s not tracked\n", filename);
-      fclose(findex);
-      fclose(fnewindex);
-      fs_rm(".beargit/.newindex");
-      return 1;
+  beargit_index* index = beargit_repo_index(repo);
+  repo->index_changed = 1;
+
+  char* marked = calloc(index->count + 1, 1);
+  int ret = 0;
+  for (int i = 0; i < npaths; i++) {
+    char path[FILENAME_SIZE];
+    if (normalize_path(paths[i], path) != 0) {
+      fprintf(stderr, "ERROR: No or invalid filename given\n");
+      ret = 1;
+      continue;
+    }
+
+    int found = 0;
+    if (fs_check_dir_exists(path)) {
+      char prefix[FILENAME_SIZE + 1];
+      dir_prefix(path, prefix);
+
+      for (int j = 0; j < index->count; j++) {
+        if (strncmp(index->entries[j].path, prefix, strlen(prefix)) == 0) {
+          marked[j] = 1;
+          found = 1;
+        }
+      }
+    } else {
+      int pos = index_find(index, path);
+      if (pos >= 0) {
+        marked[pos] = 1;
+        found = 1;
+      }
+    }
+
+    if (!found) {
+      fprintf(stderr, "ERROR: File %s not tracked\n", path);
+      ret = 1;
+    }
   }
 
-  fclose(findex);
-  fclose(fnewindex);
-  fs_mv(".beargit/.newindex", ".beargit/.index");
+  index_remove_marked(index, marked);
+  free(marked);
 
-  return 0;
+  return ret;
+}
+
+int beargit_rm_paths(int npaths, char* const* paths) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_rm(repo, npaths, paths);
+  beargit_repo_close(repo);
+  return ret;
 }
 
-/* beargit commit -m <msg>
+/* beargit commit -m <msg> [-j <jobs>]
  *
  * The commit command involves a couple of steps:
  * First, check whether the commit string contains "GO BEARS!". If not, display an error message.
- * Read the ID of the previous last commit from .beargit/.prev
+ * Read the ID of the previous last commit from the repository state (.beargit/.state)
  * Generate the next ID (newid) in such a way that:
  * ID Length is COMMIT_ID_BYTES (not including NULL terminator)
  * All characters of the id are either 6, 1 or c
@@ -179,12 +389,20 @@ int beargit_rm(const char* filename) {
  * Calling next_commit_id(char* commit_id) results in commit_id being updated to a ID.
  * The ID string consists of a branch-id (of size COMMIT_ID_BRANCH_BYTES) followed by a tag-id to fill the rest of the size of the ID. (Note: the tag-id used here has nothing to do with a git tag, git tags aren't involved in this project!)
  * We have implemented the branch-id step for you in next_commit_id(char* commit_id). Don't worry too much about where the branch-id is coming from yet (more on that in part 5), but pay close attention to what indices in the commit_id string are being updated and how the pointer is being passed to next_commit_id_part1(). To finish the next ID generation you will need to complete next_commit_id_part1().
- * Generate a new directory .beargit/<newid> and copy .beargit/.index, .beargit/.prev and all tracked files into the directory.
+ * Generate a new directory .beargit/<newid> and write the previous ID into .beargit/<newid>/.prev.
+ * Store every tracked file in the object store (.beargit/objects) and record a manifest of
+ * "<blob-id> <filename>" lines in .beargit/<newid>/.manifest. Blobs already in the store are not written again,
+ * and files whose stat data still matches the index are not even read. Files are stored by <jobs> worker
+ * threads (one per CPU by default); if any of them can't be stored, the commit is abandoned.
  * Store the commit message (<msg>) into .beargit/<newid>/.msg
- * Write the new ID into .beargit/.prev.
+ * Write the new ID into the repository state. Nothing before that changes what is checked out, so
+ * a commit cut short leaves the previous one current, and the next commit reuses its directory.
+ * If a merge is in progress (see beargit merge), the commit concludes it: the commit merged in
+ * becomes its second parent.
  * 
  * Possible errors (to stderr):
  * >> ERROR: Message must contain "GO BEARS!"
+ * >> ERROR: Couldn't store <filename>: <reason>
  *
  * Output (to stdout):
  * - If the commit message does not contain the exact string "GO BEARS!", return 1. Otherwise, return 0.
@@ -238,71 +456,214 @@ void next_commit_id_part1(char* commit_id) {
   }
 }
 
-void move_alltracked_file(const char *new_dir_name) {
-  
-  FILE* findex = fopen(".beargit/.index", "r");
-  char filename[FILENAME_SIZE];
+/* Parallel file jobs
+ *
+ * Commit and checkout copy many independent files, so they hand them to a
+ * bounded pool of worker threads (beargit_set_jobs, set by -j, defaults to
+ * the number of CPUs). The first failure stops the remaining jobs, and
+ * run_file_jobs reports it so the command can abort cleanly.
+ */
+
+static int jobs = 0;
+
+void beargit_set_jobs(int n) {
+  jobs = n;
+}
 
-  char line[FILENAME_SIZE];
-  while(fgets(filename, sizeof(line), findex)) {
-    strtok(filename, "\n");
-    char copied_filename[MAX_LENGTH];
-    sprintf(copied_filename,"%s/%s", new_dir_name, filename);
+typedef struct {
+  index_entry* entry;
+  const char* commit_dir;
+  struct stat st;
+  int error;            // errno of the failure, 0 if the job succeeded
+  int* failed;          // shared between all jobs of one run
+} file_job;
+
+static int run_file_jobs(file_job* file_jobs, int njobs, worker_fn fn, const char* what) {
+  int failed = 0;
+  int nthreads = jobs > 0 ? jobs : workers_default_count();
+  if (nthreads > njobs)
+    nthreads = njobs;
+
+  if (njobs > 0) {
+    worker_pool* pool = workers_start(nthreads, 4 * nthreads);
+    for (int i = 0; i < njobs; i++) {
+      file_jobs[i].failed = &failed;
+      workers_submit(pool, fn, &file_jobs[i]);
+    }
+    workers_stop(pool);
+  }
 
-    fs_cp(filename, copied_filename);
+  for (int i = 0; i < njobs; i++) {
+    if (file_jobs[i].error) {
+      fprintf(stderr, "ERROR: Couldn't %s %s: %s\n", what, file_jobs[i].entry->path,
+              strerror(file_jobs[i].error));
+      return 1;
+    }
   }
-  fclose(findex);
+  return 0;
 }
 
-int beargit_commit(const char* msg) {
-  
-  char current_branch[BRANCHNAME_SIZE];
-  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
-  if (!strlen(current_branch)) {
-    fprintf(stderr, "ERROR: Need to be on HEAD of a branch to commit");
+static int file_job_skipped(file_job* job) {
+  return __atomic_load_n(job->failed, __ATOMIC_RELAXED);
+}
+
+static void file_job_fail(file_job* job) {
+  job->error = errno ? errno : EIO;
+  __atomic_store_n(job->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void store_file_job(void* arg) {
+  file_job* job = arg;
+  if (file_job_skipped(job))
+    return;
+
+  if (object_store_file(job->entry->path, job->entry->blob_id) < 0) {
+    file_job_fail(job);
+    return;
   }
+  index_entry_set_stat(job->entry, &job->st);
+}
 
-  if (!is_commit_msg_ok(msg)) {
-    fprintf(stderr, "ERROR: Message must contain \"%s\"\n", go_bears);
-    return 1;
+// Stores every changed tracked file and writes the manifest of the commit.
+// Only the entries at <positions> can have changed; files outside <sparse>
+// that aren't there keep their blobs. Updates <index>, which the caller
+// writes once the objects are published.
+int move_alltracked_file(const char *new_dir_name, beargit_index* index,
+                         const int* positions, int npositions,
+                         const sparse_patterns* sparse) {
+  file_job* file_jobs = calloc(npositions + 1, sizeof(file_job));
+  int njobs = 0;
+  for (int k = 0; k < npositions; k++) {
+    index_entry* entry = &index->entries[positions[k]];
+
+    struct stat s;
+    if (stat(entry->path, &s) != 0) {
+      if (errno == ENOENT && entry->blob_id[0] && !sparse_includes(sparse, entry->path))
+        continue;
+      fprintf(stderr, "ERROR: Couldn't store %s: %s\n", entry->path, strerror(errno));
+      free(file_jobs);
+      return 1;
+    }
+    if (index_entry_is_clean(index, entry, &s))
+      continue;
+
+    file_jobs[njobs].entry = entry;
+    file_jobs[njobs].st = s;
+    njobs++;
   }
 
+  int ret = run_file_jobs(file_jobs, njobs, store_file_job, "store");
+  free(file_jobs);
+
+  if (ret == 0)
+    index_write_manifest(index, new_dir_name);
+  return ret;
+}
+
+static void next_commit_id_on_branch(const char* branch, char* commit_id);
+
+// Commits the index with message <msg>, on top of HEAD and, during a
+// merge, of the commit being merged.
+static int commit_index(beargit_repo_t* repo, const char* msg) {
+  repo_state* state = &repo->state;
   char commit_id[COMMIT_ID_SIZE];
-  read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
-  next_commit_id(commit_id); 
+  strcpy(commit_id, state->head);
+  next_commit_id_on_branch(state->branch, commit_id);
 
   /* COMPLETE THE REST */
+  // Everything up to journal_commit is undone if the commit fails or
+  // crashes (see journal.h). The directory may still be left over from a
+  // commit that crashed with durability "none"; its files are all rewritten
+  // below.
   char new_dir_name[MAX_LENGTH];
   sprintf(new_dir_name, ".beargit/%s", commit_id);
-  fs_mkdir(new_dir_name);
-
-  move_alltracked_file(new_dir_name);
-
-  char copied_index_file[MAX_LENGTH];
-  sprintf(copied_index_file, "%s/.index", new_dir_name);
-  fs_cp(".beargit/.index", copied_index_file);
+  if (!fs_check_dir_exists(new_dir_name))
+    fs_mkdir(new_dir_name);
+
+  // Staged changes go to disk first: a failed commit drops the index from
+  // memory, since it then refers to objects that were never published.
+  beargit_repo_flush(repo);
+  beargit_index* index = beargit_repo_index(repo);
+  beargit_repo_poll(repo);
+  int* positions;
+  int npositions = beargit_repo_dirty_entries(repo, &positions);
+  journal_begin(state, commit_id);
+  if (move_alltracked_file(new_dir_name, index, positions, npositions, beargit_repo_sparse(repo))) {
+    free(positions);
+    index_free(index);
+    repo->index_loaded = 0;
+    journal_abort();
+    rmdir(new_dir_name);
+    return 1;
+  }
 
   char copied_prev_file[MAX_LENGTH];
   sprintf(copied_prev_file, "%s/.prev", new_dir_name);
-  fs_cp(".beargit/.prev", copied_prev_file);
+  write_string_to_file(copied_prev_file, state->head);
 
   char msg_file[MAX_LENGTH];
   sprintf(msg_file, "%s/.msg", new_dir_name);
   write_string_to_file(msg_file, msg);
 
-  write_string_to_file(".beargit/.prev", commit_id);
-  
-
+  msgindex_append(beargit_repo_commit_log(repo)->count, msg);
+  commitlog_append(commit_id, state->head, state->merge_head[0] ? state->merge_head : NULL, msg);
+  commitgraph_close(&repo->graph);
+  repo->graph_open = 0;
+  msgindex_close(&repo->msgs);
+  repo->msgs_open = 0;
+  commitlog_close(&repo->log);
+  repo->log_open = 0;
+
+  strcpy(state->head, commit_id);
+  state->merge_head[0] = '\0';
+  journal_commit(state);
+  index_write(index);
+  state_write(state);
+  journal_finish();
+
+  // The stored files match the index now.
+  for (int k = 0; k < npositions && repo->watch; k++)
+    watch_clear(repo->watch, index->entries[positions[k]].path);
+  free(positions);
   return 0;
 }
 
+int beargit_repo_commit(beargit_repo_t* repo, const char* msg) {
+  repo_state* state = &repo->state;
+  if (!strlen(state->branch)) {
+    fprintf(stderr, "ERROR: Need to be on HEAD of a branch to commit");
+  }
+
+  if (!is_commit_msg_ok(msg)) {
+    fprintf(stderr, "ERROR: Message must contain \"%s\"\n", go_bears);
+    return 1;
+  }
+
+  return commit_index(repo, msg);
+}
+
+int beargit_commit(const char* msg) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_commit(repo, msg);
+  beargit_repo_close(repo);
+  return ret;
+}
+
 /* beargit log
  *
- * - List all commits, latest to oldest. .beargit/.prev contains the ID of the latest commit, 
+ * - List all commits, latest to oldest. The repository state contains the ID of the latest commit, 
  * and each directory .beargit/ contains a .prev file pointing to that commit's predecessor.
+ *   The same links and the messages are kept in the mapped commit log (see commitlog.h), so the
+ *   walk only falls back to the per-commit files for commits made before the log existed.
  * - For each commit, print the commit's ID followed by the commit message (see below for the exact format).
  * - If you pass in the -n flag (e.g. beargit -n 10), then limit the number of log records printed to the amount specified. 
  *   If the -n flag is not passed, then the argument "int limit" will be set to INT_MAX.
+ * - With a <commit> (given as for beargit diff), list the commits from that one back instead.
+ * - With --grep <term> (any number of times), only list the commits whose messages contain
+ *   every term, in any case and with its words as whole words (see msgindex.h). Candidates
+ *   are looked up in the message index, then their messages and their ancestry (in the commit
+ *   graph) are checked, so neither the commits in between nor any commit directory are read.
+ *   Commits made before the commit log existed are never listed.
  * 
  * Possible errors (to stderr):
  * >> ERROR: There are no commits!
@@ -312,32 +673,66 @@ int beargit_commit(const char* msg) {
  * 
  */
 
-int beargit_log(int limit) {
+// Reads the parent and message of a commit that isn't in the commit log, from
+// its directory or, once it was repacked, from the pack. <parent> may be
+// <commit_id> itself.
+static void read_commit_info(const char* commit_id, char* parent, char* msg) {
+  const char* data;
+  size_t size;
+  if (pack_find(commit_id, PACK_COMMIT, &data, &size)) {
+    const char* manifest;
+    size_t manifest_size;
+    ASSERT_ERROR_MESSAGE(pack_parse_commit(data, size, parent, msg, MSG_SIZE,
+                                           &manifest, &manifest_size) == 0,
+                         "malformed commit in pack");
+    return;
+  }
+
+  char commit_dir[MAX_LENGTH];
+  sprintf(commit_dir, ".beargit/%s", commit_id);
+
+  char msg_file_name[MAX_LENGTH];
+  sprintf(msg_file_name, "%s/.msg", commit_dir);
+  read_string_from_file(msg_file_name, msg, MSG_SIZE);
+
+  char prev_file[MAX_LENGTH];
+  sprintf(prev_file, "%s/.prev", commit_dir);
+  read_string_from_file(prev_file, parent, COMMIT_ID_SIZE);
+}
+
+static int resolve_commit(beargit_repo_t* repo, const char* arg, char* commit_id);
+
+int beargit_repo_log(beargit_repo_t* repo, int limit, const char* from) {
   /* COMPLETE THE REST */
   char commit_id[COMMIT_ID_SIZE];
-  read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+  strcpy(commit_id, repo->state.head);
+  if (from && resolve_commit(repo, from, commit_id))
+    return 1;
   if (strcmp(commit_id, "0000000000000000000000000000000000000000") == 0) {
     fprintf(stderr, "ERROR: There are no commits!\n");
     return 1;
   }
 
+  const commit_log* log = beargit_repo_commit_log(repo);
+  int64_t pos = commitlog_find(log, commit_id);
+
   fprintf(stdout, "\n");
   while (limit--) {
     fprintf(stdout, "commit %s\n", commit_id);
-    char commit_dir[MAX_LENGTH];
-    sprintf(commit_dir, ".beargit/%s", commit_id);
-
-    char msg_file_name[MAX_LENGTH];
-    sprintf(msg_file_name, "%s/.msg", commit_dir);
-
-    char msg[MSG_SIZE];
-    read_string_from_file(msg_file_name, msg, MSG_SIZE);
-    fprintf(stdout, "    %s\n\n", msg);
 
-    char prev_file[MAX_LENGTH];
-    sprintf(prev_file, "%s/.prev", commit_dir);
+    const char* msg = pos >= 0 ? commitlog_message(log, &log->records[pos]) : NULL;
+    if (msg) {
+      fprintf(stdout, "    %s\n\n", msg);
+      memcpy(commit_id, log->records[pos].parent, COMMIT_ID_BYTES);
+      pos = log->records[pos].parent_pos;
+    } else {
+      // Commits made before the commit log existed
+      char file_msg[MSG_SIZE];
+      read_commit_info(commit_id, commit_id, file_msg);
+      fprintf(stdout, "    %s\n\n", file_msg);
+      pos = -1;
+    }
 
-    read_string_from_file(prev_file, commit_id, COMMIT_ID_SIZE);
     if (strcmp(commit_id, "0000000000000000000000000000000000000000") == 0) {
       break;
     }
@@ -346,18 +741,62 @@ int beargit_log(int limit) {
   return 0;
 }
 
+int beargit_log(int limit) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_log(repo, limit, NULL);
+  beargit_repo_close(repo);
+  return ret;
+}
 
-const char* digits = "61c";
+int beargit_repo_log_grep(beargit_repo_t* repo, int limit, const char* from,
+                          int nterms, char* const* terms) {
+  char commit_id[COMMIT_ID_SIZE];
+  strcpy(commit_id, repo->state.head);
+  if (from && resolve_commit(repo, from, commit_id))
+    return 1;
+  if (strcmp(commit_id, "0000000000000000000000000000000000000000") == 0) {
+    fprintf(stderr, "ERROR: There are no commits!\n");
+    return 1;
+  }
 
-void next_commit_id(char* commit_id) {
-  char current_branch[BRANCHNAME_SIZE];
-  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
+  const commit_log* log = beargit_repo_commit_log(repo);
+  const commit_graph* graph = beargit_repo_commit_graph(repo);
+  int64_t* positions;
+  int64_t count = msgindex_search(beargit_repo_msg_index(repo), nterms, terms, &positions);
+
+  // Record numbers grow from parents to children, so going backwards lists
+  // the matches latest to oldest.
+  int64_t from_pos = commitgraph_find(graph, commit_id);
+  fprintf(stdout, "\n");
+  for (int64_t i = count - 1; i >= 0 && from_pos >= 0 && limit > 0; i--) {
+    if (!commitgraph_is_ancestor(graph, positions[i], from_pos))
+      continue;
+    const commit_record* record = &log->records[positions[i]];
+    fprintf(stdout, "commit %.40s\n", record->id);
+    fprintf(stdout, "    %s\n\n", commitlog_message(log, record));
+    limit--;
+  }
+  free(positions);
+  return 0;
+}
+
+int beargit_log_grep(int limit, int nterms, char* const* terms) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_log_grep(repo, limit, NULL, nterms, terms);
+  beargit_repo_close(repo);
+  return ret;
+}
 
+
+const char* digits = "61c";
+
+// The id of the commit that follows <commit_id> on branch <branch>.
+static void next_commit_id_on_branch(const char* branch, char* commit_id) {
   // The first COMMIT_ID_BRANCH_BYTES=10 characters of the commit ID will
   // be used to encode the current branch number. This is necessary to avoid
   // duplicate IDs in different branches, as they can have the same pre-
   // decessor (so next_commit_id has to depend on something else).
-  int n = get_branch_number(current_branch);
+  int n = get_branch_number(branch);
   for (int i = 0; i < COMMIT_ID_BRANCH_BYTES; i++) {
     commit_id[i] = digits[n%3];
     n /= 3;
@@ -367,33 +806,24 @@ void next_commit_id(char* commit_id) {
   next_commit_id_part1(commit_id + COMMIT_ID_BRANCH_BYTES);
 }
 
+void next_commit_id(char* commit_id) {
+  repo_state state;
+  state_read(&state);
+  next_commit_id_on_branch(state.branch, commit_id);
+}
+
 
 // This helper function returns the branch number for a specific branch, or
 // returns -1 if the branch does not exist.
 int get_branch_number(const char* branch_name) {
-  FILE* fbranches = fopen(".beargit/.branches", "r");
-
-  int branch_index = -1;
-  int counter = 0;
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), fbranches)) {
-    strtok(line, "\n");
-    if (strcmp(line, branch_name) == 0) {
-      branch_index = counter;
-    }
-    counter++;
-  }
-
-  fclose(fbranches);
-
-  return branch_index;
+  return refs_find(branch_name, NULL);
 }
 
 /* beargit branch
  *
  * Beargit branch prints all the branches and puts a star in front of the current one. 
- * Do you remember beargit status? This is almost the same: you need to read the entire .branches file line by line and output it.
- * However, you also need to check each line against the string in .current_branch.
+ * Do you remember beargit status? This is almost the same: you need to go through every branch in the refs database (refs_for_each) and output it.
+ * However, you also need to check each line against the current branch in the repository state.
  * If they are the same, you need to print a * in front of it.
  * Note that we require you to print branches in the order of creation, from oldest to latest. 
  * Also note that if you have checked out a commit previously (in contrast to a branch), 
@@ -404,35 +834,36 @@ int get_branch_number(const char* branch_name) {
  * This function should always return 0 (indicating success) and should never output to stderr.
  */
 
-int beargit_branch() {
-  /* COMPLETE THE REST */
-  char current_branch[BRANCHNAME_SIZE];
-  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
-  
-  FILE* fbranches = fopen(".beargit/.branches", "r");
-  char line[BRANCHNAME_SIZE];
-  while(fgets(line, sizeof(line), fbranches)) {
-    strtok(line, "\n");
-    if (strcmp(line, current_branch) == 0) {
-      fprintf(stdout, "*");
-    }
-    fprintf(stdout, " %s\n", line);
+static void print_branch(const char* name, const char* head, void* current_branch) {
+  (void) head;
+  if (strcmp(name, current_branch) == 0) {
+    fprintf(stdout, "*");
   }
-  fclose(fbranches);
+  fprintf(stdout, " %s\n", name);
+}
 
+int beargit_repo_branch(beargit_repo_t* repo) {
+  refs_for_each(print_branch, repo->state.branch);
   return 0;
 }
 
+int beargit_branch() {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_branch(repo);
+  beargit_repo_close(repo);
+  return ret;
+}
+
 /* beargit checkout
  *
  * Once you know whether you are dealing with a branch or a commit, you have to do one of two things:
  * If it's a commit, check out the commit by replacing the currently tracked files with those from the time of the commit.
  * If it's a branch (and you're not creating a new one), first check whether it exists. If yes, you need to switch to that branch. 
- * This means that you first store the latest commit of the current branch into the branch_branchname file, 
- * and then replace the content of current_branch by the new branch. You then read the branch_newbranch file to find out the HEAD commit of that branch, 
+ * This means that you first store the latest commit of the current branch as its head in the refs database (refs.h),
+ * and then replace the content of current_branch by the new branch. You then look up the new branch to find out its HEAD commit,
  * and then you check that commit out just like in 1). You are creating a new branch. 
- * This is very similar to 2), but you also have to add the branch to the .branches file and instead of reading the HEAD ID from .branch_branchname, 
- * you make the current prev ID the head ID for that branch and store it into that file.
+ * This is very similar to 2), but you also have to add the branch to the refs database and instead of looking up its HEAD ID,
+ * you make the current prev ID the head ID for that branch.
  * Since we are nice people, we actually implemented the functionality above for you, except for the implementation of the actual checkout! 
  * But because we had to write this project in a rush, there are three mistakes in the beargit_checkout function 
  * -- you need to find and correct them for everything to run (one line per mistake). Consider using cgdb and printf for debugging to help you!
@@ -445,66 +876,196 @@ int beargit_branch() {
  * a branch that exists and new_branch is false, or a branch that doesn't exist and new_branch is true, 
  * the function should return 0 and produce no output on stderr.
  * If the argument is a commit ID but the commit does not exist, the function should return 1 and produce errors.
+ * Files outside the sparse checkout patterns (see sparse.h and beargit sparse) are tracked but not written out;
+ * if one of them has changes in the working directory, checkout prints "ERROR: <filename> has uncommitted changes"
+ * and returns 1 without touching anything.
+ * Only files that differ between the index and the commit are removed or restored; the others, and their
+ * timestamps, are left alone. Files are copied out by worker threads (-j <jobs>, one per CPU by default). If a file can't be restored,
+ * checkout prints "ERROR: Couldn't check out <filename>: <reason>", returns 1 and leaves the repository state and the index alone.
+ * A successful checkout abandons a merge in progress (see beargit merge).
+ * An argument that isn't a branch may also be an abbreviated commit id (see beargit diff); if more
+ * than one commit's id starts with it, checkout prints "ERROR: Commit id <arg> is ambiguous" and returns 1.
  * 
  * 
  * assignments: Find out 3 ERROR in beargit_checkout and complete checkout_commit(), is_it_a_commit_id();
  */
 
-void delete_all_tracked_file_of_current_index() {
-  FILE* findex = fopen(".beargit/.index", "r");
+/* Checkout only touches the files that differ between the index and the
+ * target commit: files the target doesn't track are removed, and files that
+ * are new, have different contents, or were modified in the working
+ * directory are restored. Everything else keeps its inode and timestamps.
+ */
 
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    fs_rm(line);
+static void restore_file_job(void* arg) {
+  file_job* job = arg;
+  if (file_job_skipped(job))
+    return;
+
+  index_entry* entry = job->entry;
+  fs_mkdir_parents(entry->path);
+
+  // Restore next to the file and rename it into place, so a stale copy is
+  // never half rewritten and a failed restore leaves it alone.
+  const char* name = strrchr(entry->path, '/');
+  name = name ? name + 1 : entry->path;
+  char tmp_path[FILENAME_SIZE + 16];
+  sprintf(tmp_path, "%.*s.%s.checkout", (int) (name - entry->path), entry->path, name);
+
+  // Commits made before the object store existed keep full copies of
+  // their files in the commit directory.
+  int ret;
+  if (entry->blob_id[0]) {
+    ret = object_restore_file(entry->blob_id, tmp_path);
+  } else {
+    char file_name_in_commit_dir[MAX_LENGTH];
+    sprintf(file_name_in_commit_dir, "%s/%s", job->commit_dir, entry->path);
+    ret = fs_try_cp(file_name_in_commit_dir, tmp_path);
   }
-  fclose(findex);
+
+  struct stat s;
+  if (ret != 0 || rename(tmp_path, entry->path) != 0 || stat(entry->path, &s) != 0) {
+    file_job_fail(job);
+    unlink(tmp_path);
+    return;
+  }
+  index_entry_set_stat(entry, &s);
 }
 
-void copy_out_all_tracked_file(const char *commit_dir_name) {
-  FILE* findex = fopen(".beargit/.index", "r");
+// 1 if the working copy of <current> already has the contents <target> wants.
+static int checkout_can_keep(beargit_index* index, index_entry* current, index_entry* target) {
+  if (!target->blob_id[0] || strcmp(current->blob_id, target->blob_id) != 0)
+    return 0;
 
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
+  int state = index_entry_refresh(index, current);
+  if (state != ENTRY_UNCHANGED && state != ENTRY_REFRESHED)
+    return 0;
 
-    char file_name_in_commit_dir[MAX_LENGTH];
-    sprintf(file_name_in_commit_dir, "%s/%s", commit_dir_name, line);  
-    char file_name_in_init_dir[MAX_LENGTH];
-    sprintf(file_name_in_init_dir, "%s", line);
+  target->mtime_sec = current->mtime_sec;
+  target->mtime_nsec = current->mtime_nsec;
+  target->size = current->size;
+  target->ino = current->ino;
+  target->dirty = 1;
+  return 1;
+}
 
-    fs_cp(file_name_in_commit_dir, file_name_in_init_dir);
+int checkout_tracked_files(beargit_repo_t* repo, const char* commit_dir_name) {
+  beargit_index* current = beargit_repo_index(repo);
+  beargit_index target;
+  if (commit_dir_name)
+    index_read_manifest(&target, commit_dir_name);
+  else
+    memset(&target, 0, sizeof(target));
+
+  // Files about to leave the working directory for the sparse checkout
+  // must not lose changes.
+  const sparse_patterns* sparse = beargit_repo_sparse(repo);
+  for (int i = 0; i < target.count; i++) {
+    index_entry* entry = &target.entries[i];
+    if (!entry->blob_id[0] || sparse_includes(sparse, entry->path) || access(entry->path, F_OK) != 0)
+      continue;
+    int pos = index_find(current, entry->path);
+    if (pos < 0)
+      continue;
+    int state = index_entry_refresh(current, &current->entries[pos]);
+    if (state == ENTRY_REFRESHED)
+      repo->index_changed = 1;
+    if (state != ENTRY_UNCHANGED && state != ENTRY_REFRESHED) {
+      fprintf(stderr, "ERROR: %s has uncommitted changes\n", entry->path);
+      index_free(&target);
+      return 1;
+    }
   }
-  fclose(findex);
-}
 
-int checkout_commit(const char* commit_id) {
-  /* COMPLETE THE REST */
-  
-  //Going through the index of the current index file, delete all those files 
-  //(in the current directory; i.e., the directory where we ran beargit).
-  delete_all_tracked_file_of_current_index();
+  // A file that is no longer tracked goes first if it blocks a directory
+  // of the same name; all others only once every restore worked, so a
+  // failed checkout leaves the working files alone.
+  for (int i = 0; i < target.count; i++) {
+    char dir[FILENAME_SIZE];
+    strcpy(dir, target.entries[i].path);
+    char* slash;
+    while ((slash = strrchr(dir, '/')) != NULL) {
+      *slash = '\0';
+      if (index_find(current, dir) >= 0 && index_find(&target, dir) < 0 &&
+          unlink(dir) != 0 && errno != ENOENT) {
+        fprintf(stderr, "ERROR: Couldn't remove %s: %s\n", dir, strerror(errno));
+        index_free(&target);
+        return 1;
+      }
+    }
+  }
 
-  //In the special case that the new commit is the 00.0 commit
-  if (strcmp(commit_id, "0000000000000000000000000000000000000000") == 0) {
-    write_string_to_file(".beargit/.index", "");
-    write_string_to_file(".beargit/.prev", commit_id);
-    return 0;
+  // Files outside the sparse checkout are only tracked.
+  file_job* file_jobs = calloc(target.count + 1, sizeof(file_job));
+  int njobs = 0;
+  for (int i = 0; i < target.count; i++) {
+    index_entry* entry = &target.entries[i];
+    if (entry->blob_id[0] && !sparse_includes(sparse, entry->path))
+      continue;
+    int pos = index_find(current, entry->path);
+    if (pos >= 0 && checkout_can_keep(current, &current->entries[pos], entry))
+      continue;
+
+    file_jobs[njobs].entry = entry;
+    file_jobs[njobs].commit_dir = commit_dir_name;
+    njobs++;
   }
 
-  //Copy the index from the commit that is being checked out to the .beargit directory.
-  char commit_dir_name[MAX_LENGTH];
-  sprintf(commit_dir_name, ".beargit/%s", commit_id);
-  char new_index_file[MAX_LENGTH];
-  sprintf(new_index_file, "%s/.index", commit_dir_name);
-  fs_cp(new_index_file, ".beargit/.index");
+  int ret = run_file_jobs(file_jobs, njobs, restore_file_job, "check out");
+  free(file_jobs);
 
-  //Copy all that commit's tracked files from the commit's directory into the current directory.
-  copy_out_all_tracked_file(commit_dir_name);
+  // The checkout is done by now: a file that can't be removed is just left
+  // behind, untracked or outside the sparse checkout.
+  for (int i = 0; i < current->count && ret == 0; i++) {
+    const char* path = current->entries[i].path;
+    if (index_find(&target, path) < 0 && !fs_check_dir_exists(path) &&
+        unlink(path) != 0 && errno != ENOENT)
+      fprintf(stderr, "ERROR: Couldn't remove %s: %s\n", path, strerror(errno));
+  }
+  for (int i = 0; i < target.count && ret == 0; i++) {
+    index_entry* entry = &target.entries[i];
+    if (entry->blob_id[0] && !sparse_includes(sparse, entry->path) &&
+        unlink(entry->path) != 0 && errno != ENOENT)
+      fprintf(stderr, "ERROR: Couldn't remove %s: %s\n", entry->path, strerror(errno));
+  }
 
-  write_string_to_file(".beargit/.prev", commit_id);
+  // The target becomes the index, in memory as well.
+  if (ret == 0) {
+    index_write(&target);
+    index_free(current);
+    *current = target;
+    repo->index_changed = 0;
+    for (int i = 0; i < current->count && repo->watch; i++)
+      watch_add_dir_of(repo->watch, current->entries[i].path);
+  } else {
+    index_free(&target);
+  }
+  return ret;
+}
 
-  return 0;
+// Puts the files of <commit_id> in place. The caller then records the new
+// commit in the repository state.
+int checkout_commit(beargit_repo_t* repo, const char* commit_id) {
+  // The 00.0 commit has no files, so checking it out untracks everything.
+  if (strcmp(commit_id, "0000000000000000000000000000000000000000") == 0)
+    return checkout_tracked_files(repo, NULL);
+
+  char commit_dir_name[MAX_LENGTH];
+  sprintf(commit_dir_name, ".beargit/%s", commit_id);
+  return checkout_tracked_files(repo, commit_dir_name);
+}
+
+// Whether commit <commit_id> exists: in the commit graph or, for commits
+// made before the commit log existed, as a directory or in the pack.
+static int commit_exists(beargit_repo_t* repo, const char* commit_id) {
+  if (strcmp(commit_id, "0000000000000000000000000000000000000000") == 0)
+    return 1;
+  if (commitgraph_find(beargit_repo_commit_graph(repo), commit_id) >= 0)
+    return 1;
+  char commit_dir[FILENAME_SIZE];
+  sprintf(commit_dir, ".beargit/%s", commit_id);
+  const char* data;
+  size_t size;
+  return fs_check_dir_exists(commit_dir) || pack_find(commit_id, PACK_COMMIT, &data, &size);
 }
 
 int is_it_a_commit_id(const char* commit_id) {
@@ -515,47 +1076,83 @@ int is_it_a_commit_id(const char* commit_id) {
 
   for (int i = 0; i < id_length; ++i) {
     char c = commit_id[i];
-    if (c != '6' || c != '1' || c != 'c')
+    if (c != '6' && c != '1' && c != 'c')
       return 0;
   }
 
   return 1;
 }
 
-int beargit_checkout(const char* arg, int new_branch) {
+// Looks up the commit whose id starts with <prefix>, at least
+// COMMIT_ID_MIN_PREFIX characters of an id, in the commit graph. Returns 0
+// and puts its id into <commit_id>, 1 if there is none, or 2 if the prefix
+// is ambiguous.
+static int find_commit_prefix(beargit_repo_t* repo, const char* prefix, char* commit_id) {
+  size_t len = strlen(prefix);
+  if (len < COMMIT_ID_MIN_PREFIX || len > COMMIT_ID_BYTES || strspn(prefix, "61c") != len)
+    return 1;
+
+  const commit_graph* graph = beargit_repo_commit_graph(repo);
+  int64_t pos;
+  int found = commitgraph_find_prefix(graph, prefix, &pos);
+  if (found == 1) {
+    memcpy(commit_id, graph->log->records[pos].id, COMMIT_ID_BYTES);
+    commit_id[COMMIT_ID_BYTES] = '\0';
+    return 0;
+  }
+  return found == 0 ? 1 : 2;
+}
+
+int beargit_repo_checkout(beargit_repo_t* repo, const char* arg, int new_branch) {
   // Get the current branch
-  char current_branch[BRANCHNAME_SIZE];
-  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);   // 1st ERROR at "current_branch"
+  repo_state* state = &repo->state;
 
   // If not detached, update the current branch by storing the current HEAD into that branch's file...
   // Even if we cancel later, this is still ok.
-  if (strlen(current_branch)) {
-    char current_branch_file[BRANCHNAME_SIZE+50];
-    sprintf(current_branch_file, ".beargit/.branch_%s", current_branch);
-    fs_cp(".beargit/.prev", current_branch_file);
+  if (strlen(state->branch)) {
+    refs_set_head(state->branch, state->head);
+  }
+
+  // An abbreviated commit id stands for the full one, unless a branch has
+  // that name.
+  char commit_id[COMMIT_ID_SIZE];
+  if (!new_branch && !is_it_a_commit_id(arg) && refs_find(arg, commit_id) < 0) {
+    int found = find_commit_prefix(repo, arg, commit_id);
+    if (found == 2) {
+      fprintf(stderr, "ERROR: Commit id %s is ambiguous\n", arg);
+      return 1;
+    }
+    if (found == 0)
+      arg = commit_id;
   }
 
   // Check whether the argument is a commit ID. If yes, we just stay in detached mode
   // without actually having to change into any other branch.
   if (is_it_a_commit_id(arg)) {
-    char commit_dir[FILENAME_SIZE] = ".beargit/";
-    strcat(commit_dir, arg);
-    if (!fs_check_dir_exists(commit_dir)) {
+    if (!commit_exists(repo, arg)) {
       fprintf(stderr, "ERROR: Commit %s does not exist\n", arg);
       return 1;
     }
 
-    // Set the current branch to none (i.e., detached).
-    write_string_to_file(".beargit/.current_branch", "");
+    if (checkout_commit(repo, arg))
+      return 1;
 
-    return checkout_commit(arg);
+    // Set the current branch to none (i.e., detached).
+    strcpy(state->head, arg);
+    state->branch[0] = '\0';
+    state->merge_head[0] = '\0';
+    state_write(state);
+    journal_sync_file(REFS_FILE);
+    journal_sync_file(STATE_FILE);
+    return 0;
   }
 
   // Just a better name, since we now know the argument is a branch name.
   const char* branch_name = arg;
 
-  // Read branches file (giving us the HEAD commit id for that branch).
-  int branch_exists = (get_branch_number(branch_name) >= 0);
+  // Look the branch up (giving us the HEAD commit id for that branch).
+  char branch_head_commit_id[COMMIT_ID_SIZE];
+  int branch_exists = (refs_find(branch_name, branch_head_commit_id) >= 0);
 
   // Check for errors.
   if (!(!branch_exists || !new_branch)) {
@@ -564,27 +1161,914 @@ int beargit_checkout(const char* arg, int new_branch) {
   } else if (!branch_exists && !new_branch) { // else if (!branch_exists && new_branch). 2nd ERROR at (new_branch)
     fprintf(stderr, "ERROR: No branch %s exists\n", branch_name);
     return 1;
+  } else if (strlen(branch_name) >= BRANCHNAME_SIZE) {
+    fprintf(stderr, "ERROR: Branch name %s is too long\n", branch_name);
+    return 1;
   }
 
-  // File for the branch we are changing into.
-  //char* branch_file = ".beargit/.branch_"; // 3rd ERROR
-  char branch_file[] = ".beargit/.branch_";
-  strcat(branch_file, branch_name);
-
-  // Update the branch file if new branch is created (now it can't go wrong anymore)
+  // Add the branch if a new one is created (now it can't go wrong anymore);
+  // it starts at the current commit.
   if (new_branch) {
-    FILE* fbranches = fopen(".beargit/.branches", "a");
-    fprintf(fbranches, "%s\n", branch_name);
-    fclose(fbranches);
-    fs_cp(".beargit/.prev", branch_file); 
+    strcpy(branch_head_commit_id, state->head);
+    refs_add(branch_name, branch_head_commit_id);
   }
 
-  write_string_to_file(".beargit/.current_branch", branch_name); //check out branch_name
+  // Check out the actual commit, and only switch branches if that worked.
+  if (checkout_commit(repo, branch_head_commit_id))
+    return 1;
 
-  // Read the head commit ID of this branch.
-  char branch_head_commit_id[COMMIT_ID_SIZE];
-  read_string_from_file(branch_file, branch_head_commit_id, COMMIT_ID_SIZE);
+  strcpy(state->head, branch_head_commit_id);
+  snprintf(state->branch, BRANCHNAME_SIZE, "%s", branch_name); //check out branch_name
+  state->merge_head[0] = '\0';
+  state_write(state);
+  journal_sync_file(REFS_FILE);
+  journal_sync_file(STATE_FILE);
+  return 0;
+}
+
+int beargit_checkout(const char* arg, int new_branch) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_checkout(repo, arg, new_branch);
+  beargit_repo_close(repo);
+  return ret;
+}
+
+/* beargit diff [<commit> [<commit>]]
+ *
+ * Shows how the tracked files changed, as a unified diff (see diff.h): from
+ * the current commit to the working directory, from <commit> to the working
+ * directory, or from the first <commit> to the second. Commits are given by
+ * id, by the first COMMIT_ID_MIN_PREFIX or more characters of an id that no
+ * other commit's id starts with, or by branch name, meaning the branch's
+ * head. Abbreviated ids are looked up in the commit graph (see
+ * commitgraph.h), never by listing commit directories.
+ *
+ * Files with the same blob id on both sides are skipped without reading
+ * them; so are files in the working directory whose stat data matches the
+ * index (see beargit status).
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: No commit or branch named <arg>
+ * >> ERROR: Commit id <arg> is ambiguous
+ * >> ERROR: Couldn't read <path>: <reason>
+ */
+
+// Resolves <arg>, a commit id, an abbreviated one or a branch name, to a
+// commit id. Returns 0, or prints why it can't and returns 1.
+static int resolve_commit(beargit_repo_t* repo, const char* arg, char* commit_id) {
+  if (strlen(arg) == COMMIT_ID_BYTES && commit_exists(repo, arg)) {
+    strcpy(commit_id, arg);
+    return 0;
+  }
+  // The refs only learn the head of the current branch when leaving it.
+  if (strcmp(arg, repo->state.branch) == 0) {
+    strcpy(commit_id, repo->state.head);
+    return 0;
+  }
+  if (refs_find(arg, commit_id) >= 0)
+    return 0;
+
+  int found = find_commit_prefix(repo, arg, commit_id);
+  if (found == 1)
+    fprintf(stderr, "ERROR: No commit or branch named %s\n", arg);
+  else if (found == 2)
+    fprintf(stderr, "ERROR: Commit id %s is ambiguous\n", arg);
+  return found != 0;
+}
+
+// One side of a diff: the files of a commit, or the working directory.
+typedef struct {
+  beargit_index* index;
+  beargit_index manifest;
+  char commit_dir[FILENAME_SIZE];     // empty for the working directory
+  int* states;                        // working directory: index_entry_refresh results
+} diff_tree;
+
+static int diff_tree_open(beargit_repo_t* repo, const char* commit_id, diff_tree* tree) {
+  memset(tree, 0, sizeof(*tree));
+  if (commit_id == NULL) {
+    tree->index = beargit_repo_index(repo);
+    tree->states = malloc((tree->index->count + 1) * sizeof(int));
+    ASSERT_ERROR_MESSAGE(tree->states != NULL, "out of memory");
+    for (int i = 0; i < tree->index->count; i++) {
+      tree->states[i] = beargit_repo_refresh(repo, &tree->index->entries[i]);
+      if (tree->states[i] == ENTRY_REFRESHED)
+        repo->index_changed = 1;
+    }
+    return 0;
+  }
+
+  tree->index = &tree->manifest;
+  sprintf(tree->commit_dir, ".beargit/%s", commit_id);
+  if (strcmp(commit_id, "0000000000000000000000000000000000000000") != 0)
+    index_read_manifest(&tree->manifest, tree->commit_dir);
+  return 0;
+}
+
+static void diff_tree_close(diff_tree* tree) {
+  index_free(&tree->manifest);
+  free(tree->states);
+}
+
+// Position of <path> in <tree>, or -1 if the tree doesn't have it.
+static int diff_tree_find(diff_tree* tree, const char* path) {
+  int pos = index_find(tree->index, path);
+  if (pos >= 0 && tree->states && tree->states[pos] == ENTRY_MISSING)
+    return -1;
+  return pos;
+}
+
+// Blob id of the file at <pos>, or NULL if it isn't known without reading
+// the file.
+static const char* diff_tree_blob(diff_tree* tree, int pos) {
+  index_entry* entry = &tree->index->entries[pos];
+  if (!entry->blob_id[0])
+    return NULL;
+  if (tree->states && tree->states[pos] != ENTRY_UNCHANGED && tree->states[pos] != ENTRY_REFRESHED)
+    return NULL;
+  return entry->blob_id;
+}
+
+// Puts the name of a file with the contents of the file at <pos> into
+// <file>. Compressed, chunked and packed blobs are restored to a temporary
+// file first; *temporary is set then. Returns 0, or -1 with errno set.
+static int diff_tree_file(diff_tree* tree, int pos, char* file, int* temporary) {
+  index_entry* entry = &tree->index->entries[pos];
+  *temporary = 0;
+  // Files outside the sparse checkout come from the object store.
+  if (!tree->commit_dir[0] && (!entry->blob_id[0] || access(entry->path, F_OK) == 0)) {
+    strcpy(file, entry->path);
+    return 0;
+  }
+  // Commits made before the object store existed keep full copies.
+  if (tree->commit_dir[0] && !entry->blob_id[0]) {
+    sprintf(file, "%s/%s", tree->commit_dir, entry->path);
+    return 0;
+  }
+
+  int format;
+  if (object_loose_file(entry->blob_id, file, &format) == 0 && format == OBJECT_PLAIN)
+    return 0;
+
+  strcpy(file, ".beargit/.diff_XXXXXX");
+  int fd = mkstemp(file);
+  if (fd < 0)
+    return -1;
+  close(fd);
+  *temporary = 1;
+  return object_restore_file(entry->blob_id, file);
+}
+
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+int beargit_repo_diff(beargit_repo_t* repo, const char* from, const char* to) {
+  char from_id[COMMIT_ID_SIZE], to_id[COMMIT_ID_SIZE];
+  if (from == NULL) {
+    strcpy(from_id, repo->state.head);
+  } else if (resolve_commit(repo, from, from_id)) {
+    return 1;
+  }
+  if (to && resolve_commit(repo, to, to_id))
+    return 1;
+
+  diff_tree a, b;
+  diff_tree_open(repo, from_id, &a);
+  diff_tree_open(repo, to ? to_id : NULL, &b);
+
+  // Every path on either side, once, in order.
+  const char** paths = malloc((a.index->count + b.index->count + 1) * sizeof(char*));
+  ASSERT_ERROR_MESSAGE(paths != NULL, "out of memory");
+  int npaths = 0;
+  for (int i = 0; i < a.index->count; i++)
+    paths[npaths++] = a.index->entries[i].path;
+  for (int i = 0; i < b.index->count; i++) {
+    if (index_find(a.index, b.index->entries[i].path) < 0)
+      paths[npaths++] = b.index->entries[i].path;
+  }
+  qsort(paths, npaths, sizeof(char*), compare_paths);
+
+  int ret = 0;
+  for (int i = 0; i < npaths && ret == 0; i++) {
+    int pos_a = diff_tree_find(&a, paths[i]);
+    int pos_b = diff_tree_find(&b, paths[i]);
+    if (pos_a < 0 && pos_b < 0)
+      continue;
+    const char* blob_a = pos_a >= 0 ? diff_tree_blob(&a, pos_a) : NULL;
+    const char* blob_b = pos_b >= 0 ? diff_tree_blob(&b, pos_b) : NULL;
+    if (blob_a && blob_b && strcmp(blob_a, blob_b) == 0)
+      continue;
+
+    char file_a[MAX_LENGTH], file_b[MAX_LENGTH];
+    int temporary_a = 0, temporary_b = 0;
+    if ((pos_a >= 0 && diff_tree_file(&a, pos_a, file_a, &temporary_a) != 0) ||
+        (pos_b >= 0 && diff_tree_file(&b, pos_b, file_b, &temporary_b) != 0) ||
+        diff_print(paths[i], pos_a >= 0 ? file_a : NULL, pos_b >= 0 ? file_b : NULL, stdout) != 0) {
+      fprintf(stderr, "ERROR: Couldn't read %s: %s\n", paths[i], strerror(errno));
+      ret = 1;
+    }
+    if (temporary_a)
+      unlink(file_a);
+    if (temporary_b)
+      unlink(file_b);
+  }
+
+  free(paths);
+  diff_tree_close(&a);
+  diff_tree_close(&b);
+  return ret;
+}
+
+int beargit_diff(const char* from, const char* to) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_diff(repo, from, to);
+  beargit_repo_close(repo);
+  return ret;
+}
+
+/* beargit merge <commit>
+ *
+ * Merges <commit>, given as for beargit diff, into the current branch.
+ * The working directory must match the current commit.
+ *
+ * - If <commit> is already part of the current branch, there is nothing to do:
+ *   >> Already up to date
+ * - If the current commit is an ancestor of <commit>, its files are checked
+ *   out and the branch moves to it:
+ *   >> Fast-forward to <commit id>
+ * - Otherwise the changes made on both sides since their merge base (their
+ *   latest common ancestor, found through the commit graph) are combined
+ *   file by file. Files with the same blob id on two sides need no reading;
+ *   only files both sides changed are merged line by line (see diff_merge in
+ *   diff.h). Without conflicts, the result is committed right away as
+ *   "Merge <commit>", a commit with two parents. Otherwise the conflicting
+ *   files are left with conflict markers (binary files as they are in the
+ *   current commit; files deleted on one side and modified on the other as
+ *   the side that modified them has them), and the next commit concludes
+ *   the merge:
+ *   >> CONFLICT (content): Merge conflict in <path>
+ *   >> CONFLICT (modify/delete): <path> deleted in <HEAD or commit>
+ *   >> Automatic merge failed; fix conflicts and then commit the result.
+ *   and the function returns 1.
+ * - Files outside the sparse checkout (see sparse.h) are only written out if
+ *   they need a line merge.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: Need to be on HEAD of a branch to merge
+ * >> ERROR: A merge is in progress; commit it first
+ * >> ERROR: No commit or branch named <commit>
+ * >> ERROR: Commit id <commit> is ambiguous
+ * >> ERROR: Can't find a merge base with <commit>
+ * >> ERROR: Commit your changes before merging
+ * >> ERROR: Couldn't merge <path>: <reason>
+ */
+
+// 1 if the index and the working directory both match the current commit.
+static int merge_worktree_clean(beargit_repo_t* repo) {
+  beargit_index* index = beargit_repo_index(repo);
+  diff_tree head;
+  diff_tree_open(repo, repo->state.head, &head);
+  int clean = head.index->count == index->count;
+  for (int i = 0; i < index->count && clean; i++) {
+    int pos = index_find(head.index, index->entries[i].path);
+    clean = pos >= 0 && strcmp(head.index->entries[pos].blob_id, index->entries[i].blob_id) == 0;
+  }
+  diff_tree_close(&head);
+
+  beargit_repo_poll(repo);
+  int* positions;
+  int npositions = beargit_repo_dirty_entries(repo, &positions);
+  for (int k = 0; k < npositions && clean; k++) {
+    int state = beargit_repo_refresh(repo, &index->entries[positions[k]]);
+    if (state == ENTRY_REFRESHED)
+      repo->index_changed = 1;
+    clean = state == ENTRY_UNCHANGED || state == ENTRY_REFRESHED;
+  }
+  free(positions);
+  return clean;
+}
+
+// Three-way merges <path> into the working directory, from <base_pos> in
+// <base> (-1 if it didn't exist) and <theirs_pos> in <theirs>. Returns the
+// number of conflicts, DIFF_BINARY or -1 as diff_merge does.
+static int merge_file(const char* path, diff_tree* base, int base_pos,
+                      diff_tree* theirs, int theirs_pos, const char* label) {
+  char base_file[MAX_LENGTH], theirs_file[MAX_LENGTH];
+  int temporary_base = 0, temporary_theirs = 0;
+  int ret = -1;
+  if ((base_pos < 0 || diff_tree_file(base, base_pos, base_file, &temporary_base) == 0) &&
+      diff_tree_file(theirs, theirs_pos, theirs_file, &temporary_theirs) == 0) {
+    // Merged next to the file and renamed into place, like a checkout.
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    char tmp_path[FILENAME_SIZE + 16];
+    sprintf(tmp_path, "%.*s.%s.merge", (int) (name - path), path, name);
+    FILE* out = fopen(tmp_path, "w");
+    if (out) {
+      ret = diff_merge(base_pos >= 0 ? base_file : NULL, path, theirs_file, "HEAD", label, out);
+      if (fclose(out) != 0 && ret >= 0)
+        ret = -1;
+      if (ret >= 0 && rename(tmp_path, path) != 0)
+        ret = -1;
+      if (ret < 0)
+        unlink(tmp_path);
+    }
+  }
+  if (temporary_base)
+    unlink(base_file);
+  if (temporary_theirs)
+    unlink(theirs_file);
+  return ret;
+}
+
+// Combines the changes from <base_id> to <theirs_id> with those from
+// <base_id> to the index. Returns the number of conflicts, or -1 if a file
+// couldn't be merged.
+static int merge_trees(beargit_repo_t* repo, const char* base_id, const char* theirs_id,
+                       const char* label) {
+  beargit_index* index = beargit_repo_index(repo);
+  diff_tree base, theirs;
+  diff_tree_open(repo, base_id, &base);
+  diff_tree_open(repo, theirs_id, &theirs);
+
+  // Every path on either side, once, in order. Files new on both sides
+  // have an empty base.
+  const char** paths = malloc((index->count + theirs.index->count + 1) * sizeof(char*));
+  ASSERT_ERROR_MESSAGE(paths != NULL, "out of memory");
+  int npaths = 0;
+  for (int i = 0; i < index->count; i++)
+    paths[npaths++] = index->entries[i].path;
+  for (int i = 0; i < theirs.index->count; i++) {
+    if (index_find(index, theirs.index->entries[i].path) < 0)
+      paths[npaths++] = theirs.index->entries[i].path;
+  }
+  qsort(paths, npaths, sizeof(char*), compare_paths);
+
+  // Files taken from <theirs> are restored in one run after the walk, since
+  // adding entries moves the others (but not their paths).
+  const char** taken = malloc((npaths + 1) * sizeof(char*));
+  char* removed = calloc(index->count + 1, 1);
+  ASSERT_ERROR_MESSAGE(taken != NULL && removed != NULL, "out of memory");
+  int ntaken = 0, nremoved = 0;
+  int conflicts = 0;
+  int ret = 0;
+  for (int i = 0; i < npaths && ret == 0; i++) {
+    const char* path = paths[i];
+    int ours_pos = index_find(index, path);
+    int base_pos = index_find(base.index, path);
+    int theirs_pos = index_find(theirs.index, path);
+    const char* ours_blob = ours_pos >= 0 ? index->entries[ours_pos].blob_id : NULL;
+    const char* base_blob = base_pos >= 0 ? base.index->entries[base_pos].blob_id : NULL;
+    const char* theirs_blob = theirs_pos >= 0 ? theirs.index->entries[theirs_pos].blob_id : NULL;
+
+    // Commits made before the object store existed have no blob ids; their
+    // files count as changed.
+    int theirs_changed = !(base_blob && theirs_blob ? base_blob[0] && strcmp(base_blob, theirs_blob) == 0
+                                                    : !base_blob && !theirs_blob);
+    int ours_changed = !(base_blob && ours_blob ? base_blob[0] && strcmp(base_blob, ours_blob) == 0
+                                                : !base_blob && !ours_blob);
+    if (!theirs_changed || (ours_blob && theirs_blob && ours_blob[0] && strcmp(ours_blob, theirs_blob) == 0))
+      continue;
+
+    if (!ours_changed) {
+      if (theirs_pos >= 0) {
+        taken[ntaken++] = path;
+      } else {
+        if (unlink(path) != 0 && errno != ENOENT) {
+          fprintf(stderr, "ERROR: Couldn't remove %s: %s\n", path, strerror(errno));
+          ret = -1;
+        }
+        removed[ours_pos] = 1;
+        nremoved++;
+      }
+      continue;
+    }
+
+    // Modified on one side, deleted on the other: the modified version
+    // stays, ours as it is, theirs taken.
+    if (ours_pos < 0 || theirs_pos < 0) {
+      fprintf(stdout, "CONFLICT (modify/delete): %s deleted in %s\n", path,
+              ours_pos < 0 ? "HEAD" : label);
+      if (ours_pos < 0)
+        taken[ntaken++] = path;
+      conflicts++;
+      continue;
+    }
+
+    // A file outside the sparse checkout that needs a line merge is
+    // written out.
+    if (ours_blob[0] && access(path, F_OK) != 0) {
+      fs_mkdir_parents(path);
+      if (object_restore_file(ours_blob, path) != 0) {
+        fprintf(stderr, "ERROR: Couldn't merge %s: %s\n", path, strerror(errno));
+        ret = -1;
+        continue;
+      }
+    }
+
+    int merged = merge_file(path, &base, base_pos, &theirs, theirs_pos, label);
+    if (merged < 0 && merged != DIFF_BINARY) {
+      fprintf(stderr, "ERROR: Couldn't merge %s: %s\n", path, strerror(errno));
+      ret = -1;
+    } else if (merged != 0) {
+      fprintf(stdout, "CONFLICT (content): Merge conflict in %s\n", path);
+      beargit_repo_touch(repo, path);
+      conflicts++;
+    } else {
+      // Hashed and stored by the commit.
+      index_entry* entry = &index->entries[ours_pos];
+      entry->blob_id[0] = '\0';
+      entry->dirty = 1;
+      repo->index_changed = 1;
+      beargit_repo_touch(repo, path);
+    }
+  }
+
+  // Removals go last: they renumber the entries.
+  if (ret == 0 && ntaken > 0) {
+    for (int k = 0; k < ntaken; k++) {
+      if (index_find(index, taken[k]) < 0)
+        index_add(index, taken[k]);
+    }
+    const sparse_patterns* sparse = beargit_repo_sparse(repo);
+    file_job* file_jobs = calloc(ntaken + 1, sizeof(file_job));
+    ASSERT_ERROR_MESSAGE(file_jobs != NULL, "out of memory");
+    int njobs = 0;
+    for (int k = 0; k < ntaken; k++) {
+      index_entry* entry = &index->entries[index_find(index, taken[k])];
+      strcpy(entry->blob_id, theirs.index->entries[index_find(theirs.index, taken[k])].blob_id);
+      entry->dirty = 1;
+      beargit_repo_touch(repo, entry->path);
+      if (entry->blob_id[0] && !sparse_includes(sparse, entry->path) && access(entry->path, F_OK) != 0)
+        continue;
+      file_jobs[njobs].entry = entry;
+      file_jobs[njobs].commit_dir = theirs.commit_dir;
+      njobs++;
+    }
+    if (run_file_jobs(file_jobs, njobs, restore_file_job, "check out"))
+      ret = -1;
+    free(file_jobs);
+    repo->index_changed = 1;
+  }
+  if (nremoved > 0) {
+    index_remove_marked(index, removed);
+    repo->index_changed = 1;
+  }
+
+  free(taken);
+  free(removed);
+  free(paths);
+  diff_tree_close(&base);
+  diff_tree_close(&theirs);
+  return ret < 0 ? -1 : conflicts;
+}
+
+int beargit_repo_merge(beargit_repo_t* repo, const char* arg) {
+  repo_state* state = &repo->state;
+  if (!strlen(state->branch)) {
+    fprintf(stderr, "ERROR: Need to be on HEAD of a branch to merge\n");
+    return 1;
+  }
+  if (state->merge_head[0]) {
+    fprintf(stderr, "ERROR: A merge is in progress; commit it first\n");
+    return 1;
+  }
+
+  char theirs_id[COMMIT_ID_SIZE];
+  if (resolve_commit(repo, arg, theirs_id))
+    return 1;
+
+  const char* zero_id = "0000000000000000000000000000000000000000";
+  char base_id[COMMIT_ID_SIZE];
+  if (strcmp(theirs_id, state->head) == 0 || strcmp(theirs_id, zero_id) == 0) {
+    strcpy(base_id, theirs_id);
+  } else if (strcmp(state->head, zero_id) == 0) {
+    strcpy(base_id, zero_id);
+  } else {
+    const commit_graph* graph = beargit_repo_commit_graph(repo);
+    int64_t ours_pos = commitgraph_find(graph, state->head);
+    int64_t theirs_pos = commitgraph_find(graph, theirs_id);
+    if (ours_pos < 0 || theirs_pos < 0) {
+      fprintf(stderr, "ERROR: Can't find a merge base with %s\n", arg);
+      return 1;
+    }
+    int64_t base_pos = commitgraph_merge_base(graph, ours_pos, theirs_pos);
+    if (base_pos >= 0)
+      memcpy(base_id, graph->log->records[base_pos].id, COMMIT_ID_BYTES);
+    else
+      memcpy(base_id, zero_id, COMMIT_ID_BYTES);
+    base_id[COMMIT_ID_BYTES] = '\0';
+  }
+
+  if (strcmp(base_id, theirs_id) == 0) {
+    fprintf(stdout, "Already up to date\n");
+    return 0;
+  }
+
+  if (!merge_worktree_clean(repo)) {
+    fprintf(stderr, "ERROR: Commit your changes before merging\n");
+    return 1;
+  }
+
+  if (strcmp(base_id, state->head) == 0) {
+    if (checkout_commit(repo, theirs_id))
+      return 1;
+    strcpy(state->head, theirs_id);
+    state_write(state);
+    journal_sync_file(STATE_FILE);
+    fprintf(stdout, "Fast-forward to %s\n", theirs_id);
+    return 0;
+  }
+
+  int conflicts = merge_trees(repo, base_id, theirs_id, arg);
+  if (conflicts < 0)
+    return 1;
+
+  strcpy(state->merge_head, theirs_id);
+  if (conflicts == 0) {
+    char msg[MSG_SIZE];
+    snprintf(msg, MSG_SIZE, "Merge %s", arg);
+    return commit_index(repo, msg);
+  }
+
+  beargit_repo_flush(repo);
+  state_write(state);
+  journal_sync_file(".beargit/.index");
+  journal_sync_file(STATE_FILE);
+  fprintf(stdout, "Automatic merge failed; fix conflicts and then commit the result.\n");
+  return 1;
+}
+
+int beargit_merge(const char* arg) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_merge(repo, arg);
+  beargit_repo_close(repo);
+  return ret;
+}
+
+/* beargit sparse [<pattern> ...]
+ *
+ * Without patterns, prints the sparse checkout patterns (see sparse.h), one
+ * per line. With patterns, replaces them and updates the working directory:
+ * tracked files the new patterns leave out are removed, and those they take
+ * in again are restored. --disable removes all patterns, so every tracked
+ * file is checked out again. The index and the commits keep every file
+ * either way.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: <path> has uncommitted changes
+ * >> ERROR: Couldn't check out <path>: <reason>
+ */
+
+int beargit_repo_sparse_list(beargit_repo_t* repo) {
+  const sparse_patterns* sparse = beargit_repo_sparse(repo);
+  for (int i = 0; i < sparse->count; i++)
+    fprintf(stdout, "%s\n", sparse->patterns[i]);
+  return 0;
+}
+
+int beargit_repo_sparse_set(beargit_repo_t* repo, int npatterns, char* const* patterns) {
+  beargit_index* index = beargit_repo_index(repo);
+  const sparse_patterns* current = beargit_repo_sparse(repo);
+  sparse_patterns next;
+  sparse_init(&next, npatterns, patterns);
+
+  // Files about to leave the working directory must not lose changes.
+  for (int i = 0; i < index->count; i++) {
+    index_entry* entry = &index->entries[i];
+    if (!entry->blob_id[0] || sparse_includes(&next, entry->path) || access(entry->path, F_OK) != 0)
+      continue;
+    int state = index_entry_refresh(index, entry);
+    if (state == ENTRY_REFRESHED)
+      repo->index_changed = 1;
+    if (state != ENTRY_UNCHANGED && state != ENTRY_REFRESHED) {
+      fprintf(stderr, "ERROR: %s has uncommitted changes\n", entry->path);
+      sparse_free(&next);
+      return 1;
+    }
+  }
+
+  char commit_dir[FILENAME_SIZE];
+  sprintf(commit_dir, ".beargit/%s", repo->state.head);
+  file_job* file_jobs = calloc(index->count + 1, sizeof(file_job));
+  ASSERT_ERROR_MESSAGE(file_jobs != NULL, "out of memory");
+  int njobs = 0;
+  int ret = 0;
+  for (int i = 0; i < index->count && ret == 0; i++) {
+    index_entry* entry = &index->entries[i];
+    if (!entry->blob_id[0])
+      continue;
+    int was_in = sparse_includes(current, entry->path);
+    int is_in = sparse_includes(&next, entry->path);
+    if (was_in && !is_in) {
+      if (unlink(entry->path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "ERROR: Couldn't remove %s: %s\n", entry->path, strerror(errno));
+        ret = 1;
+      }
+    } else if (!was_in && is_in && access(entry->path, F_OK) != 0) {
+      file_jobs[njobs].entry = entry;
+      file_jobs[njobs].commit_dir = commit_dir;
+      njobs++;
+    }
+  }
+  if (ret == 0)
+    ret = run_file_jobs(file_jobs, njobs, restore_file_job, "check out");
+  for (int k = 0; k < njobs; k++)
+    beargit_repo_touch(repo, file_jobs[k].entry->path);
+  free(file_jobs);
+  if (njobs > 0)
+    repo->index_changed = 1;
+
+  // The patterns change even if not every file could be updated: the ones
+  // left over are just outside them, or missing.
+  sparse_write(&next);
+  sparse_free(&repo->sparse);
+  repo->sparse = next;
+  return ret;
+}
+
+int beargit_sparse_list(void) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_sparse_list(repo);
+  beargit_repo_close(repo);
+  return ret;
+}
+
+int beargit_sparse_set(int npatterns, char* const* patterns) {
+  beargit_repo_t* repo = beargit_repo_open();
+  int ret = beargit_repo_sparse_set(repo, npatterns, patterns);
+  beargit_repo_close(repo);
+  return ret;
+}
+
+/* beargit repack
+ *
+ * Moves every loose object and every commit directory into the pack
+ * (.beargit/objects/pack, see pack.h), together with whatever was packed
+ * before, and then deletes the loose copies. Commits made before the object
+ * store existed (those without a .manifest) are left as they are. The
+ * commit graph (see commitgraph.h) and the message index (see msgindex.h)
+ * are rewritten to cover every commit.
+ *
+ * Blobs are added in the order of the commit log, and each one is stored as a
+ * delta against the previous version of the same file if that takes at most
+ * half its size and the chain of deltas stays at most PACK_MAX_DEPTH long.
+ *
+ * Output (to stdout):
+ * >> Packed <n> objects (<d> as deltas) and <m> commits
+ */
+
+typedef struct {
+  char** paths;
+  int count;
+  int capacity;
+} path_list;
+
+static void path_list_add(path_list* list, const char* path) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? 2 * list->capacity : 256;
+    list->paths = realloc(list->paths, list->capacity * sizeof(char*));
+    ASSERT_ERROR_MESSAGE(list->paths != NULL, "out of memory");
+  }
+  list->paths[list->count] = malloc(strlen(path) + 1);
+  ASSERT_ERROR_MESSAGE(list->paths[list->count] != NULL, "out of memory");
+  strcpy(list->paths[list->count++], path);
+}
+
+static void path_list_free(path_list* list) {
+  for (int i = 0; i < list->count; i++)
+    free(list->paths[i]);
+  free(list->paths);
+}
+
+static void repack_copy_entry(const char* id, int type, int flags, const char* data, size_t size,
+                              void* arg) {
+  pack_writer_add(arg, id, type, flags, data, size);
+}
+
+// Adds the loose blobs that commits use, in the order the commits were made,
+// each as a delta against the previous version of the same file where that
+// pays off. Returns the number of deltas.
+static int repack_deltas(pack_writer* writer) {
+  commit_log log;
+  commitlog_open(&log);
+
+  // Latest version of every path seen so far
+  beargit_index latest = { 0 };
+  int ndeltas = 0;
+
+  for (int64_t pos = 0; pos < log.count; pos++) {
+    char commit_dir[FILENAME_SIZE];
+    sprintf(commit_dir, ".beargit/%.*s", COMMIT_ID_BYTES, log.records[pos].id);
+
+    beargit_index manifest;
+    index_read_manifest(&manifest, commit_dir);
+    for (int i = 0; i < manifest.count; i++) {
+      index_entry* entry = &manifest.entries[i];
+      if (!entry->blob_id[0])
+        continue;
+
+      int prev = index_find(&latest, entry->path);
+      if (prev < 0)
+        prev = index_add(&latest, entry->path) - latest.entries;
+
+      char path[FILENAME_SIZE];
+      int format;
+      if (!pack_writer_has(writer, entry->blob_id, PACK_BLOB) &&
+          object_loose_file(entry->blob_id, path, &format) == 0) {
+        const char* base = latest.entries[prev].blob_id[0] ? latest.entries[prev].blob_id : NULL;
+        ndeltas += pack_writer_add_blob(writer, entry->blob_id, base);
+      }
+      strcpy(latest.entries[prev].blob_id, entry->blob_id);
+    }
+    index_free(&manifest);
+  }
+
+  index_free(&latest);
+  commitlog_close(&log);
+  return ndeltas;
+}
+
+// Adds the remaining loose objects to <writer> and lists the files of all of
+// them in <packed>.
+static void repack_objects(pack_writer* writer, path_list* packed) {
+  DIR* objects = opendir(OBJECTS_DIR);
+  ASSERT_ERROR_MESSAGE(objects != NULL, "couldn't read the object store");
+
+  struct dirent* fanout;
+  while ((fanout = readdir(objects)) != NULL) {
+    if (strlen(fanout->d_name) != 2 || fanout->d_name[0] == '.')
+      continue;
+
+    char fanout_dir[FILENAME_SIZE];
+    sprintf(fanout_dir, "%s/%s", OBJECTS_DIR, fanout->d_name);
+    DIR* blobs = opendir(fanout_dir);
+    if (blobs == NULL)
+      continue;
+
+    struct dirent* blob;
+    while ((blob = readdir(blobs)) != NULL) {
+      // Plain, compressed or chunked object
+      const char* suffix = blob->d_name + BLOB_ID_BYTES - 2;
+      if (strlen(blob->d_name) < BLOB_ID_BYTES - 2 ||
+          (*suffix && strcmp(suffix, OBJECT_COMPRESSED_SUFFIX) != 0 &&
+           strcmp(suffix, OBJECT_CHUNKED_SUFFIX) != 0))
+        continue;
+
+      char blob_id[BLOB_ID_SIZE], path[FILENAME_SIZE];
+      snprintf(blob_id, sizeof(blob_id), "%.2s%.*s", fanout->d_name, BLOB_ID_BYTES - 2, blob->d_name);
+      if (snprintf(path, sizeof(path), "%s/%s", fanout_dir, blob->d_name) >= (int) sizeof(path))
+        continue;
+
+      if (!pack_writer_has(writer, blob_id, PACK_BLOB))
+        pack_writer_add_blob(writer, blob_id, NULL);
+      path_list_add(packed, path);
+    }
+    closedir(blobs);
+  }
+  closedir(objects);
+}
+
+// Adds the commit directories to <writer> and lists them in <packed>.
+static void repack_commits(pack_writer* writer, path_list* packed) {
+  DIR* beargit_dir = opendir(".beargit");
+  ASSERT_ERROR_MESSAGE(beargit_dir != NULL, "couldn't read .beargit");
+
+  struct dirent* de;
+  while ((de = readdir(beargit_dir)) != NULL) {
+    if (strlen(de->d_name) != COMMIT_ID_BYTES || de->d_name[0] == '.')
+      continue;
+
+    char commit_dir[FILENAME_SIZE], manifest_file[FILENAME_SIZE];
+    snprintf(commit_dir, sizeof(commit_dir), ".beargit/%.*s", COMMIT_ID_BYTES, de->d_name);
+    snprintf(manifest_file, sizeof(manifest_file), ".beargit/%.*s/.manifest", COMMIT_ID_BYTES, de->d_name);
+
+    FILE* fmanifest = fopen(manifest_file, "r");
+    if (fmanifest == NULL)
+      continue;
+
+    char parent[COMMIT_ID_SIZE], msg[MSG_SIZE];
+    read_commit_info(de->d_name, parent, msg);
+
+    // "<parent-id>\n<msg>\0<manifest lines>"
+    size_t header_size = COMMIT_ID_BYTES + 1 + strlen(msg) + 1;
+    size_t capacity = header_size + 4096, size = header_size;
+    char* data = malloc(capacity);
+    ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+    sprintf(data, "%s\n%s", parent, msg);
+
+    size_t n;
+    while ((n = fread(data + size, 1, capacity - size, fmanifest)) > 0) {
+      size += n;
+      if (size == capacity) {
+        capacity *= 2;
+        data = realloc(data, capacity);
+        ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+      }
+    }
+    ASSERT_ERROR_MESSAGE(!ferror(fmanifest), "couldn't read commit manifest");
+    fclose(fmanifest);
+
+    pack_writer_add(writer, de->d_name, PACK_COMMIT, 0, data, size);
+    free(data);
+    path_list_add(packed, commit_dir);
+  }
+  closedir(beargit_dir);
+}
+
+int beargit_repack(void) {
+  path_list objects = { 0 }, commits = { 0 };
+
+  pack_writer* writer = pack_writer_start();
+  pack_for_each(repack_copy_entry, writer);
+  int ndeltas = repack_deltas(writer);
+  repack_objects(writer, &objects);
+  repack_commits(writer, &commits);
+  pack_writer_finish(writer);
+
+  // Everything is in the new pack now, so the loose copies can go once the
+  // pack is on disk under its name.
+  journal_sync_file(PACK_FILE);
+  for (int i = 0; i < objects.count; i++) {
+    unlink(objects.paths[i]);
+    *strrchr(objects.paths[i], '/') = '\0';
+    rmdir(objects.paths[i]);
+  }
 
-  // Check out the actual commit.
-  return checkout_commit(branch_head_commit_id);
+  const char* commit_files[] = { ".manifest", ".prev", ".msg" };
+  for (int i = 0; i < commits.count; i++) {
+    for (int j = 0; j < 3; j++) {
+      char path[FILENAME_SIZE];
+      sprintf(path, "%s/%s", commits.paths[i], commit_files[j]);
+      unlink(path);
+    }
+    rmdir(commits.paths[i]);
+  }
+
+  commit_log log;
+  commitlog_open(&log);
+  commitgraph_write(&log);
+  msgindex_write(&log);
+  commitlog_close(&log);
+
+  fprintf(stdout, "Packed %d objects (%d as deltas) and %d commits\n", objects.count, ndeltas,
+          commits.count);
+  path_list_free(&objects);
+  path_list_free(&commits);
+  return 0;
+}
+
+/* beargit config [<name> [<value>]]
+ *
+ * - Without arguments, print every setting as "<name> = <value>".
+ * - With a name, print the value of that setting.
+ * - With a name and a value, change the setting (stored in .beargit/.config_<name>).
+ *
+ * Settings:
+ * - copy_mode: "auto" (default) copies files into and out of the object store,
+ *   using reflinks or in-kernel copies where the filesystem supports them.
+ *   "reflink" (or its old name "hardlink") stores every object as a plain
+ *   file, uncompressed and unchunked, so it can be cloned where supported.
+ * - compression: "none" (default) stores objects as plain copies. "lz"
+ *   compresses new objects, trading some CPU on commit and checkout for disk
+ *   space. Existing objects are left as they are.
+ * - durability: how long commits wait for the disk (see journal.h). "none"
+ *   never syncs, "commit" (default) syncs the files a commit wrote in two
+ *   rounds and "full" also syncs every object as it is written.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: Unknown setting <name>
+ * >> ERROR: Invalid value <value> for <name>
+ */
+
+static void print_setting(const char* name, const char* value) {
+  fprintf(stdout, "%s = %s\n", name, value);
+}
+
+int beargit_config(const char* name, const char* value) {
+  if (!name) {
+    config_for_each(print_setting);
+    return 0;
+  }
+
+  if (!config_is_known(name)) {
+    fprintf(stderr, "ERROR: Unknown setting %s\n", name);
+    return 1;
+  }
+
+  if (!value) {
+    char current[CONFIG_VALUE_SIZE];
+    config_get(name, current);
+    fprintf(stdout, "%s\n", current);
+    return 0;
+  }
+
+  if (!config_is_valid(name, value)) {
+    fprintf(stderr, "ERROR: Invalid value %s for %s\n", value, name);
+    return 1;
+  }
+
+  config_set(name, value);
+  return 0;
 }
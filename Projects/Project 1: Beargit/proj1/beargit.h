@@ -1,19 +1,36 @@
 int beargit_init(void);
 int beargit_add(const char* filename);
 int beargit_rm(const char* filename);
+int beargit_add_paths(int npaths, char* const* paths);
+int beargit_add_all();
+int beargit_rm_paths(int npaths, char* const* paths);
 int beargit_commit(const char* message);
 int beargit_status();
 int beargit_log(int limit);
+int beargit_log_grep(int limit, int nterms, char* const* terms);
 int beargit_branch();
 int beargit_checkout(const char* arg, int new_branch);
+int beargit_diff(const char* from, const char* to);
+int beargit_merge(const char* arg);
+int beargit_sparse_list(void);
+int beargit_sparse_set(int npatterns, char* const* patterns);
+int beargit_repack(void);
+int beargit_config(const char* name, const char* value);
+
+// Number of worker threads commit and checkout copy files with (0: one per CPU)
+void beargit_set_jobs(int n);
 
 // Helper functions
 int get_branch_number(const char* branch_name);
 void next_commit_id(char* commit_id);
+int is_it_a_commit_id(const char* commit_id);
 
 // Number of bytes in a commit id
 #define COMMIT_ID_BYTES 40
 
+// Fewest characters of a commit id that commands take in place of all of them
+#define COMMIT_ID_MIN_PREFIX 4
+
 // Preprocessor macros capturing the maximum size of different  structures
 #define FILENAME_SIZE 512
 #define COMMIT_ID_SIZE (COMMIT_ID_BYTES+1)
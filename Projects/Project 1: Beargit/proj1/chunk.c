@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <unistd.h>
+
+#include "chunk.h"
+#include "util.h"
+
+/* Boundaries
+ *
+ * The hash is a "gear" hash: shifted left by one bit per byte with a random
+ * 64-bit value for the byte added, so its top bits depend on the last 64
+ * bytes only. A boundary goes after any byte where the top CHUNK_MASK_BITS
+ * bits are all zero, at least CHUNK_MIN_SIZE bytes into the chunk (those
+ * aren't even hashed) and at the latest after CHUNK_MAX_SIZE bytes.
+ */
+
+#define CHUNK_MASK_BITS 16
+#define CHUNK_MASK (~(uint64_t) 0 << (64 - CHUNK_MASK_BITS))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// The table must never change, or the same file would chunk differently.
+// It is filled from a fixed seed with splitmix64.
+static void gear_init(void) {
+  uint64_t state = 0x62656172676974ull;
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+// Length of the chunk at the start of <data>, out of <size> available bytes.
+// <size> is only less than CHUNK_MAX_SIZE at the end of the file.
+static size_t next_boundary(const unsigned char* data, size_t size) {
+  if (size <= CHUNK_MIN_SIZE)
+    return size;
+  size_t limit = size < CHUNK_MAX_SIZE ? size : CHUNK_MAX_SIZE;
+  uint64_t hash = 0;
+  for (size_t i = CHUNK_MIN_SIZE; i < limit; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if (!(hash & CHUNK_MASK))
+      return i + 1;
+  }
+  return limit;
+}
+
+int chunk_stream(int fd, int (*fn)(const char* data, size_t size, void* arg), void* arg) {
+  pthread_once(&gear_once, gear_init);
+
+  // Holds the chunk being cut and whatever was read past it.
+  size_t capacity = 2 * CHUNK_MAX_SIZE;
+  unsigned char* buffer = malloc(capacity);
+  ASSERT_ERROR_MESSAGE(buffer != NULL, "out of memory");
+
+  size_t start = 0, end = 0;
+  int eof = 0, ret = 0;
+  while (ret == 0) {
+    if (!eof && end - start < CHUNK_MAX_SIZE) {
+      memmove(buffer, buffer + start, end - start);
+      end -= start;
+      start = 0;
+      while (!eof && end < capacity) {
+        ssize_t n = read(fd, buffer + end, capacity - end);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0) {
+          ret = -1;
+          break;
+        }
+        eof = n == 0;
+        end += n;
+      }
+      if (ret != 0)
+        break;
+    }
+    if (start == end)
+      break;
+
+    size_t len = next_boundary(buffer + start, end - start);
+    if (fn((const char*) buffer + start, len, arg) != 0)
+      ret = -1;
+    start += len;
+  }
+
+  int saved_errno = errno;
+  free(buffer);
+  errno = saved_errno;
+  return ret;
+}
@@ -0,0 +1,27 @@
+/**
+ * Content-defined chunking for large files. A rolling hash over the last
+ * few dozen bytes picks the chunk boundaries, so they depend only on the
+ * nearby contents: an edit moves or adds the boundaries around it and leaves
+ * every other chunk of the file as it was.
+ */
+
+#include <stddef.h>
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+// Files at least this large are stored as chunks.
+#define CHUNK_FILE_THRESHOLD (4 << 20)
+
+// Chunk sizes. Boundaries fall every CHUNK_AVG_SIZE bytes on average, but
+// never less than CHUNK_MIN_SIZE or more than CHUNK_MAX_SIZE apart.
+#define CHUNK_MIN_SIZE (16 << 10)
+#define CHUNK_AVG_SIZE (64 << 10)
+#define CHUNK_MAX_SIZE (256 << 10)
+
+// Reads the file <fd> to the end and calls <fn> on every chunk in order.
+// Stops early if <fn> returns nonzero. Returns 0, or -1 with errno set on a
+// read error or a failing <fn>.
+int chunk_stream(int fd, int (*fn)(const char* data, size_t size, void* arg), void* arg);
+
+#endif
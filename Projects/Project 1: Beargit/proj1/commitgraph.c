@@ -0,0 +1,379 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "commitgraph.h"
+#include "util.h"
+
+/* Commit graph file format
+ *
+ *   header    commitgraph_header
+ *   entries   one commitgraph_entry per commit, in commit log order
+ *   buckets   nbuckets int32: open addressing with linear probing over the
+ *             commit ids, record number + 1 or 0 for an empty bucket
+ *   sorted    one int32 per commit: the record numbers ordered by commit id
+ *
+ * The header names the last commit covered, so a log that was cut back
+ * (journal recovery) and grew again isn't mistaken for the one the graph
+ * was written for.
+ */
+
+#define COMMITGRAPH_MAGIC "BCGR"
+#define COMMITGRAPH_VERSION 2
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+  char last_id[40];
+  uint32_t nbuckets;
+  uint32_t reserved;
+} commitgraph_header;
+
+static uint32_t id_hash(const char* id) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 40; i++)
+    hash = (hash ^ (unsigned char) id[i]) * 16777619u;
+  return hash;
+}
+
+// Orders record numbers by commit id, and equal ids by record number.
+static const commit_record* sort_records;
+
+static int compare_by_id(const void* a, const void* b) {
+  int32_t x = *(const int32_t*) a, y = *(const int32_t*) b;
+  int cmp = memcmp(sort_records[x].id, sort_records[y].id, 40);
+  return cmp ? cmp : (x > y) - (x < y);
+}
+
+// Fills sorted[] with the record numbers from..to-1, ordered by id.
+static void sort_by_id(const commit_log* log, int32_t* sorted, int64_t from, int64_t to) {
+  for (int64_t pos = from; pos < to; pos++)
+    sorted[pos - from] = pos;
+  sort_records = log->records;
+  qsort(sorted, to - from, sizeof(int32_t), compare_by_id);
+}
+
+// Fills entries[from..to) from the log. Parents always come before their
+// children in the log, so their entries are already there.
+static void build_entries(const commit_log* log, const commit_graph* graph,
+                          commitgraph_entry* entries, int64_t from, int64_t to) {
+  for (int64_t pos = from; pos < to; pos++) {
+    commitgraph_entry* entry = &entries[pos - from];
+    int64_t parent = log->records[pos].parent_pos;
+    entry->parents[0] = parent >= 0 && parent < pos ? (int32_t) parent : -1;
+    int64_t merge = (int64_t) log->records[pos].merge_pos - 1;
+    entry->parents[1] = merge >= 0 && merge < pos ? (int32_t) merge : -1;
+    entry->generation = 1;
+    for (int i = 0; i < 2; i++) {
+      if (entry->parents[i] < 0)
+        continue;
+      const commitgraph_entry* p = entry->parents[i] >= from ? &entries[entry->parents[i] - from]
+                                                             : commitgraph_entry_at(graph, entry->parents[i]);
+      if (p->generation + 1 > entry->generation)
+        entry->generation = p->generation + 1;
+    }
+  }
+}
+
+int commitgraph_write(const commit_log* log) {
+  commitgraph_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMMITGRAPH_MAGIC, 4);
+  header.version = COMMITGRAPH_VERSION;
+  header.count = log->count;
+  if (log->count)
+    memcpy(header.last_id, log->records[log->count - 1].id, 40);
+  header.nbuckets = 16;
+  while (header.nbuckets < 2 * log->count)
+    header.nbuckets *= 2;
+
+  commitgraph_entry* entries = malloc((log->count + 1) * sizeof(commitgraph_entry));
+  int32_t* buckets = calloc(header.nbuckets, sizeof(int32_t));
+  int32_t* sorted = malloc((log->count + 1) * sizeof(int32_t));
+  ASSERT_ERROR_MESSAGE(entries != NULL && buckets != NULL && sorted != NULL, "out of memory");
+  build_entries(log, NULL, entries, 0, log->count);
+  for (int64_t pos = 0; pos < log->count; pos++) {
+    uint32_t i = id_hash(log->records[pos].id) & (header.nbuckets - 1);
+    while (buckets[i])
+      i = (i + 1) & (header.nbuckets - 1);
+    buckets[i] = pos + 1;
+  }
+  sort_by_id(log, sorted, 0, log->count);
+
+  // Written aside and renamed into place, so readers only ever map a
+  // whole graph.
+  char tmp_file[64];
+  sprintf(tmp_file, COMMITGRAPH_FILE ".%d", (int) getpid());
+  FILE* f = fopen(tmp_file, "w");
+  int ret = f ? 0 : -1;
+  if (f) {
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(entries, sizeof(commitgraph_entry), log->count, f);
+    fwrite(buckets, sizeof(int32_t), header.nbuckets, f);
+    fwrite(sorted, sizeof(int32_t), log->count, f);
+    if (ferror(f))
+      ret = -1;
+    if (fclose(f) != 0)
+      ret = -1;
+    if (ret == 0)
+      ret = rename(tmp_file, COMMITGRAPH_FILE);
+    if (ret != 0)
+      unlink(tmp_file);
+  }
+  free(entries);
+  free(buckets);
+  free(sorted);
+  return ret;
+}
+
+// Maps the graph file if it fits <log>.
+static void map_graph(commit_graph* graph, const commit_log* log) {
+  int fd = open(COMMITGRAPH_FILE, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat s;
+  if (fstat(fd, &s) == 0 && (size_t) s.st_size >= sizeof(commitgraph_header)) {
+    void* base = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base != MAP_FAILED) {
+      graph->base = base;
+      graph->size = s.st_size;
+    }
+  }
+  close(fd);
+  if (graph->base == NULL)
+    return;
+
+  const commitgraph_header* header = graph->base;
+  int fits = memcmp(header->magic, COMMITGRAPH_MAGIC, 4) == 0 &&
+             header->version == COMMITGRAPH_VERSION &&
+             header->count <= (uint64_t) log->count &&
+             (header->count == 0 || memcmp(header->last_id, log->records[header->count - 1].id, 40) == 0) &&
+             graph->size == sizeof(commitgraph_header) + header->count * sizeof(commitgraph_entry) +
+                            (header->nbuckets + header->count) * sizeof(int32_t);
+  if (!fits) {
+    munmap(graph->base, graph->size);
+    graph->base = NULL;
+    graph->size = 0;
+    return;
+  }
+
+  graph->entries = (const commitgraph_entry*) (header + 1);
+  graph->covered = header->count;
+  graph->buckets = (const int32_t*) (graph->entries + header->count);
+  graph->nbuckets = header->nbuckets;
+  graph->sorted = graph->buckets + header->nbuckets;
+}
+
+void commitgraph_open(commit_graph* graph, const commit_log* log) {
+  memset(graph, 0, sizeof(*graph));
+  graph->log = log;
+  graph->count = log->count;
+
+  map_graph(graph, log);
+  if (log->count - graph->covered > COMMITGRAPH_MAX_TAIL && commitgraph_write(log) == 0) {
+    if (graph->base)
+      munmap(graph->base, graph->size);
+    memset(graph, 0, sizeof(*graph));
+    graph->log = log;
+    graph->count = log->count;
+    map_graph(graph, log);
+  }
+
+  int64_t ntail = log->count - graph->covered;
+  graph->tail = malloc((ntail + 1) * sizeof(commitgraph_entry));
+  ASSERT_ERROR_MESSAGE(graph->tail != NULL, "out of memory");
+  build_entries(log, graph, graph->tail, graph->covered, log->count);
+  graph->tail_sorted = malloc((ntail + 1) * sizeof(int32_t));
+  ASSERT_ERROR_MESSAGE(graph->tail_sorted != NULL, "out of memory");
+  sort_by_id(log, graph->tail_sorted, graph->covered, log->count);
+}
+
+void commitgraph_close(commit_graph* graph) {
+  if (graph->base)
+    munmap(graph->base, graph->size);
+  free(graph->tail);
+  free(graph->tail_sorted);
+  memset(graph, 0, sizeof(*graph));
+}
+
+int64_t commitgraph_find(const commit_graph* graph, const char* id) {
+  const commit_record* records = graph->log->records;
+  for (int64_t pos = graph->count - 1; pos >= graph->covered; pos--) {
+    if (memcmp(records[pos].id, id, 40) == 0)
+      return pos;
+  }
+
+  if (graph->nbuckets == 0)
+    return -1;
+  for (uint32_t i = id_hash(id) & (graph->nbuckets - 1); graph->buckets[i];
+       i = (i + 1) & (graph->nbuckets - 1)) {
+    int64_t pos = graph->buckets[i] - 1;
+    if (memcmp(records[pos].id, id, 40) == 0)
+      return pos;
+  }
+  return -1;
+}
+
+// Adds the matches of <prefix> in <sorted> to those in *found (their number,
+// up to 2, and one of them in *pos).
+static void find_prefix_in(const commit_record* records, const int32_t* sorted, int64_t count,
+                           const char* prefix, size_t len, int* found, int64_t* pos) {
+  int64_t lo = 0, hi = count;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (memcmp(records[sorted[mid]].id, prefix, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  // Equal ids sort next to each other, so the matches are a run.
+  for (; lo < count && *found < 2 && memcmp(records[sorted[lo]].id, prefix, len) == 0; lo++) {
+    if (*found == 0) {
+      *pos = sorted[lo];
+      *found = 1;
+    } else if (memcmp(records[sorted[lo]].id, records[*pos].id, 40) != 0) {
+      *found = 2;
+    }
+  }
+}
+
+int commitgraph_find_prefix(const commit_graph* graph, const char* prefix, int64_t* pos) {
+  size_t len = strlen(prefix);
+  if (len > 40)
+    return 0;
+  int found = 0;
+  find_prefix_in(graph->log->records, graph->sorted, graph->covered, prefix, len, &found, pos);
+  find_prefix_in(graph->log->records, graph->tail_sorted, graph->count - graph->covered, prefix, len,
+                 &found, pos);
+  return found;
+}
+
+const commitgraph_entry* commitgraph_entry_at(const commit_graph* graph, int64_t pos) {
+  return pos < graph->covered ? &graph->entries[pos] : &graph->tail[pos - graph->covered];
+}
+
+/* Queries */
+
+int commitgraph_is_ancestor(const commit_graph* graph, int64_t ancestor, int64_t descendant) {
+  uint32_t floor = commitgraph_entry_at(graph, ancestor)->generation;
+  if (commitgraph_entry_at(graph, descendant)->generation <= floor)
+    return ancestor == descendant;
+
+  char* seen = calloc(graph->count + 1, 1);
+  int64_t* stack = malloc((graph->count + 1) * sizeof(int64_t));
+  ASSERT_ERROR_MESSAGE(seen != NULL && stack != NULL, "out of memory");
+
+  int found = 0;
+  int64_t depth = 0;
+  stack[depth++] = descendant;
+  seen[descendant] = 1;
+  while (depth > 0) {
+    int64_t pos = stack[--depth];
+    if (pos == ancestor) {
+      found = 1;
+      break;
+    }
+    const commitgraph_entry* entry = commitgraph_entry_at(graph, pos);
+    for (int i = 0; i < 2; i++) {
+      int64_t parent = entry->parents[i];
+      if (parent < 0 || seen[parent] || commitgraph_entry_at(graph, parent)->generation < floor)
+        continue;
+      seen[parent] = 1;
+      stack[depth++] = parent;
+    }
+  }
+
+  free(seen);
+  free(stack);
+  return found;
+}
+
+// Max-heap of record numbers by generation.
+typedef struct {
+  const commit_graph* graph;
+  int64_t* items;
+  int64_t count;
+} commit_queue;
+
+static int queue_before(const commit_queue* queue, int64_t a, int64_t b) {
+  uint32_t ga = commitgraph_entry_at(queue->graph, a)->generation;
+  uint32_t gb = commitgraph_entry_at(queue->graph, b)->generation;
+  return ga != gb ? ga > gb : a > b;
+}
+
+static void queue_push(commit_queue* queue, int64_t pos) {
+  int64_t i = queue->count++;
+  while (i > 0 && queue_before(queue, pos, queue->items[(i - 1) / 2])) {
+    queue->items[i] = queue->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  queue->items[i] = pos;
+}
+
+static int64_t queue_pop(commit_queue* queue) {
+  int64_t top = queue->items[0];
+  int64_t last = queue->items[--queue->count];
+  int64_t i = 0;
+  for (;;) {
+    int64_t child = 2 * i + 1;
+    if (child >= queue->count)
+      break;
+    if (child + 1 < queue->count && queue_before(queue, queue->items[child + 1], queue->items[child]))
+      child++;
+    if (!queue_before(queue, queue->items[child], last))
+      break;
+    queue->items[i] = queue->items[child];
+    i = child;
+  }
+  queue->items[i] = last;
+  return top;
+}
+
+#define REACHES_A 1
+#define REACHES_B 2
+
+int64_t commitgraph_merge_base(const commit_graph* graph, int64_t a, int64_t b) {
+  if (a == b)
+    return a;
+
+  // Commits come off the queue newest generation first, so by the time one
+  // does, everything above it that reaches it has marked it. The first one
+  // both sides reach is a common ancestor no other one descends from.
+  char* flags = calloc(graph->count + 1, 1);
+  commit_queue queue = { graph, malloc((graph->count + 1) * sizeof(int64_t)), 0 };
+  ASSERT_ERROR_MESSAGE(flags != NULL && queue.items != NULL, "out of memory");
+  flags[a] = REACHES_A;
+  flags[b] = REACHES_B;
+  queue_push(&queue, a);
+  queue_push(&queue, b);
+
+  int64_t base = -1;
+  while (queue.count > 0) {
+    int64_t pos = queue_pop(&queue);
+    if (flags[pos] == (REACHES_A | REACHES_B)) {
+      base = pos;
+      break;
+    }
+    const commitgraph_entry* entry = commitgraph_entry_at(graph, pos);
+    for (int i = 0; i < 2; i++) {
+      int64_t parent = entry->parents[i];
+      if (parent < 0 || (flags[parent] & flags[pos]) == flags[pos])
+        continue;
+      if (!flags[parent])
+        queue_push(&queue, parent);
+      flags[parent] |= flags[pos];
+    }
+  }
+
+  free(flags);
+  free(queue.items);
+  return base;
+}
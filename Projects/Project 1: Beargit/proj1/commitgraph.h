@@ -0,0 +1,76 @@
+/**
+ * The commit graph (.beargit/.commit-graph) caches, for every commit in the
+ * commit log, the record numbers of its parents (two for a merge) and its
+ * generation number: 1 for a commit without parents in the log, otherwise
+ * one more than the highest generation of its parents. A hash table over
+ * the commit ids makes finding a commit a probe or two, and a table of the
+ * commits sorted by id resolves abbreviated ids with a binary search.
+ *
+ * A commit's ancestors all have lower generations, so ancestry and merge
+ * base queries stop walking as soon as they are below the commit they are
+ * looking for, instead of going all the way back to the first commit.
+ *
+ * The file is a cache: it covers the log as it was when it was written, and
+ * commits made since then are added in memory when the graph is opened. It
+ * is rewritten once those are more than COMMITGRAPH_MAX_TAIL, by
+ * `beargit repack`, and whenever it doesn't match the log anymore.
+ */
+
+#include <stdint.h>
+
+#include "commitlog.h"
+
+#ifndef COMMITGRAPH_H
+#define COMMITGRAPH_H
+
+#define COMMITGRAPH_FILE ".beargit/.commit-graph"
+#define COMMITGRAPH_MAX_TAIL 64
+
+typedef struct {
+  uint32_t generation;
+  int32_t parents[2];     // record numbers, -1 for none
+} commitgraph_entry;
+
+typedef struct {
+  const commit_log* log;    // must stay open while the graph is
+
+  const commitgraph_entry* entries;   // the first <covered> commits
+  int64_t covered;
+  const int32_t* buckets;             // record number + 1, 0 for empty
+  uint32_t nbuckets;
+  const int32_t* sorted;              // record numbers, by commit id
+
+  commitgraph_entry* tail;            // the commits after those
+  int32_t* tail_sorted;
+  int64_t count;                      // all commits
+
+  // Mapping, for commitgraph_close
+  void* base;
+  size_t size;
+} commit_graph;
+
+void commitgraph_open(commit_graph* graph, const commit_log* log);
+void commitgraph_close(commit_graph* graph);
+
+// Writes the graph for all of <log>. Returns 0, or -1 if it couldn't; the
+// graph is then just built in memory by the next commitgraph_open.
+int commitgraph_write(const commit_log* log);
+
+// Record number of commit <id>, or -1 if it isn't in the log.
+int64_t commitgraph_find(const commit_graph* graph, const char* id);
+
+// Looks up the commits whose ids start with <prefix>. Returns 0 if there
+// are none, 1 if they all have the same id (*pos is one of them), or 2 if
+// <prefix> is ambiguous.
+int commitgraph_find_prefix(const commit_graph* graph, const char* prefix, int64_t* pos);
+
+const commitgraph_entry* commitgraph_entry_at(const commit_graph* graph, int64_t pos);
+
+// Whether <ancestor> is <descendant> or one of its ancestors.
+int commitgraph_is_ancestor(const commit_graph* graph, int64_t ancestor, int64_t descendant);
+
+// A common ancestor of <a> and <b> that is no ancestor of another one (the
+// one with the highest generation), or -1 if they have none.
+int64_t commitgraph_merge_base(const commit_graph* graph, int64_t a, int64_t b);
+
+#endif
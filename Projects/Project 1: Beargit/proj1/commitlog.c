@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "commitlog.h"
+#include "util.h"
+
+/* Commit log file format
+ *
+ *   header    commitlog_header
+ *   records   one commit_record per commit, in the order they were made
+ *
+ * The message heap is just the NUL-terminated messages one after another.
+ * A commit appends its message first and its record second, so a record
+ * never points at a message that isn't there; a record cut short by a crash
+ * is ignored when the log is read.
+ */
+
+#define COMMITLOG_MAGIC "BCLG"
+#define COMMITLOG_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t reserved;
+} commitlog_header;
+
+static void* map_file(const char* filename, size_t* size) {
+  *size = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    ASSERT_ERROR_MESSAGE(errno == ENOENT, "couldn't open commit log");
+    return NULL;
+  }
+
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &s) == 0, "couldn't stat commit log");
+  void* base = NULL;
+  if (s.st_size > 0) {
+    base = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ASSERT_ERROR_MESSAGE(base != MAP_FAILED, "couldn't map commit log");
+    *size = s.st_size;
+  }
+  close(fd);
+  return base;
+}
+
+void commitlog_open(commit_log* log) {
+  memset(log, 0, sizeof(*log));
+
+  log->log_base = map_file(COMMITLOG_FILE, &log->log_size);
+  log->messages_base = map_file(COMMITLOG_MESSAGES, &log->messages_size);
+  log->messages = log->messages_base;
+
+  if (log->log_size < sizeof(commitlog_header))
+    return;
+
+  const commitlog_header* header = log->log_base;
+  ASSERT_ERROR_MESSAGE(memcmp(header->magic, COMMITLOG_MAGIC, 4) == 0, "not a commit log");
+  ASSERT_ERROR_MESSAGE(header->version == COMMITLOG_VERSION &&
+                       header->record_size == sizeof(commit_record),
+                       "unsupported commit log version");
+
+  log->records = (const commit_record*) ((const char*) log->log_base + sizeof(commitlog_header));
+  log->count = (log->log_size - sizeof(commitlog_header)) / sizeof(commit_record);
+}
+
+void commitlog_close(commit_log* log) {
+  if (log->log_base)
+    munmap(log->log_base, log->log_size);
+  if (log->messages_base)
+    munmap(log->messages_base, log->messages_size);
+  memset(log, 0, sizeof(*log));
+}
+
+int64_t commitlog_find(const commit_log* log, const char* id) {
+  for (int64_t pos = log->count - 1; pos >= 0; pos--) {
+    if (memcmp(log->records[pos].id, id, sizeof(log->records[pos].id)) == 0)
+      return pos;
+  }
+  return -1;
+}
+
+const char* commitlog_message(const commit_log* log, const commit_record* record) {
+  if (record->msg_offset + record->msg_len >= log->messages_size ||
+      log->messages[record->msg_offset + record->msg_len] != '\0')
+    return NULL;
+  return log->messages + record->msg_offset;
+}
+
+static void write_all(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    ASSERT_ERROR_MESSAGE(n > 0 || errno == EINTR, "couldn't write commit log");
+    if (n > 0) {
+      p += n;
+      len -= n;
+    }
+  }
+}
+
+// Opens <filename> for appending. Returns its current size in *size.
+static int open_for_append(const char* filename, off_t* size) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't open commit log");
+
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &s) == 0, "couldn't stat commit log");
+  *size = s.st_size;
+  return fd;
+}
+
+void commitlog_append(const char* id, const char* parent, const char* merge_parent,
+                      const char* msg) {
+  commit_record record;
+  memset(&record, 0, sizeof(record));
+  memcpy(record.id, id, sizeof(record.id));
+  memcpy(record.parent, parent, sizeof(record.parent));
+
+  commit_log log;
+  commitlog_open(&log);
+  record.parent_pos = commitlog_find(&log, parent);
+  if (merge_parent)
+    record.merge_pos = commitlog_find(&log, merge_parent) + 1;
+  commitlog_close(&log);
+
+  off_t size;
+  int fd = open_for_append(COMMITLOG_MESSAGES, &size);
+  record.msg_offset = size;
+  record.msg_len = strlen(msg);
+  write_all(fd, msg, record.msg_len + 1);
+  close(fd);
+
+  fd = open_for_append(COMMITLOG_FILE, &size);
+  if (size < (off_t) sizeof(commitlog_header)) {
+    ASSERT_ERROR_MESSAGE(size == 0, "truncated commit log");
+    commitlog_header header = { COMMITLOG_MAGIC, COMMITLOG_VERSION, sizeof(commit_record), 0 };
+    write_all(fd, &header, sizeof(header));
+  } else if ((size - sizeof(commitlog_header)) % sizeof(commit_record) != 0) {
+    // Drop a record a crash left half written, so ours lands on a record boundary.
+    ASSERT_ERROR_MESSAGE(ftruncate(fd, size - (size - sizeof(commitlog_header)) % sizeof(commit_record)) == 0,
+                         "couldn't repair commit log");
+  }
+  write_all(fd, &record, sizeof(record));
+  close(fd);
+}
@@ -0,0 +1,58 @@
+/**
+ * The commit log (.beargit/.commits) has one fixed-size record per commit,
+ * appended when the commit is made, and the commit messages live back to
+ * back in a companion heap (.beargit/.messages). Both files are only ever
+ * appended to, and readers map them, so walking the history is a pointer
+ * chase through memory instead of two file opens per commit.
+ *
+ * Commits made before the log existed are not in it; their message and
+ * parent are still read from .beargit/<id>/.msg and .beargit/<id>/.prev.
+ *
+ * The second parent of a merge commit is only recorded here, as a record
+ * number; the parent in the commit directory is always the first one.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COMMITLOG_H
+#define COMMITLOG_H
+
+#define COMMITLOG_FILE ".beargit/.commits"
+#define COMMITLOG_MESSAGES ".beargit/.messages"
+
+typedef struct {
+  char id[40];
+  char parent[40];
+  int64_t parent_pos;     // record number of the parent, -1 if not in the log
+  uint64_t msg_offset;    // message position in the message heap
+  uint32_t msg_len;
+  uint32_t merge_pos;     // record number + 1 of the second parent, 0 if none
+} commit_record;
+
+typedef struct {
+  const commit_record* records;
+  int64_t count;
+  const char* messages;
+  size_t messages_size;
+
+  // Mappings, for commitlog_close
+  void* log_base;
+  size_t log_size;
+  void* messages_base;
+} commit_log;
+
+void commitlog_open(commit_log* log);
+void commitlog_close(commit_log* log);
+
+// Record number of commit <id>, or -1. Searches from the newest commit back.
+int64_t commitlog_find(const commit_log* log, const char* id);
+
+// The message of a record, or NULL if it points outside the heap.
+const char* commitlog_message(const commit_log* log, const commit_record* record);
+
+// <merge_parent> is the second parent of a merge commit, or NULL.
+void commitlog_append(const char* id, const char* parent, const char* merge_parent,
+                      const char* msg);
+
+#endif
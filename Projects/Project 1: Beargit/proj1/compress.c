@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "compress.h"
+#include "util.h"
+
+/* Compressed stream format
+ *
+ *   "BLZ1"
+ *   blocks    uint32 raw size, uint32 stored size, stored bytes; the top bit
+ *             of the stored size marks a block kept uncompressed
+ *   end       a raw size of 0
+ *
+ * All integers are little-endian. A compressed block is a series of
+ * sequences, each a token byte (literal count in the high nibble, match
+ * length - MIN_MATCH in the low one, 15 meaning more length bytes follow),
+ * the extra literal count bytes, the literals, then a 16-bit match offset
+ * back into the block and the extra match length bytes. The last sequence of
+ * a block has literals only.
+ */
+
+#define STREAM_MAGIC "BLZ1"
+#define STORED_RAW 0x80000000u
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 14
+
+// Largest compressed block, when nothing matches
+#define MAX_BLOCK_BOUND (COMPRESS_BLOCK_SIZE + COMPRESS_BLOCK_SIZE / 255 + 16)
+
+static uint32_t read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static void put_le32(unsigned char* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static unsigned char* put_length(unsigned char* out, size_t len) {
+  while (len >= 255) {
+    *out++ = 255;
+    len -= 255;
+  }
+  *out++ = len;
+  return out;
+}
+
+static unsigned char* put_sequence(unsigned char* out, const unsigned char* literals,
+                                   size_t nliterals, size_t offset, size_t match_len) {
+  size_t extra = match_len ? match_len - MIN_MATCH : 0;
+  unsigned char* token = out++;
+  *token = (nliterals < 15 ? nliterals : 15) << 4;
+  if (nliterals >= 15)
+    out = put_length(out, nliterals - 15);
+  memcpy(out, literals, nliterals);
+  out += nliterals;
+
+  if (match_len) {
+    *token |= extra < 15 ? extra : 15;
+    *out++ = offset;
+    *out++ = offset >> 8;
+    if (extra >= 15)
+      out = put_length(out, extra - 15);
+  }
+  return out;
+}
+
+// Compresses one block into <out> (MAX_BLOCK_BOUND bytes). Returns the
+// compressed size.
+static size_t compress_block(const unsigned char* in, size_t size, unsigned char* out) {
+  int32_t table[1 << HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+
+  unsigned char* op = out;
+  size_t anchor = 0, pos = 0;
+  while (pos + MIN_MATCH <= size) {
+    uint32_t seq = read32(in + pos);
+    uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+    int32_t cand = table[h];
+    table[h] = pos;
+
+    if (cand < 0 || pos - cand > MAX_OFFSET || read32(in + cand) != seq) {
+      pos++;
+      continue;
+    }
+
+    size_t len = MIN_MATCH;
+    while (pos + len < size && in[cand + len] == in[pos + len])
+      len++;
+    op = put_sequence(op, in + anchor, pos - anchor, pos - cand, len);
+    pos += len;
+    anchor = pos;
+  }
+  op = put_sequence(op, in + anchor, size - anchor, 0, 0);
+  return op - out;
+}
+
+static int get_length(const unsigned char** p, const unsigned char* end, size_t* len) {
+  unsigned char byte;
+  do {
+    if (*p == end)
+      return -1;
+    byte = *(*p)++;
+    *len += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+// Decompresses one block of <raw_size> bytes into <out>. Returns 0, or -1 if
+// the block is malformed.
+static int decompress_block(const unsigned char* in, size_t size, unsigned char* out,
+                            size_t raw_size) {
+  const unsigned char* p = in;
+  const unsigned char* end = in + size;
+  size_t done = 0;
+
+  while (p < end) {
+    unsigned char token = *p++;
+    size_t nliterals = token >> 4;
+    if (nliterals == 15 && get_length(&p, end, &nliterals))
+      return -1;
+    if (nliterals > (size_t) (end - p) || nliterals > raw_size - done)
+      return -1;
+    memcpy(out + done, p, nliterals);
+    p += nliterals;
+    done += nliterals;
+    if (p == end)
+      break;
+
+    if (end - p < 2)
+      return -1;
+    size_t offset = p[0] | (p[1] << 8);
+    p += 2;
+    size_t len = (token & 15) + MIN_MATCH;
+    if ((token & 15) == 15 && get_length(&p, end, &len))
+      return -1;
+    if (offset == 0 || offset > done || len > raw_size - done)
+      return -1;
+
+    // Byte by byte: the match may overlap the bytes it produces.
+    for (size_t i = 0; i < len; i++)
+      out[done + i] = out[done - offset + i];
+    done += len;
+  }
+  return done == raw_size ? 0 : -1;
+}
+
+/* Streams */
+
+static int write_all(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      errno = n < 0 ? errno : EIO;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Reads up to <len> bytes, fewer only at the end of the file. Returns the
+// number read or -1.
+static ssize_t read_full(int fd, void* buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char*) buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+// Compresses and writes one block of at most COMPRESS_BLOCK_SIZE bytes.
+// <packed> is scratch space of 8 + MAX_BLOCK_BOUND bytes.
+static int write_block(int out, const unsigned char* raw, size_t n, unsigned char* packed) {
+  size_t size = compress_block(raw, n, packed + 8);
+  uint32_t stored = size;
+  if (size >= n) {
+    memcpy(packed + 8, raw, n);
+    size = n;
+    stored = n | STORED_RAW;
+  }
+  put_le32(packed, n);
+  put_le32(packed + 4, stored);
+  return write_all(out, packed, 8 + size);
+}
+
+int compress_stream(int in, int out) {
+  unsigned char* raw = malloc(COMPRESS_BLOCK_SIZE);
+  unsigned char* packed = malloc(8 + MAX_BLOCK_BOUND);
+  ASSERT_ERROR_MESSAGE(raw != NULL && packed != NULL, "out of memory");
+
+  int ret = write_all(out, STREAM_MAGIC, 4);
+  ssize_t n = 0;
+  while (ret == 0 && (n = read_full(in, raw, COMPRESS_BLOCK_SIZE)) > 0)
+    ret = write_block(out, raw, n, packed);
+
+  unsigned char end[4] = { 0 };
+  if (ret == 0 && n == 0)
+    ret = write_all(out, end, 4);
+  else
+    ret = -1;
+
+  free(raw);
+  free(packed);
+  return ret;
+}
+
+int compress_buffer(const char* data, size_t size, int out) {
+  unsigned char* packed = malloc(8 + MAX_BLOCK_BOUND);
+  ASSERT_ERROR_MESSAGE(packed != NULL, "out of memory");
+
+  int ret = write_all(out, STREAM_MAGIC, 4);
+  for (size_t done = 0; ret == 0 && done < size; done += COMPRESS_BLOCK_SIZE) {
+    size_t n = size - done < COMPRESS_BLOCK_SIZE ? size - done : COMPRESS_BLOCK_SIZE;
+    ret = write_block(out, (const unsigned char*) data + done, n, packed);
+  }
+
+  unsigned char end[4] = { 0 };
+  if (ret == 0)
+    ret = write_all(out, end, 4);
+  free(packed);
+  return ret;
+}
+
+int decompress_stream(int in, int out) {
+  unsigned char* raw = malloc(COMPRESS_BLOCK_SIZE);
+  unsigned char* packed = malloc(MAX_BLOCK_BOUND);
+  ASSERT_ERROR_MESSAGE(raw != NULL && packed != NULL, "out of memory");
+
+  // Read errors keep their errno, anything wrong with the data is EINVAL.
+  int ret = 0, malformed = 0;
+  unsigned char header[8];
+  ssize_t n = read_full(in, header, 4);
+  malformed = n >= 0 && (n != 4 || memcmp(header, STREAM_MAGIC, 4) != 0);
+  ret = n < 0 || malformed ? -1 : 0;
+
+  while (ret == 0) {
+    n = read_full(in, header, 4);
+    if (n != 4) {
+      malformed = n >= 0;
+      ret = -1;
+      break;
+    }
+    uint32_t raw_size = get_le32(header);
+    if (raw_size == 0)
+      break;
+
+    n = read_full(in, header + 4, 4);
+    uint32_t stored = n == 4 ? get_le32(header + 4) : 0;
+    uint32_t size = stored & ~STORED_RAW;
+    malformed = n >= 0 && (n != 4 || raw_size > COMPRESS_BLOCK_SIZE || size == 0 ||
+                           size > MAX_BLOCK_BOUND);
+    if (n != 4 || malformed) {
+      ret = -1;
+      break;
+    }
+
+    n = read_full(in, packed, size);
+    if (n != (ssize_t) size) {
+      malformed = n >= 0;
+      ret = -1;
+      break;
+    }
+
+    if (stored & STORED_RAW) {
+      malformed = size != raw_size;
+      ret = malformed ? -1 : write_all(out, packed, size);
+    } else {
+      malformed = decompress_block(packed, size, raw, raw_size) != 0;
+      ret = malformed ? -1 : write_all(out, raw, raw_size);
+    }
+  }
+
+  if (malformed)
+    errno = EINVAL;
+  free(raw);
+  free(packed);
+  return ret;
+}
+
+char* decompress_buffer(const char* data, size_t size, size_t max_size, size_t* out_size) {
+  const unsigned char* p = (const unsigned char*) data;
+  const unsigned char* end = p + size;
+  if (size < 4 || memcmp(p, STREAM_MAGIC, 4) != 0)
+    return NULL;
+  p += 4;
+
+  size_t capacity = COMPRESS_BLOCK_SIZE, done = 0;
+  char* result = malloc(capacity);
+  ASSERT_ERROR_MESSAGE(result != NULL, "out of memory");
+
+  for (;;) {
+    if (end - p < 4)
+      break;
+    uint32_t raw_size = get_le32(p);
+    p += 4;
+    if (raw_size == 0) {
+      *out_size = done;
+      return result;
+    }
+
+    if (end - p < 4)
+      break;
+    uint32_t stored = get_le32(p);
+    uint32_t stored_size = stored & ~STORED_RAW;
+    p += 4;
+    if (raw_size > COMPRESS_BLOCK_SIZE || stored_size > (size_t) (end - p) ||
+        done + raw_size > max_size)
+      break;
+
+    if (done + raw_size > capacity) {
+      while (done + raw_size > capacity)
+        capacity *= 2;
+      result = realloc(result, capacity);
+      ASSERT_ERROR_MESSAGE(result != NULL, "out of memory");
+    }
+    if (stored & STORED_RAW) {
+      if (stored_size != raw_size)
+        break;
+      memcpy(result + done, p, raw_size);
+    } else if (decompress_block(p, stored_size, (unsigned char*) result + done, raw_size) != 0) {
+      break;
+    }
+    p += stored_size;
+    done += raw_size;
+  }
+
+  free(result);
+  return NULL;
+}
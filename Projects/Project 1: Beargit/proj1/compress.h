@@ -0,0 +1,27 @@
+/**
+ * Block-based LZ compression for stored blobs. Streams are cut into
+ * COMPRESS_BLOCK_SIZE blocks that are compressed independently, so
+ * compressing or decompressing a file only ever holds one block in memory.
+ */
+
+#include <stddef.h>
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#define COMPRESS_BLOCK_SIZE 65536
+
+// Copy <in> to <out>, compressing or decompressing on the way. Return 0, or
+// -1 with errno set (EINVAL for a malformed stream).
+int compress_stream(int in, int out);
+int decompress_stream(int in, int out);
+
+// Writes <data> to <out> as a compressed stream. Same return as above.
+int compress_buffer(const char* data, size_t size, int out);
+
+// Decompresses a whole stream held in memory. Returns the contents (to be
+// freed by the caller), or NULL if the stream is malformed or would
+// decompress to more than <max_size> bytes.
+char* decompress_buffer(const char* data, size_t size, size_t max_size, size_t* out_size);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "config.h"
+#include "util.h"
+
+typedef struct {
+  const char* name;
+  const char* default_value;
+  const char* const* values;    // allowed values, NULL-terminated
+} config_setting;
+
+static const char* const copy_modes[] = { "auto", "reflink", "hardlink", NULL };
+static const char* const compressions[] = { "none", "lz", NULL };
+static const char* const durabilities[] = { "none", "commit", "full", NULL };
+
+static const config_setting settings[] = {
+  { CONFIG_COPY_MODE, "auto", copy_modes },
+  { CONFIG_COMPRESSION, "none", compressions },
+  { CONFIG_DURABILITY, "commit", durabilities },
+  { NULL, NULL, NULL }
+};
+
+static const config_setting* find_setting(const char* name) {
+  for (const config_setting* setting = settings; setting->name; setting++) {
+    if (strcmp(setting->name, name) == 0)
+      return setting;
+  }
+  return NULL;
+}
+
+static void config_file(const char* name, char* filename) {
+  sprintf(filename, ".beargit/.config_%s", name);
+}
+
+int config_is_known(const char* name) {
+  return find_setting(name) != NULL;
+}
+
+int config_is_valid(const char* name, const char* value) {
+  const config_setting* setting = find_setting(name);
+  if (!setting || strlen(value) > CONFIG_VALUE_SIZE - 1)
+    return 0;
+
+  for (const char* const* allowed = setting->values; *allowed; allowed++) {
+    if (strcmp(*allowed, value) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+void config_get(const char* name, char* value) {
+  const config_setting* setting = find_setting(name);
+  ASSERT_ERROR_MESSAGE(setting != NULL, "unknown setting");
+
+  char filename[FILENAME_SIZE];
+  config_file(name, filename);
+
+  struct stat s;
+  if (stat(filename, &s) != 0) {
+    strcpy(value, setting->default_value);
+    return;
+  }
+
+  memset(value, 0, CONFIG_VALUE_SIZE);
+  read_string_from_file(filename, value, CONFIG_VALUE_SIZE - 1);
+}
+
+void config_set(const char* name, const char* value) {
+  ASSERT_ERROR_MESSAGE(config_is_valid(name, value), "invalid setting");
+
+  char filename[FILENAME_SIZE];
+  config_file(name, filename);
+  write_string_to_file(filename, value);
+}
+
+void config_for_each(void (*fn)(const char* name, const char* value)) {
+  for (const config_setting* setting = settings; setting->name; setting++) {
+    char value[CONFIG_VALUE_SIZE];
+    config_get(setting->name, value);
+    fn(setting->name, value);
+  }
+}
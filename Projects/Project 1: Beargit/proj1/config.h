@@ -0,0 +1,33 @@
+/**
+ * Repository settings. Every setting lives in its own file,
+ * .beargit/.config_<name>. Unset settings read as their default.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_VALUE_SIZE 128
+
+// How fs_cp-based snapshots move file data into and out of the object store:
+// "auto" copies (reflink/in-kernel when possible), "reflink" ("hardlink" is its
+// old name) keeps objects plain so they can always be cloned; objects never
+// share an inode with a working file.
+#define CONFIG_COPY_MODE "copy_mode"
+
+// How new objects are stored: "none" keeps them as plain copies, "lz"
+// compresses them (see compress.h). Only applies with copy_mode "auto".
+#define CONFIG_COMPRESSION "compression"
+
+// How long commits wait for the disk: "none", "commit" or "full" (see
+// journal.h).
+#define CONFIG_DURABILITY "durability"
+
+int config_is_known(const char* name);
+int config_is_valid(const char* name, const char* value);
+void config_get(const char* name, char* value);
+void config_set(const char* name, const char* value);
+
+// Calls fn(name, value) for every known setting.
+void config_for_each(void (*fn)(const char* name, const char* value));
+
+#endif
@@ -1,10 +1,29 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
 #include "Cunit/Basic.h"
 #include <limits.h>
 #include "beargit.h"
+#include "chunk.h"
+#include "commitgraph.h"
+#include "commitlog.h"
+#include "daemon.h"
+#include "diff.h"
+#include "ignore.h"
+#include "index.h"
+#include "journal.h"
+#include "msgindex.h"
+#include "objects.h"
+#include "pack.h"
+#include "refs.h"
+#include "repo.h"
+#include "sha1.h"
+#include "sparse.h"
+#include "state.h"
 #include "util.h"
 
 /* printf/fprintf calls in this tester will NOT go to file. */
@@ -138,6 +157,1516 @@ void simple_log_test(void)
     free_commit_list(&commit_list);
 }
 
+void fs_force_rm_dir(const char* dir)
+{
+    char cmd[FILENAME_SIZE];
+    sprintf(cmd, "rm -rf %s", dir);
+    system(cmd);
+}
+
+/* Current commit id, from the repository state. */
+void read_head(char* commit_id)
+{
+    repo_state state;
+    state_read(&state);
+    strcpy(commit_id, state.head);
+}
+
+int count_objects(void)
+{
+    int count = 0;
+    DIR* objects = opendir(OBJECTS_DIR);
+    struct dirent* fanout;
+    while ((fanout = readdir(objects)) != NULL) {
+      if (fanout->d_name[0] == '.')
+        continue;
+      char fanout_dir[FILENAME_SIZE];
+      sprintf(fanout_dir, "%s/%s", OBJECTS_DIR, fanout->d_name);
+      DIR* blobs = opendir(fanout_dir);
+      if (blobs == NULL)
+        continue;
+      struct dirent* blob;
+      while ((blob = readdir(blobs)) != NULL) {
+        if (blob->d_name[0] != '.')
+          count++;
+      }
+      closedir(blobs);
+    }
+    closedir(objects);
+    return count;
+}
+
+/* Commits store each distinct file content exactly once in the object store,
+ * and checking out restores the committed contents.
+ */
+void object_store_dedup_test(void)
+{
+    int retval;
+    retval = beargit_init();
+    CU_ASSERT(0==retval);
+    write_string_to_file("same1.txt", "same contents");
+    write_string_to_file("same2.txt", "same contents");
+    write_string_to_file("other.txt", "other contents");
+    CU_ASSERT(0==beargit_add("same1.txt"));
+    CU_ASSERT(0==beargit_add("same2.txt"));
+    CU_ASSERT(0==beargit_add("other.txt"));
+
+    CU_ASSERT(0==beargit_commit("GO BEARS! first"));
+    CU_ASSERT(2==count_objects());
+
+    // Committing again without changes must not add any objects.
+    CU_ASSERT(0==beargit_commit("GO BEARS! second"));
+    CU_ASSERT(2==count_objects());
+
+    write_string_to_file("other.txt", "changed contents");
+    CU_ASSERT(0==beargit_commit("GO BEARS! third"));
+    CU_ASSERT(3==count_objects());
+
+    // Branching from the third commit and coming back restores it.
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    write_string_to_file("other.txt", "scribbled over");
+    CU_ASSERT(0==beargit_checkout("master", 0));
+
+    char contents[MSG_SIZE];
+    read_string_from_file("other.txt", contents, MSG_SIZE);
+    CU_ASSERT_STRING_EQUAL(contents, "changed contents");
+}
+
+/* beargit status lists files changed since the last commit in a separate
+ * section, and only once their contents actually differ.
+ */
+void status_modified_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("kept.txt", "kept");
+    write_string_to_file("edited.txt", "before");
+    CU_ASSERT(0==beargit_add("kept.txt"));
+    CU_ASSERT(0==beargit_add("edited.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! base"));
+
+    write_string_to_file("edited.txt", "after!");
+    write_string_to_file("kept.txt", "kept");
+    CU_ASSERT(0==beargit_status());
+
+    const char* expected =
+      "Tracked files:\n\n  kept.txt\n  edited.txt\n\n2 files total\n"
+      "\nModified files:\n\n  edited.txt\n\n1 files modified\n";
+    char output[MSG_SIZE] = { 0 };
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+    fread(output, 1, MSG_SIZE - 1, fstdout);
+    fclose(fstdout);
+    CU_ASSERT_STRING_EQUAL(output, expected);
+}
+
+/* Adding directories picks up every file below them exactly once, and
+ * removing a directory untracks everything below it.
+ */
+void batch_add_rm_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    fs_force_rm_dir("tree");
+    fs_mkdir("tree");
+    fs_mkdir("tree/sub");
+    write_string_to_file("tree/a.txt", "a");
+    write_string_to_file("tree/sub/b.txt", "b");
+    write_string_to_file("tree/.hidden", "h");
+    write_string_to_file("top.txt", "top");
+
+    char* first[] = { "tree/sub/b.txt" };
+    CU_ASSERT(0==beargit_add_paths(1, first));
+    char* all[] = { "./tree/", "top.txt" };
+    CU_ASSERT(0==beargit_add_paths(2, all));
+
+    beargit_index index;
+    index_read(&index);
+    CU_ASSERT(3==index.count);
+    CU_ASSERT(index_find(&index, "tree/a.txt") >= 0);
+    CU_ASSERT(index_find(&index, "tree/sub/b.txt") >= 0);
+    CU_ASSERT(index_find(&index, "tree/.hidden") < 0);
+    index_free(&index);
+
+    char* dir[] = { "tree" };
+    CU_ASSERT(0==beargit_rm_paths(1, dir));
+    index_read(&index);
+    CU_ASSERT(1==index.count);
+    CU_ASSERT(index_find(&index, "top.txt") == 0);
+    index_free(&index);
+
+    // "./x" and "x" are the same file, one path at a time or several.
+    write_string_to_file("second.txt", "second");
+    char* dotted[] = { "./second.txt" };
+    CU_ASSERT(0==beargit_add_paths(1, dotted));
+    char* plain[] = { "second.txt", "top.txt" };
+    CU_ASSERT(3==beargit_add_paths(2, plain));
+    index_read(&index);
+    CU_ASSERT(2==index.count);
+    CU_ASSERT(index_find(&index, "second.txt") >= 0);
+    index_free(&index);
+    char* dotted_top[] = { "./top.txt" };
+    CU_ASSERT(0==beargit_rm_paths(1, dotted_top));
+    CU_ASSERT(0==beargit_rm_paths(1, dotted));
+
+    // ".." is resolved before anything else: nothing outside the working
+    // directory or inside .beargit can be named, and a detour is still the
+    // same file.
+    char* escaping[] = { "tree/../.beargit/.index" };
+    CU_ASSERT(1==beargit_add_paths(1, escaping));
+    char* outside[] = { "../top.txt", "tree/../../top.txt" };
+    CU_ASSERT(1==beargit_add_paths(2, outside));
+    char* detour[] = { "tree/a.txt", "tree/sub/../a.txt" };
+    CU_ASSERT(3==beargit_add_paths(2, detour));
+    index_read(&index);
+    CU_ASSERT(1==index.count);
+    CU_ASSERT(index_find(&index, "tree/a.txt") == 0);
+    index_free(&index);
+    char* detour_rm[] = { "tree/./sub/../a.txt" };
+    CU_ASSERT(0==beargit_rm_paths(1, detour_rm));
+
+    fs_rm("second.txt");
+    fs_force_rm_dir("tree");
+}
+
+/* Commits store files on several worker threads. A file that can't be
+ * stored aborts the commit without leaving a commit behind, and checkout
+ * restores every file of a many-file commit.
+ */
+void parallel_commit_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    beargit_set_jobs(3);
+
+    char name[32];
+    for (int i = 0; i < 40; i++) {
+        sprintf(name, "p%d.txt", i);
+        write_string_to_file(name, name);
+        CU_ASSERT(0==beargit_add(name));
+    }
+    CU_ASSERT(0==beargit_commit("GO BEARS! parallel"));
+
+    char first_commit[COMMIT_ID_SIZE];
+    read_head(first_commit);
+    CU_ASSERT(40==count_objects());
+
+    fs_rm("p7.txt");
+    CU_ASSERT(1==beargit_commit("GO BEARS! missing"));
+    char prev[COMMIT_ID_SIZE];
+    read_head(prev);
+    CU_ASSERT(0==strcmp(prev, first_commit));
+
+    write_string_to_file("p7.txt", "edited");
+    CU_ASSERT(0==beargit_checkout("other", 1));
+    char contents[32];
+    read_string_from_file("p7.txt", contents, sizeof(contents));
+    CU_ASSERT(0==strcmp(contents, "p7.txt"));
+
+    for (int i = 0; i < 40; i++) {
+        sprintf(name, "p%d.txt", i);
+        fs_rm(name);
+    }
+    beargit_set_jobs(0);
+}
+
+/* Switching branches only rewrites the files that differ: unchanged files
+ * keep their inode and mtime, dropped files are removed and changed files
+ * get their committed contents back.
+ */
+void minimal_checkout_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("same.txt", "same");
+    write_string_to_file("changed.txt", "master");
+    CU_ASSERT(0==beargit_add("same.txt"));
+    CU_ASSERT(0==beargit_add("changed.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! master"));
+
+    CU_ASSERT(0==beargit_checkout("other", 1));
+    write_string_to_file("changed.txt", "other");
+    write_string_to_file("extra.txt", "extra");
+    CU_ASSERT(0==beargit_add("extra.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! other"));
+
+    struct stat before, after;
+    stat("same.txt", &before);
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    stat("same.txt", &after);
+    CU_ASSERT(before.st_ino == after.st_ino);
+    CU_ASSERT(before.st_mtim.tv_sec == after.st_mtim.tv_sec);
+    CU_ASSERT(before.st_mtim.tv_nsec == after.st_mtim.tv_nsec);
+
+    char contents[32];
+    read_string_from_file("changed.txt", contents, sizeof(contents));
+    CU_ASSERT(0==strcmp(contents, "master"));
+    CU_ASSERT(access("extra.txt", F_OK) != 0);
+
+    CU_ASSERT(0==beargit_checkout("other", 0));
+    CU_ASSERT(access("extra.txt", F_OK) == 0);
+
+    // A checkout that can't restore a file removes nothing either.
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    beargit_index index;
+    index_read(&index);
+    char object[FILENAME_SIZE];
+    object_path(index.entries[index_find(&index, "changed.txt")].blob_id, object);
+    index_free(&index);
+    CU_ASSERT(0==beargit_checkout("other", 0));
+    CU_ASSERT(0==rename(object, "object.saved"));
+    CU_ASSERT(1==beargit_checkout("master", 0));
+    CU_ASSERT(access("extra.txt", F_OK) == 0);
+    read_string_from_file("changed.txt", contents, sizeof(contents));
+    CU_ASSERT(0==strcmp(contents, "other"));
+    CU_ASSERT(0==rename("object.saved", object));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+
+    // A file that is no longer tracked makes way for a directory.
+    CU_ASSERT(0==beargit_checkout("as_dir", 1));
+    fs_mkdir("swap");
+    write_string_to_file("swap/in.txt", "in");
+    CU_ASSERT(0==beargit_add("swap/in.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! dir"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    rmdir("swap");
+    CU_ASSERT(0==beargit_checkout("as_file", 1));
+    write_string_to_file("swap", "file");
+    CU_ASSERT(0==beargit_add("swap"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! file"));
+    CU_ASSERT(0==beargit_checkout("as_dir", 0));
+    read_string_from_file("swap/in.txt", contents, sizeof(contents));
+    CU_ASSERT(0==strcmp(contents, "in"));
+
+    fs_rm("swap/in.txt");
+    rmdir("swap");
+    fs_rm("same.txt");
+    fs_rm("changed.txt");
+}
+
+/* Every commit appends a record linked to its parent's record. History from
+ * before the commit log existed is still listed from the commit directories.
+ */
+void commit_log_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("log.txt", "log");
+    CU_ASSERT(0==beargit_add("log.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! first"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! second"));
+
+    char head[COMMIT_ID_SIZE];
+    read_head(head);
+
+    commit_log log;
+    commitlog_open(&log);
+    CU_ASSERT(2==log.count);
+    CU_ASSERT(1==commitlog_find(&log, head));
+    CU_ASSERT(0==log.records[1].parent_pos);
+    CU_ASSERT(-1==log.records[0].parent_pos);
+    CU_ASSERT_STRING_EQUAL(commitlog_message(&log, &log.records[1]), "GO BEARS! second");
+    commitlog_close(&log);
+
+    // Pretend both commits predate the commit log.
+    fs_rm(COMMITLOG_FILE);
+    fs_rm(COMMITLOG_MESSAGES);
+    CU_ASSERT(0==beargit_commit("GO BEARS! third"));
+    CU_ASSERT(0==beargit_log(INT_MAX));
+
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+    char line[512];
+    int commits = 0;
+    while (fgets(line, sizeof(line), fstdout)) {
+      if (strncmp(line, "commit", strlen("commit")) == 0)
+        commits++;
+    }
+    CU_ASSERT(3==commits);
+    fclose(fstdout);
+
+    fs_rm("log.txt");
+}
+
+/* Repacking moves loose objects and commit directories into the pack, and
+ * checkout and log read them back from there.
+ */
+void repack_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("pack.txt", "one");
+    CU_ASSERT(0==beargit_add("pack.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! one"));
+    char first_commit[COMMIT_ID_SIZE];
+    read_head(first_commit);
+
+    CU_ASSERT(0==beargit_checkout("other", 1));
+    write_string_to_file("pack.txt", "two");
+    CU_ASSERT(0==beargit_commit("GO BEARS! two"));
+
+    CU_ASSERT(0==beargit_repack());
+    CU_ASSERT(0==count_objects());
+    char commit_dir[FILENAME_SIZE];
+    sprintf(commit_dir, ".beargit/%s", first_commit);
+    CU_ASSERT(!fs_check_dir_exists(commit_dir));
+
+    const char* data;
+    size_t size;
+    CU_ASSERT(1==pack_find(first_commit, PACK_COMMIT, &data, &size));
+    CU_ASSERT(0==pack_find(first_commit, PACK_BLOB, &data, &size));
+
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    char contents[32];
+    read_string_from_file("pack.txt", contents, sizeof(contents));
+    CU_ASSERT(0==strcmp(contents, "one"));
+
+    // Without the commit log, log reads the messages from the pack.
+    fs_rm(".beargit/.commits");
+    fs_rm(".beargit/.messages");
+    CU_ASSERT(0==beargit_log(INT_MAX));
+
+    fs_rm("pack.txt");
+}
+
+/* Successive versions of a file are packed as deltas, with the chains cut
+ * at PACK_MAX_DEPTH, and every version rebuilds to its original contents.
+ */
+void delta_pack_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+
+    const int versions = 2 * PACK_MAX_DEPTH + 3;
+    char blob_ids[2 * PACK_MAX_DEPTH + 3][BLOB_ID_SIZE];
+    char line[64];
+    for (int v = 0; v < versions; v++) {
+      FILE* f = fopen("delta.txt", "w");
+      for (int i = 0; i < 2000; i++) {
+        sprintf(line, i == 50 * v ? "version %d\n" : "line %d\n", i == 50 * v ? v : i);
+        fputs(line, f);
+      }
+      fclose(f);
+      if (v == 0)
+        CU_ASSERT(0==beargit_add("delta.txt"));
+      CU_ASSERT(0==beargit_commit("GO BEARS! delta"));
+
+      beargit_index index;
+      index_read(&index);
+      strcpy(blob_ids[v], index.entries[0].blob_id);
+      index_free(&index);
+    }
+
+    CU_ASSERT(0==beargit_repack());
+
+    int deltas = 0;
+    for (int v = 0; v < versions; v++) {
+      const char* data;
+      size_t size;
+      CU_ASSERT(1==pack_find(blob_ids[v], PACK_BLOB, &data, &size));
+      if (strncmp(data, blob_ids[v > 0 ? v - 1 : 0], BLOB_ID_BYTES) == 0)
+        deltas++;
+
+      // Read each version twice, the second time from the cache.
+      for (int pass = 0; pass < 2; pass++) {
+        pack_blob blob;
+        CU_ASSERT(1==pack_read_blob(blob_ids[v], &blob));
+        sha1_ctx ctx;
+        unsigned char digest[SHA1_DIGEST_BYTES];
+        char hex[BLOB_ID_SIZE];
+        sha1_init(&ctx);
+        sha1_update(&ctx, blob.data, blob.size);
+        sha1_final(&ctx, digest);
+        sha1_to_hex(digest, hex);
+        CU_ASSERT_STRING_EQUAL(hex, blob_ids[v]);
+        pack_blob_free(&blob);
+      }
+    }
+    CU_ASSERT(versions - 3 == deltas);
+
+    fs_rm("delta.txt");
+}
+
+/* With compression on, new objects are stored compressed and come back
+ * intact from the loose store and from the pack.
+ */
+void compression_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    CU_ASSERT(0==beargit_config("compression", "lz"));
+
+    FILE* f = fopen("lz.txt", "w");
+    for (int i = 0; i < 4000; i++)
+      fprintf(f, "line %d of a file that compresses well\n", i);
+    fclose(f);
+    CU_ASSERT(0==beargit_add("lz.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! compressed"));
+
+    char blob_id[BLOB_ID_SIZE], path[FILENAME_SIZE];
+    CU_ASSERT(0==object_hash_file("lz.txt", blob_id));
+    int format = OBJECT_PLAIN;
+    CU_ASSERT(0==object_loose_file(blob_id, path, &format));
+    CU_ASSERT(OBJECT_COMPRESSED==format);
+    struct stat original, stored;
+    stat("lz.txt", &original);
+    stat(path, &stored);
+    CU_ASSERT(stored.st_size < original.st_size / 2);
+
+    CU_ASSERT(0==beargit_checkout("other", 1));
+    write_string_to_file("lz.txt", "other");
+    CU_ASSERT(0==beargit_commit("GO BEARS! other"));
+
+    char restored_id[BLOB_ID_SIZE];
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(0==object_hash_file("lz.txt", restored_id));
+    CU_ASSERT_STRING_EQUAL(restored_id, blob_id);
+
+    CU_ASSERT(0==beargit_repack());
+    CU_ASSERT(0==count_objects());
+    CU_ASSERT(0==beargit_checkout("other", 0));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(0==object_hash_file("lz.txt", restored_id));
+    CU_ASSERT_STRING_EQUAL(restored_id, blob_id);
+
+    fs_rm("lz.txt");
+}
+
+/* Large files are stored as chunks, an edit in the middle only stores the
+ * chunks around it, and checkout puts the file back together.
+ */
+void chunked_file_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+
+    // Deterministic pseudo-random contents, so no two chunks are alike.
+    const int size = CHUNK_FILE_THRESHOLD + (1 << 20);
+    char* contents = malloc(size);
+    unsigned state = 61;
+    for (int i = 0; i < size; i++) {
+      state = state * 1103515245 + 12345;
+      contents[i] = state >> 16;
+    }
+    FILE* f = fopen("chunked.bin", "w");
+    fwrite(contents, 1, size, f);
+    fclose(f);
+    CU_ASSERT(0==beargit_add("chunked.bin"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! chunked"));
+
+    char blob_id[BLOB_ID_SIZE], path[FILENAME_SIZE];
+    CU_ASSERT(0==object_hash_file("chunked.bin", blob_id));
+    int format = OBJECT_PLAIN;
+    CU_ASSERT(0==object_loose_file(blob_id, path, &format));
+    CU_ASSERT(OBJECT_CHUNKED==format);
+    int objects = count_objects();
+    CU_ASSERT(objects > size / CHUNK_MAX_SIZE);
+
+    CU_ASSERT(0==beargit_checkout("other", 1));
+    f = fopen("chunked.bin", "r+");
+    fseek(f, size / 2, SEEK_SET);
+    fputs("GO BEARS!", f);
+    fclose(f);
+    CU_ASSERT(0==beargit_commit("GO BEARS! edited"));
+    // The new chunk list and the one or two chunks the edit touched
+    CU_ASSERT(count_objects() - objects <= 3);
+
+    char restored_id[BLOB_ID_SIZE];
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(0==object_hash_file("chunked.bin", restored_id));
+    CU_ASSERT_STRING_EQUAL(restored_id, blob_id);
+
+    CU_ASSERT(0==beargit_repack());
+    CU_ASSERT(0==count_objects());
+    CU_ASSERT(0==beargit_checkout("other", 0));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(0==object_hash_file("chunked.bin", restored_id));
+    CU_ASSERT_STRING_EQUAL(restored_id, blob_id);
+
+    free(contents);
+    fs_rm("chunked.bin");
+}
+
+/* Branches live in the refs database: numbers follow creation order past
+ * the point where the table grows, heads move on checkout, and a repository
+ * with the old .branches file is imported as is.
+ */
+void refs_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("refs.txt", "master");
+    CU_ASSERT(0==beargit_add("refs.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! master"));
+    char master_head[COMMIT_ID_SIZE];
+    read_head(master_head);
+
+    char name[BRANCHNAME_SIZE];
+    for (int i = 1; i <= 100; i++) {
+      sprintf(name, "branch%d", i);
+      CU_ASSERT(0==beargit_checkout(name, 1));
+    }
+    CU_ASSERT(0==get_branch_number("master"));
+    CU_ASSERT(100==get_branch_number("branch100"));
+    CU_ASSERT(-1==get_branch_number("branch101"));
+
+    write_string_to_file("refs.txt", "branch100");
+    CU_ASSERT(0==beargit_commit("GO BEARS! branch100"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    char head[COMMIT_ID_SIZE];
+    CU_ASSERT(100==refs_find("branch100", head));
+    CU_ASSERT(0!=strcmp(head, master_head));
+    CU_ASSERT(1==refs_find("branch1", head));
+    CU_ASSERT_STRING_EQUAL(head, master_head);
+
+    CU_ASSERT(0==beargit_branch());
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+    char line[512];
+    fgets(line, sizeof(line), fstdout);
+    CU_ASSERT_STRING_EQUAL(line, "* master\n");
+    fgets(line, sizeof(line), fstdout);
+    CU_ASSERT_STRING_EQUAL(line, " branch1\n");
+    fclose(fstdout);
+
+    // Old layout: .branches in creation order, heads in .branch_<name>
+    fs_rm(REFS_FILE);
+    write_string_to_file(".beargit/.branches", "master\ndev\nfeature\n");
+    write_string_to_file(".beargit/.branch_dev", master_head);
+    CU_ASSERT(2==refs_find("feature", NULL));
+    CU_ASSERT(1==refs_find("dev", head));
+    CU_ASSERT_STRING_EQUAL(head, master_head);
+    CU_ASSERT(-1==refs_find("branch1", NULL));
+
+    fs_rm("refs.txt");
+}
+
+/* Commits and checkouts record the head, branch and index generation in
+ * one state record; a commit directory left behind by a crashed commit is
+ * reused, and repositories without a state file still work.
+ */
+void state_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    repo_state state;
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, "0000000000000000000000000000000000000000");
+    CU_ASSERT_STRING_EQUAL(state.branch, "master");
+    uint64_t seq = state.seq;
+
+    write_string_to_file("state.txt", "one");
+    CU_ASSERT(0==beargit_add("state.txt"));
+
+    // A commit that crashed before writing the state left its directory.
+    char commit_id[COMMIT_ID_SIZE], commit_dir[FILENAME_SIZE];
+    strcpy(commit_id, state.head);
+    next_commit_id(commit_id);
+    sprintf(commit_dir, ".beargit/%s", commit_id);
+    fs_mkdir(commit_dir);
+    CU_ASSERT(0==beargit_commit("GO BEARS! one"));
+
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, commit_id);
+    CU_ASSERT(seq + 1 == state.seq);
+
+    CU_ASSERT(0==beargit_checkout("other", 1));
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.branch, "other");
+    CU_ASSERT_STRING_EQUAL(state.head, commit_id);
+
+    // Old layout: .prev and .current_branch
+    fs_rm(STATE_FILE);
+    write_string_to_file(".beargit/.prev", commit_id);
+    write_string_to_file(".beargit/.current_branch", "master");
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, commit_id);
+    CU_ASSERT_STRING_EQUAL(state.branch, "master");
+    CU_ASSERT(0==beargit_log(INT_MAX));
+    write_string_to_file("state.txt", "two");
+    CU_ASSERT(0==beargit_commit("GO BEARS! two"));
+    state_read(&state);
+    CU_ASSERT(0!=strcmp(state.head, commit_id));
+
+    fs_rm("state.txt");
+}
+
+static int64_t commitlog_count(void) {
+    commit_log log;
+    commitlog_open(&log);
+    int64_t count = log.count;
+    commitlog_close(&log);
+    return count;
+}
+
+/* A commit interrupted before its journal was complete is rolled back; one
+ * interrupted after it is finished, redoing the object renames.
+ */
+void journal_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("journal.txt", "one");
+    CU_ASSERT(0==beargit_add("journal.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! one"));
+    CU_ASSERT(0!=access(JOURNAL_FILE, F_OK));
+
+    repo_state state;
+    state_read(&state);
+    char head[COMMIT_ID_SIZE], commit_id[COMMIT_ID_SIZE], commit_dir[FILENAME_SIZE];
+    strcpy(head, state.head);
+    strcpy(commit_id, head);
+    next_commit_id(commit_id);
+    sprintf(commit_dir, ".beargit/%s", commit_id);
+    int64_t count = commitlog_count();
+
+    // Crash before the journal is complete.
+    char blob_id[BLOB_ID_SIZE], object[FILENAME_SIZE], msg_file[FILENAME_SIZE];
+    write_string_to_file("journal.txt", "two");
+    journal_begin(&state, commit_id);
+    CU_ASSERT(0<=object_store_file("journal.txt", blob_id));
+    object_path(blob_id, object);
+    CU_ASSERT(0!=access(object, F_OK));
+    fs_mkdir(commit_dir);
+    sprintf(msg_file, "%s/.msg", commit_dir);
+    write_string_to_file(msg_file, "GO BEARS! two");
+    commitlog_append(commit_id, head, NULL, "GO BEARS! two");
+    CU_ASSERT(count + 1 == commitlog_count());
+
+    journal_recover();
+    object_batch_abort();
+    CU_ASSERT(0!=access(JOURNAL_FILE, F_OK));
+    CU_ASSERT(!fs_check_dir_exists(commit_dir));
+    CU_ASSERT(count == commitlog_count());
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, head);
+    DIR* dir = opendir(OBJECTS_DIR);
+    struct dirent* entry;
+    int tmp_files = 0;
+    while ((entry = readdir(dir)) != NULL)
+      tmp_files += strncmp(entry->d_name, ".tmp_", 5) == 0;
+    closedir(dir);
+    CU_ASSERT(0==tmp_files);
+
+    // Crash after the journal is complete, before the state is written and
+    // before the object rename reached the disk.
+    journal_begin(&state, commit_id);
+    CU_ASSERT(0<=object_store_file("journal.txt", blob_id));
+    fs_mkdir(commit_dir);
+    commitlog_append(commit_id, head, NULL, "GO BEARS! two");
+    repo_state new_state = state;
+    strcpy(new_state.head, commit_id);
+    journal_commit(&new_state);
+    CU_ASSERT(0==access(object, F_OK));
+
+    char journal[4096] = "", *rename_line, tmp_path[FILENAME_SIZE];
+    FILE* fjournal = fopen(JOURNAL_FILE, "r");
+    fread(journal, 1, sizeof(journal) - 1, fjournal);
+    fclose(fjournal);
+    rename_line = strstr(journal, "\nrename ");
+    CU_ASSERT(rename_line != NULL);
+    if (rename_line) {
+      sscanf(rename_line, "\nrename %511s", tmp_path);
+      CU_ASSERT(0==rename(object, tmp_path));
+    }
+
+    journal_recover();
+    CU_ASSERT(0!=access(JOURNAL_FILE, F_OK));
+    CU_ASSERT(0==access(object, F_OK));
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, commit_id);
+    CU_ASSERT_STRING_EQUAL(state.branch, "master");
+    CU_ASSERT(count + 1 == commitlog_count());
+
+    CU_ASSERT(0==beargit_log(INT_MAX));
+
+    fs_rm("journal.txt");
+}
+
+static int index_on_disk_has(const char* path) {
+    beargit_index index;
+    index_read(&index);
+    int found = index_find(&index, path) >= 0;
+    index_free(&index);
+    return found;
+}
+
+/* One repository handle runs a whole session; staged changes only reach the
+ * index file at a flush or a commit, and the handle keeps working across
+ * branch creation and checkouts.
+ */
+void repo_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    beargit_repo_t* repo = beargit_repo_open();
+    CU_ASSERT(repo != NULL);
+
+    write_string_to_file("repo1.txt", "one");
+    write_string_to_file("repo2.txt", "two");
+    char* paths[] = { "repo1.txt", "repo2.txt" };
+    CU_ASSERT(0==beargit_repo_add(repo, 2, paths));
+    CU_ASSERT(3==beargit_repo_add(repo, 1, paths));
+    CU_ASSERT(!index_on_disk_has("repo1.txt"));
+    beargit_repo_flush(repo);
+    CU_ASSERT(index_on_disk_has("repo1.txt"));
+
+    CU_ASSERT(0==beargit_repo_commit(repo, "GO BEARS! one"));
+    char first[COMMIT_ID_SIZE];
+    strcpy(first, repo->state.head);
+    repo_state state;
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, first);
+    CU_ASSERT(1==beargit_repo_commit_log(repo)->count);
+
+    CU_ASSERT(0==beargit_repo_checkout(repo, "side", 1));
+    write_string_to_file("repo1.txt", "side");
+    CU_ASSERT(0==beargit_repo_commit(repo, "GO BEARS! side"));
+    CU_ASSERT(0!=strcmp(repo->state.head, first));
+    CU_ASSERT(2==beargit_repo_commit_log(repo)->count);
+    CU_ASSERT(0==beargit_repo_branch(repo));
+    CU_ASSERT(0==beargit_repo_log(repo, INT_MAX, NULL));
+
+    CU_ASSERT(0==beargit_repo_checkout(repo, "master", 0));
+    char contents[16];
+    read_string_from_file("repo1.txt", contents, sizeof(contents));
+    CU_ASSERT_STRING_EQUAL(contents, "one");
+    CU_ASSERT_STRING_EQUAL(repo->state.branch, "master");
+
+    CU_ASSERT(0==beargit_repo_rm(repo, 1, paths + 1));
+    CU_ASSERT(0==beargit_repo_status(repo));
+    CU_ASSERT(index_on_disk_has("repo2.txt"));
+    beargit_repo_close(repo);
+    CU_ASSERT(!index_on_disk_has("repo2.txt"));
+
+    // The one-shot commands see what the handle wrote.
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, first);
+    CU_ASSERT(0==beargit_checkout("side", 0));
+    read_string_from_file("repo1.txt", contents, sizeof(contents));
+    CU_ASSERT_STRING_EQUAL(contents, "side");
+
+    fs_rm("repo1.txt");
+    fs_rm("repo2.txt");
+}
+
+/* Commands sent to a daemon run against its warm handle and report their
+ * return values; without a daemon the client says so.
+ */
+void daemon_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("daemon.txt", "one");
+
+    int ret = 0;
+    char* add[] = { "beargit", "add", "daemon.txt" };
+    CU_ASSERT(-1==daemon_client_run(3, add, &ret));
+
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(daemon_serve());
+    CU_ASSERT(pid > 0);
+    for (int i = 0; i < 200 && access(DAEMON_SOCKET, F_OK) != 0; i++)
+      usleep(10000);
+
+    CU_ASSERT(0==daemon_client_run(3, add, &ret));
+    CU_ASSERT(0==ret);
+    CU_ASSERT(0==daemon_client_run(3, add, &ret));
+    CU_ASSERT(3==ret);
+
+    char* commit[] = { "beargit", "commit", "-m", "GO BEARS! daemon" };
+    CU_ASSERT(0==daemon_client_run(4, commit, &ret));
+    CU_ASSERT(0==ret);
+    repo_state state;
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.head, "6666666666666666666666666666666666666666");
+
+    char* checkout[] = { "beargit", "checkout", "nosuchbranch" };
+    CU_ASSERT(0==daemon_client_run(3, checkout, &ret));
+    CU_ASSERT(1==ret);
+    char* log[] = { "beargit", "log" };
+    CU_ASSERT(0==daemon_client_run(2, log, &ret));
+    CU_ASSERT(0==ret);
+
+    // Bad commands, and commands that exit on an internal error, leave the
+    // daemon running.
+    char* no_target[] = { "beargit", "checkout" };
+    CU_ASSERT(0==daemon_client_run(2, no_target, &ret));
+    CU_ASSERT(1==ret);
+    CU_ASSERT(0==rename(OBJECTS_DIR, "objects.saved"));
+    char* repack[] = { "beargit", "repack" };
+    CU_ASSERT(0==daemon_client_run(2, repack, &ret));
+    CU_ASSERT(1==ret);
+    CU_ASSERT(0==rename("objects.saved", OBJECTS_DIR));
+    CU_ASSERT(0==daemon_client_run(2, log, &ret));
+    CU_ASSERT(0==ret);
+
+    // A change made behind the daemon's back is picked up.
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    char* branch_side[] = { "beargit", "commit", "-m", "GO BEARS! side" };
+    CU_ASSERT(0==daemon_client_run(4, branch_side, &ret));
+    CU_ASSERT(0==ret);
+    state_read(&state);
+    CU_ASSERT_STRING_EQUAL(state.branch, "side");
+    CU_ASSERT(0!=strcmp(state.head, "6666666666666666666666666666666666666666"));
+
+    char* stop[] = { "beargit", "daemon", "stop" };
+    CU_ASSERT(0==daemon_client_run(3, stop, &ret));
+    CU_ASSERT(0==ret);
+    int status;
+    CU_ASSERT(pid==waitpid(pid, &status, 0));
+    CU_ASSERT(WIFEXITED(status) && 0==WEXITSTATUS(status));
+    CU_ASSERT(0!=access(DAEMON_SOCKET, F_OK));
+
+    fs_rm("daemon.txt");
+}
+
+static int dirty_count(beargit_repo_t* repo) {
+    int* positions;
+    int count = beargit_repo_dirty_entries(repo, &positions);
+    free(positions);
+    return count;
+}
+
+/* With a watch, only files changed since they were last checked are dirty,
+ * in the top-level directory and below it; without one, every tracked file
+ * is a candidate.
+ */
+void watch_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("watch1.txt", "one");
+    write_string_to_file("watch2.txt", "two");
+
+    beargit_repo_t* repo = beargit_repo_open();
+    char* paths[] = { "watch1.txt", "watch2.txt", "watchdir" };
+    CU_ASSERT(0==beargit_repo_add(repo, 2, paths));
+    CU_ASSERT(2==dirty_count(repo));
+    if (beargit_repo_watch(repo) != 0) {
+      beargit_repo_close(repo);
+      fs_rm("watch1.txt");
+      fs_rm("watch2.txt");
+      return;
+    }
+
+    fs_mkdir("watchdir");
+    write_string_to_file("watchdir/watch3.txt", "three");
+    CU_ASSERT(0==beargit_repo_add(repo, 1, paths + 2));
+    CU_ASSERT(0==beargit_repo_commit(repo, "GO BEARS! watch"));
+    beargit_repo_poll(repo);
+    CU_ASSERT(0==dirty_count(repo));
+
+    write_string_to_file("watchdir/watch3.txt", "changed");
+    beargit_repo_poll(repo);
+    int* positions;
+    CU_ASSERT(1==beargit_repo_dirty_entries(repo, &positions));
+    CU_ASSERT_STRING_EQUAL(repo->index.entries[positions[0]].path, "watchdir/watch3.txt");
+    free(positions);
+
+    fs_rm("watch1.txt");
+    beargit_repo_poll(repo);
+    CU_ASSERT(2==dirty_count(repo));
+    CU_ASSERT(0==beargit_repo_status(repo));
+
+    // Putting the old contents back makes the file clean again.
+    write_string_to_file("watch1.txt", "one");
+    beargit_repo_poll(repo);
+    CU_ASSERT(1==dirty_count(repo));
+    CU_ASSERT(0==beargit_repo_commit(repo, "GO BEARS! watch again"));
+    CU_ASSERT(0==dirty_count(repo));
+    beargit_repo_close(repo);
+
+    fs_rm("watch1.txt");
+    fs_rm("watch2.txt");
+    fs_rm("watchdir/watch3.txt");
+    rmdir("watchdir");
+}
+
+/* Line diffs keep the longest common subsequence and print it as unified
+ * hunks; beargit diff compares commits with each other and with the
+ * working directory.
+ */
+void diff_test(void)
+{
+    const uint64_t a[] = { 1, 2, 3, 4, 5, 6, 7 };
+    const uint64_t b[] = { 2, 3, 9, 5, 6, 7, 8 };
+    char changed_a[7], changed_b[7];
+    diff_lines(a, 7, b, 7, changed_a, changed_b);
+    CU_ASSERT(0==memcmp(changed_a, "\1\0\0\1\0\0\0", 7));
+    CU_ASSERT(0==memcmp(changed_b, "\0\0\1\0\0\0\1", 7));
+
+    // write_string_to_file writes the NUL too, which would make them binary.
+    FILE* f = fopen("diff_a.txt", "w");
+    fputs("1\n2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n12\n", f);
+    fclose(f);
+    f = fopen("diff_b.txt", "w");
+    fputs("1\n2\nthree\n4\n5\n6\n7\n8\n9\n10\n11\n12", f);
+    fclose(f);
+    FILE* out = fopen("diff_out.txt", "w+");
+    CU_ASSERT(0==diff_print("f", "diff_a.txt", "diff_b.txt", out));
+    CU_ASSERT(0==diff_print("f", "diff_a.txt", "diff_a.txt", out));
+    char text[512];
+    rewind(out);
+    size_t n = fread(text, 1, sizeof(text) - 1, out);
+    text[n] = '\0';
+    fclose(out);
+    CU_ASSERT_STRING_EQUAL(text,
+        "diff --beargit a/f b/f\n--- a/f\n+++ b/f\n"
+        "@@ -1,6 +1,6 @@\n 1\n 2\n-3\n+three\n 4\n 5\n 6\n"
+        "@@ -9,4 +9,4 @@\n 9\n 10\n 11\n-12\n+12\n\\ No newline at end of file\n");
+
+    CU_ASSERT(0==beargit_init());
+    CU_ASSERT(0==beargit_add("diff_a.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! diff"));
+    f = fopen("diff_a.txt", "w");
+    fputs("1\n2\nthree\n4\n5\n6\n7\n8\n9\n10\n11\n12\n", f);
+    fclose(f);
+    CU_ASSERT(0==beargit_diff(NULL, NULL));
+    char output[512] = { 0 };
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+    fread(output, 1, sizeof(output) - 1, fstdout);
+    fclose(fstdout);
+    CU_ASSERT_STRING_EQUAL(output,
+        "diff --beargit a/diff_a.txt b/diff_a.txt\n--- a/diff_a.txt\n+++ b/diff_a.txt\n"
+        "@@ -1,6 +1,6 @@\n 1\n 2\n-3\n+three\n 4\n 5\n 6\n");
+    CU_ASSERT(0==beargit_diff("master", NULL));
+    CU_ASSERT(0==beargit_diff("0000000000000000000000000000000000000000", "master"));
+    CU_ASSERT(1==beargit_diff("nosuchbranch", NULL));
+
+    fs_rm("diff_a.txt");
+    fs_rm("diff_b.txt");
+    fs_rm("diff_out.txt");
+}
+
+/* The commit graph answers ancestry and merge base queries the same way
+ * whether commits come from the graph file or were made after it.
+ */
+void commitgraph_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("graph.txt", "zero");
+    CU_ASSERT(0==beargit_add("graph.txt"));
+
+    // ids[3] and ids[4] go on a branch off ids[1], the others on master.
+    beargit_repo_t* repo = beargit_repo_open();
+    char ids[6][COMMIT_ID_SIZE];
+    const int order[] = { 0, 1, -1, 2, -2, 3, 4, -3, 5 };
+    for (int k = 0; k < 9; k++) {
+      if (order[k] == -1) {
+        CU_ASSERT(0==beargit_repo_checkout(repo, "side", 1));
+        CU_ASSERT(0==beargit_repo_checkout(repo, "master", 0));
+      } else if (order[k] == -2) {
+        commitgraph_write(beargit_repo_commit_log(repo));
+        CU_ASSERT(0==beargit_repo_checkout(repo, "side", 0));
+      } else if (order[k] == -3) {
+        CU_ASSERT(0==beargit_repo_checkout(repo, "master", 0));
+      } else {
+        CU_ASSERT(0==beargit_repo_commit(repo, "GO BEARS! graph"));
+        strcpy(ids[order[k]], repo->state.head);
+      }
+    }
+
+    const commit_graph* graph = beargit_repo_commit_graph(repo);
+    CU_ASSERT(3==graph->covered);
+    CU_ASSERT(6==graph->count);
+    int64_t pos[6];
+    for (int i = 0; i < 6; i++)
+      pos[i] = commitgraph_find(graph, ids[i]);
+    CU_ASSERT(0==pos[0] && 2==pos[2] && 5==pos[5]);
+    CU_ASSERT(-1==commitgraph_find(graph, "0000000000000000000000000000000000000000"));
+    CU_ASSERT(3==commitgraph_entry_at(graph, pos[2])->generation);
+    CU_ASSERT(4==commitgraph_entry_at(graph, pos[4])->generation);
+
+    CU_ASSERT(commitgraph_is_ancestor(graph, pos[0], pos[4]));
+    CU_ASSERT(commitgraph_is_ancestor(graph, pos[1], pos[5]));
+    CU_ASSERT(!commitgraph_is_ancestor(graph, pos[2], pos[4]));
+    CU_ASSERT(!commitgraph_is_ancestor(graph, pos[4], pos[1]));
+    CU_ASSERT(pos[1]==commitgraph_merge_base(graph, pos[4], pos[5]));
+    CU_ASSERT(pos[2]==commitgraph_merge_base(graph, pos[2], pos[5]));
+    beargit_repo_close(repo);
+
+    // A graph file written for part of the log is extended in memory.
+    commit_log log;
+    commitlog_open(&log);
+    commit_log shorter = log;
+    shorter.count = 2;
+    commitgraph_write(&shorter);
+    commit_graph rebuilt;
+    commitgraph_open(&rebuilt, &log);
+    CU_ASSERT(2==rebuilt.covered);
+    CU_ASSERT(pos[1]==commitgraph_merge_base(&rebuilt, pos[3], pos[5]));
+    commitgraph_close(&rebuilt);
+    commitlog_close(&log);
+
+    fs_rm("graph.txt");
+}
+
+static void write_text(const char* path, const char* text) {
+    FILE* f = fopen(path, "w");
+    fputs(text, f);
+    fclose(f);
+}
+
+static void read_text(const char* path, char* text, size_t size) {
+    FILE* f = fopen(path, "r");
+    size_t n = f ? fread(text, 1, size - 1, f) : 0;
+    text[n] = '\0';
+    if (f)
+      fclose(f);
+}
+
+/* Merges combine both sides' changes since the merge base, line by line
+ * where both changed a file, and record both parents.
+ */
+void merge_test(void)
+{
+    write_text("merge_base.txt", "1\n2\n3\n4\n5\n6\n7\n8\n");
+    write_text("merge_ours.txt", "one\n2\n3\n4\n5\n6\n7\n8\n");
+    write_text("merge_theirs.txt", "1\n2\n3\n4\n5\n6\n7\neight\n");
+    FILE* out = fopen("merge_out.txt", "w");
+    CU_ASSERT(0==diff_merge("merge_base.txt", "merge_ours.txt", "merge_theirs.txt", "HEAD", "side", out));
+    fclose(out);
+    char text[512];
+    read_text("merge_out.txt", text, sizeof(text));
+    CU_ASSERT_STRING_EQUAL(text, "one\n2\n3\n4\n5\n6\n7\neight\n");
+
+    CU_ASSERT(0==beargit_init());
+    write_text("merge.txt", "1\n2\n3\n4\n5\n6\n7\n8\n");
+    write_text("merge_gone.txt", "gone\n");
+    CU_ASSERT(0==beargit_add("merge.txt"));
+    CU_ASSERT(0==beargit_add("merge_gone.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! base"));
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    write_text("merge.txt", "1\n2\n3\n4\n5\n6\n7\neight\n");
+    write_text("merge_new.txt", "new\n");
+    CU_ASSERT(0==beargit_add("merge_new.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! side"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    write_text("merge.txt", "one\n2\n3\n4\n5\n6\n7\n8\n");
+    CU_ASSERT(0==beargit_rm("merge_gone.txt"));
+    fs_rm("merge_gone.txt");
+    CU_ASSERT(0==beargit_commit("GO BEARS! master"));
+
+    // Uncommitted changes would be overwritten.
+    write_text("merge.txt", "dirty\n");
+    CU_ASSERT(1==beargit_merge("side"));
+    write_text("merge.txt", "one\n2\n3\n4\n5\n6\n7\n8\n");
+
+    CU_ASSERT(0==beargit_merge("side"));
+    read_text("merge.txt", text, sizeof(text));
+    CU_ASSERT_STRING_EQUAL(text, "one\n2\n3\n4\n5\n6\n7\neight\n");
+    CU_ASSERT(access("merge_new.txt", F_OK) == 0);
+    CU_ASSERT(access("merge_gone.txt", F_OK) != 0);
+
+    commit_log log;
+    commitlog_open(&log);
+    CU_ASSERT(4==log.count);
+    CU_ASSERT(2==log.records[3].parent_pos && 2==log.records[3].merge_pos);
+    commitlog_close(&log);
+    CU_ASSERT(0==beargit_merge("side"));
+
+    // The side branch catches up without a merge commit.
+    CU_ASSERT(0==beargit_checkout("side", 0));
+    CU_ASSERT(0==beargit_merge("master"));
+    commitlog_open(&log);
+    CU_ASSERT(4==log.count);
+    commitlog_close(&log);
+
+    // Both change the same line: the conflict is left for the next commit.
+    write_text("merge.txt", "side\n");
+    CU_ASSERT(0==beargit_commit("GO BEARS! side again"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    write_text("merge.txt", "master\n");
+    CU_ASSERT(0==beargit_commit("GO BEARS! master again"));
+    CU_ASSERT(1==beargit_merge("side"));
+    CU_ASSERT(1==beargit_merge("side"));
+    write_text("merge.txt", "both\n");
+    CU_ASSERT(0==beargit_commit("GO BEARS! resolved"));
+    commitlog_open(&log);
+    CU_ASSERT(7==log.count);
+    CU_ASSERT(5==log.records[6].merge_pos);
+    commitlog_close(&log);
+
+    // A file deleted on one side and modified on the other keeps the
+    // modified version, whichever side that is.
+    write_text("merge_md1.txt", "md1\n");
+    write_text("merge_md2.txt", "md2\n");
+    CU_ASSERT(0==beargit_add("merge_md1.txt"));
+    CU_ASSERT(0==beargit_add("merge_md2.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! modify/delete base"));
+    CU_ASSERT(0==beargit_checkout("side", 0));
+    CU_ASSERT(0==beargit_merge("master"));
+    write_text("merge_md1.txt", "md1 side\n");
+    CU_ASSERT(0==beargit_rm("merge_md2.txt"));
+    fs_rm("merge_md2.txt");
+    CU_ASSERT(0==beargit_commit("GO BEARS! side modify/delete"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(0==beargit_rm("merge_md1.txt"));
+    fs_rm("merge_md1.txt");
+    write_text("merge_md2.txt", "md2 master\n");
+    CU_ASSERT(0==beargit_commit("GO BEARS! master modify/delete"));
+    CU_ASSERT(1==beargit_merge("side"));
+    read_text("merge_md1.txt", text, sizeof(text));
+    CU_ASSERT_STRING_EQUAL(text, "md1 side\n");
+    read_text("merge_md2.txt", text, sizeof(text));
+    CU_ASSERT_STRING_EQUAL(text, "md2 master\n");
+    CU_ASSERT(0==beargit_commit("GO BEARS! keep both"));
+
+    fs_rm("merge_md1.txt");
+    fs_rm("merge_md2.txt");
+    fs_rm("merge.txt");
+    fs_rm("merge_new.txt");
+    fs_rm("merge_base.txt");
+    fs_rm("merge_ours.txt");
+    fs_rm("merge_theirs.txt");
+    fs_rm("merge_out.txt");
+}
+
+/* Message searches find the same commits whether their terms are in the
+ * index file or only in its tail, and ignore terms a rolled back commit
+ * left behind.
+ */
+void msgindex_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("search.txt", "search");
+    CU_ASSERT(0==beargit_add("search.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! Fixes BUG-42"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! bug-7 and docs"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! more docs"));
+
+    commit_log log;
+    commitlog_open(&log);
+    msg_index index;
+    msgindex_open(&index, &log);
+    CU_ASSERT(0==index.covered);
+    char* bug[] = { "bug" };
+    char* bug42[] = { "Bug", "42" };
+    char* docs[] = { "and DOCS" };
+    char* none[] = { "bears", "nothing" };
+    int64_t* positions;
+    CU_ASSERT(2==msgindex_search(&index, 1, bug, &positions));
+    CU_ASSERT(0==positions[0] && 1==positions[1]);
+    free(positions);
+    CU_ASSERT(1==msgindex_search(&index, 2, bug42, &positions));
+    CU_ASSERT(0==positions[0]);
+    free(positions);
+    CU_ASSERT(1==msgindex_search(&index, 1, docs, &positions));
+    CU_ASSERT(1==positions[0]);
+    free(positions);
+    CU_ASSERT(0==msgindex_search(&index, 2, none, &positions));
+    free(positions);
+    msgindex_close(&index);
+
+    // A commit that was rolled back, and the one that took its place.
+    msgindex_append(log.count, "GO BEARS! ghost bug");
+    commitlog_close(&log);
+    CU_ASSERT(0==beargit_commit("GO BEARS! real"));
+    char* ghost[] = { "ghost" };
+    char* real[] = { "real" };
+    commitlog_open(&log);
+    msgindex_open(&index, &log);
+    CU_ASSERT(0==msgindex_search(&index, 1, ghost, &positions));
+    free(positions);
+    CU_ASSERT(1==msgindex_search(&index, 1, real, &positions));
+    CU_ASSERT(3==positions[0]);
+    free(positions);
+    msgindex_close(&index);
+
+    // The same answers from the index file.
+    CU_ASSERT(0==msgindex_write(&log));
+    msgindex_open(&index, &log);
+    CU_ASSERT(4==index.covered && 0==index.ntail);
+    CU_ASSERT(2==msgindex_search(&index, 1, bug, &positions));
+    free(positions);
+    CU_ASSERT(1==msgindex_search(&index, 1, real, &positions));
+    free(positions);
+    msgindex_close(&index);
+    commitlog_close(&log);
+
+    CU_ASSERT(0==beargit_log_grep(INT_MAX, 1, bug));
+
+    // A term matches the words of a message only in the order it has them.
+    CU_ASSERT(0==beargit_commit("GO BEARS! PROJ-1 fixed 123 tests"));
+    char* proj[] = { "PROJ-123" };
+    char* fixed[] = { "proj-1 FIXED" };
+    commitlog_open(&log);
+    msgindex_open(&index, &log);
+    CU_ASSERT(0==msgindex_search(&index, 1, proj, &positions));
+    free(positions);
+    CU_ASSERT(1==msgindex_search(&index, 1, fixed, &positions));
+    CU_ASSERT(4==positions[0]);
+    free(positions);
+    msgindex_close(&index);
+    commitlog_close(&log);
+    fs_rm("search.txt");
+}
+
+/* Abbreviated commit ids resolve through the sorted id table of the commit
+ * graph, from the graph file and from commits made since.
+ */
+void prefix_test(void)
+{
+    CU_ASSERT(is_it_a_commit_id("6666666666c16666666666666666666666666666"));
+    CU_ASSERT(!is_it_a_commit_id("6666666666c1666666666666666666666666666x"));
+    CU_ASSERT(!is_it_a_commit_id("6666666666"));
+
+    CU_ASSERT(0==beargit_init());
+    write_string_to_file("prefix.txt", "0");
+    CU_ASSERT(0==beargit_add("prefix.txt"));
+    char ids[4][COMMIT_ID_SIZE];
+    beargit_repo_t* repo = beargit_repo_open();
+    for (int i = 0; i < 4; i++) {
+      if (i == 2)
+        commitgraph_write(beargit_repo_commit_log(repo));
+      CU_ASSERT(0==beargit_repo_commit(repo, "GO BEARS! prefix"));
+      strcpy(ids[i], repo->state.head);
+    }
+
+    const commit_graph* graph = beargit_repo_commit_graph(repo);
+    CU_ASSERT(2==graph->covered);
+    int64_t pos;
+    CU_ASSERT(2==commitgraph_find_prefix(graph, "6666", &pos));
+    CU_ASSERT(0==commitgraph_find_prefix(graph, "1666", &pos));
+    for (int i = 0; i < 4; i++) {
+      CU_ASSERT(1==commitgraph_find_prefix(graph, ids[i], &pos));
+      CU_ASSERT(i==pos);
+    }
+    char prefix[COMMIT_ID_SIZE];
+    snprintf(prefix, 13, "%s", ids[1]);
+    CU_ASSERT(1==commitgraph_find_prefix(graph, prefix, &pos));
+    CU_ASSERT(1==pos);
+
+    CU_ASSERT(0==beargit_repo_checkout(repo, prefix, 0));
+    CU_ASSERT_STRING_EQUAL(repo->state.head, ids[1]);
+    CU_ASSERT(1==beargit_repo_checkout(repo, "6666", 0));
+    CU_ASSERT(0==beargit_repo_log(repo, 1, prefix));
+    CU_ASSERT(1==beargit_repo_log(repo, 1, "6666"));
+    beargit_repo_close(repo);
+
+    fs_rm("prefix.txt");
+}
+
+/* Files outside the sparse checkout patterns stay tracked and committed
+ * without being written to the working directory.
+ */
+void sparse_test(void)
+{
+    char* patterns[] = { "sparse_dir/", "*.c" };
+    sparse_patterns sparse;
+    sparse_init(&sparse, 2, patterns);
+    CU_ASSERT(sparse_includes(&sparse, "sparse_dir/a.txt"));
+    CU_ASSERT(sparse_includes(&sparse, "main.c"));
+    CU_ASSERT(!sparse_includes(&sparse, "lib/main.c"));
+    CU_ASSERT(!sparse_includes(&sparse, "sparse_out.txt"));
+    sparse_free(&sparse);
+
+    CU_ASSERT(0==beargit_init());
+    fs_mkdir("sparse_dir");
+    write_string_to_file("sparse_dir/a.txt", "a");
+    write_string_to_file("sparse_out.txt", "out");
+    CU_ASSERT(0==beargit_add("sparse_dir/a.txt"));
+    CU_ASSERT(0==beargit_add("sparse_out.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! sparse"));
+
+    // Uncommitted changes are never dropped.
+    write_string_to_file("sparse_out.txt", "changed");
+    CU_ASSERT(1==beargit_sparse_set(2, patterns));
+    write_string_to_file("sparse_out.txt", "out");
+    CU_ASSERT(0==beargit_sparse_set(2, patterns));
+    CU_ASSERT(access("sparse_out.txt", F_OK) != 0);
+    CU_ASSERT(access("sparse_dir/a.txt", F_OK) == 0);
+
+    // Commits and checkouts keep the file without writing it out.
+    write_string_to_file("sparse_dir/a.txt", "b");
+    CU_ASSERT(0==beargit_commit("GO BEARS! sparse again"));
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(access("sparse_out.txt", F_OK) != 0);
+
+    // Nor does checkout drop changes to a file outside the patterns.
+    write_string_to_file("sparse_out.txt", "local");
+    CU_ASSERT(1==beargit_checkout("side", 0));
+    CU_ASSERT(access("sparse_out.txt", F_OK) == 0);
+    fs_rm("sparse_out.txt");
+    beargit_repo_t* repo = beargit_repo_open();
+    beargit_index* index = beargit_repo_index(repo);
+    CU_ASSERT(2==index->count);
+    CU_ASSERT(ENTRY_UNCHANGED==beargit_repo_refresh(repo, &index->entries[index_find(index, "sparse_out.txt")]));
+    beargit_repo_close(repo);
+
+    CU_ASSERT(0==beargit_sparse_set(0, NULL));
+    char contents[16];
+    read_string_from_file("sparse_out.txt", contents, sizeof(contents));
+    CU_ASSERT_STRING_EQUAL(contents, "out");
+
+    fs_rm("sparse_dir/a.txt");
+    rmdir("sparse_dir");
+    fs_rm("sparse_out.txt");
+}
+
+/* Ignore patterns compile into one automaton; beargit add --all skips the
+ * files it ignores and doesn't descend into ignored directories.
+ */
+void ignore_test(void)
+{
+    ignore_rules rules;
+    CU_ASSERT(0==ignore_compile(&rules,
+        "# build output\n*.o\n!keep.o\nbuild/\n/top.txt\ndoc/*.tmp\na/**/b\n[x-z]?.log\n"));
+    CU_ASSERT(ignore_path(&rules, "main.o", 0));
+    CU_ASSERT(ignore_path(&rules, "src/lib/main.o", 0));
+    CU_ASSERT(!ignore_path(&rules, "main.c", 0));
+    CU_ASSERT(!ignore_path(&rules, "src/keep.o", 0));
+    CU_ASSERT(ignore_path(&rules, "build", 1));
+    CU_ASSERT(ignore_path(&rules, "src/build", 1));
+    CU_ASSERT(!ignore_path(&rules, "build", 0));
+    CU_ASSERT(ignore_path(&rules, "top.txt", 0));
+    CU_ASSERT(!ignore_path(&rules, "src/top.txt", 0));
+    CU_ASSERT(ignore_path(&rules, "doc/a.tmp", 0));
+    CU_ASSERT(!ignore_path(&rules, "doc/sub/a.tmp", 0));
+    CU_ASSERT(ignore_path(&rules, "a/b", 0));
+    CU_ASSERT(ignore_path(&rules, "a/x/y/b", 0));
+    CU_ASSERT(!ignore_path(&rules, "a/xb", 0));
+    CU_ASSERT(ignore_path(&rules, "y1.log", 0));
+    CU_ASSERT(!ignore_path(&rules, "a1.log", 0));
+    // Matching "src/" then "main.o" is matching "src/main.o".
+    int state = ignore_walk(&rules, rules.start, "src/");
+    CU_ASSERT(ignore_state_ignored(&rules, ignore_walk(&rules, state, "main.o"), 0));
+    ignore_free(&rules);
+    CU_ASSERT(5==ignore_compile(&rules, "*.o\n\n\n\n[abc\n"));
+    CU_ASSERT(ignore_path(&rules, "x.o", 0));
+    ignore_free(&rules);
+
+    CU_ASSERT(0==beargit_init());
+    FILE* f = fopen(".beargitignore", "w");
+    fputs("*.o\nignore_out/\n", f);
+    fclose(f);
+    fs_mkdir("ignore_dir");
+    fs_mkdir("ignore_out");
+    write_string_to_file("ignore_dir/a.txt", "a");
+    write_string_to_file("ignore_dir/a.o", "a");
+    write_string_to_file("ignore_out/b.txt", "b");
+    CU_ASSERT(0==beargit_add_all());
+
+    beargit_repo_t* repo = beargit_repo_open();
+    beargit_index* index = beargit_repo_index(repo);
+    CU_ASSERT(index_find(index, "ignore_dir/a.txt") >= 0);
+    CU_ASSERT(index_find(index, "ignore_dir/a.o") < 0);
+    CU_ASSERT(index_find(index, "ignore_out/b.txt") < 0);
+    beargit_repo_close(repo);
+
+    // Files named explicitly are added anyway.
+    CU_ASSERT(0==beargit_add("ignore_dir/a.o"));
+
+    fs_rm("ignore_dir/a.txt");
+    fs_rm("ignore_dir/a.o");
+    fs_rm("ignore_out/b.txt");
+    rmdir("ignore_dir");
+    rmdir("ignore_out");
+    fs_rm(".beargitignore");
+}
+
+/* In copy_mode "hardlink" (now "reflink"), editing a committed file in
+ * place leaves its snapshot alone.
+ */
+void copy_mode_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    CU_ASSERT(0==beargit_config("copy_mode", "hardlink"));
+    FILE* f = fopen("copy_mode.txt", "w");
+    fputs("s1\n", f);
+    fclose(f);
+    CU_ASSERT(0==beargit_add("copy_mode.txt"));
+    CU_ASSERT(0==beargit_commit("GO BEARS! s1"));
+    char first[COMMIT_ID_SIZE];
+    read_head(first);
+
+    f = fopen("copy_mode.txt", "r+");
+    fputs("s2\n", f);
+    fclose(f);
+    CU_ASSERT(0==beargit_commit("GO BEARS! s2"));
+
+    CU_ASSERT(0==beargit_checkout(first, 0));
+    char text[16] = { 0 };
+    f = fopen("copy_mode.txt", "r");
+    fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    CU_ASSERT_STRING_EQUAL(text, "s1\n");
+
+    struct stat st;
+    CU_ASSERT(0==stat("copy_mode.txt", &st));
+    CU_ASSERT(1==st.st_nlink);
+
+    fs_rm("copy_mode.txt");
+}
+
+/* The binary index: a text index is converted on the first add, the hash
+ * directory grows as files are added one by one, removing a directory finds
+ * its files both in the sorted table and among the records appended after
+ * it, and a mostly removed index is compacted.
+ */
+void index_test(void)
+{
+    CU_ASSERT(0==beargit_init());
+    FILE* f = fopen(".beargit/.index", "w");
+    fputs("ia.txt\nib.txt\n", f);
+    fclose(f);
+    CU_ASSERT(0==index_read_generation());
+    CU_ASSERT(0==beargit_add("idx.txt"));
+    CU_ASSERT(index_read_generation() > 0);
+
+    beargit_index index;
+    index_read(&index);
+    CU_ASSERT(3==index.count);
+    CU_ASSERT(index_find(&index, "ia.txt") >= 0);
+    CU_ASSERT(index_find(&index, "ib.txt") >= 0);
+    CU_ASSERT(index_find(&index, "idx.txt") >= 0);
+    index_free(&index);
+
+    // Far past half of the initial directory, so it is rewritten at least
+    // once, and files are appended after the last rewrite too.
+    fs_force_rm_dir("idx");
+    fs_mkdir("idx");
+    char name[32];
+    for (int i = 0; i < 70; i++) {
+        sprintf(name, "idx/f%02d", i);
+        CU_ASSERT(0==beargit_add(name));
+    }
+    CU_ASSERT(3==beargit_add("idx/f00"));
+    index_read(&index);
+    CU_ASSERT(73==index.count);
+    for (int i = 0; i < 70; i++) {
+        sprintf(name, "idx/f%02d", i);
+        CU_ASSERT(index_find(&index, name) >= 0);
+    }
+    index_free(&index);
+
+    struct stat before, after;
+    CU_ASSERT(0==stat(".beargit/.index", &before));
+    char* dir[] = { "idx" };
+    CU_ASSERT(0==beargit_rm_paths(1, dir));
+    CU_ASSERT(1==beargit_rm_paths(1, dir));
+    CU_ASSERT(0==stat(".beargit/.index", &after));
+    CU_ASSERT(after.st_size < before.st_size);
+
+    index_read(&index);
+    CU_ASSERT(3==index.count);
+    CU_ASSERT(index_find(&index, "idx.txt") >= 0);
+    CU_ASSERT(index_find(&index, "idx/f00") < 0);
+
+    // A write in between moves the records; an index read before it is
+    // written out whole instead of patched at the old offsets.
+    beargit_index other;
+    index_read(&other);
+    index_remove(&other, index_find(&other, "ia.txt"));
+    index_write(&other);
+    index_free(&other);
+    int pos = index_find(&index, "idx.txt");
+    strcpy(index.entries[pos].blob_id, "1111111111111111111111111111111111111111");
+    index.entries[pos].dirty = 1;
+    index_write(&index);
+    index_free(&index);
+    index_read(&index);
+    CU_ASSERT(3==index.count);
+    CU_ASSERT(index_find(&index, "ia.txt") >= 0);
+    CU_ASSERT(index_find(&index, "ib.txt") >= 0);
+    pos = index_find(&index, "idx.txt");
+    CU_ASSERT(pos >= 0);
+    if (pos >= 0)
+      CU_ASSERT_STRING_EQUAL(index.entries[pos].blob_id, "1111111111111111111111111111111111111111");
+    index_free(&index);
+
+    fs_force_rm_dir("idx");
+}
+
 /* The main() function for setting up and running the tests.
  * Returns a CUE_SUCCESS on successful running, another
  * CUnit error code on failure.
@@ -146,6 +1675,31 @@ int cunittester()
 {
    CU_pSuite pSuite = NULL;
    CU_pSuite pSuite2 = NULL;
+   CU_pSuite pSuite3 = NULL;
+   CU_pSuite pSuite4 = NULL;
+   CU_pSuite pSuite5 = NULL;
+   CU_pSuite pSuite6 = NULL;
+   CU_pSuite pSuite7 = NULL;
+   CU_pSuite pSuite8 = NULL;
+   CU_pSuite pSuite9 = NULL;
+   CU_pSuite pSuite10 = NULL;
+   CU_pSuite pSuite11 = NULL;
+   CU_pSuite pSuite12 = NULL;
+   CU_pSuite pSuite13 = NULL;
+   CU_pSuite pSuite14 = NULL;
+   CU_pSuite pSuite15 = NULL;
+   CU_pSuite pSuite16 = NULL;
+   CU_pSuite pSuite17 = NULL;
+   CU_pSuite pSuite18 = NULL;
+   CU_pSuite pSuite19 = NULL;
+   CU_pSuite pSuite20 = NULL;
+   CU_pSuite pSuite21 = NULL;
+   CU_pSuite pSuite22 = NULL;
+   CU_pSuite pSuite23 = NULL;
+   CU_pSuite pSuite24 = NULL;
+   CU_pSuite pSuite25 = NULL;
+   CU_pSuite pSuite26 = NULL;
+   CU_pSuite pSuite27 = NULL;
 
    /* initialize the CUnit test registry */
    if (CUE_SUCCESS != CU_initialize_registry())
@@ -178,6 +1732,331 @@ int cunittester()
       return CU_get_error();
    }
 
+   pSuite3 = CU_add_suite("Suite_3", init_suite, clean_suite);
+   if (NULL == pSuite3) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #3 */
+   if (NULL == CU_add_test(pSuite3, "Object store dedup test", object_store_dedup_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite4 = CU_add_suite("Suite_4", init_suite, clean_suite);
+   if (NULL == pSuite4) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #4 */
+   if (NULL == CU_add_test(pSuite4, "Status modified files test", status_modified_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite5 = CU_add_suite("Suite_5", init_suite, clean_suite);
+   if (NULL == pSuite5) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #5 */
+   if (NULL == CU_add_test(pSuite5, "Batch add/rm test", batch_add_rm_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite6 = CU_add_suite("Suite_6", init_suite, clean_suite);
+   if (NULL == pSuite6) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #6 */
+   if (NULL == CU_add_test(pSuite6, "Parallel commit test", parallel_commit_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite7 = CU_add_suite("Suite_7", init_suite, clean_suite);
+   if (NULL == pSuite7) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #7 */
+   if (NULL == CU_add_test(pSuite7, "Minimal checkout test", minimal_checkout_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite8 = CU_add_suite("Suite_8", init_suite, clean_suite);
+   if (NULL == pSuite8) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #8 */
+   if (NULL == CU_add_test(pSuite8, "Commit log test", commit_log_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite9 = CU_add_suite("Suite_9", init_suite, clean_suite);
+   if (NULL == pSuite9) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #9 */
+   if (NULL == CU_add_test(pSuite9, "Repack test", repack_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite10 = CU_add_suite("Suite_10", init_suite, clean_suite);
+   if (NULL == pSuite10) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #10 */
+   if (NULL == CU_add_test(pSuite10, "Delta pack test", delta_pack_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite11 = CU_add_suite("Suite_11", init_suite, clean_suite);
+   if (NULL == pSuite11) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #11 */
+   if (NULL == CU_add_test(pSuite11, "Compression test", compression_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite12 = CU_add_suite("Suite_12", init_suite, clean_suite);
+   if (NULL == pSuite12) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #12 */
+   if (NULL == CU_add_test(pSuite12, "Chunked file test", chunked_file_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite13 = CU_add_suite("Suite_13", init_suite, clean_suite);
+   if (NULL == pSuite13) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #13 */
+   if (NULL == CU_add_test(pSuite13, "Refs test", refs_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite14 = CU_add_suite("Suite_14", init_suite, clean_suite);
+   if (NULL == pSuite14) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #14 */
+   if (NULL == CU_add_test(pSuite14, "State test", state_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite15 = CU_add_suite("Suite_15", init_suite, clean_suite);
+   if (NULL == pSuite15) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #15 */
+   if (NULL == CU_add_test(pSuite15, "Journal test", journal_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite16 = CU_add_suite("Suite_16", init_suite, clean_suite);
+   if (NULL == pSuite16) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #16 */
+   if (NULL == CU_add_test(pSuite16, "Repository handle test", repo_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite17 = CU_add_suite("Suite_17", init_suite, clean_suite);
+   if (NULL == pSuite17) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #17 */
+   if (NULL == CU_add_test(pSuite17, "Daemon test", daemon_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite18 = CU_add_suite("Suite_18", init_suite, clean_suite);
+   if (NULL == pSuite18) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #18 */
+   if (NULL == CU_add_test(pSuite18, "Watch test", watch_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite19 = CU_add_suite("Suite_19", init_suite, clean_suite);
+   if (NULL == pSuite19) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #19 */
+   if (NULL == CU_add_test(pSuite19, "Diff test", diff_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite20 = CU_add_suite("Suite_20", init_suite, clean_suite);
+   if (NULL == pSuite20) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #20 */
+   if (NULL == CU_add_test(pSuite20, "Commit graph test", commitgraph_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite21 = CU_add_suite("Suite_21", init_suite, clean_suite);
+   if (NULL == pSuite21) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #21 */
+   if (NULL == CU_add_test(pSuite21, "Merge test", merge_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite22 = CU_add_suite("Suite_22", init_suite, clean_suite);
+   if (NULL == pSuite22) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #22 */
+   if (NULL == CU_add_test(pSuite22, "Message index test", msgindex_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite23 = CU_add_suite("Suite_23", init_suite, clean_suite);
+   if (NULL == pSuite23) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #23 */
+   if (NULL == CU_add_test(pSuite23, "Commit id prefix test", prefix_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite24 = CU_add_suite("Suite_24", init_suite, clean_suite);
+   if (NULL == pSuite24) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #24 */
+   if (NULL == CU_add_test(pSuite24, "Sparse checkout test", sparse_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite25 = CU_add_suite("Suite_25", init_suite, clean_suite);
+   if (NULL == pSuite25) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #25 */
+   if (NULL == CU_add_test(pSuite25, "Ignore rules test", ignore_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite26 = CU_add_suite("Suite_26", init_suite, clean_suite);
+   if (NULL == pSuite26) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #26 */
+   if (NULL == CU_add_test(pSuite26, "Copy mode test", copy_mode_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite27 = CU_add_suite("Suite_27", init_suite, clean_suite);
+   if (NULL == pSuite27) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #27 */
+   if (NULL == CU_add_test(pSuite27, "Index test", index_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
    /* Run all tests using the CUnit Basic interface */
    CU_basic_set_mode(CU_BRM_VERBOSE);
    CU_basic_run_tests();
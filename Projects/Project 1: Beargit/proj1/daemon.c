@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "beargit.h"
+#include "commitlog.h"
+#include "daemon.h"
+#include "refs.h"
+#include "repo.h"
+#include "state.h"
+#include "util.h"
+
+/* Protocol
+ *
+ * The client sends "BGD1", a uint32 payload size and the payload: its
+ * arguments from argv[1] on, each NUL-terminated. The first bytes carry its
+ * stdout and stderr as SCM_RIGHTS. The daemon runs the command with those as
+ * its fds 1 and 2 and answers with the int32 return value. Integers are in
+ * host byte order, as both ends are on the same machine.
+ */
+
+#define REQUEST_MAGIC "BGD1"
+#define MAX_REQUEST_SIZE (16 << 20)
+
+// How long a client may take to send its request
+#define REQUEST_TIMEOUT_SEC 5
+
+static int write_all(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len) {
+  char* p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void socket_address(struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, DAEMON_SOCKET);
+}
+
+static int connect_daemon(void) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_un addr;
+  socket_address(&addr);
+  if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Client */
+
+int daemon_client_run(int argc, char** argv, int* ret) {
+  int fd = connect_daemon();
+  if (fd < 0)
+    return -1;
+
+  size_t size = 0;
+  for (int i = 1; i < argc; i++)
+    size += strlen(argv[i]) + 1;
+  char* request = malloc(8 + size);
+  ASSERT_ERROR_MESSAGE(request != NULL, "out of memory");
+  memcpy(request, REQUEST_MAGIC, 4);
+  uint32_t payload_size = size;
+  memcpy(request + 4, &payload_size, 4);
+  char* p = request + 8;
+  for (int i = 1; i < argc; i++) {
+    strcpy(p, argv[i]);
+    p += strlen(argv[i]) + 1;
+  }
+
+  // The header goes with the fds, the rest follows.
+  int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { request, 8 };
+  struct msghdr msg = { 0 };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  fflush(stdout);
+  fflush(stderr);
+  int32_t status;
+  int sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == 8 && write_all(fd, request + 8, size) == 0;
+  free(request);
+  if (!sent || read_all(fd, &status, sizeof(status)) != 0) {
+    fprintf(stderr, "ERROR: The daemon stopped before finishing the command\n");
+    status = 1;
+  }
+  close(fd);
+  *ret = status;
+  return 0;
+}
+
+/* Daemon */
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} file_stamp;
+
+// The files a repository handle caches
+static const char* const watched_files[] = {
+  STATE_FILE, ".beargit/.index", REFS_FILE, COMMITLOG_FILE
+};
+#define NWATCHED (sizeof(watched_files) / sizeof(watched_files[0]))
+
+static void take_stamps(file_stamp* stamps) {
+  memset(stamps, 0, NWATCHED * sizeof(file_stamp));
+  for (size_t i = 0; i < NWATCHED; i++) {
+    struct stat s;
+    if (stat(watched_files[i], &s) != 0)
+      continue;
+    stamps[i].dev = s.st_dev;
+    stamps[i].ino = s.st_ino;
+    stamps[i].size = s.st_size;
+    stamps[i].mtime_sec = s.st_mtim.tv_sec;
+    stamps[i].mtime_nsec = s.st_mtim.tv_nsec;
+  }
+}
+
+static volatile sig_atomic_t stopping;
+
+static void on_stop_signal(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+static int is_reader(int argc, char** argv) {
+  return argc > 1 && (strcmp(argv[1], "log") == 0 || strcmp(argv[1], "status") == 0 ||
+                      strcmp(argv[1], "branch") == 0 || strcmp(argv[1], "diff") == 0);
+}
+
+// Reads a request from <conn> into a NULL-terminated argv (argv[0] is
+// "beargit") and the client's output fds. Returns 0, or -1 if the request
+// is malformed; the fds are closed then.
+static int read_request(int conn, int* fds, int* argc, char*** argv, char** payload) {
+  char header[8];
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = { header, sizeof(header) };
+  struct msghdr msg = { 0 };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  fds[0] = fds[1] = -1;
+  ssize_t n;
+  while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+  struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+  uint32_t size = 0;
+  int ok = fds[0] >= 0 && n > 0 && read_all(conn, header + n, sizeof(header) - n) == 0 &&
+           memcmp(header, REQUEST_MAGIC, 4) == 0;
+  if (ok) {
+    memcpy(&size, header + 4, 4);
+    ok = size > 0 && size <= MAX_REQUEST_SIZE;
+  }
+
+  *payload = ok ? malloc(size) : NULL;
+  ok = ok && *payload != NULL && read_all(conn, *payload, size) == 0 && (*payload)[size - 1] == '\0';
+  if (!ok) {
+    free(*payload);
+    if (fds[0] >= 0) {
+      close(fds[0]);
+      close(fds[1]);
+    }
+    return -1;
+  }
+
+  *argc = 1;
+  for (uint32_t i = 0; i < size; i++)
+    *argc += (*payload)[i] == '\0';
+  *argv = calloc(*argc + 1, sizeof(char*));
+  ASSERT_ERROR_MESSAGE(*argv != NULL, "out of memory");
+  (*argv)[0] = "beargit";
+  char* arg = *payload;
+  for (int i = 1; i < *argc; i++) {
+    (*argv)[i] = arg;
+    arg += strlen(arg) + 1;
+  }
+  return 0;
+}
+
+// Runs a command with the client's stdout and stderr as its own.
+static int run_redirected(beargit_repo_t* repo, int argc, char** argv, const int* fds) {
+  fflush(stdout);
+  fflush(stderr);
+  int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+  dup2(fds[0], STDOUT_FILENO);
+  dup2(fds[1], STDERR_FILENO);
+
+  beargit_set_jobs(0);
+  int ret = beargit_repo_run(repo, argc, argv);
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(saved_out, STDOUT_FILENO);
+  dup2(saved_err, STDERR_FILENO);
+  close(saved_out);
+  close(saved_err);
+  return ret;
+}
+
+// Runs a writer in a child of its own, like a reader but waiting for it,
+// so a command that exits on an error doesn't take the daemon down with it.
+// Returns its return value, or 1 if it died.
+static int run_writer(beargit_repo_t* repo, int argc, char** argv, const int* fds) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int ret = run_redirected(repo, argc, argv, fds);
+    beargit_repo_flush(repo);
+    _exit(ret & 0xff);
+  }
+  if (pid < 0) {
+    dprintf(fds[1], "ERROR: Couldn't start the command: %s\n", strerror(errno));
+    return 1;
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return 1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static int open_socket(void) {
+  int fd = connect_daemon();
+  if (fd >= 0) {
+    close(fd);
+    fprintf(stderr, "ERROR: A daemon is already running\n");
+    return -1;
+  }
+
+  // Left behind by a daemon that didn't stop cleanly
+  unlink(DAEMON_SOCKET);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't create daemon socket");
+  struct sockaddr_un addr;
+  socket_address(&addr);
+  ASSERT_ERROR_MESSAGE(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 && listen(fd, 64) == 0,
+                       "couldn't listen on " DAEMON_SOCKET);
+  return fd;
+}
+
+int daemon_serve(void) {
+  int listener = open_socket();
+  if (listener < 0)
+    return 1;
+
+  // No SA_RESTART, so a signal interrupts accept.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  beargit_repo_t* repo = beargit_repo_open();
+  beargit_repo_watch(repo);
+  file_stamp stamps[NWATCHED], now[NWATCHED];
+  take_stamps(stamps);
+  int readers = 0;
+
+  while (!stopping) {
+    int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+      readers--;
+    if (conn < 0)
+      continue;
+
+    struct timeval timeout = { REQUEST_TIMEOUT_SEC, 0 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int fds[2], argc;
+    char** argv;
+    char* payload;
+    if (read_request(conn, fds, &argc, &argv, &payload) != 0) {
+      close(conn);
+      continue;
+    }
+
+    // Someone else changed the repository: start over from the files.
+    take_stamps(now);
+    if (memcmp(now, stamps, sizeof(stamps)) != 0) {
+      // Stat data refreshed by polling must not overwrite their index.
+      repo->index_changed = 0;
+      beargit_repo_close(repo);
+      repo = beargit_repo_open();
+      beargit_repo_watch(repo);
+    }
+    beargit_repo_index(repo);
+    beargit_repo_commit_log(repo);
+    // Readers can't poll the watch themselves (see watch_poll), so they get
+    // a dirty set that is up to date when they are forked.
+    beargit_repo_poll(repo);
+
+    int32_t status = 0;
+    if (argc == 3 && strcmp(argv[1], "daemon") == 0 && strcmp(argv[2], "stop") == 0) {
+      stopping = 1;
+    } else if (is_reader(argc, argv)) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(listener);
+        status = run_redirected(repo, argc, argv, fds);
+        write_all(conn, &status, sizeof(status));
+        _exit(0);
+      }
+      if (pid > 0)
+        readers++;
+      close(fds[0]);
+      close(fds[1]);
+      free(argv);
+      free(payload);
+      close(conn);
+      continue;
+    } else {
+      while (readers > 0) {
+        if (waitpid(-1, NULL, 0) > 0 || errno == ECHILD)
+          readers--;
+      }
+      status = run_writer(repo, argc, argv, fds);
+      // The writer's changes are only on disk.
+      take_stamps(now);
+      if (memcmp(now, stamps, sizeof(stamps)) != 0)
+        repo = beargit_repo_reopen(repo);
+    }
+    take_stamps(stamps);
+
+    write_all(conn, &status, sizeof(status));
+    close(fds[0]);
+    close(fds[1]);
+    free(argv);
+    free(payload);
+    close(conn);
+  }
+
+  while (readers-- > 0)
+    waitpid(-1, NULL, 0);
+  close(listener);
+  unlink(DAEMON_SOCKET);
+  beargit_repo_close(repo);
+  return 0;
+}
+
+int beargit_daemon(int argc, char** argv) {
+  if (argc == 2)
+    return daemon_serve();
+
+  if (argc != 3 || strcmp(argv[2], "stop") != 0) {
+    fprintf(stderr, "ERROR: Invalid arguments for daemon ([stop])\n");
+    return 1;
+  }
+
+  int ret;
+  if (daemon_client_run(argc, argv, &ret) != 0) {
+    fprintf(stderr, "ERROR: No daemon is running\n");
+    return 1;
+  }
+  return ret;
+}
@@ -0,0 +1,45 @@
+/**
+ * beargit daemon [stop]
+ *
+ * Serves beargit commands for the repository in the current directory over
+ * the Unix socket .beargit/daemon.sock, keeping a repository handle (see
+ * repo.h) warm between them. The command line client passes its arguments
+ * and its stdout and stderr to the daemon and exits with the command's
+ * return value; without a daemon it runs commands itself.
+ *
+ * log, status, branch and diff only read the repository, so each runs in a child
+ * process forked off the daemon, concurrently with other readers. Every
+ * other command runs in a child too, one at a time, once the readers before
+ * it are done; the daemon waits for it and then reopens its handle, keeping
+ * its watch. A command that exits on an internal error only ends its child.
+ * Changes made by other processes (the repository files' inode, size or
+ * mtime changed) also make the daemon reopen its handle before the next
+ * command.
+ *
+ * The daemon watches the tracked files (see beargit_repo_watch), so status
+ * and commit through it only check the files that changed since the last
+ * command instead of every tracked file.
+ *
+ * "beargit daemon stop" stops a running daemon, as do SIGINT and SIGTERM.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR: A daemon is already running
+ * >> ERROR: No daemon is running
+ * >> ERROR: The daemon stopped before finishing the command
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#define DAEMON_SOCKET ".beargit/daemon.sock"
+
+int beargit_daemon(int argc, char** argv);
+
+// Serves commands until stopped. Returns 0, or 1 if it couldn't start.
+int daemon_serve(void);
+
+// Has a running daemon run argv (as passed to main) and stores its return
+// value in *ret. Returns 0, or -1 if no daemon is running.
+int daemon_client_run(int argc, char** argv, int* ret);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "util.h"
+
+/* Delta format
+ *
+ *   varint base size, varint target size, then instructions:
+ *   0x00 <varint len> <len bytes>     insert bytes
+ *   0x01 <varint offset> <varint len> copy len bytes of the base from offset
+ *
+ * Varints are little-endian groups of 7 bits, the high bit set on all but
+ * the last byte.
+ *
+ * The encoder indexes the base by the hash of every DELTA_BLOCK-byte block
+ * and slides a rolling hash of the same width over the target. A hit is
+ * verified, grown in both directions, and becomes a copy; the bytes between
+ * copies become inserts.
+ */
+
+#define DELTA_INSERT 0x00
+#define DELTA_COPY 0x01
+
+#define DELTA_BLOCK 16
+#define HASH_MULT 0x01000193u
+
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+} delta_buffer;
+
+// Returns 0, or -1 once the buffer would reach its capacity.
+static int put_bytes(delta_buffer* out, const void* bytes, size_t len) {
+  if (out->size + len >= out->capacity)
+    return -1;
+  memcpy(out->data + out->size, bytes, len);
+  out->size += len;
+  return 0;
+}
+
+static int put_varint(delta_buffer* out, uint64_t value) {
+  unsigned char bytes[10];
+  int n = 0;
+  do {
+    bytes[n] = value & 0x7f;
+    value >>= 7;
+    if (value)
+      bytes[n] |= 0x80;
+    n++;
+  } while (value);
+  return put_bytes(out, bytes, n);
+}
+
+static int get_varint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*p == end)
+      return -1;
+    unsigned char byte = *(*p)++;
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+static uint32_t block_hash(const unsigned char* p) {
+  uint32_t hash = 0;
+  for (int i = 0; i < DELTA_BLOCK; i++)
+    hash = hash * HASH_MULT + p[i];
+  return hash;
+}
+
+static int put_insert(delta_buffer* out, const char* bytes, size_t len) {
+  if (len == 0)
+    return 0;
+  unsigned char op = DELTA_INSERT;
+  return put_bytes(out, &op, 1) || put_varint(out, len) || put_bytes(out, bytes, len) ? -1 : 0;
+}
+
+static int put_copy(delta_buffer* out, size_t offset, size_t len) {
+  unsigned char op = DELTA_COPY;
+  return put_bytes(out, &op, 1) || put_varint(out, offset) || put_varint(out, len) ? -1 : 0;
+}
+
+char* delta_encode(const char* base, size_t base_size, const char* target, size_t target_size,
+                   size_t max_size, size_t* delta_size) {
+  delta_buffer out = { malloc(max_size), 0, max_size };
+  ASSERT_ERROR_MESSAGE(out.data != NULL, "out of memory");
+  if (put_varint(&out, base_size) || put_varint(&out, target_size)) {
+    free(out.data);
+    return NULL;
+  }
+
+  // Hash table over the base's blocks, slot value is offset + 1.
+  size_t nblocks = base_size / DELTA_BLOCK;
+  size_t nslots = 64;
+  while (nslots < 2 * nblocks)
+    nslots *= 2;
+  size_t* slots = calloc(nslots, sizeof(size_t));
+  ASSERT_ERROR_MESSAGE(slots != NULL, "out of memory");
+  const unsigned char* b = (const unsigned char*) base;
+  const unsigned char* t = (const unsigned char*) target;
+  for (size_t i = 0; i < nblocks; i++)
+    slots[block_hash(b + i * DELTA_BLOCK) & (nslots - 1)] = i * DELTA_BLOCK + 1;
+
+  // HASH_MULT^(DELTA_BLOCK-1), to roll the oldest byte out of the hash
+  uint32_t top = 1;
+  for (int i = 0; i < DELTA_BLOCK - 1; i++)
+    top *= HASH_MULT;
+
+  int failed = 0;
+  size_t pending = 0;       // start of the bytes not covered by an instruction yet
+  size_t pos = 0;
+  uint32_t hash = target_size >= DELTA_BLOCK ? block_hash(t) : 0;
+  while (!failed && nblocks && pos + DELTA_BLOCK <= target_size) {
+    size_t slot = slots[hash & (nslots - 1)];
+    if (slot && memcmp(b + slot - 1, t + pos, DELTA_BLOCK) == 0) {
+      size_t src = slot - 1;
+      size_t len = DELTA_BLOCK;
+      while (src + len < base_size && pos + len < target_size && b[src + len] == t[pos + len])
+        len++;
+      while (src > 0 && pos > pending && b[src - 1] == t[pos - 1]) {
+        src--;
+        pos--;
+        len++;
+      }
+
+      failed = put_insert(&out, target + pending, pos - pending) || put_copy(&out, src, len);
+      pos += len;
+      pending = pos;
+      if (pos + DELTA_BLOCK <= target_size)
+        hash = block_hash(t + pos);
+    } else {
+      if (pos + DELTA_BLOCK < target_size)
+        hash = (hash - t[pos] * top) * HASH_MULT + t[pos + DELTA_BLOCK];
+      pos++;
+    }
+  }
+  free(slots);
+
+  if (failed || put_insert(&out, target + pending, target_size - pending)) {
+    free(out.data);
+    return NULL;
+  }
+  *delta_size = out.size;
+  return out.data;
+}
+
+char* delta_apply(const char* base, size_t base_size, const char* delta, size_t delta_size,
+                  size_t* result_size) {
+  const unsigned char* p = (const unsigned char*) delta;
+  const unsigned char* end = p + delta_size;
+
+  uint64_t expected_base, size;
+  if (get_varint(&p, end, &expected_base) || expected_base != base_size ||
+      get_varint(&p, end, &size))
+    return NULL;
+
+  char* result = malloc(size ? size : 1);
+  ASSERT_ERROR_MESSAGE(result != NULL, "out of memory");
+  size_t done = 0;
+  int malformed = 0;
+  while (!malformed && p < end) {
+    unsigned char op = *p++;
+    uint64_t offset = 0, len = 0;
+    malformed = (op != DELTA_COPY && op != DELTA_INSERT) ||
+                (op == DELTA_COPY && get_varint(&p, end, &offset)) ||
+                get_varint(&p, end, &len) || len > size - done;
+    if (malformed)
+      break;
+
+    if (op == DELTA_COPY) {
+      malformed = offset > base_size || len > base_size - offset;
+      if (!malformed)
+        memcpy(result + done, base + offset, len);
+    } else {
+      malformed = len > (uint64_t) (end - p);
+      if (!malformed) {
+        memcpy(result + done, p, len);
+        p += len;
+      }
+    }
+    done += len;
+  }
+
+  if (malformed || done != size) {
+    free(result);
+    return NULL;
+  }
+  *result_size = size;
+  return result;
+}
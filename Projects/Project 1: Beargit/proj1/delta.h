@@ -0,0 +1,23 @@
+/**
+ * Delta encoding: a file version is stored as instructions that rebuild it
+ * from another version (its base), either copying a range of the base or
+ * inserting new bytes. Files that change by a few lines per commit shrink
+ * to a few dozen bytes.
+ */
+
+#include <stddef.h>
+
+#ifndef DELTA_H
+#define DELTA_H
+
+// Encodes <target> against <base>. Returns the delta (to be freed by the
+// caller), or NULL if it would be <max_size> bytes or more.
+char* delta_encode(const char* base, size_t base_size, const char* target, size_t target_size,
+                   size_t max_size, size_t* delta_size);
+
+// Rebuilds the target of <delta> from <base>. Returns it (to be freed by the
+// caller), or NULL if the delta is malformed or wasn't made against <base>.
+char* delta_apply(const char* base, size_t base_size, const char* delta, size_t delta_size,
+                  size_t* result_size);
+
+#endif
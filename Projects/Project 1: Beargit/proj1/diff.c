@@ -0,0 +1,446 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "util.h"
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+/* Reading files
+ *
+ * Every line is hashed with 64-bit FNV-1a, its newline included, so a last
+ * line without one differs from the same line with one. Lines are equal
+ * when their hashes are; a collision is too unlikely to matter for showing
+ * changes.
+ */
+
+static void add_line(diff_file* file, uint64_t hash, off_t start) {
+  if (file->count + 1 >= file->capacity) {
+    file->capacity = file->capacity ? 2 * file->capacity : 1024;
+    file->hashes = realloc(file->hashes, file->capacity * sizeof(uint64_t));
+    file->offsets = realloc(file->offsets, file->capacity * sizeof(off_t));
+    ASSERT_ERROR_MESSAGE(file->hashes != NULL && file->offsets != NULL, "out of memory");
+  }
+  file->hashes[file->count] = hash;
+  file->offsets[file->count] = start;
+  file->count++;
+}
+
+int diff_file_open(diff_file* file, const char* path) {
+  memset(file, 0, sizeof(*file));
+  file->offsets = malloc(sizeof(off_t));
+  ASSERT_ERROR_MESSAGE(file->offsets != NULL, "out of memory");
+  file->offsets[0] = 0;
+  if (path == NULL)
+    return 0;
+
+  file->file = fopen(path, "r");
+  if (file->file == NULL) {
+    int saved_errno = errno;
+    diff_file_close(file);
+    errno = saved_errno;
+    return -1;
+  }
+
+  char buffer[65536];
+  uint64_t hash = FNV_OFFSET;
+  off_t offset = 0, start = 0;
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file->file)) > 0) {
+    for (size_t i = 0; i < n; i++, offset++) {
+      unsigned char c = buffer[i];
+      hash = (hash ^ c) * FNV_PRIME;
+      if (c == '\0')
+        file->binary = 1;
+      if (c == '\n') {
+        add_line(file, hash, start);
+        hash = FNV_OFFSET;
+        start = offset + 1;
+      }
+    }
+  }
+  if (ferror(file->file)) {
+    int saved_errno = errno ? errno : EIO;
+    diff_file_close(file);
+    errno = saved_errno;
+    return -1;
+  }
+  if (offset > start)
+    add_line(file, hash, start);
+  file->offsets[file->count] = offset;
+  return 0;
+}
+
+void diff_file_close(diff_file* file) {
+  if (file->file)
+    fclose(file->file);
+  free(file->hashes);
+  free(file->offsets);
+  memset(file, 0, sizeof(*file));
+}
+
+/* Myers' algorithm
+ *
+ * The search runs from both corners of the edit graph at once, one edit at
+ * a time, keeping the furthest point reached on every diagonal k = x - y
+ * (forward[k] and backward[k]). Once the two meet, the point where they do
+ * lies on a shortest edit script, and the halves before and after it are
+ * compared recursively. Both searches stay within the diagonals the
+ * current subproblem has, so the arrays are sized for the whole problem
+ * once.
+ */
+
+typedef struct {
+  const uint64_t* a;
+  const uint64_t* b;
+  char* changed_a;
+  char* changed_b;
+  int* forward;       // indexed by diagonal
+  int* backward;
+} myers;
+
+// Finds the point (*xmid, *ymid) where the searches from both ends of
+// a[xoff..xlim) and b[yoff..ylim) meet. Both must have different first
+// and last elements.
+static void split(myers* m, int xoff, int xlim, int yoff, int ylim, int* xmid, int* ymid) {
+  int* fd = m->forward;
+  int* bd = m->backward;
+  const int dmin = xoff - ylim, dmax = xlim - yoff;
+  const int fmid = xoff - yoff, bmid = xlim - ylim;
+  const int odd = (fmid - bmid) & 1;
+  int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+  fd[fmid] = xoff;
+  bd[bmid] = xlim;
+
+  for (;;) {
+    // One more edit from the top left...
+    if (fmin > dmin)
+      fd[--fmin - 1] = -1;
+    else
+      fmin++;
+    if (fmax < dmax)
+      fd[++fmax + 1] = -1;
+    else
+      fmax--;
+    for (int d = fmax; d >= fmin; d -= 2) {
+      int x = fd[d - 1] < fd[d + 1] ? fd[d + 1] : fd[d - 1] + 1;
+      int y = x - d;
+      while (x < xlim && y < ylim && m->a[x] == m->b[y])
+        x++, y++;
+      fd[d] = x;
+      if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+        *xmid = x;
+        *ymid = y;
+        return;
+      }
+    }
+
+    // ...and from the bottom right.
+    if (bmin > dmin)
+      bd[--bmin - 1] = xlim + 1;
+    else
+      bmin++;
+    if (bmax < dmax)
+      bd[++bmax + 1] = xlim + 1;
+    else
+      bmax--;
+    for (int d = bmax; d >= bmin; d -= 2) {
+      int x = bd[d - 1] < bd[d + 1] ? bd[d - 1] : bd[d + 1] - 1;
+      int y = x - d;
+      while (x > xoff && y > yoff && m->a[x - 1] == m->b[y - 1])
+        x--, y--;
+      bd[d] = x;
+      if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+        *xmid = x;
+        *ymid = y;
+        return;
+      }
+    }
+  }
+}
+
+static void compare(myers* m, int xoff, int xlim, int yoff, int ylim) {
+  while (xoff < xlim && yoff < ylim && m->a[xoff] == m->b[yoff])
+    xoff++, yoff++;
+  while (xlim > xoff && ylim > yoff && m->a[xlim - 1] == m->b[ylim - 1])
+    xlim--, ylim--;
+
+  if (xoff == xlim) {
+    memset(m->changed_b + yoff, 1, ylim - yoff);
+  } else if (yoff == ylim) {
+    memset(m->changed_a + xoff, 1, xlim - xoff);
+  } else {
+    int xmid, ymid;
+    split(m, xoff, xlim, yoff, ylim, &xmid, &ymid);
+    compare(m, xoff, xmid, yoff, ymid);
+    compare(m, xmid, xlim, ymid, ylim);
+  }
+}
+
+void diff_lines(const uint64_t* a, int n, const uint64_t* b, int m,
+                char* changed_a, char* changed_b) {
+  memset(changed_a, 0, n);
+  memset(changed_b, 0, m);
+
+  // Diagonals run from -m to n, and the searches look one beyond.
+  int* diagonals = malloc(2 * (n + m + 3) * sizeof(int));
+  ASSERT_ERROR_MESSAGE(diagonals != NULL, "out of memory");
+  myers state = { a, b, changed_a, changed_b,
+                  diagonals + m + 1, diagonals + (n + m + 3) + m + 1 };
+  compare(&state, 0, n, 0, m);
+  free(diagonals);
+}
+
+/* Output */
+
+// Copies line <i> of <file> to <out>. Returns 1 if it ends with a newline,
+// 0 if it doesn't (the last line may not), or -1 with errno set.
+static int copy_line(FILE* out, diff_file* file, int i) {
+  off_t start = file->offsets[i], end = file->offsets[i + 1];
+  if (ftello(file->file) != start && fseeko(file->file, start, SEEK_SET) != 0)
+    return -1;
+
+  char buffer[1024];
+  int newline = 0;
+  while (start < end) {
+    size_t want = end - start < (off_t) sizeof(buffer) ? (size_t) (end - start) : sizeof(buffer);
+    size_t n = fread(buffer, 1, want, file->file);
+    if (n == 0) {
+      errno = ferror(file->file) ? errno : EIO;
+      return -1;
+    }
+    fprintf(out, "%.*s", (int) n, buffer);
+    newline = buffer[n - 1] == '\n';
+    start += n;
+  }
+  return newline;
+}
+
+// Prints line <i> of <file> after <sign>.
+static int print_line(FILE* out, char sign, diff_file* file, int i) {
+  fprintf(out, "%c", sign);
+  int ret = copy_line(out, file, i);
+  if (ret == 0)
+    fprintf(out, "\n\\ No newline at end of file\n");
+  return ret < 0 ? -1 : 0;
+}
+
+static void print_range(FILE* out, char sign, int start, int len) {
+  if (len == 1)
+    fprintf(out, "%c%d", sign, start + 1);
+  else
+    fprintf(out, "%c%d,%d", sign, len ? start + 1 : start, len);
+}
+
+static int print_hunks(FILE* out, diff_file* a, diff_file* b,
+                       const char* changed_a, const char* changed_b) {
+  int n = a->count, m = b->count;
+  int i = 0, j = 0;
+  for (;;) {
+    while (i < n && j < m && !changed_a[i] && !changed_b[j])
+      i++, j++;
+    if (i >= n && j >= m)
+      return 0;
+
+    // The hunk starts with up to DIFF_CONTEXT unchanged lines, and takes in
+    // the following changes until they are more than twice that apart.
+    int context = i < DIFF_CONTEXT ? i : DIFF_CONTEXT;
+    int start_a = i - context, start_b = j - context;
+    int end_a = i, end_b = j;
+    for (;;) {
+      while (end_a < n && changed_a[end_a])
+        end_a++;
+      while (end_b < m && changed_b[end_b])
+        end_b++;
+      int run = 0;
+      while (end_a + run < n && end_b + run < m && !changed_a[end_a + run] && !changed_b[end_b + run])
+        run++;
+      int last = end_a + run >= n && end_b + run >= m;
+      if (last || run > 2 * DIFF_CONTEXT) {
+        context = run < DIFF_CONTEXT ? run : DIFF_CONTEXT;
+        end_a += context;
+        end_b += context;
+        break;
+      }
+      end_a += run;
+      end_b += run;
+    }
+
+    fprintf(out, "@@ ");
+    print_range(out, '-', start_a, end_a - start_a);
+    fprintf(out, " ");
+    print_range(out, '+', start_b, end_b - start_b);
+    fprintf(out, " @@\n");
+
+    int ret = 0;
+    for (i = start_a, j = start_b; ret == 0 && (i < end_a || j < end_b);) {
+      if (i < end_a && changed_a[i])
+        ret = print_line(out, '-', a, i++);
+      else if (j < end_b && changed_b[j])
+        ret = print_line(out, '+', b, j++);
+      else
+        ret = print_line(out, ' ', a, i++), j++;
+    }
+    if (ret != 0)
+      return -1;
+  }
+}
+
+int diff_print(const char* name, const char* path_a, const char* path_b, FILE* out) {
+  diff_file a, b;
+  if (diff_file_open(&a, path_a) != 0)
+    return -1;
+  if (diff_file_open(&b, path_b) != 0) {
+    int saved_errno = errno;
+    diff_file_close(&a);
+    errno = saved_errno;
+    return -1;
+  }
+
+  int ret = 0;
+  int same = path_a && path_b && a.count == b.count && a.offsets[a.count] == b.offsets[b.count] &&
+             memcmp(a.hashes, b.hashes, a.count * sizeof(uint64_t)) == 0;
+  if (!same) {
+    fprintf(out, "diff --beargit a/%s b/%s\n", name, name);
+    if (a.binary || b.binary) {
+      fprintf(out, "Binary files %s%s and %s%s differ\n",
+              path_a ? "a/" : "", path_a ? name : "/dev/null",
+              path_b ? "b/" : "", path_b ? name : "/dev/null");
+    } else {
+      fprintf(out, "--- %s%s\n", path_a ? "a/" : "", path_a ? name : "/dev/null");
+      fprintf(out, "+++ %s%s\n", path_b ? "b/" : "", path_b ? name : "/dev/null");
+
+      char* changed = malloc(a.count + b.count + 1);
+      ASSERT_ERROR_MESSAGE(changed != NULL, "out of memory");
+      diff_lines(a.hashes, a.count, b.hashes, b.count, changed, changed + a.count);
+      ret = print_hunks(out, &a, &b, changed, changed + a.count);
+      free(changed);
+    }
+  }
+
+  int saved_errno = errno;
+  diff_file_close(&a);
+  diff_file_close(&b);
+  errno = saved_errno;
+  return ret;
+}
+
+/* Three-way merges
+ *
+ * Both sides are diffed against the base. Base lines that neither side
+ * changed are where the two sides are in sync; between two of those, each
+ * side has a (possibly empty) run of lines. If only one side's run differs
+ * from the base's, that side's run is taken; if both differ, they conflict
+ * unless they are the same.
+ */
+
+// For every line of <a>, the line of <b> it is matched with, or -1.
+static int* match_lines(const diff_file* a, const diff_file* b) {
+  char* changed = malloc(a->count + b->count + 1);
+  int* match = malloc((a->count + 1) * sizeof(int));
+  ASSERT_ERROR_MESSAGE(changed != NULL && match != NULL, "out of memory");
+  diff_lines(a->hashes, a->count, b->hashes, b->count, changed, changed + a->count);
+  for (int i = 0, j = 0; i < a->count; i++) {
+    if (changed[i]) {
+      match[i] = -1;
+      continue;
+    }
+    while (changed[a->count + j])
+      j++;
+    match[i] = j++;
+  }
+  free(changed);
+  return match;
+}
+
+static int same_lines(const diff_file* a, int a0, int a1, const diff_file* b, int b0, int b1) {
+  return a1 - a0 == b1 - b0 &&
+         memcmp(a->hashes + a0, b->hashes + b0, (a1 - a0) * sizeof(uint64_t)) == 0;
+}
+
+// Copies lines [from, to) of <file>. *newline tells whether the output ends
+// with one.
+static int copy_lines(FILE* out, diff_file* file, int from, int to, int* newline) {
+  for (int i = from; i < to; i++) {
+    int ret = copy_line(out, file, i);
+    if (ret < 0)
+      return -1;
+    *newline = ret;
+  }
+  return 0;
+}
+
+static void put_marker(FILE* out, int* newline, const char* marker, const char* label) {
+  if (!*newline)
+    fprintf(out, "\n");
+  if (label)
+    fprintf(out, "%s %s\n", marker, label);
+  else
+    fprintf(out, "%s\n", marker);
+  *newline = 1;
+}
+
+static int merge_files(diff_file* base, diff_file* ours, diff_file* theirs,
+                       const char* ours_label, const char* theirs_label, FILE* out) {
+  int* match_ours = match_lines(base, ours);
+  int* match_theirs = match_lines(base, theirs);
+
+  int conflicts = 0, newline = 1, ret = 0;
+  int i = 0, o = 0, t = 0;
+  while (ret == 0) {
+    int next = i;
+    while (next < base->count && (match_ours[next] < 0 || match_theirs[next] < 0))
+      next++;
+    int end_o = next < base->count ? match_ours[next] : ours->count;
+    int end_t = next < base->count ? match_theirs[next] : theirs->count;
+
+    if (next == i && end_o == o && end_t == t) {
+      if (next == base->count)
+        break;
+      ret = copy_lines(out, ours, o, o + 1, &newline);
+      i++, o++, t++;
+      continue;
+    }
+
+    if (same_lines(base, i, next, ours, o, end_o)) {
+      ret = copy_lines(out, theirs, t, end_t, &newline);
+    } else if (same_lines(base, i, next, theirs, t, end_t) ||
+               same_lines(ours, o, end_o, theirs, t, end_t)) {
+      ret = copy_lines(out, ours, o, end_o, &newline);
+    } else {
+      put_marker(out, &newline, "<<<<<<<", ours_label);
+      ret = copy_lines(out, ours, o, end_o, &newline);
+      put_marker(out, &newline, "=======", NULL);
+      if (ret == 0)
+        ret = copy_lines(out, theirs, t, end_t, &newline);
+      put_marker(out, &newline, ">>>>>>>", theirs_label);
+      conflicts++;
+    }
+    i = next, o = end_o, t = end_t;
+  }
+
+  free(match_ours);
+  free(match_theirs);
+  return ret < 0 ? -1 : conflicts;
+}
+
+int diff_merge(const char* path_base, const char* path_ours, const char* path_theirs,
+               const char* ours_label, const char* theirs_label, FILE* out) {
+  diff_file files[3];
+  const char* paths[3] = { path_base, path_ours, path_theirs };
+  int opened = 0, ret = 0;
+  while (opened < 3 && (ret = diff_file_open(&files[opened], paths[opened])) == 0)
+    opened++;
+  if (ret == 0 && (files[0].binary || files[1].binary || files[2].binary))
+    ret = DIFF_BINARY;
+  if (ret == 0)
+    ret = merge_files(&files[0], &files[1], &files[2], ours_label, theirs_label, out);
+
+  int saved_errno = errno;
+  for (int i = 0; i < opened; i++)
+    diff_file_close(&files[i]);
+  errno = saved_errno;
+  return ret;
+}
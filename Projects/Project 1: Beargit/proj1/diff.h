@@ -0,0 +1,60 @@
+/**
+ * Line diffs. Files are read once, in blocks, into a hash and an offset per
+ * line; the diff itself only compares hashes, and the lines printed are
+ * read back from the files by offset, so neither file is ever held in memory
+ * whole.
+ *
+ * Lines are matched with Myers' O(ND) algorithm in its linear-space form:
+ * the middle snake of the shortest edit script splits the problem in two,
+ * and each half is solved the same way after stripping its common prefix
+ * and suffix. Three-way merges (diff3) build on the diffs of both sides
+ * against their common base.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifndef DIFF_H
+#define DIFF_H
+
+// Lines of unchanged context around every change
+#define DIFF_CONTEXT 3
+
+typedef struct {
+  FILE* file;
+  uint64_t* hashes;
+  off_t* offsets;     // count + 1 entries; the last is the file size
+  int count;
+  int capacity;
+  int binary;         // has a NUL byte
+} diff_file;
+
+// Splits <path> into lines. A NULL <path> is an empty file. Returns 0, or -1
+// (with errno set) if it can't be read.
+int diff_file_open(diff_file* file, const char* path);
+void diff_file_close(diff_file* file);
+
+// Sets changed_a[i] for every line of <a> and changed_b[j] for every line of
+// <b> that is not part of a longest common subsequence of the two.
+void diff_lines(const uint64_t* a, int n, const uint64_t* b, int m,
+                char* changed_a, char* changed_b);
+
+// Prints the unified diff from <path_a> to <path_b> (either NULL for a file
+// that doesn't exist on that side) under the name <name>, preceded by its
+// header. Prints nothing if they are the same. Returns 0, or -1 (with errno
+// set) if one of them can't be read.
+int diff_print(const char* name, const char* path_a, const char* path_b, FILE* out);
+
+#define DIFF_BINARY (-2)
+
+// Writes the merge of the changes from <path_base> to <path_ours> and from
+// <path_base> to <path_theirs> (NULL for an empty file) to <out>. Where both
+// changed the same lines differently, both versions go in, between conflict
+// markers naming <ours_label> and <theirs_label>. Returns the number of
+// conflicts, DIFF_BINARY without writing anything if a file has a NUL
+// byte, or -1 (with errno set) if one can't be read.
+int diff_merge(const char* path_base, const char* path_ours, const char* path_theirs,
+               const char* ours_label, const char* theirs_label, FILE* out);
+
+#endif
@@ -0,0 +1,454 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ignore.h"
+#include "util.h"
+
+/* Compilation
+ *
+ * Every pattern becomes a piece of one NFA whose states each have at most
+ * one byte-set transition and two epsilon moves; the last state of a
+ * pattern accepts with the pattern's number. The subset construction then
+ * turns the NFA into the DFA, over classes of bytes rather than all 256 of
+ * them, and records for every DFA state the last pattern it accepts.
+ */
+
+typedef struct {
+  uint8_t on[32];     // bytes of the transition, a bitmap
+  int target;         // -1 if none
+  int eps[2];
+  int neps;
+  int accept;         // pattern number, -1 if none
+} nfa_state;
+
+typedef struct {
+  nfa_state* states;
+  int count;
+  int capacity;
+} nfa;
+
+static int nfa_add(nfa* n) {
+  if (n->count == n->capacity) {
+    n->capacity = n->capacity ? 2 * n->capacity : 64;
+    n->states = realloc(n->states, n->capacity * sizeof(nfa_state));
+    ASSERT_ERROR_MESSAGE(n->states != NULL, "out of memory");
+  }
+  nfa_state* state = &n->states[n->count];
+  memset(state, 0, sizeof(*state));
+  state->target = -1;
+  state->accept = -1;
+  return n->count++;
+}
+
+static int set_has(const uint8_t* set, int byte) {
+  return set[byte >> 3] & (1 << (byte & 7));
+}
+
+static void set_add(uint8_t* set, int byte) {
+  set[byte >> 3] |= 1 << (byte & 7);
+}
+
+// Every byte but '/'
+static void set_component(uint8_t* set) {
+  memset(set, 0xff, 32);
+  set[(int) '/' >> 3] &= ~(1 << ('/' & 7));
+}
+
+// The pieces below all continue from state <at>, which has no moves yet,
+// and return the state the rest of the pattern continues from.
+
+static int add_set(nfa* n, int at, const uint8_t* set) {
+  int next = nfa_add(n);
+  memcpy(n->states[at].on, set, 32);
+  n->states[at].target = next;
+  return next;
+}
+
+// Any number of bytes from <set>
+static int add_loop(nfa* n, int at, const uint8_t* set) {
+  int next = nfa_add(n);
+  memcpy(n->states[at].on, set, 32);
+  n->states[at].target = at;
+  n->states[at].eps[n->states[at].neps++] = next;
+  return next;
+}
+
+// Any number of leading directories: ([^/]* /)*
+static int add_dirs(nfa* n, int at) {
+  int next = nfa_add(n);
+  int name = nfa_add(n);
+  int slash = nfa_add(n);
+  n->states[at].eps[n->states[at].neps++] = next;
+  n->states[at].eps[n->states[at].neps++] = name;
+  set_component(n->states[name].on);
+  n->states[name].target = name;
+  n->states[name].eps[n->states[name].neps++] = slash;
+  set_add(n->states[slash].on, '/');
+  n->states[slash].target = at;
+  return next;
+}
+
+// Parses the class at <p> (after its '['). Returns the character after its
+// ']', or NULL if it isn't closed.
+static const char* parse_class(const char* p, uint8_t* set) {
+  int negate = *p == '!' || *p == '^';
+  if (negate)
+    p++;
+  memset(set, 0, 32);
+  int first = 1;
+  while (*p && (*p != ']' || first)) {
+    unsigned char lo = *p++, hi = lo;
+    if (*p == '-' && p[1] && p[1] != ']') {
+      hi = p[1];
+      p += 2;
+    }
+    for (int c = lo; c <= hi; c++)
+      set_add(set, c);
+    first = 0;
+  }
+  if (*p != ']')
+    return NULL;
+
+  if (negate) {
+    for (int i = 0; i < 32; i++)
+      set[i] = ~set[i];
+  }
+  set[(int) '/' >> 3] &= ~(1 << ('/' & 7));
+  return p + 1;
+}
+
+// Adds <pattern> (without '!' and a trailing '/') as pattern number <k>,
+// starting at state <at>. Returns -1 if it is malformed.
+static int add_pattern(nfa* n, int at, const char* pattern, int k) {
+  int anchored = strchr(pattern, '/') != NULL;
+  if (pattern[0] == '/')
+    pattern++;
+  if (!anchored)
+    at = add_dirs(n, at);
+
+  uint8_t set[32];
+  const char* p = pattern;
+  while (*p) {
+    if (p[0] == '*' && p[1] == '*' && (p == pattern || p[-1] == '/') && (p[2] == '/' || !p[2])) {
+      if (p[2] == '/') {
+        at = add_dirs(n, at);
+        p += 3;
+      } else {
+        memset(set, 0xff, 32);
+        at = add_loop(n, at, set);
+        p += 2;
+      }
+    } else if (*p == '*') {
+      set_component(set);
+      at = add_loop(n, at, set);
+      p++;
+    } else if (*p == '?') {
+      set_component(set);
+      at = add_set(n, at, set);
+      p++;
+    } else if (*p == '[') {
+      p = parse_class(p + 1, set);
+      if (p == NULL)
+        return -1;
+      at = add_set(n, at, set);
+    } else {
+      if (*p == '\\' && p[1])
+        p++;
+      memset(set, 0, 32);
+      set_add(set, (unsigned char) *p++);
+      at = add_set(n, at, set);
+    }
+  }
+  n->states[at].accept = k;
+  return 0;
+}
+
+/* Subset construction */
+
+typedef struct {
+  int* members;     // sorted NFA states
+  int count;
+} nfa_set;
+
+typedef struct {
+  const nfa* n;
+  nfa_set* sets;    // per DFA state
+  int nsets;
+  int capacity;
+  int* buckets;     // DFA state + 1, 0 for empty
+  int nbuckets;
+  char* mark;       // scratch, per NFA state
+  int* stack;
+} subset_builder;
+
+static uint32_t set_hash(const int* members, int count) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < count; i++)
+    hash = (hash ^ (uint32_t) members[i]) * 16777619u;
+  return hash;
+}
+
+static int compare_ints(const void* a, const void* b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+static void builder_rehash(subset_builder* b) {
+  free(b->buckets);
+  b->nbuckets = b->nbuckets ? 2 * b->nbuckets : 64;
+  b->buckets = calloc(b->nbuckets, sizeof(int));
+  ASSERT_ERROR_MESSAGE(b->buckets != NULL, "out of memory");
+  for (int s = 0; s < b->nsets; s++) {
+    uint32_t i = set_hash(b->sets[s].members, b->sets[s].count) & (b->nbuckets - 1);
+    while (b->buckets[i])
+      i = (i + 1) & (b->nbuckets - 1);
+    b->buckets[i] = s + 1;
+  }
+}
+
+// The DFA state for the epsilon closure of the <count> NFA states in
+// <members> (which it may reorder and extend; room for every NFA state).
+static int builder_state(subset_builder* b, int* members, int count) {
+  int depth = 0;
+  for (int i = 0; i < count; i++) {
+    b->mark[members[i]] = 1;
+    b->stack[depth++] = members[i];
+  }
+  while (depth > 0) {
+    const nfa_state* state = &b->n->states[b->stack[--depth]];
+    for (int e = 0; e < state->neps; e++) {
+      if (!b->mark[state->eps[e]]) {
+        b->mark[state->eps[e]] = 1;
+        b->stack[depth++] = state->eps[e];
+        members[count++] = state->eps[e];
+      }
+    }
+  }
+  for (int i = 0; i < count; i++)
+    b->mark[members[i]] = 0;
+  qsort(members, count, sizeof(int), compare_ints);
+
+  uint32_t i = set_hash(members, count) & (b->nbuckets - 1);
+  for (; b->buckets[i]; i = (i + 1) & (b->nbuckets - 1)) {
+    const nfa_set* set = &b->sets[b->buckets[i] - 1];
+    if (set->count == count && memcmp(set->members, members, count * sizeof(int)) == 0)
+      return b->buckets[i] - 1;
+  }
+
+  if (b->nsets == b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : 64;
+    b->sets = realloc(b->sets, b->capacity * sizeof(nfa_set));
+    ASSERT_ERROR_MESSAGE(b->sets != NULL, "out of memory");
+  }
+  nfa_set* set = &b->sets[b->nsets];
+  set->members = malloc((count + 1) * sizeof(int));
+  ASSERT_ERROR_MESSAGE(set->members != NULL, "out of memory");
+  memcpy(set->members, members, count * sizeof(int));
+  set->count = count;
+  b->buckets[i] = ++b->nsets;
+  if (2 * b->nsets > b->nbuckets)
+    builder_rehash(b);
+  return b->nsets - 1;
+}
+
+// Splits the byte classes so no transition of <n> tells two bytes of one
+// class apart.
+static void build_classes(ignore_rules* rules, const nfa* n) {
+  memset(rules->classes, 0, sizeof(rules->classes));
+  rules->nclasses = 1;
+  int split[2 * 256];
+  for (int s = 0; s < n->count; s++) {
+    if (n->states[s].target < 0)
+      continue;
+    memset(split, -1, 2 * rules->nclasses * sizeof(int));
+    int nclasses = 0;
+    for (int c = 0; c < 256; c++) {
+      int key = 2 * rules->classes[c] + (set_has(n->states[s].on, c) ? 1 : 0);
+      if (split[key] < 0)
+        split[key] = nclasses++;
+      rules->classes[c] = split[key];
+    }
+    rules->nclasses = nclasses;
+  }
+}
+
+static void build_dfa(ignore_rules* rules, const nfa* n, const int* starts, int nstarts,
+                      const char* dir_only) {
+  build_classes(rules, n);
+
+  subset_builder b;
+  memset(&b, 0, sizeof(b));
+  b.n = n;
+  b.mark = calloc(n->count + 1, 1);
+  b.stack = malloc((n->count + 1) * sizeof(int));
+  int* members = malloc((n->count + 1) * sizeof(int));
+  ASSERT_ERROR_MESSAGE(b.mark != NULL && b.stack != NULL && members != NULL, "out of memory");
+  builder_rehash(&b);
+
+  // State 0 is the empty set: nothing matches from there on.
+  builder_state(&b, members, 0);
+  memcpy(members, starts, nstarts * sizeof(int));
+  rules->start = builder_state(&b, members, nstarts);
+
+  int capacity = 0;
+  rules->next = NULL;
+  for (int s = 0; s < b.nsets; s++) {
+    if (b.nsets > capacity) {
+      capacity = 2 * b.nsets;
+      rules->next = realloc(rules->next, (size_t) capacity * rules->nclasses * sizeof(int32_t));
+      ASSERT_ERROR_MESSAGE(rules->next != NULL, "out of memory");
+    }
+    for (int c = 0; c < rules->nclasses; c++) {
+      int byte = 0;
+      while (rules->classes[byte] != c)
+        byte++;
+      int count = 0;
+      for (int i = 0; i < b.sets[s].count; i++) {
+        const nfa_state* state = &n->states[b.sets[s].members[i]];
+        if (state->target >= 0 && set_has(state->on, byte) && !b.mark[state->target]) {
+          b.mark[state->target] = 1;
+          members[count++] = state->target;
+        }
+      }
+      for (int i = 0; i < count; i++)
+        b.mark[members[i]] = 0;
+      // Can add states, and so move b.sets.
+      int target = builder_state(&b, members, count);
+      rules->next[(size_t) s * rules->nclasses + c] = target;
+    }
+  }
+  rules->nstates = b.nsets;
+
+  rules->accept = malloc((2 * rules->nstates + 1) * sizeof(int32_t));
+  ASSERT_ERROR_MESSAGE(rules->accept != NULL, "out of memory");
+  for (int s = 0; s < b.nsets; s++) {
+    int file = -1, dir = -1;
+    for (int i = 0; i < b.sets[s].count; i++) {
+      int k = n->states[b.sets[s].members[i]].accept;
+      if (k > dir)
+        dir = k;
+      if (k > file && !dir_only[k])
+        file = k;
+    }
+    rules->accept[2 * s] = file;
+    rules->accept[2 * s + 1] = dir;
+    free(b.sets[s].members);
+  }
+
+  free(b.sets);
+  free(b.buckets);
+  free(b.mark);
+  free(b.stack);
+  free(members);
+}
+
+int ignore_compile(ignore_rules* rules, const char* text) {
+  memset(rules, 0, sizeof(*rules));
+  nfa n = { 0 };
+  int npatterns = 0, capacity = 16;
+  int* starts = malloc(capacity * sizeof(int));
+  char* dir_only = malloc(capacity);
+  rules->negated = malloc(capacity);
+  ASSERT_ERROR_MESSAGE(starts != NULL && dir_only != NULL && rules->negated != NULL, "out of memory");
+
+  int bad_line = 0;
+  char line[1024];
+  for (int lineno = 1; *text; lineno++) {
+    size_t len = strcspn(text, "\n");
+    snprintf(line, sizeof(line), "%.*s", (int) len, text);
+    text += len + (text[len] == '\n');
+
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' '))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#')
+      continue;
+
+    char* pattern = line;
+    int negated = pattern[0] == '!';
+    if (negated)
+      pattern++;
+    int is_dir_only = len > 1 && line[len - 1] == '/';
+    if (is_dir_only)
+      line[--len] = '\0';
+    if (!*pattern)
+      continue;
+
+    if (npatterns == capacity) {
+      capacity *= 2;
+      starts = realloc(starts, capacity * sizeof(int));
+      dir_only = realloc(dir_only, capacity);
+      rules->negated = realloc(rules->negated, capacity);
+      ASSERT_ERROR_MESSAGE(starts != NULL && dir_only != NULL && rules->negated != NULL, "out of memory");
+    }
+    int count = n.count;
+    starts[npatterns] = nfa_add(&n);
+    if (add_pattern(&n, starts[npatterns], pattern, npatterns) != 0) {
+      n.count = count;
+      if (!bad_line)
+        bad_line = lineno;
+      continue;
+    }
+    dir_only[npatterns] = is_dir_only;
+    rules->negated[npatterns] = negated;
+    npatterns++;
+  }
+
+  build_dfa(rules, &n, starts, npatterns, dir_only);
+  free(n.states);
+  free(starts);
+  free(dir_only);
+  return bad_line;
+}
+
+void ignore_read(ignore_rules* rules) {
+  FILE* f = fopen(IGNORE_FILE, "r");
+  if (f == NULL) {
+    ASSERT_ERROR_MESSAGE(errno == ENOENT, "couldn't read " IGNORE_FILE);
+    ignore_compile(rules, "");
+    return;
+  }
+
+  size_t size = 0, capacity = 4096;
+  char* text = malloc(capacity);
+  ASSERT_ERROR_MESSAGE(text != NULL, "out of memory");
+  size_t n;
+  while ((n = fread(text + size, 1, capacity - size - 1, f)) > 0) {
+    size += n;
+    if (capacity - size == 1) {
+      capacity *= 2;
+      text = realloc(text, capacity);
+      ASSERT_ERROR_MESSAGE(text != NULL, "out of memory");
+    }
+  }
+  fclose(f);
+  text[size] = '\0';
+
+  int bad_line = ignore_compile(rules, text);
+  if (bad_line)
+    fprintf(stderr, "ERROR: Skipping malformed pattern on line %d of " IGNORE_FILE "\n", bad_line);
+  free(text);
+}
+
+void ignore_free(ignore_rules* rules) {
+  free(rules->next);
+  free(rules->accept);
+  free(rules->negated);
+  memset(rules, 0, sizeof(*rules));
+}
+
+int ignore_walk(const ignore_rules* rules, int state, const char* text) {
+  for (const unsigned char* p = (const unsigned char*) text; *p && state != 0; p++)
+    state = rules->next[(size_t) state * rules->nclasses + rules->classes[*p]];
+  return state;
+}
+
+int ignore_state_ignored(const ignore_rules* rules, int state, int is_dir) {
+  int k = rules->accept[2 * state + (is_dir ? 1 : 0)];
+  return k >= 0 && !rules->negated[k];
+}
+
+int ignore_path(const ignore_rules* rules, const char* path, int is_dir) {
+  return ignore_state_ignored(rules, ignore_walk(rules, rules->start, path), is_dir);
+}
@@ -0,0 +1,60 @@
+/**
+ * Ignore rules (.beargitignore): glob patterns, one per line, naming files
+ * that directory scans (beargit add <dir>, beargit add --all) leave alone.
+ * Blank lines and lines starting with '#' don't count.
+ *
+ *   *, ?, [a-z], [!a-z]   match within one path component
+ *   **                    matches across components: "**" + "/" matches any
+ *                         number of leading directories, "/" + "**" everything
+ *                         inside a directory
+ *   name                  a pattern without '/' matches at any depth
+ *   dir/name, /name       a pattern with '/' matches from the top
+ *   name/                 only matches directories
+ *   !pattern              takes a path matched by an earlier pattern back in
+ *
+ * The last pattern matching a path decides. An ignored directory is not
+ * scanned at all, so nothing below it can be taken back in.
+ *
+ * All patterns are compiled into a single DFA over path bytes: matching a
+ * path is one table lookup per byte, whatever the number of patterns. Since
+ * the DFA state after "dir/" is all that matters about a directory, scans
+ * carry it into the directory and only feed the names below it.
+ */
+
+#include <stdint.h>
+
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#define IGNORE_FILE ".beargitignore"
+
+typedef struct {
+  uint8_t classes[256];   // bytes that no pattern tells apart share a class
+  int nclasses;
+  int32_t* next;          // next[state * nclasses + class]; state 0 is dead
+  int32_t* accept;        // last pattern matching at a state, -1 for none:
+                          // accept[2 * state] for files, accept[2 * state + 1]
+                          // for directories
+  char* negated;          // per pattern
+  int nstates;
+  int start;
+} ignore_rules;
+
+// Compiles the patterns in <text>, one per line. Returns 0, or the line of
+// the first malformed pattern (an unclosed '['); the others still count.
+int ignore_compile(ignore_rules* rules, const char* text);
+
+// Compiles .beargitignore in the current directory; no file means no rules.
+void ignore_read(ignore_rules* rules);
+void ignore_free(ignore_rules* rules);
+
+// The state after feeding <text> to the DFA in <state>.
+int ignore_walk(const ignore_rules* rules, int state, const char* text);
+
+// Whether the path that led to <state> is ignored.
+int ignore_state_ignored(const ignore_rules* rules, int state, int is_dir);
+
+// Whether <path>, relative to the top of the working directory, is ignored.
+int ignore_path(const ignore_rules* rules, const char* path, int is_dir);
+
+#endif
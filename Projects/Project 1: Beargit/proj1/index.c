@@ -0,0 +1,824 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "index.h"
+#include "pack.h"
+#include "util.h"
+
+/* Index file format (version 3)
+ *
+ *   header        index_header
+ *   directory     nbuckets hash slots { path hash, record offset }, where
+ *                 offset 0 marks an empty slot and 1 a removed entry
+ *   sorted table  nsorted record offsets, ordered by path
+ *   records       an index_record followed by the NUL-terminated path (padded
+ *                 to 8 bytes) per tracked file, in the order files were added
+ *
+ * Adding a file appends its record at records_end and fills one slot;
+ * removing a file flags its record and empties its slot, and refreshing stat
+ * data overwrites the record in place. The whole file is only rewritten once
+ * the directory is half full or half the records are removed, which keeps
+ * every single add/rm O(1). Records appended since the last rewrite are not
+ * in the sorted table; they start at sorted_end. Removing a directory finds
+ * its files with a binary search for the range of the sorted table under
+ * "<dir>/", plus a pass over the appended records.
+ *
+ * Older index files are text: either just one filename per line, or a
+ * "BEARGIT-INDEX 2" header followed by lines of
+ * "<blob-id> <mtime-sec> <mtime-nsec> <size> <inode> <filename>".
+ * They are read as-is and converted on the next write.
+ *
+ * A commit manifest (.beargit/<id>/.manifest) has one "<blob-id> <filename>"
+ * line per file. Commits made before the object store existed have no
+ * manifest, only a plain .index and full copies of their files. Repacked
+ * commits have no directory at all; their manifest is in the pack.
+ */
+
+#define INDEX_MAGIC "BIDX"
+#define INDEX_VERSION 3
+#define INDEX_MIN_BUCKETS 64
+
+#define SLOT_EMPTY 0
+#define SLOT_REMOVED 1
+
+#define RECORD_REMOVED 0x1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t nrecords;        // records in the file, including removed ones
+  uint32_t nlive;
+  uint32_t nbuckets;        // always a power of two
+  uint32_t nsorted;
+  uint32_t records_start;
+  uint32_t records_end;
+  uint64_t generation;      // incremented on every write
+  uint32_t sorted_end;      // end of the records in the sorted table, 0 if unknown
+  char reserved[20];
+} index_header;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t offset;
+} index_slot;
+
+typedef struct {
+  uint32_t flags;
+  uint32_t path_len;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint64_t ino;
+  char blob_id[BLOB_ID_BYTES];  // all '0' if the file was never hashed
+} index_record;
+
+typedef struct {
+  int fd;
+  char* base;
+  size_t size;
+  index_header* header;
+  index_slot* slots;
+} index_map;
+
+static const char* index_v2_header = "BEARGIT-INDEX 2";
+static const char* null_blob_id = "0000000000000000000000000000000000000000";
+
+static char* copy_string(const char* str) {
+  char* copy = malloc(strlen(str) + 1);
+  ASSERT_ERROR_MESSAGE(copy != NULL, "out of memory");
+  strcpy(copy, str);
+  return copy;
+}
+
+// FNV-1a
+static uint32_t path_hash(const char* path) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char* p = (const unsigned char*) path; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t record_size(size_t path_len) {
+  return (sizeof(index_record) + path_len + 1 + 7) & ~7u;
+}
+
+static uint32_t buckets_for(int count) {
+  uint32_t nbuckets = INDEX_MIN_BUCKETS;
+  while (nbuckets < 4 * (uint32_t) count)
+    nbuckets *= 2;
+  return nbuckets;
+}
+
+/* In-memory index */
+
+static void index_rehash(beargit_index* index) {
+  free(index->buckets);
+  index->nbuckets = INDEX_MIN_BUCKETS;
+  while (index->nbuckets < 2 * index->count)
+    index->nbuckets *= 2;
+  index->buckets = calloc(index->nbuckets, sizeof(int));
+  ASSERT_ERROR_MESSAGE(index->buckets != NULL, "out of memory");
+
+  for (int i = 0; i < index->count; i++) {
+    uint32_t b = path_hash(index->entries[i].path) & (index->nbuckets - 1);
+    while (index->buckets[b])
+      b = (b + 1) & (index->nbuckets - 1);
+    index->buckets[b] = i + 1;
+  }
+}
+
+index_entry* index_add(beargit_index* index, const char* path) {
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity ? 2 * index->capacity : 64;
+    index->entries = realloc(index->entries, index->capacity * sizeof(index_entry));
+    ASSERT_ERROR_MESSAGE(index->entries != NULL, "out of memory");
+  }
+
+  index_entry* entry = &index->entries[index->count++];
+  memset(entry, 0, sizeof(*entry));
+  entry->path = copy_string(path);
+  index->rewrite = 1;
+
+  if (index->buckets) {
+    if (2 * index->count > index->nbuckets) {
+      free(index->buckets);
+      index->buckets = NULL;
+    } else {
+      uint32_t b = path_hash(path) & (index->nbuckets - 1);
+      while (index->buckets[b])
+        b = (b + 1) & (index->nbuckets - 1);
+      index->buckets[b] = index->count;
+    }
+  }
+  return entry;
+}
+
+void index_remove(beargit_index* index, int pos) {
+  free(index->entries[pos].path);
+  memmove(&index->entries[pos], &index->entries[pos+1],
+          (index->count - pos - 1) * sizeof(index_entry));
+  index->count--;
+  index->rewrite = 1;
+
+  free(index->buckets);
+  index->buckets = NULL;
+}
+
+// Removes every entry i with marked[i] set, in a single pass.
+void index_remove_marked(beargit_index* index, const char* marked) {
+  int kept = 0;
+  for (int i = 0; i < index->count; i++) {
+    if (marked[i]) {
+      free(index->entries[i].path);
+    } else {
+      index->entries[kept++] = index->entries[i];
+    }
+  }
+
+  if (kept != index->count) {
+    index->count = kept;
+    index->rewrite = 1;
+    free(index->buckets);
+    index->buckets = NULL;
+  }
+}
+
+int index_find(beargit_index* index, const char* path) {
+  if (!index->buckets)
+    index_rehash(index);
+
+  uint32_t b = path_hash(path) & (index->nbuckets - 1);
+  while (index->buckets[b]) {
+    int pos = index->buckets[b] - 1;
+    if (strcmp(index->entries[pos].path, path) == 0)
+      return pos;
+    b = (b + 1) & (index->nbuckets - 1);
+  }
+  return -1;
+}
+
+void index_free(beargit_index* index) {
+  for (int i = 0; i < index->count; i++)
+    free(index->entries[i].path);
+  free(index->entries);
+  free(index->buckets);
+  memset(index, 0, sizeof(*index));
+}
+
+/* Binary index file access */
+
+// Maps .beargit/.index. Returns 1 if it is a binary index, 0 if it is a
+// (possibly empty) text index from an older version.
+static int index_map_open(index_map* map, int writable) {
+  memset(map, 0, sizeof(*map));
+  map->fd = open(".beargit/.index", writable ? O_RDWR : O_RDONLY);
+  ASSERT_ERROR_MESSAGE(map->fd >= 0, "couldn't open .beargit/.index");
+
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(fstat(map->fd, &s) == 0, "couldn't stat .beargit/.index");
+  if (s.st_size < (off_t) sizeof(index_header))
+    return 0;
+
+  map->size = s.st_size;
+  map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, map->fd, 0);
+  ASSERT_ERROR_MESSAGE(map->base != MAP_FAILED, "couldn't map .beargit/.index");
+
+  map->header = (index_header*) map->base;
+  if (memcmp(map->header->magic, INDEX_MAGIC, 4) != 0)
+    return 0;
+  ASSERT_ERROR_MESSAGE(map->header->version == INDEX_VERSION, "unsupported index version");
+  ASSERT_ERROR_MESSAGE(map->header->records_end <= map->size, "truncated index");
+
+  map->slots = (index_slot*) (map->base + sizeof(index_header));
+  return 1;
+}
+
+static void index_map_close(index_map* map) {
+  if (map->base && map->base != MAP_FAILED)
+    munmap(map->base, map->size);
+  close(map->fd);
+}
+
+static const char* record_path(const index_map* map, uint32_t offset) {
+  return map->base + offset + sizeof(index_record);
+}
+
+// Returns the slot holding <path>, or -1. *insert_at is set to the first
+// slot a new entry for <path> could use.
+static int index_map_lookup(const index_map* map, const char* path, uint32_t hash,
+                            int* insert_at) {
+  uint32_t mask = map->header->nbuckets - 1;
+  uint32_t b = hash & mask;
+  *insert_at = -1;
+
+  for (uint32_t probes = 0; probes < map->header->nbuckets; probes++) {
+    const index_slot* slot = &map->slots[b];
+    if (slot->offset == SLOT_EMPTY) {
+      if (*insert_at < 0)
+        *insert_at = b;
+      return -1;
+    }
+    if (slot->offset == SLOT_REMOVED) {
+      if (*insert_at < 0)
+        *insert_at = b;
+    } else if (slot->hash == hash && slot->offset < map->header->records_end &&
+               strcmp(record_path(map, slot->offset), path) == 0) {
+      return b;
+    }
+    b = (b + 1) & mask;
+  }
+  return -1;
+}
+
+static void pwrite_all(int fd, const void* buf, size_t len, off_t offset) {
+  ssize_t ret = pwrite(fd, buf, len, offset);
+  ASSERT_ERROR_MESSAGE(ret == (ssize_t) len, "writing .beargit/.index failed");
+}
+
+static void fill_record(index_record* record, const index_entry* entry) {
+  memset(record, 0, sizeof(*record));
+  record->path_len = strlen(entry->path);
+  record->mtime_sec = entry->mtime_sec;
+  record->mtime_nsec = entry->mtime_nsec;
+  record->size = entry->size;
+  record->ino = entry->ino;
+  memcpy(record->blob_id, entry->blob_id[0] ? entry->blob_id : null_blob_id, BLOB_ID_BYTES);
+}
+
+static void parse_text_index_line(beargit_index* index, char* line, int has_stat) {
+  if (!has_stat) {
+    index_add(index, line);
+    return;
+  }
+
+  char blob_id[BLOB_ID_SIZE];
+  int64_t mtime_sec, mtime_nsec, size;
+  uint64_t ino;
+  int path_start = 0;
+  int fields = sscanf(line, "%40s %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNu64 "%n",
+                      blob_id, &mtime_sec, &mtime_nsec, &size, &ino, &path_start);
+  ASSERT_ERROR_MESSAGE(fields == 5 && line[path_start] == ' ', "malformed index entry");
+
+  index_entry* entry = index_add(index, line + path_start + 1);
+  if (strcmp(blob_id, null_blob_id) != 0)
+    strcpy(entry->blob_id, blob_id);
+  entry->mtime_sec = mtime_sec;
+  entry->mtime_nsec = mtime_nsec;
+  entry->size = size;
+  entry->ino = ino;
+}
+
+static void index_read_text(beargit_index* index) {
+  FILE* findex = fopen(".beargit/.index", "r");
+  ASSERT_ERROR_MESSAGE(findex != NULL, "couldn't open .beargit/.index");
+
+  char line[BLOB_ID_SIZE + FILENAME_SIZE + 128];
+  int first = 1, has_stat = 0;
+  while(fgets(line, sizeof(line), findex)) {
+    strtok(line, "\n");
+    if (first && strcmp(line, index_v2_header) == 0) {
+      has_stat = 1;
+    } else {
+      parse_text_index_line(index, line, has_stat);
+    }
+    first = 0;
+  }
+  fclose(findex);
+}
+
+void index_read(beargit_index* index) {
+  memset(index, 0, sizeof(*index));
+
+  index_map map;
+  int binary = index_map_open(&map, 0);
+
+  struct stat s;
+  if (fstat(map.fd, &s) == 0) {
+    index->mtime_sec = s.st_mtim.tv_sec;
+    index->mtime_nsec = s.st_mtim.tv_nsec;
+  }
+
+  if (!binary) {
+    index_map_close(&map);
+    index_read_text(index);
+    return;
+  }
+
+  uint32_t offset = map.header->records_start;
+  while (offset < map.header->records_end) {
+    const index_record* record = (const index_record*) (map.base + offset);
+    if (!(record->flags & RECORD_REMOVED)) {
+      index_entry* entry = index_add(index, record_path(&map, offset));
+      if (memcmp(record->blob_id, null_blob_id, BLOB_ID_BYTES) != 0) {
+        memcpy(entry->blob_id, record->blob_id, BLOB_ID_BYTES);
+        entry->blob_id[BLOB_ID_BYTES] = '\0';
+      }
+      entry->mtime_sec = record->mtime_sec;
+      entry->mtime_nsec = record->mtime_nsec;
+      entry->size = record->size;
+      entry->ino = record->ino;
+      entry->offset = offset;
+    }
+    offset += record_size(record->path_len);
+  }
+
+  index->generation = map.header->generation;
+  index->rewrite = 0;
+  index_map_close(&map);
+}
+
+uint64_t index_read_generation(void) {
+  int fd = open(".beargit/.index", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  index_header header;
+  ssize_t n = pread(fd, &header, sizeof(header), 0);
+  close(fd);
+  if (n != sizeof(header) || memcmp(header.magic, INDEX_MAGIC, 4) != 0)
+    return 0;
+  return header.generation;
+}
+
+static const beargit_index* sort_index;
+
+static int compare_entry_paths(const void* a, const void* b) {
+  return strcmp(sort_index->entries[*(const int*) a].path,
+                sort_index->entries[*(const int*) b].path);
+}
+
+// Writes the whole index to .beargit/.newindex and moves it into place.
+static void index_rewrite(beargit_index* index) {
+  index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, 4);
+  header.version = INDEX_VERSION;
+  header.nrecords = index->count;
+  header.nlive = index->count;
+  header.nbuckets = buckets_for(index->count);
+  header.nsorted = index->count;
+  header.records_start = sizeof(index_header) + header.nbuckets * sizeof(index_slot) +
+                         header.nsorted * sizeof(uint32_t);
+  header.generation = index->generation + 1;
+
+  uint32_t offset = header.records_start;
+  for (int i = 0; i < index->count; i++) {
+    index->entries[i].offset = offset;
+    offset += record_size(strlen(index->entries[i].path));
+  }
+  header.records_end = offset;
+  header.sorted_end = offset;
+
+  char* buffer = calloc(1, header.records_end);
+  ASSERT_ERROR_MESSAGE(buffer != NULL, "out of memory");
+  memcpy(buffer, &header, sizeof(header));
+
+  index_slot* slots = (index_slot*) (buffer + sizeof(index_header));
+  int* order = malloc((index->count + 1) * sizeof(int));
+  ASSERT_ERROR_MESSAGE(order != NULL, "out of memory");
+
+  for (int i = 0; i < index->count; i++) {
+    const index_entry* entry = &index->entries[i];
+
+    uint32_t hash = path_hash(entry->path);
+    uint32_t b = hash & (header.nbuckets - 1);
+    while (slots[b].offset != SLOT_EMPTY)
+      b = (b + 1) & (header.nbuckets - 1);
+    slots[b].hash = hash;
+    slots[b].offset = entry->offset;
+
+    index_record record;
+    fill_record(&record, entry);
+    memcpy(buffer + entry->offset, &record, sizeof(record));
+    strcpy(buffer + entry->offset + sizeof(record), entry->path);
+
+    order[i] = i;
+  }
+
+  sort_index = index;
+  qsort(order, index->count, sizeof(int), compare_entry_paths);
+  uint32_t* sorted = (uint32_t*) (slots + header.nbuckets);
+  for (int i = 0; i < index->count; i++)
+    sorted[i] = index->entries[order[i]].offset;
+  free(order);
+
+  FILE* fnewindex = fopen(".beargit/.newindex", "w");
+  ASSERT_ERROR_MESSAGE(fnewindex != NULL, "couldn't create .beargit/.newindex");
+  ASSERT_ERROR_MESSAGE(fwrite(buffer, 1, header.records_end, fnewindex) == header.records_end,
+                       "writing .beargit/.newindex failed");
+  fclose(fnewindex);
+  free(buffer);
+
+  fs_mv(".beargit/.newindex", ".beargit/.index");
+
+  for (int i = 0; i < index->count; i++)
+    index->entries[i].dirty = 0;
+  index->generation = header.generation;
+  index->rewrite = 0;
+}
+
+void index_write(beargit_index* index) {
+  if (index->rewrite || !index->generation) {
+    index_rewrite(index);
+    return;
+  }
+
+  // Nothing was added or removed: only overwrite the records that changed,
+  // unless the file was written since it was read, which may have moved
+  // them.
+  index_map map;
+  int binary = index_map_open(&map, 1);
+  if (!binary || map.header->generation != index->generation) {
+    index_map_close(&map);
+    index_rewrite(index);
+    return;
+  }
+
+  int changed = 0;
+  for (int i = 0; i < index->count; i++) {
+    index_entry* entry = &index->entries[i];
+    if (!entry->dirty)
+      continue;
+
+    index_record record;
+    fill_record(&record, entry);
+    pwrite_all(map.fd, &record, sizeof(record), entry->offset);
+    entry->dirty = 0;
+    changed = 1;
+  }
+
+  if (changed) {
+    index_header header = *map.header;
+    header.generation++;
+    pwrite_all(map.fd, &header, sizeof(header), 0);
+    index->generation = header.generation;
+  }
+  index_map_close(&map);
+}
+
+int index_add_path(const char* path) {
+  index_map map;
+  int binary = index_map_open(&map, 1);
+
+  uint32_t hash = path_hash(path);
+  int insert_at = -1;
+  if (binary && index_map_lookup(&map, path, hash, &insert_at) >= 0) {
+    index_map_close(&map);
+    return 1;
+  }
+
+  index_entry new_entry;
+  memset(&new_entry, 0, sizeof(new_entry));
+  new_entry.path = (char*) path;
+  struct stat s;
+  int has_stat = (stat(path, &s) == 0);
+  if (has_stat)
+    index_entry_set_stat(&new_entry, &s);
+
+  // Text indexes get converted, and a directory that would become more than
+  // half full gets doubled, by rewriting the whole file.
+  if (!binary || insert_at < 0 || 2 * (map.header->nrecords + 1) > map.header->nbuckets) {
+    index_map_close(&map);
+
+    beargit_index index;
+    index_read(&index);
+    if (index_find(&index, path) >= 0) {
+      index_free(&index);
+      return 1;
+    }
+    index_entry* entry = index_add(&index, path);
+    if (has_stat)
+      index_entry_set_stat(entry, &s);
+    index_write(&index);
+    index_free(&index);
+    return 0;
+  }
+
+  index_header header = *map.header;
+  uint32_t offset = header.records_end;
+  uint32_t size = record_size(strlen(path));
+
+  char* buffer = calloc(1, size);
+  ASSERT_ERROR_MESSAGE(buffer != NULL, "out of memory");
+  fill_record((index_record*) buffer, &new_entry);
+  strcpy(buffer + sizeof(index_record), path);
+  pwrite_all(map.fd, buffer, size, offset);
+  free(buffer);
+
+  index_slot slot = { hash, offset };
+  pwrite_all(map.fd, &slot, sizeof(slot), sizeof(index_header) + insert_at * sizeof(index_slot));
+
+  header.nrecords++;
+  header.nlive++;
+  header.records_end += size;
+  header.generation++;
+  pwrite_all(map.fd, &header, sizeof(header), 0);
+
+  index_map_close(&map);
+  return 0;
+}
+
+// Flags the record that slot <slot_pos> points to removed and empties the
+// slot. index_map_finish_removal then updates the header.
+static void index_map_remove_slot(index_map* map, int slot_pos) {
+  index_slot slot = map->slots[slot_pos];
+
+  uint32_t flags = ((const index_record*) (map->base + slot.offset))->flags | RECORD_REMOVED;
+  pwrite_all(map->fd, &flags, sizeof(flags), slot.offset + offsetof(index_record, flags));
+
+  slot.offset = SLOT_REMOVED;
+  pwrite_all(map->fd, &slot, sizeof(slot), sizeof(index_header) + slot_pos * sizeof(index_slot));
+}
+
+// Removes the record at <offset> unless it is removed already. Returns the
+// number of records removed.
+static int index_map_remove_record(index_map* map, uint32_t offset) {
+  if (((const index_record*) (map->base + offset))->flags & RECORD_REMOVED)
+    return 0;
+  const char* path = record_path(map, offset);
+  int insert_at;
+  int slot_pos = index_map_lookup(map, path, path_hash(path), &insert_at);
+  ASSERT_ERROR_MESSAGE(slot_pos >= 0 && map->slots[slot_pos].offset == offset,
+                       "corrupt index directory");
+  index_map_remove_slot(map, slot_pos);
+  return 1;
+}
+
+// Records <removed> removals in the header and closes <map>, compacting the
+// file once most of it is removed records.
+static void index_map_finish_removal(index_map* map, int removed) {
+  index_header header = *map->header;
+  if (removed) {
+    header.nlive -= removed;
+    header.generation++;
+    pwrite_all(map->fd, &header, sizeof(header), 0);
+  }
+  index_map_close(map);
+
+  if (removed && 2 * header.nlive < header.nrecords && header.nrecords > INDEX_MIN_BUCKETS) {
+    beargit_index index;
+    index_read(&index);
+    index.rewrite = 1;
+    index_write(&index);
+    index_free(&index);
+  }
+}
+
+int index_remove_path(const char* path) {
+  index_map map;
+  int binary = index_map_open(&map, 1);
+
+  if (!binary) {
+    index_map_close(&map);
+
+    beargit_index index;
+    index_read(&index);
+    int pos = index_find(&index, path);
+    if (pos >= 0) {
+      index_remove(&index, pos);
+      index_write(&index);
+    }
+    index_free(&index);
+    return pos < 0;
+  }
+
+  int insert_at;
+  int slot_pos = index_map_lookup(&map, path, path_hash(path), &insert_at);
+  if (slot_pos < 0) {
+    index_map_close(&map);
+    return 1;
+  }
+
+  index_map_remove_slot(&map, slot_pos);
+  index_map_finish_removal(&map, 1);
+  return 0;
+}
+
+int index_remove_prefix(const char* prefix) {
+  size_t prefix_len = strlen(prefix);
+  index_map map;
+  int binary = index_map_open(&map, 1);
+
+  if (!binary) {
+    index_map_close(&map);
+
+    beargit_index index;
+    index_read(&index);
+    char* marked = calloc(index.count + 1, 1);
+    ASSERT_ERROR_MESSAGE(marked != NULL, "out of memory");
+    int removed = 0;
+    for (int i = 0; i < index.count; i++) {
+      if (strncmp(index.entries[i].path, prefix, prefix_len) == 0) {
+        marked[i] = 1;
+        removed++;
+      }
+    }
+    if (removed) {
+      index_remove_marked(&index, marked);
+      index_write(&index);
+    }
+    free(marked);
+    index_free(&index);
+    return removed;
+  }
+
+  // The range of the sorted table under <prefix>, then the records appended
+  // since it was written.
+  const uint32_t* sorted = (const uint32_t*) (map.slots + map.header->nbuckets);
+  uint32_t lo = 0, hi = map.header->nsorted;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strcmp(record_path(&map, sorted[mid]), prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int removed = 0;
+  for (uint32_t i = lo; i < map.header->nsorted; i++) {
+    if (strncmp(record_path(&map, sorted[i]), prefix, prefix_len) != 0)
+      break;
+    removed += index_map_remove_record(&map, sorted[i]);
+  }
+
+  uint32_t offset = map.header->sorted_end ? map.header->sorted_end : map.header->records_start;
+  while (offset < map.header->records_end) {
+    if (strncmp(record_path(&map, offset), prefix, prefix_len) == 0)
+      removed += index_map_remove_record(&map, offset);
+    offset += record_size(((const index_record*) (map.base + offset))->path_len);
+  }
+
+  index_map_finish_removal(&map, removed);
+  return removed;
+}
+
+void index_entry_set_stat(index_entry* entry, const struct stat* s) {
+  entry->dirty = 1;
+  entry->mtime_sec = s->st_mtim.tv_sec;
+  entry->mtime_nsec = s->st_mtim.tv_nsec;
+  entry->size = s->st_size;
+  entry->ino = s->st_ino;
+}
+
+int index_entry_is_clean(const beargit_index* index, const index_entry* entry,
+                         const struct stat* s) {
+  if (!entry->blob_id[0])
+    return 0;
+
+  if (entry->mtime_sec != s->st_mtim.tv_sec || entry->mtime_nsec != s->st_mtim.tv_nsec ||
+      entry->size != s->st_size || entry->ino != s->st_ino)
+    return 0;
+
+  // Racily clean: the file may have been written again in the same
+  // timestamp tick as the index, so its stat data can't be trusted.
+  if (entry->mtime_sec > index->mtime_sec ||
+      (entry->mtime_sec == index->mtime_sec && entry->mtime_nsec >= index->mtime_nsec))
+    return 0;
+
+  return 1;
+}
+
+int index_entry_refresh(const beargit_index* index, index_entry* entry) {
+  struct stat s;
+  if (stat(entry->path, &s) != 0)
+    return ENTRY_MISSING;
+
+  if (!entry->blob_id[0])
+    return ENTRY_UNHASHED;
+
+  if (index_entry_is_clean(index, entry, &s))
+    return ENTRY_UNCHANGED;
+
+  if (entry->size != s.st_size)
+    return ENTRY_MODIFIED;
+
+  char blob_id[BLOB_ID_SIZE];
+  if (object_hash_file(entry->path, blob_id) != 0 || strcmp(blob_id, entry->blob_id) != 0)
+    return ENTRY_MODIFIED;
+
+  index_entry_set_stat(entry, &s);
+  return ENTRY_REFRESHED;
+}
+
+void index_read_manifest(beargit_index* index, const char* commit_dir) {
+  memset(index, 0, sizeof(*index));
+
+  char manifest_file[FILENAME_SIZE];
+  sprintf(manifest_file, "%s/.manifest", commit_dir);
+
+  FILE* fmanifest = fopen(manifest_file, "r");
+  if (fmanifest) {
+    char line[BLOB_ID_SIZE + FILENAME_SIZE];
+    while(fgets(line, sizeof(line), fmanifest)) {
+      strtok(line, "\n");
+      line[BLOB_ID_BYTES] = '\0';
+      index_entry* entry = index_add(index, line + BLOB_ID_SIZE);
+      strcpy(entry->blob_id, line);
+    }
+    fclose(fmanifest);
+    return;
+  }
+
+  // Repacked commits keep their manifest in the pack.
+  const char* commit_id = strrchr(commit_dir, '/');
+  const char* data;
+  size_t size;
+  if (commit_id && pack_find(commit_id + 1, PACK_COMMIT, &data, &size)) {
+    char parent[COMMIT_ID_SIZE], msg[MSG_SIZE];
+    const char* manifest;
+    size_t manifest_size;
+    ASSERT_ERROR_MESSAGE(pack_parse_commit(data, size, parent, msg, MSG_SIZE,
+                                           &manifest, &manifest_size) == 0,
+                         "malformed commit in pack");
+    while (manifest_size > BLOB_ID_SIZE) {
+      const char* end = memchr(manifest, '\n', manifest_size);
+      size_t len = end ? (size_t) (end - manifest) : manifest_size;
+      ASSERT_ERROR_MESSAGE(len > BLOB_ID_SIZE && len - BLOB_ID_SIZE < FILENAME_SIZE,
+                           "malformed manifest in pack");
+
+      char path[FILENAME_SIZE];
+      memcpy(path, manifest + BLOB_ID_SIZE, len - BLOB_ID_SIZE);
+      path[len - BLOB_ID_SIZE] = '\0';
+      index_entry* entry = index_add(index, path);
+      memcpy(entry->blob_id, manifest, BLOB_ID_BYTES);
+      entry->blob_id[BLOB_ID_BYTES] = '\0';
+
+      manifest += end ? len + 1 : len;
+      manifest_size -= end ? len + 1 : len;
+    }
+    return;
+  }
+
+  char index_file[FILENAME_SIZE];
+  sprintf(index_file, "%s/.index", commit_dir);
+  FILE* findex = fopen(index_file, "r");
+  ASSERT_ERROR_MESSAGE(findex != NULL, "commit has neither a .manifest nor an .index");
+
+  char line[FILENAME_SIZE];
+  while(fgets(line, sizeof(line), findex)) {
+    strtok(line, "\n");
+    index_add(index, line);
+  }
+  fclose(findex);
+}
+
+void index_write_manifest(const beargit_index* index, const char* commit_dir) {
+  char manifest_file[FILENAME_SIZE];
+  sprintf(manifest_file, "%s/.manifest", commit_dir);
+
+  FILE* fmanifest = fopen(manifest_file, "w");
+  ASSERT_ERROR_MESSAGE(fmanifest != NULL, "couldn't create commit manifest");
+  for (int i = 0; i < index->count; i++)
+    fprintf(fmanifest, "%s %s\n", index->entries[i].blob_id, index->entries[i].path);
+  fclose(fmanifest);
+}
@@ -0,0 +1,89 @@
+/**
+ * The index (.beargit/.index) lists the tracked files. For every file it also
+ * caches the stat() data and blob id recorded the last time the file was
+ * hashed, so unchanged files can be recognized with a single stat() call.
+ *
+ * On disk the index is a binary file with a hash directory, so single files
+ * can be looked up, appended or removed without reading the whole index.
+ */
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "objects.h"
+
+#ifndef INDEX_H
+#define INDEX_H
+
+typedef struct {
+  char* path;
+  char blob_id[BLOB_ID_SIZE];   // empty string if the file was never hashed
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint64_t ino;
+
+  uint32_t offset;              // offset of the entry's record in the index file, 0 if new
+  int dirty;                    // stat data or blob id changed since it was read
+} index_entry;
+
+typedef struct {
+  index_entry* entries;
+  int count;
+  int capacity;
+
+  // In-memory hash table over entries (entry position + 1, 0 for empty).
+  // Rebuilt lazily after removals.
+  int* buckets;
+  int nbuckets;
+
+  // Set when entries were added or removed, so index_write can't just
+  // patch the records that are already on disk.
+  int rewrite;
+
+  // Generation of the index file this was read from, 0 if none.
+  uint64_t generation;
+
+  // Modification time of the index file when it was read. Entries whose
+  // mtime is not older than this may have changed without changing their
+  // stat data ("racily clean") and must be re-hashed.
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} beargit_index;
+
+void index_read(beargit_index* index);
+void index_write(beargit_index* index);
+void index_free(beargit_index* index);
+
+// Generation of .beargit/.index as it is on disk, 0 for a text index.
+uint64_t index_read_generation(void);
+
+int index_find(beargit_index* index, const char* path);
+index_entry* index_add(beargit_index* index, const char* path);
+void index_remove(beargit_index* index, int pos);
+void index_remove_marked(beargit_index* index, const char* marked);
+
+// Operate on .beargit/.index directly, touching only the records and hash
+// slots involved. index_add_path returns 1 if <path> is already tracked,
+// index_remove_path returns 1 if it isn't tracked. index_remove_prefix
+// removes every path starting with <prefix> ("<dir>/" for a directory, ""
+// for all) and returns how many it removed.
+int index_add_path(const char* path);
+int index_remove_path(const char* path);
+int index_remove_prefix(const char* prefix);
+
+// Results of index_entry_refresh
+#define ENTRY_UNCHANGED 0   // stat data matches, contents not read
+#define ENTRY_REFRESHED 1   // contents unchanged, cached stat data updated
+#define ENTRY_MODIFIED 2
+#define ENTRY_MISSING 3
+#define ENTRY_UNHASHED 4    // added since the last commit, no contents to compare
+
+void index_entry_set_stat(index_entry* entry, const struct stat* s);
+int index_entry_is_clean(const beargit_index* index, const index_entry* entry,
+                         const struct stat* s);
+int index_entry_refresh(const beargit_index* index, index_entry* entry);
+
+void index_read_manifest(beargit_index* index, const char* commit_dir);
+void index_write_manifest(const beargit_index* index, const char* commit_dir);
+
+#endif
@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "commitlog.h"
+#include "config.h"
+#include "journal.h"
+#include "msgindex.h"
+#include "objects.h"
+#include "util.h"
+
+/* Journal format
+ *
+ * Lines of text. The begin record is
+ *
+ *   BEARGIT-JOURNAL 1
+ *   seq <seq of the state the commit starts from>
+ *   commit <commit id> <parent commit id>
+ *   commitlog <size of .commits> <size of .messages>
+ *
+ * and journal_commit appends
+ *
+ *   rename <temporary object path> <object path>     (one per new object)
+ *   head <new head>
+ *   branch <branch, may be empty>
+ *   end <checksum>
+ *
+ * The checksum is FNV-1a over every byte before the "end" line, so a journal
+ * a crash cut short anywhere reads as incomplete. The state sequence number
+ * tells recovery whether the commit already took effect.
+ */
+
+#define JOURNAL_MAGIC "BEARGIT-JOURNAL 1"
+
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+} journal_text;
+
+// The journal of the commit in progress
+static journal_text journal;
+static int journal_mode;
+static char journal_commit_id[COMMIT_ID_SIZE];
+
+static void text_printf(journal_text* text, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+
+  if (text->size + n + 1 > text->capacity) {
+    while (text->size + n + 1 > text->capacity)
+      text->capacity = text->capacity ? 2 * text->capacity : 1024;
+    text->data = realloc(text->data, text->capacity);
+    ASSERT_ERROR_MESSAGE(text->data != NULL, "out of memory");
+  }
+
+  va_start(args, format);
+  vsnprintf(text->data + text->size, n + 1, format, args);
+  va_end(args);
+  text->size += n;
+}
+
+static void text_free(journal_text* text) {
+  free(text->data);
+  memset(text, 0, sizeof(*text));
+}
+
+static uint32_t text_checksum(const char* data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+  return hash;
+}
+
+// Appends <size> bytes to the journal (creating it if <create>), fsynced if
+// <sync> is set.
+static void journal_write(const char* data, size_t size, int create, int sync) {
+  int fd = open(JOURNAL_FILE, O_WRONLY | O_APPEND | (create ? O_CREAT | O_TRUNC : 0), 0644);
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't open " JOURNAL_FILE);
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    ASSERT_ERROR_MESSAGE(n > 0 || errno == EINTR, "couldn't write " JOURNAL_FILE);
+    if (n > 0) {
+      data += n;
+      size -= n;
+    }
+  }
+  ASSERT_ERROR_MESSAGE(!sync || fsync(fd) == 0, "couldn't sync " JOURNAL_FILE);
+  close(fd);
+}
+
+// fsyncs <path>, a file or a directory. There is nothing to sync for a
+// path that doesn't exist.
+static void sync_path(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ASSERT_ERROR_MESSAGE(errno == ENOENT, "couldn't open file to sync");
+    return;
+  }
+  ASSERT_ERROR_MESSAGE(fsync(fd) == 0 || errno == EINVAL, "couldn't sync repository");
+  close(fd);
+}
+
+// fsyncs the directory <path> is in, which holds its name after a create or
+// a rename.
+static void sync_parent(const char* path) {
+  char dir[FILENAME_SIZE];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char* slash = strrchr(dir, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else
+    *slash = '\0';
+  sync_path(dir);
+}
+
+// fsyncs every file in the directory of commit <commit_id>, and the
+// directory itself.
+static void sync_commit_dir(const char* commit_id) {
+  char commit_dir[FILENAME_SIZE];
+  snprintf(commit_dir, sizeof(commit_dir), ".beargit/%.40s", commit_id);
+  DIR* dir = opendir(commit_dir);
+  if (dir == NULL)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char path[2 * FILENAME_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", commit_dir, entry->d_name);
+    sync_path(path);
+  }
+  closedir(dir);
+  sync_path(commit_dir);
+}
+
+static off_t file_size(const char* filename) {
+  struct stat s;
+  return stat(filename, &s) == 0 ? s.st_size : 0;
+}
+
+int journal_durability(void) {
+  char value[CONFIG_VALUE_SIZE];
+  config_get(CONFIG_DURABILITY, value);
+  if (strcmp(value, "none") == 0)
+    return DURABILITY_NONE;
+  if (strcmp(value, "full") == 0)
+    return DURABILITY_FULL;
+  return DURABILITY_COMMIT;
+}
+
+void journal_begin(const repo_state* state, const char* commit_id) {
+  journal_mode = journal_durability();
+  snprintf(journal_commit_id, COMMIT_ID_SIZE, "%s", commit_id);
+  text_free(&journal);
+  text_printf(&journal, "%s\nseq %" PRIu64 "\ncommit %s %s\ncommitlog %lld %lld\n",
+              JOURNAL_MAGIC, state->seq, commit_id, state->head,
+              (long long) file_size(COMMITLOG_FILE), (long long) file_size(COMMITLOG_MESSAGES));
+  journal_write(journal.data, journal.size, 1, journal_mode == DURABILITY_FULL);
+  object_batch_begin(journal_mode == DURABILITY_FULL);
+}
+
+void journal_abort(void) {
+  object_batch_abort();
+  unlink(JOURNAL_FILE);
+  text_free(&journal);
+}
+
+static void add_rename(const char* tmp_path, const char* path, void* arg) {
+  text_printf(arg, "rename %s %s\n", tmp_path, path);
+}
+
+void journal_commit(const repo_state* new_state) {
+  size_t begin_size = journal.size;
+  object_batch_for_each(add_rename, &journal);
+  text_printf(&journal, "head %s\nbranch %s\n", new_state->head, new_state->branch);
+  text_printf(&journal, "end %08x\n", (unsigned) text_checksum(journal.data, journal.size));
+  journal_write(journal.data + begin_size, journal.size - begin_size, 0,
+                journal_mode != DURABILITY_NONE);
+
+  // The first sync: the objects, the commit directory, the commit log and
+  // the journal are all on disk before anything points at them.
+  int sync = journal_mode != DURABILITY_NONE;
+  if (sync) {
+    object_batch_sync();
+    sync_commit_dir(journal_commit_id);
+    sync_path(COMMITLOG_FILE);
+    sync_path(COMMITLOG_MESSAGES);
+    sync_path(MSGINDEX_TAIL);
+    sync_path(".beargit");
+  }
+  object_batch_publish(sync);
+}
+
+void journal_finish(void) {
+  // The second sync: the renames (synced by object_batch_publish), the
+  // index and the state are on disk, so the journal isn't needed anymore.
+  if (journal_mode != DURABILITY_NONE) {
+    sync_path(".beargit/.index");
+    sync_path(STATE_FILE);
+    sync_path(".beargit");
+  }
+  unlink(JOURNAL_FILE);
+  text_free(&journal);
+}
+
+void journal_sync_file(const char* path) {
+  if (journal_durability() != DURABILITY_NONE) {
+    sync_path(path);
+    sync_parent(path);
+  }
+}
+
+/* Recovery */
+
+// Reads the whole journal into a NUL-terminated buffer. Returns NULL if there
+// is none.
+static char* read_journal(size_t* size) {
+  int fd = open(JOURNAL_FILE, O_RDONLY);
+  if (fd < 0) {
+    ASSERT_ERROR_MESSAGE(errno == ENOENT, "couldn't open " JOURNAL_FILE);
+    return NULL;
+  }
+
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &s) == 0, "couldn't stat " JOURNAL_FILE);
+  char* data = malloc(s.st_size + 1);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+  size_t done = 0;
+  while (done < (size_t) s.st_size) {
+    ssize_t n = read(fd, data + done, s.st_size - done);
+    ASSERT_ERROR_MESSAGE(n >= 0 || errno == EINTR, "couldn't read " JOURNAL_FILE);
+    if (n == 0)
+      break;
+    if (n > 0)
+      done += n;
+  }
+  close(fd);
+  data[done] = '\0';
+  *size = done;
+  return data;
+}
+
+// Whether <data> ends in an "end" line with the right checksum.
+static int journal_is_complete(const char* data, size_t size) {
+  if (size < 2 || data[size - 1] != '\n')
+    return 0;
+  const char* last = data + size - 1;
+  while (last > data && last[-1] != '\n')
+    last--;
+
+  unsigned checksum;
+  char newline;
+  return sscanf(last, "end %8x%c", &checksum, &newline) == 2 && newline == '\n' &&
+         checksum == text_checksum(data, last - data);
+}
+
+static void remove_commit_dir(const char* commit_id) {
+  char commit_dir[FILENAME_SIZE];
+  sprintf(commit_dir, ".beargit/%.40s", commit_id);
+  DIR* dir = opendir(commit_dir);
+  if (dir == NULL)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char path[2 * FILENAME_SIZE];
+    sprintf(path, "%s/%s", commit_dir, entry->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+  rmdir(commit_dir);
+}
+
+// Deletes the objects that were never published.
+static void remove_tmp_objects(void) {
+  DIR* dir = opendir(OBJECTS_DIR);
+  if (dir == NULL)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, ".tmp_", 5) != 0)
+      continue;
+    char path[2 * FILENAME_SIZE];
+    sprintf(path, "%s/%s", OBJECTS_DIR, entry->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+}
+
+static void truncate_to(const char* filename, long long size) {
+  ASSERT_ERROR_MESSAGE(file_size(filename) <= size || truncate(filename, size) == 0,
+                       "couldn't roll back commit log");
+}
+
+void journal_recover(void) {
+  size_t size;
+  char* data = read_journal(&size);
+  if (data == NULL)
+    return;
+
+  int complete = journal_is_complete(data, size);
+  int sync = journal_durability() != DURABILITY_NONE;
+  repo_state state;
+  state_read(&state);
+
+  uint64_t seq = 0;
+  char commit_id[COMMIT_ID_SIZE] = "";
+  long long commits_size = -1, messages_size = -1;
+  int begun = 0, lines = 0;
+  char* save;
+  for (char* line = strtok_r(data, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+    char from[FILENAME_SIZE], to[FILENAME_SIZE];
+    lines++;
+    if (lines == 1 && strcmp(line, JOURNAL_MAGIC) != 0)
+      break;
+    else if (lines == 2)
+      sscanf(line, "seq %" SCNu64, &seq);
+    else if (lines == 3)
+      sscanf(line, "commit %40s", commit_id);
+    else if (lines == 4)
+      begun = sscanf(line, "commitlog %lld %lld", &commits_size, &messages_size) == 2 &&
+              strlen(commit_id) == COMMIT_ID_BYTES;
+    else if (!complete)
+      continue;
+    else if (sscanf(line, "rename %511s %511s", from, to) == 2) {
+      ASSERT_ERROR_MESSAGE(access(from, F_OK) != 0 || rename(from, to) == 0,
+                           "couldn't publish object");
+      if (sync)
+        sync_parent(to);
+    } else if (strncmp(line, "head ", 5) == 0)
+      snprintf(state.head, COMMIT_ID_SIZE, "%s", line + 5);
+    else if (strncmp(line, "branch ", 7) == 0)
+      snprintf(state.branch, BRANCHNAME_SIZE, "%s", line + 7);
+  }
+
+  // The commit took effect if the state was written since it began.
+  int applied = state.seq != seq;
+  if (complete && !applied) {
+    // Every commit concludes the merge in progress, if any.
+    state.merge_head[0] = '\0';
+    state_write(&state);
+  } else if (!complete && begun && !applied) {
+    truncate_to(COMMITLOG_FILE, commits_size);
+    truncate_to(COMMITLOG_MESSAGES, messages_size);
+    remove_commit_dir(commit_id);
+  }
+  if (!complete)
+    remove_tmp_objects();
+
+  free(data);
+  if (sync) {
+    sync_path(STATE_FILE);
+    sync_path(COMMITLOG_FILE);
+    sync_path(COMMITLOG_MESSAGES);
+    sync_path(".beargit");
+  }
+  unlink(JOURNAL_FILE);
+}
@@ -0,0 +1,63 @@
+/**
+ * The commit journal (.beargit/.journal) makes a commit all-or-nothing
+ * across crashes. A commit first writes a begin record saying what it is
+ * about to change, stores its objects without publishing them (see
+ * object_batch_begin), and then appends the list of renames and the new
+ * repository state, ending in a checksum. From that point on the commit is
+ * decided: the renames and the state are applied, and the journal goes away
+ * once they are on disk.
+ *
+ * journal_recover, run before every command, finishes a complete journal
+ * and rolls an incomplete one back (its commit log records, its commit
+ * directory and its unpublished objects).
+ *
+ * How much a commit waits for the disk is the "durability" setting:
+ *   none    never syncs; a crash may lose recent commits or leave them torn
+ *   commit  syncs the files a commit wrote in two rounds, one when the
+ *           journal is complete (the journal, the new objects, the commit
+ *           directory and the commit log) and one when the commit has been
+ *           applied (the object directories, the index and the state)
+ *           (default)
+ *   full    as "commit", but also syncs every object and the begin record
+ *           on their own as they are written
+ */
+
+#include "state.h"
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_FILE ".beargit/.journal"
+
+#define DURABILITY_NONE 0
+#define DURABILITY_COMMIT 1
+#define DURABILITY_FULL 2
+
+// The configured durability mode
+int journal_durability(void);
+
+// Starts commit <commit_id> on top of <state>: writes the begin record and
+// opens an object batch.
+void journal_begin(const repo_state* state, const char* commit_id);
+
+// Gives up on the commit started by journal_begin and deletes its objects.
+// The caller removes anything else it wrote.
+void journal_abort(void);
+
+// Completes the journal with the objects to publish and <new_state>, makes
+// it durable and publishes the objects. The caller then writes the index
+// and the state and calls journal_finish.
+void journal_commit(const repo_state* new_state);
+
+// Waits for the applied commit to reach the disk and removes the journal.
+void journal_finish(void);
+
+// Waits for <path> and its directory entry to reach the disk, unless
+// durability is "none". For commands that don't keep a journal (checkout,
+// merge, repack), with each file they need to survive a crash.
+void journal_sync_file(const char* path);
+
+// Finishes or rolls back a commit that was interrupted by a crash.
+void journal_recover(void);
+
+#endif
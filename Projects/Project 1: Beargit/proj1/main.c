@@ -11,6 +11,9 @@
 
 #include "beargit.h"
 #include "cunittests.h"
+#include "daemon.h"
+#include "repo.h"
+#include "util.h"
 
 int check_initialized(void) {
   struct stat s;
@@ -22,12 +25,187 @@ int check_filename(const char* filename) {
   if (strlen(filename) > FILENAME_SIZE-1 || strlen(filename) == 0)
     return 0;
 
-  if (filename[0] == '.')
+  // Paths must stay inside the working directory, and apart from "." (the
+  // whole working directory) must not start with a dot once normalized, so
+  // .beargit itself can't be added.
+  char normalized[FILENAME_SIZE];
+  if (normalize_path(filename, normalized) != 0)
     return 0;
 
   struct stat s;
-  int ret_code = stat(filename, &s);
-  return (ret_code != -1 && !(S_ISDIR(s.st_mode)));
+  int ret_code = stat(normalized, &s);
+  return ret_code != -1;
+}
+
+// Parses the argument of -j. Returns the number of jobs, or 0 if invalid.
+int parse_jobs(const char* arg) {
+  if (arg == NULL)
+    return 0;
+  int n = atoi(arg);
+  return n > 0 ? n : 0;
+}
+
+// Runs the command in argv[1] against <repo>. Shared by main and the daemon
+// (see daemon.h), so both accept exactly the same command lines.
+int beargit_repo_run(beargit_repo_t* repo, int argc, char** argv) {
+    if (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "rm") == 0) {
+
+      if (strcmp(argv[1], "add") == 0 && argc == 3 && strcmp(argv[2], "--all") == 0)
+        return beargit_repo_add_all(repo);
+
+      if (argc < 3) {
+        fprintf(stderr, "ERROR: No or invalid filename given\n");
+        return 1;
+      }
+
+      for (int i = 2; i < argc; i++) {
+        if (!check_filename(argv[i])) {
+          fprintf(stderr, "ERROR: No or invalid filename given\n");
+          return 1;
+        }
+      }
+
+      if (strcmp(argv[1], "rm") == 0) {
+        return beargit_repo_rm(repo, argc - 2, argv + 2);
+      } else {
+        return beargit_repo_add(repo, argc - 2, argv + 2);
+      }
+
+    } else if (strcmp(argv[1], "commit") == 0) {
+
+      if (argc < 4 || strcmp(argv[2], "-m") != 0) {
+        fprintf(stderr, "ERROR: Need a commit message (-m <msg>)\n");
+        return 1;
+      }
+
+      if (argc > 4) {
+        int n = (argc == 6 && strcmp(argv[4], "-j") == 0) ? parse_jobs(argv[5]) : 0;
+        if (!n) {
+          fprintf(stderr, "ERROR: Invalid arguments for commit (-m <msg> [-j <jobs>])\n");
+          return 1;
+        }
+        beargit_set_jobs(n);
+      }
+
+      if (strlen(argv[3]) > MSG_SIZE-1) {
+        fprintf(stderr, "ERROR: Message is too long!\n");
+        return 1;
+      }
+
+      return beargit_repo_commit(repo, argv[3]);
+
+    } else if (strcmp(argv[1], "status") == 0) {
+        return beargit_repo_status(repo);
+    } else if (strcmp(argv[1], "log") == 0) {
+        int limit = INT_MAX;
+        char* terms[argc];
+        int nterms = 0;
+        char* from = NULL;
+        for (int i = 2; i < argc; i++) {
+          if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc) {
+              fprintf(stderr, "ERROR: No log limit specified!\n");
+              return 1;
+            }
+            limit = atoi(argv[++i]);
+            if (limit < 0){
+              fprintf(stderr, "ERROR: Illegal log limit specified!\n");
+            }
+          } else if (strcmp(argv[i], "--grep") == 0) {
+            if (i + 1 == argc) {
+              fprintf(stderr, "ERROR: No search term specified!\n");
+              return 1;
+            }
+            terms[nterms++] = argv[++i];
+          } else if (argv[i][0] == '-' || from) {
+            fprintf(stderr, "ERROR: Invalid argument: %s\n", argv[i]);
+            return 1;
+          } else {
+            from = argv[i];
+          }
+        }
+        if (nterms > 0)
+          return beargit_repo_log_grep(repo, limit, from, nterms, terms);
+        return beargit_repo_log(repo, limit, from);
+    } else if (strcmp(argv[1], "branch") == 0) {
+        return beargit_repo_branch(repo);
+    } else if (strcmp(argv[1], "checkout") == 0) {
+        int branch_new = 0;
+        char* arg = NULL;
+
+        for (int i = 2; i < argc; i++) {
+          if (argv[i][0] == '-') {
+            if (strcmp(argv[i], "-b") == 0) {
+              branch_new = 1;
+              continue;
+            } else if (strcmp(argv[i], "-j") == 0) {
+              int n = parse_jobs(i + 1 < argc ? argv[i+1] : NULL);
+              if (!n) {
+                fprintf(stderr, "ERROR: Invalid number of jobs\n");
+                return 1;
+              }
+              beargit_set_jobs(n);
+              i++;
+              continue;
+            } else {
+              fprintf(stderr, "ERROR: Invalid argument: %s", argv[i]);
+              return 1;
+            }
+          }
+
+          if (arg) {
+              fprintf(stderr, "ERROR: Too many arguments for checkout!");
+              return 1;
+          }
+
+          arg = argv[i];
+        }
+
+        if (arg == NULL) {
+          fprintf(stderr, "ERROR: No branch or commit given for checkout!\n");
+          return 1;
+        }
+
+        return beargit_repo_checkout(repo, arg, branch_new);
+    } else if (strcmp(argv[1], "diff") == 0) {
+        if (argc > 4) {
+          fprintf(stderr, "ERROR: Too many arguments for diff!\n");
+          return 1;
+        }
+        return beargit_repo_diff(repo, argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+    } else if (strcmp(argv[1], "merge") == 0) {
+        if (argc != 3) {
+          fprintf(stderr, "ERROR: merge takes exactly one commit or branch!\n");
+          return 1;
+        }
+        return beargit_repo_merge(repo, argv[2]);
+    } else if (strcmp(argv[1], "sparse") == 0) {
+        if (argc == 2)
+          return beargit_repo_sparse_list(repo);
+        if (strcmp(argv[2], "--disable") == 0) {
+          if (argc > 3) {
+            fprintf(stderr, "ERROR: Too many arguments for sparse!\n");
+            return 1;
+          }
+          return beargit_repo_sparse_set(repo, 0, NULL);
+        }
+        return beargit_repo_sparse_set(repo, argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "repack") == 0) {
+        if (argc > 2) {
+          fprintf(stderr, "ERROR: Too many arguments for repack!\n");
+          return 1;
+        }
+        return beargit_repack();
+    } else if (strcmp(argv[1], "config") == 0) {
+        if (argc > 4) {
+          fprintf(stderr, "ERROR: Too many arguments for config!\n");
+          return 1;
+        }
+        return beargit_config(argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+    } else {
+        fprintf(stderr, "ERROR: Unknown command \"%s\"\n", argv[1]);
+        return 1;
+    }
 }
 
 #ifndef TESTING
@@ -55,78 +233,18 @@ int main(int argc, char **argv) {
             return 1;
         }
 
-        if (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "rm") == 0) {
-
-          if (argc < 3 || !check_filename(argv[2])) {
-            fprintf(stderr, "ERROR: No or invalid filename given\n");
-            return 1;
-          }
-
-          if (strcmp(argv[1], "rm") == 0) {
-            return beargit_rm(argv[2]);
-          } else {
-            return beargit_add(argv[2]);
-          }
+        if (strcmp(argv[1], "daemon") == 0)
+            return beargit_daemon(argc, argv);
 
-        } else if (strcmp(argv[1], "commit") == 0) {
+        // A running daemon does the work; otherwise the command runs here.
+        int ret;
+        if (daemon_client_run(argc, argv, &ret) == 0)
+            return ret;
 
-          if (argc < 4 || strcmp(argv[2], "-m") != 0) {
-            fprintf(stderr, "ERROR: Need a commit message (-m <msg>)\n");
-            return 1;
-          }
-
-          if (strlen(argv[3]) > MSG_SIZE-1) {
-            fprintf(stderr, "ERROR: Message is too long!\n");
-            return 1;
-          }
-
-          return beargit_commit(argv[3]);
-
-        } else if (strcmp(argv[1], "status") == 0) {
-            return beargit_status();
-        } else if (strcmp(argv[1], "log") == 0) {
-            int limit = INT_MAX;
-            if (argc > 2 && strcmp(argv[2], "-n") == 0){
-              if (argc == 3){
-                fprintf(stderr, "ERROR: No log limit specified!\n");
-                return 1;
-              }
-              limit = atoi(argv[3]);
-              if (limit < 0){
-                fprintf(stderr, "ERROR: Illegal log limit specified!\n");
-              }
-            }
-            return beargit_log(limit);
-        } else if (strcmp(argv[1], "branch") == 0) {
-            return beargit_branch();
-        } else if (strcmp(argv[1], "checkout") == 0) {
-            int branch_new = 0;
-            char* arg = NULL;
-
-            for (int i = 2; i < argc; i++) {
-              if (argv[i][0] == '-') {
-                if (strcmp(argv[i], "-b") == 0) {
-                  branch_new = 1;
-                  continue;
-                } else {
-                  fprintf(stderr, "ERROR: Invalid argument: %s", argv[i]);
-                  return 1;
-                }
-              }
-
-              if (arg) {
-                  fprintf(stderr, "ERROR: Too many arguments for checkout!");
-                  return 1;
-              }
-
-              arg = argv[i];
-            }
-
-            return beargit_checkout(arg, branch_new);
-        } else {
-            fprintf(stderr, "ERROR: Unknown command \"%s\"\n", argv[1]);
-            return 1;
-        }
+        beargit_repo_t* repo = beargit_repo_open();
+        ret = beargit_repo_run(repo, argc, argv);
+        beargit_repo_close(repo);
+        return ret;
     }
 }
 #else
@@ -0,0 +1,446 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "msgindex.h"
+#include "util.h"
+
+/* Message index file format
+ *
+ *   header    msgindex_header
+ *   buckets   nbuckets msgindex_bucket: open addressing with linear probing
+ *             over the terms
+ *   postings  npostings uint32: the record numbers of every term, ascending,
+ *             one term after another
+ *
+ * The tail is just msgindex_tail_entry records: the terms of each commit,
+ * followed by a marker (term 0) saying it is complete. As for the commit
+ * graph, the header names the last commit covered.
+ */
+
+#define MSGINDEX_MAGIC "BMIX"
+#define MSGINDEX_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+  char last_id[40];
+  uint32_t nbuckets;
+  uint32_t reserved;
+  uint64_t npostings;
+} msgindex_header;
+
+// Hash of the next term at *text, or 0 if there are no more. Advances *text
+// past it.
+static uint64_t next_term(const char** text) {
+  const unsigned char* p = (const unsigned char*) *text;
+  while (*p && !isalnum(*p) && *p != '_')
+    p++;
+  if (!*p) {
+    *text = (const char*) p;
+    return 0;
+  }
+
+  uint64_t hash = 14695981039346656037ull;
+  while (*p && (isalnum(*p) || *p == '_'))
+    hash = (hash ^ tolower(*p++)) * 1099511628211ull;
+  *text = (const char*) p;
+  return hash ? hash : 1;
+}
+
+static int compare_terms(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Puts the distinct terms of <text> into *terms, sorted. Returns their
+// number. Free <*terms>.
+static int collect_terms(const char* text, uint64_t** terms) {
+  int count = 0, capacity = 16;
+  *terms = malloc(capacity * sizeof(uint64_t));
+  ASSERT_ERROR_MESSAGE(*terms != NULL, "out of memory");
+  uint64_t term;
+  while ((term = next_term(&text)) != 0) {
+    if (count == capacity) {
+      capacity *= 2;
+      *terms = realloc(*terms, capacity * sizeof(uint64_t));
+      ASSERT_ERROR_MESSAGE(*terms != NULL, "out of memory");
+    }
+    (*terms)[count++] = term;
+  }
+
+  qsort(*terms, count, sizeof(uint64_t), compare_terms);
+  int distinct = 0;
+  for (int i = 0; i < count; i++) {
+    if (distinct == 0 || (*terms)[distinct - 1] != (*terms)[i])
+      (*terms)[distinct++] = (*terms)[i];
+  }
+  return distinct;
+}
+
+static void write_all(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    ASSERT_ERROR_MESSAGE(n > 0 || errno == EINTR, "couldn't write message index");
+    if (n > 0) {
+      p += n;
+      len -= n;
+    }
+  }
+}
+
+void msgindex_append(int64_t pos, const char* msg) {
+  uint64_t* terms;
+  int nterms = collect_terms(msg, &terms);
+  msgindex_tail_entry* entries = calloc(nterms + 1, sizeof(msgindex_tail_entry));
+  ASSERT_ERROR_MESSAGE(entries != NULL, "out of memory");
+  for (int i = 0; i <= nterms; i++) {
+    entries[i].term = i < nterms ? terms[i] : 0;
+    entries[i].pos = pos;
+  }
+
+  int fd = open(MSGINDEX_TAIL, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't open message index");
+  // Drop an entry a crash left half written, so ours land on entry boundaries.
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &s) == 0, "couldn't stat message index");
+  if (s.st_size % sizeof(msgindex_tail_entry) != 0)
+    ASSERT_ERROR_MESSAGE(ftruncate(fd, s.st_size - s.st_size % sizeof(msgindex_tail_entry)) == 0,
+                         "couldn't repair message index");
+  write_all(fd, entries, (nterms + 1) * sizeof(msgindex_tail_entry));
+  close(fd);
+  free(entries);
+  free(terms);
+}
+
+typedef struct {
+  uint64_t term;
+  uint32_t pos;
+} posting;
+
+static int compare_postings(const void* a, const void* b) {
+  const posting* x = a;
+  const posting* y = b;
+  if (x->term != y->term)
+    return x->term < y->term ? -1 : 1;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+int msgindex_write(const commit_log* log) {
+  int64_t npostings = 0, capacity = 1024;
+  posting* postings = malloc(capacity * sizeof(posting));
+  ASSERT_ERROR_MESSAGE(postings != NULL, "out of memory");
+  for (int64_t pos = 0; pos < log->count; pos++) {
+    const char* msg = commitlog_message(log, &log->records[pos]);
+    if (msg == NULL)
+      continue;
+    uint64_t* terms;
+    int nterms = collect_terms(msg, &terms);
+    if (npostings + nterms > capacity) {
+      while (npostings + nterms > capacity)
+        capacity *= 2;
+      postings = realloc(postings, capacity * sizeof(posting));
+      ASSERT_ERROR_MESSAGE(postings != NULL, "out of memory");
+    }
+    for (int i = 0; i < nterms; i++) {
+      postings[npostings].term = terms[i];
+      postings[npostings].pos = pos;
+      npostings++;
+    }
+    free(terms);
+  }
+  qsort(postings, npostings, sizeof(posting), compare_postings);
+
+  int64_t nterms = 0;
+  for (int64_t i = 0; i < npostings; i++) {
+    if (i == 0 || postings[i].term != postings[i - 1].term)
+      nterms++;
+  }
+
+  msgindex_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MSGINDEX_MAGIC, 4);
+  header.version = MSGINDEX_VERSION;
+  header.count = log->count;
+  if (log->count)
+    memcpy(header.last_id, log->records[log->count - 1].id, 40);
+  header.nbuckets = 16;
+  while (header.nbuckets < 2 * nterms)
+    header.nbuckets *= 2;
+  header.npostings = npostings;
+
+  msgindex_bucket* buckets = calloc(header.nbuckets, sizeof(msgindex_bucket));
+  uint32_t* positions = malloc((npostings + 1) * sizeof(uint32_t));
+  ASSERT_ERROR_MESSAGE(buckets != NULL && positions != NULL, "out of memory");
+  for (int64_t i = 0; i < npostings; i++) {
+    positions[i] = postings[i].pos;
+    if (i > 0 && postings[i].term == postings[i - 1].term)
+      continue;
+    int64_t end = i + 1;
+    while (end < npostings && postings[end].term == postings[i].term)
+      end++;
+    uint32_t b = postings[i].term & (header.nbuckets - 1);
+    while (buckets[b].count)
+      b = (b + 1) & (header.nbuckets - 1);
+    buckets[b].term = postings[i].term;
+    buckets[b].offset = i;
+    buckets[b].count = end - i;
+  }
+  free(postings);
+
+  // Written aside and renamed into place, so readers only ever map a
+  // whole index.
+  char tmp_file[64];
+  sprintf(tmp_file, MSGINDEX_FILE ".%d", (int) getpid());
+  FILE* f = fopen(tmp_file, "w");
+  int ret = f ? 0 : -1;
+  if (f) {
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(buckets, sizeof(msgindex_bucket), header.nbuckets, f);
+    fwrite(positions, sizeof(uint32_t), npostings, f);
+    if (ferror(f))
+      ret = -1;
+    if (fclose(f) != 0)
+      ret = -1;
+    if (ret == 0)
+      ret = rename(tmp_file, MSGINDEX_FILE);
+    if (ret != 0)
+      unlink(tmp_file);
+  }
+  // Whatever the tail held is covered now.
+  if (ret == 0 && truncate(MSGINDEX_TAIL, 0) != 0 && errno != ENOENT)
+    ret = -1;
+  free(buckets);
+  free(positions);
+  return ret;
+}
+
+static void* map_file(const char* filename, size_t* size) {
+  *size = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat s;
+  void* base = NULL;
+  if (fstat(fd, &s) == 0 && s.st_size > 0) {
+    base = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+      base = NULL;
+    else
+      *size = s.st_size;
+  }
+  close(fd);
+  return base;
+}
+
+// Maps the index file if it fits <log>, and the tail.
+static void map_index(msg_index* index, const commit_log* log) {
+  memset(index, 0, sizeof(*index));
+  index->log = log;
+
+  index->tail_base = map_file(MSGINDEX_TAIL, &index->tail_size);
+  index->tail = index->tail_base;
+  index->ntail = index->tail_size / sizeof(msgindex_tail_entry);
+
+  index->base = map_file(MSGINDEX_FILE, &index->size);
+  if (index->base == NULL)
+    return;
+  const msgindex_header* header = index->base;
+  int fits = index->size >= sizeof(msgindex_header) &&
+             memcmp(header->magic, MSGINDEX_MAGIC, 4) == 0 &&
+             header->version == MSGINDEX_VERSION &&
+             header->count <= (uint64_t) log->count &&
+             (header->count == 0 || memcmp(header->last_id, log->records[header->count - 1].id, 40) == 0) &&
+             index->size == sizeof(msgindex_header) + header->nbuckets * sizeof(msgindex_bucket) +
+                            header->npostings * sizeof(uint32_t);
+  if (!fits) {
+    munmap(index->base, index->size);
+    index->base = NULL;
+    index->size = 0;
+    return;
+  }
+
+  index->buckets = (const msgindex_bucket*) (header + 1);
+  index->nbuckets = header->nbuckets;
+  index->postings = (const uint32_t*) (index->buckets + header->nbuckets);
+  index->covered = header->count;
+}
+
+static void unmap_index(msg_index* index) {
+  if (index->base)
+    munmap(index->base, index->size);
+  if (index->tail_base)
+    munmap(index->tail_base, index->tail_size);
+}
+
+// 1 if every commit the index file doesn't cover is complete in the tail,
+// and there are at most MSGINDEX_MAX_TAIL of them.
+static int tail_covers_log(const msg_index* index) {
+  int64_t missing = index->log->count - index->covered;
+  if (missing > MSGINDEX_MAX_TAIL)
+    return 0;
+
+  char* seen = calloc(missing + 1, 1);
+  ASSERT_ERROR_MESSAGE(seen != NULL, "out of memory");
+  for (int64_t i = 0; i < index->ntail; i++) {
+    int64_t pos = index->tail[i].pos;
+    if (index->tail[i].term == 0 && pos >= index->covered && pos < index->log->count && !seen[pos - index->covered]) {
+      seen[pos - index->covered] = 1;
+      missing--;
+    }
+  }
+  free(seen);
+  return missing == 0;
+}
+
+void msgindex_open(msg_index* index, const commit_log* log) {
+  map_index(index, log);
+  if (!tail_covers_log(index) && msgindex_write(log) == 0) {
+    unmap_index(index);
+    map_index(index, log);
+  }
+}
+
+void msgindex_close(msg_index* index) {
+  unmap_index(index);
+  memset(index, 0, sizeof(*index));
+}
+
+/* Searches */
+
+static int compare_positions(const void* a, const void* b) {
+  int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Puts the record numbers listed for <term> into *positions, ascending and
+// without repeats. Returns their number.
+static int64_t term_positions(const msg_index* index, uint64_t term, int64_t** positions) {
+  const msgindex_bucket* bucket = NULL;
+  for (uint32_t b = term & (index->nbuckets - 1); index->nbuckets && index->buckets[b].count;
+       b = (b + 1) & (index->nbuckets - 1)) {
+    if (index->buckets[b].term == term) {
+      bucket = &index->buckets[b];
+      break;
+    }
+  }
+
+  int64_t count = 0, capacity = (bucket ? bucket->count : 0) + 16;
+  *positions = malloc(capacity * sizeof(int64_t));
+  ASSERT_ERROR_MESSAGE(*positions != NULL, "out of memory");
+  for (uint32_t i = 0; bucket && i < bucket->count; i++)
+    (*positions)[count++] = index->postings[bucket->offset + i];
+
+  int sorted = 1;
+  for (int64_t i = 0; i < index->ntail; i++) {
+    int64_t pos = index->tail[i].pos;
+    if (index->tail[i].term != term || pos < index->covered || pos >= index->log->count)
+      continue;
+    if (count == capacity) {
+      capacity *= 2;
+      *positions = realloc(*positions, capacity * sizeof(int64_t));
+      ASSERT_ERROR_MESSAGE(*positions != NULL, "out of memory");
+    }
+    if (count > 0 && (*positions)[count - 1] >= pos)
+      sorted = 0;
+    (*positions)[count++] = pos;
+  }
+
+  // Only a log cut back by journal recovery puts the tail out of order.
+  if (!sorted) {
+    qsort(*positions, count, sizeof(int64_t), compare_positions);
+    int64_t distinct = 0;
+    for (int64_t i = 0; i < count; i++) {
+      if (distinct == 0 || (*positions)[distinct - 1] != (*positions)[i])
+        (*positions)[distinct++] = (*positions)[i];
+    }
+    count = distinct;
+  }
+  return count;
+}
+
+// 1 if the message of record <pos> has all <nterms> sorted <terms> and
+// contains each of the <nqueries> <queries>, in any case.
+static int message_matches(const commit_log* log, int64_t pos, const uint64_t* terms, int nterms,
+                           int nqueries, char* const* queries) {
+  const char* msg = commitlog_message(log, &log->records[pos]);
+  if (msg == NULL)
+    return 0;
+  uint64_t* found;
+  int nfound = collect_terms(msg, &found);
+  int matches = 1;
+  for (int i = 0; i < nterms && matches; i++)
+    matches = bsearch(&terms[i], found, nfound, sizeof(uint64_t), compare_terms) != NULL;
+  free(found);
+  for (int i = 0; i < nqueries && matches; i++)
+    matches = strcasestr(msg, queries[i]) != NULL;
+  return matches;
+}
+
+int64_t msgindex_search(const msg_index* index, int nqueries, char* const* queries,
+                        int64_t** positions) {
+  // All terms of all queries, as one query.
+  size_t length = 1;
+  for (int i = 0; i < nqueries; i++)
+    length += strlen(queries[i]) + 1;
+  char* query = malloc(length);
+  ASSERT_ERROR_MESSAGE(query != NULL, "out of memory");
+  query[0] = '\0';
+  for (int i = 0; i < nqueries; i++) {
+    strcat(query, queries[i]);
+    strcat(query, " ");
+  }
+  uint64_t* terms;
+  int nterms = collect_terms(query, &terms);
+  free(query);
+
+  // No terms at all match every commit.
+  int64_t count;
+  if (nterms == 0) {
+    *positions = malloc((index->log->count + 1) * sizeof(int64_t));
+    ASSERT_ERROR_MESSAGE(*positions != NULL, "out of memory");
+    for (count = 0; count < index->log->count; count++)
+      (*positions)[count] = count;
+  } else {
+    // Intersect the postings of the terms, starting from the first.
+    count = term_positions(index, terms[0], positions);
+    for (int t = 1; t < nterms && count > 0; t++) {
+      int64_t* other;
+      int64_t nother = term_positions(index, terms[t], &other);
+      int64_t kept = 0;
+      for (int64_t i = 0, j = 0; i < count && j < nother;) {
+        if ((*positions)[i] < other[j]) {
+          i++;
+        } else if ((*positions)[i] > other[j]) {
+          j++;
+        } else {
+          (*positions)[kept++] = (*positions)[i];
+          i++;
+          j++;
+        }
+      }
+      count = kept;
+      free(other);
+    }
+  }
+
+  // The terms only narrow down the candidates: "PROJ-123" has the terms of
+  // "PROJ-1 fixed 123 tests" too. Checking the messages also drops leftovers
+  // of rolled back commits (see msgindex.h).
+  int64_t kept = 0;
+  for (int64_t i = 0; i < count; i++) {
+    if (message_matches(index->log, (*positions)[i], terms, nterms, nqueries, queries))
+      (*positions)[kept++] = (*positions)[i];
+  }
+  free(terms);
+  return kept;
+}
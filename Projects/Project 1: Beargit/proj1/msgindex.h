@@ -0,0 +1,81 @@
+/**
+ * The message index (.beargit/.msg-index) is an inverted index over the
+ * commit messages in the commit log: for every term, the record numbers of
+ * the commits whose message has it. Terms are runs of letters, digits and
+ * underscores, compared without regard to case, so "Fixes BUG-42." has the
+ * terms "fixes", "bug" and "42". They are kept as 64-bit hashes.
+ *
+ * Every commit appends its terms to .beargit/.msg-index-tail before its
+ * commit log record is written, so the index is never behind the log.
+ * Like the commit graph, the index file covers the log as it was when it
+ * was written, plus the tail; it is rewritten from the message heap once
+ * the tail holds more than MSGINDEX_MAX_TAIL commits, by `beargit repack`,
+ * and whenever it doesn't match the log anymore.
+ *
+ * A commit rolled back by journal recovery may leave its terms behind in the
+ * tail, under the record number the next commit gets. Searches check the
+ * messages of the commits they find, so such leftovers never show up.
+ * Commits made before the commit log existed are not in it, nor here.
+ */
+
+#include <stdint.h>
+
+#include "commitlog.h"
+
+#ifndef MSGINDEX_H
+#define MSGINDEX_H
+
+#define MSGINDEX_FILE ".beargit/.msg-index"
+#define MSGINDEX_TAIL ".beargit/.msg-index-tail"
+#define MSGINDEX_MAX_TAIL 64
+
+typedef struct {
+  uint64_t term;
+  uint32_t offset;      // of its postings, in record numbers
+  uint32_t count;       // 0 for an empty bucket
+} msgindex_bucket;
+
+typedef struct {
+  uint64_t term;        // 0 marks the commit as indexed
+  uint32_t pos;
+  uint32_t reserved;
+} msgindex_tail_entry;
+
+typedef struct {
+  const commit_log* log;    // must stay open while the index is
+
+  const msgindex_bucket* buckets;     // the first <covered> commits
+  uint32_t nbuckets;
+  const uint32_t* postings;
+  int64_t covered;
+
+  const msgindex_tail_entry* tail;    // the commits after those
+  int64_t ntail;
+
+  // Mappings, for msgindex_close
+  void* base;
+  size_t size;
+  void* tail_base;
+  size_t tail_size;
+} msg_index;
+
+void msgindex_open(msg_index* index, const commit_log* log);
+void msgindex_close(msg_index* index);
+
+// Writes the index for all of <log> and empties the tail. Returns 0, or -1
+// if it couldn't; the tail then keeps growing until it can.
+int msgindex_write(const commit_log* log);
+
+// Adds the terms of <msg>, the message of the commit that gets record
+// number <pos>, to the tail.
+void msgindex_append(int64_t pos, const char* msg);
+
+// Puts the record numbers of the commits whose messages contain every one of
+// the <nqueries> <queries>, in any case and with all of their terms as
+// whole words, into *positions, in ascending order (every commit if there
+// are no queries). The index only finds the candidates; their messages are
+// then checked. Returns their number. Free <*positions>.
+int64_t msgindex_search(const msg_index* index, int nqueries, char* const* queries,
+                        int64_t** positions);
+
+#endif
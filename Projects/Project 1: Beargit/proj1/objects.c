@@ -0,0 +1,632 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "chunk.h"
+#include "compress.h"
+#include "config.h"
+#include "objects.h"
+#include "pack.h"
+#include "sha1.h"
+#include "util.h"
+
+/* Object store
+ *
+ * - object_hash_file(filename,blob_id): compute the blob id of <filename>
+ * - object_path(blob_id,path): path of the object file for <blob_id>
+ * - object_exists(blob_id): 1 if the object is already stored (loose or packed), 0 otherwise
+ * - object_loose_file(blob_id,path,format): path of the loose object file for
+ *   <blob_id>, and how it is stored (OBJECT_PLAIN, ...). Returns -1 if there
+ *   is none.
+ * - object_store_file(filename,blob_id): hash <filename> and store it if the
+ *   store doesn't have it yet. Returns 1 if a new object was written.
+ * - object_restore_file(blob_id,dst): copy the contents of <blob_id> to <dst>
+ *
+ * These functions may run on several worker threads at once, so instead of
+ * exiting on I/O errors they return -1 (with errno set) and leave cleaning
+ * up to the caller.
+ *
+ * With the copy_mode setting at "reflink" ("hardlink" is its old name),
+ * objects are always plain files, so commit and checkout can clone them to
+ * and from the working directory (FICLONE) where the filesystem supports it:
+ * the data is shared, but every object has an inode of its own, so editing a
+ * working file in place never changes a snapshot. Other filesystems get
+ * plain copies.
+ *
+ * With the compression setting at "lz" (and copy_mode "auto"), new objects
+ * are written compressed under <object_path>.lz. Compressed and plain objects
+ * can sit side by side; each is read the way its name says.
+ *
+ * Files of CHUNK_FILE_THRESHOLD bytes or more (again with copy_mode "auto")
+ * are cut into chunks (see chunk.h), each stored as an object of its own.
+ * The file's object, <object_path>.chunks, lists them in order as
+ * "<chunk id> <size>" lines; checkout appends them one by one to the file it
+ * restores. Chunks shared with earlier versions are only stored once.
+ *
+ * A commit stores its objects in a batch (object_batch_begin): they are
+ * written under their temporary names only, and renamed into place all
+ * together by object_batch_publish once the journal says how to finish the
+ * commit (see journal.h). Until then no object name can point at data that
+ * isn't on disk yet.
+ */
+
+static int reflink_mode(void) {
+  char mode[CONFIG_VALUE_SIZE];
+  config_get(CONFIG_COPY_MODE, mode);
+  return strcmp(mode, "reflink") == 0 || strcmp(mode, "hardlink") == 0;
+}
+
+static int compression_enabled(void) {
+  char compression[CONFIG_VALUE_SIZE];
+  config_get(CONFIG_COMPRESSION, compression);
+  return strcmp(compression, "lz") == 0;
+}
+
+int object_hash_file(const char* filename, char* blob_id) {
+  FILE* fin = fopen(filename, "r");
+  if (fin == NULL)
+    return -1;
+
+  sha1_ctx ctx;
+  sha1_init(&ctx);
+
+  char buffer[65536];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+    sha1_update(&ctx, buffer, size);
+  }
+  int failed = ferror(fin);
+  fclose(fin);
+  if (failed)
+    return -1;
+
+  unsigned char digest[SHA1_DIGEST_BYTES];
+  sha1_final(&ctx, digest);
+  sha1_to_hex(digest, blob_id);
+  return 0;
+}
+
+void object_path(const char* blob_id, char* path) {
+  sprintf(path, "%s/%.2s/%s", OBJECTS_DIR, blob_id, blob_id + 2);
+}
+
+/* Batches */
+
+static int sync_file(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int ret = fsync(fd);
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return ret;
+}
+
+typedef struct {
+  char blob_id[BLOB_ID_SIZE];
+  char tmp_path[FILENAME_SIZE];
+  char path[FILENAME_SIZE];
+} pending_object;
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int batch_open, batch_sync;
+static pending_object* pending;
+static int npending, pending_capacity;
+
+// Hash table over <pending> by blob id (position + 1, 0 for empty)
+static int* pending_slots;
+static int npending_slots;
+
+static unsigned blob_id_hash(const char* blob_id) {
+  unsigned hash = 0;
+  for (int i = 0; i < 8; i++)
+    hash = hash * 16 + (blob_id[i] <= '9' ? blob_id[i] - '0' : blob_id[i] - 'a' + 10);
+  return hash;
+}
+
+// Call with batch_lock held.
+static int pending_find(const char* blob_id) {
+  if (!npending_slots)
+    return -1;
+  for (unsigned b = blob_id_hash(blob_id) & (npending_slots - 1); pending_slots[b];
+       b = (b + 1) & (npending_slots - 1)) {
+    if (strcmp(pending[pending_slots[b] - 1].blob_id, blob_id) == 0)
+      return pending_slots[b] - 1;
+  }
+  return -1;
+}
+
+static void pending_insert_slot(int pos) {
+  unsigned b = blob_id_hash(pending[pos].blob_id) & (npending_slots - 1);
+  while (pending_slots[b])
+    b = (b + 1) & (npending_slots - 1);
+  pending_slots[b] = pos + 1;
+}
+
+// Call with batch_lock held.
+static void pending_add(const char* blob_id, const char* tmp_path, const char* path) {
+  if (npending == pending_capacity) {
+    pending_capacity = pending_capacity ? 2 * pending_capacity : 64;
+    pending = realloc(pending, pending_capacity * sizeof(pending_object));
+    ASSERT_ERROR_MESSAGE(pending != NULL, "out of memory");
+  }
+  if (2 * (npending + 1) > npending_slots) {
+    free(pending_slots);
+    npending_slots = npending_slots ? 2 * npending_slots : 128;
+    pending_slots = calloc(npending_slots, sizeof(int));
+    ASSERT_ERROR_MESSAGE(pending_slots != NULL, "out of memory");
+    for (int i = 0; i < npending; i++)
+      pending_insert_slot(i);
+  }
+
+  pending_object* object = &pending[npending];
+  strcpy(object->blob_id, blob_id);
+  strcpy(object->tmp_path, tmp_path);
+  strcpy(object->path, path);
+  pending_insert_slot(npending++);
+}
+
+static void batch_reset(void) {
+  free(pending);
+  free(pending_slots);
+  pending = NULL;
+  pending_slots = NULL;
+  npending = pending_capacity = npending_slots = 0;
+  batch_open = 0;
+}
+
+void object_batch_begin(int sync) {
+  pthread_mutex_lock(&batch_lock);
+  ASSERT_ERROR_MESSAGE(!batch_open, "object batch already open");
+  batch_open = 1;
+  batch_sync = sync;
+  pthread_mutex_unlock(&batch_lock);
+}
+
+void object_batch_for_each(void (*fn)(const char* tmp_path, const char* path, void* arg),
+                           void* arg) {
+  pthread_mutex_lock(&batch_lock);
+  for (int i = 0; i < npending; i++)
+    fn(pending[i].tmp_path, pending[i].path, arg);
+  pthread_mutex_unlock(&batch_lock);
+}
+
+void object_batch_sync(void) {
+  pthread_mutex_lock(&batch_lock);
+  for (int i = 0; i < npending && !batch_sync; i++)
+    ASSERT_ERROR_MESSAGE(sync_file(pending[i].tmp_path) == 0, "couldn't sync object");
+  if (npending)
+    ASSERT_ERROR_MESSAGE(sync_file(OBJECTS_DIR) == 0, "couldn't sync " OBJECTS_DIR);
+  pthread_mutex_unlock(&batch_lock);
+}
+
+void object_batch_publish(int sync) {
+  pthread_mutex_lock(&batch_lock);
+  // Each fanout directory is synced once, however many objects went in.
+  char synced[256] = { 0 };
+  for (int i = 0; i < npending; i++) {
+    ASSERT_ERROR_MESSAGE(rename(pending[i].tmp_path, pending[i].path) == 0,
+                         "couldn't publish object");
+    unsigned fanout = blob_id_hash(pending[i].blob_id) >> 24;
+    if (!sync || synced[fanout])
+      continue;
+    char fanout_dir[FILENAME_SIZE];
+    sprintf(fanout_dir, "%s/%.2s", OBJECTS_DIR, pending[i].blob_id);
+    ASSERT_ERROR_MESSAGE(sync_file(fanout_dir) == 0, "couldn't sync object directory");
+    synced[fanout] = 1;
+  }
+  batch_reset();
+  pthread_mutex_unlock(&batch_lock);
+}
+
+void object_batch_abort(void) {
+  pthread_mutex_lock(&batch_lock);
+  for (int i = 0; i < npending; i++)
+    unlink(pending[i].tmp_path);
+  batch_reset();
+  pthread_mutex_unlock(&batch_lock);
+}
+
+int object_exists(const char* blob_id) {
+  const char* data;
+  size_t size;
+  if (pack_find(blob_id, PACK_BLOB, &data, &size))
+    return 1;
+
+  pthread_mutex_lock(&batch_lock);
+  int batched = batch_open && pending_find(blob_id) >= 0;
+  pthread_mutex_unlock(&batch_lock);
+  if (batched)
+    return 1;
+
+  char path[FILENAME_SIZE];
+  int format;
+  return object_loose_file(blob_id, path, &format) == 0;
+}
+
+int object_loose_file(const char* blob_id, char* path, int* format) {
+  static const char* const suffixes[] = {
+    [OBJECT_PLAIN] = "",
+    [OBJECT_COMPRESSED] = OBJECT_COMPRESSED_SUFFIX,
+    [OBJECT_CHUNKED] = OBJECT_CHUNKED_SUFFIX,
+  };
+
+  object_path(blob_id, path);
+  size_t len = strlen(path);
+  for (int i = OBJECT_PLAIN; i <= OBJECT_CHUNKED; i++) {
+    struct stat s;
+    strcpy(path + len, suffixes[i]);
+    if (stat(path, &s) == 0) {
+      *format = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int make_dir(const char* dirname) {
+  return mkdir(dirname, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+static int write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      errno = n < 0 ? errno : EIO;
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Closes <fd> after writing it. Returns <ret>, or -1 if the close failed,
+// keeping the errno of the first error.
+static int close_written(int fd, int ret) {
+  int saved_errno = errno;
+  if (close(fd) != 0 && ret == 0) {
+    saved_errno = errno;
+    ret = -1;
+  }
+  errno = saved_errno;
+  return ret;
+}
+
+// Runs <fn> from file <src> into a new file <dst>. Returns 0, or -1 with
+// errno set.
+static int filter_file(const char* src, const char* dst, int (*fn)(int in, int out)) {
+  int in = open(src, O_RDONLY);
+  if (in < 0)
+    return -1;
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out < 0) {
+    int saved_errno = errno;
+    close(in);
+    errno = saved_errno;
+    return -1;
+  }
+
+  int ret = fn(in, out);
+  int saved_errno = errno;
+  close(in);
+  errno = saved_errno;
+  return close_written(out, ret);
+}
+
+static int compress_file(const char* src, const char* dst) {
+  return filter_file(src, dst, compress_stream);
+}
+
+// Makes the fanout directory for <blob_id> and picks a temporary name to
+// write the object to first, so a partially written object is never visible
+// under its final name. The name is unique per process and call, since
+// several threads may be storing objects.
+static int object_tmp_path(const char* blob_id, char* tmp_path) {
+  char fanout_dir[FILENAME_SIZE];
+  sprintf(fanout_dir, "%s/%.2s", OBJECTS_DIR, blob_id);
+  if (make_dir(OBJECTS_DIR) != 0 || make_dir(fanout_dir) != 0)
+    return -1;
+
+  static unsigned tmp_counter;
+  sprintf(tmp_path, "%s/.tmp_%d_%u", OBJECTS_DIR, (int) getpid(),
+          __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED));
+  return 0;
+}
+
+// Moves the finished object at <tmp_path> to its name for <format>, or
+// adds it to the open batch. Two threads storing the same contents at once
+// may both add it; both renames then put the same bytes in place.
+static int object_install(const char* tmp_path, const char* blob_id, int format) {
+  char path[FILENAME_SIZE];
+  object_path(blob_id, path);
+  if (format == OBJECT_COMPRESSED)
+    strcat(path, OBJECT_COMPRESSED_SUFFIX);
+  else if (format == OBJECT_CHUNKED)
+    strcat(path, OBJECT_CHUNKED_SUFFIX);
+
+  pthread_mutex_lock(&batch_lock);
+  int batched = batch_open;
+  int sync = batch_sync;
+  pthread_mutex_unlock(&batch_lock);
+
+  if (batched && sync && sync_file(tmp_path) != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+  if (batched) {
+    pthread_mutex_lock(&batch_lock);
+    pending_add(blob_id, tmp_path, path);
+    pthread_mutex_unlock(&batch_lock);
+    return 0;
+  }
+  if (rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+// Stores <data> as object <blob_id>, unless the store has it already.
+static int store_buffer(const char* blob_id, const char* data, size_t size, int compress) {
+  if (object_exists(blob_id))
+    return 0;
+
+  char tmp_path[FILENAME_SIZE];
+  if (object_tmp_path(blob_id, tmp_path) != 0)
+    return -1;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+  int ret = compress ? compress_buffer(data, size, fd) : write_all(fd, data, size);
+  if (close_written(fd, ret) != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return object_install(tmp_path, blob_id, compress ? OBJECT_COMPRESSED : OBJECT_PLAIN);
+}
+
+typedef struct {
+  FILE* list;
+  int compress;
+} chunk_writer;
+
+static int store_chunk(const char* data, size_t size, void* arg) {
+  chunk_writer* writer = arg;
+
+  sha1_ctx ctx;
+  unsigned char digest[SHA1_DIGEST_BYTES];
+  char chunk_id[BLOB_ID_SIZE];
+  sha1_init(&ctx);
+  sha1_update(&ctx, data, size);
+  sha1_final(&ctx, digest);
+  sha1_to_hex(digest, chunk_id);
+
+  if (store_buffer(chunk_id, data, size, writer->compress) != 0)
+    return -1;
+  return fprintf(writer->list, "%s %zu\n", chunk_id, size) < 0 ? -1 : 0;
+}
+
+// Stores the chunks of <filename> and writes their list to <tmp_path>.
+static int store_chunked(const char* filename, const char* tmp_path) {
+  int in = open(filename, O_RDONLY);
+  if (in < 0)
+    return -1;
+  chunk_writer writer = { fopen(tmp_path, "w"), compression_enabled() };
+  if (writer.list == NULL) {
+    int saved_errno = errno;
+    close(in);
+    errno = saved_errno;
+    return -1;
+  }
+
+  int ret = chunk_stream(in, store_chunk, &writer);
+  int saved_errno = errno;
+  close(in);
+  if (fclose(writer.list) != 0 && ret == 0) {
+    saved_errno = errno;
+    ret = -1;
+  }
+  errno = saved_errno;
+  return ret;
+}
+
+int object_store_file(const char* filename, char* blob_id) {
+  if (object_hash_file(filename, blob_id) != 0)
+    return -1;
+  if (object_exists(blob_id))
+    return 0;
+
+  char tmp_path[FILENAME_SIZE];
+  struct stat s;
+  if (object_tmp_path(blob_id, tmp_path) != 0 || stat(filename, &s) != 0)
+    return -1;
+
+  int format = OBJECT_PLAIN, ret = 0;
+  if (reflink_mode()) {
+    ret = fs_try_cp(filename, tmp_path);
+  } else if (s.st_size >= CHUNK_FILE_THRESHOLD) {
+    format = OBJECT_CHUNKED;
+    ret = store_chunked(filename, tmp_path);
+  } else if (compression_enabled()) {
+    format = OBJECT_COMPRESSED;
+    ret = compress_file(filename, tmp_path);
+  } else {
+    ret = fs_try_cp(filename, tmp_path);
+  }
+
+  if (ret != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return object_install(tmp_path, blob_id, format) == 0 ? 1 : -1;
+}
+
+// Opens <dst> to restore an object into. A hardlinked <dst> (left by
+// repositories whose objects were hard links) is unlinked rather than
+// written through.
+static int open_restored(const char* dst) {
+  struct stat s;
+  if (lstat(dst, &s) == 0 && s.st_nlink > 1)
+    unlink(dst);
+  return open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+static int copy_fd(int in, int out) {
+  char buffer[65536];
+  for (;;) {
+    ssize_t n = read(in, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n;
+    if (write_all(out, buffer, n) != 0)
+      return -1;
+  }
+}
+
+// Appends the contents of the object <blob_id>, which isn't chunked, to
+// <fd>.
+static int append_object(const char* blob_id, int fd) {
+  pack_blob blob;
+  if (pack_read_blob(blob_id, &blob)) {
+    int ret = blob.chunked ? (errno = EINVAL, -1) : write_all(fd, blob.data, blob.size);
+    pack_blob_free(&blob);
+    return ret;
+  }
+
+  char path[FILENAME_SIZE];
+  int format;
+  if (object_loose_file(blob_id, path, &format) != 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (format == OBJECT_CHUNKED) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int in = open(path, O_RDONLY);
+  if (in < 0)
+    return -1;
+  int ret = format == OBJECT_COMPRESSED ? decompress_stream(in, fd) : copy_fd(in, fd);
+  int saved_errno = errno;
+  close(in);
+  errno = saved_errno;
+  return ret;
+}
+
+// Writes the chunks in the chunk list <list> to <fd> one after the other,
+// checking each has the size the list says.
+static int append_chunks(const char* list, size_t size, int fd) {
+  const char* end = list + size;
+  off_t expected = 0;
+  while (list < end) {
+    const char* eol = memchr(list, '\n', end - list);
+    char chunk_id[BLOB_ID_SIZE];
+    char* size_end;
+    if (eol == NULL || eol - list < BLOB_ID_BYTES + 2 || list[BLOB_ID_BYTES] != ' ') {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(chunk_id, list, BLOB_ID_BYTES);
+    chunk_id[BLOB_ID_BYTES] = '\0';
+    expected += strtoull(list + BLOB_ID_BYTES + 1, &size_end, 10);
+    if (size_end != eol) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    if (append_object(chunk_id, fd) != 0)
+      return -1;
+    if (lseek(fd, 0, SEEK_CUR) != expected) {
+      errno = EINVAL;
+      return -1;
+    }
+    list = eol + 1;
+  }
+  return 0;
+}
+
+// Reads a loose chunk list into memory.
+static char* read_chunk_list(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat s;
+  char* list = NULL;
+  if (fstat(fd, &s) == 0) {
+    list = malloc(s.st_size ? s.st_size : 1);
+    ASSERT_ERROR_MESSAGE(list != NULL, "out of memory");
+    size_t done = 0;
+    while (done < (size_t) s.st_size) {
+      ssize_t n = read(fd, list + done, s.st_size - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        errno = n < 0 ? errno : EIO;
+        break;
+      }
+      done += n;
+    }
+    if (done != (size_t) s.st_size) {
+      free(list);
+      list = NULL;
+    }
+    *size = done;
+  }
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return list;
+}
+
+int object_restore_file(const char* blob_id, const char* dst) {
+  pack_blob blob;
+  if (pack_read_blob(blob_id, &blob)) {
+    int fd = open_restored(dst);
+    int ret = fd < 0 ? -1 : 0;
+    if (ret == 0) {
+      ret = blob.chunked ? append_chunks(blob.data, blob.size, fd)
+                         : write_all(fd, blob.data, blob.size);
+      ret = close_written(fd, ret);
+    }
+    int saved_errno = errno;
+    pack_blob_free(&blob);
+    errno = saved_errno;
+    return ret;
+  }
+
+  char path[FILENAME_SIZE];
+  int format;
+  if (object_loose_file(blob_id, path, &format) != 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (format == OBJECT_PLAIN)
+    return fs_try_cp(path, dst);
+
+  size_t size = 0;
+  char* list = NULL;
+  if (format == OBJECT_CHUNKED && (list = read_chunk_list(path, &size)) == NULL)
+    return -1;
+  int fd = open_restored(dst);
+  int ret = -1;
+  if (fd >= 0)
+    ret = close_written(fd, list ? append_chunks(list, size, fd) : append_object(blob_id, fd));
+  int saved_errno = errno;
+  free(list);
+  errno = saved_errno;
+  return ret;
+}
@@ -0,0 +1,46 @@
+/**
+ * Content-addressed object store. Every distinct file content is stored once
+ * under .beargit/objects/<first 2 hex digits>/<remaining 38 hex digits>,
+ * named by the SHA-1 of its contents. Objects stored with compression on have
+ * OBJECT_COMPRESSED_SUFFIX appended to that name, and large files split into
+ * chunks OBJECT_CHUNKED_SUFFIX.
+ */
+
+#ifndef OBJECTS_H
+#define OBJECTS_H
+
+#define OBJECTS_DIR ".beargit/objects"
+
+// Number of bytes in a blob id (hex-encoded SHA-1 of the contents)
+#define BLOB_ID_BYTES 40
+#define BLOB_ID_SIZE (BLOB_ID_BYTES+1)
+
+#define OBJECT_COMPRESSED_SUFFIX ".lz"
+#define OBJECT_CHUNKED_SUFFIX ".chunks"
+
+// How a loose object is stored
+#define OBJECT_PLAIN 0
+#define OBJECT_COMPRESSED 1
+#define OBJECT_CHUNKED 2
+
+int object_hash_file(const char* filename, char* blob_id);
+void object_path(const char* blob_id, char* path);
+int object_exists(const char* blob_id);
+int object_loose_file(const char* blob_id, char* path, int* format);
+int object_store_file(const char* filename, char* blob_id);
+int object_restore_file(const char* blob_id, const char* dst);
+
+// Object batches: from object_batch_begin on, new objects keep their
+// temporary names (fsynced first if <sync> is set) until object_batch_publish
+// renames them all into place, and fsyncs the directories they went into if
+// its <sync> is set; object_batch_abort deletes them instead.
+// object_batch_for_each lists the renames still to do, and object_batch_sync
+// fsyncs the objects still under their temporary names.
+void object_batch_begin(int sync);
+void object_batch_for_each(void (*fn)(const char* tmp_path, const char* path, void* arg),
+                           void* arg);
+void object_batch_sync(void);
+void object_batch_publish(int sync);
+void object_batch_abort(void);
+
+#endif
@@ -0,0 +1,591 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "compress.h"
+#include "delta.h"
+#include "objects.h"
+#include "pack.h"
+#include "util.h"
+
+/* Pack file format
+ *
+ *   header    pack_header
+ *   data      the contents of every entry, back to back
+ *   index     pack_header.count pack_index_entry records sorted by (id, type)
+ *
+ * The index comes last so the pack can be written in one pass; the header is
+ * patched at the end. Since data and index share a file, replacing the pack
+ * is a single rename and a reader never sees one without the other.
+ *
+ * A blob with the PACK_DELTA flag is stored as the id of its base blob and a
+ * delta against it. Bases are always written before the blobs that use them.
+ * A whole blob with the PACK_COMPRESSED flag is a compressed stream (see
+ * compress.h), copied as is from a compressed loose object. One with the
+ * PACK_CHUNKED flag is a chunk list; its chunks are blobs of their own and
+ * it is never a delta or the base of one.
+ */
+
+#define PACK_MAGIC "BPCK"
+#define PACK_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t index_offset;
+} pack_header;
+
+typedef struct {
+  char id[40];
+  uint32_t type;
+  uint32_t flags;
+  uint64_t offset;
+  uint64_t size;
+} pack_index_entry;
+
+// Blobs larger than this are always stored whole, so building a delta never
+// needs more than a few times this much memory.
+#define PACK_DELTA_MAX_SIZE (64 << 20)
+
+// Rebuilt blobs kept for the next lookup.
+#define BLOB_CACHE_SLOTS 64
+#define BLOB_CACHE_BYTES (64 << 20)
+
+/* Reading. The pack is mapped on the first lookup and shared by all threads. */
+
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pack_loaded;
+static char* pack_base;
+static size_t pack_size;
+static const pack_index_entry* pack_index;
+static uint32_t pack_count;
+
+static void pack_load(void) {
+  pthread_mutex_lock(&pack_lock);
+  if (!pack_loaded) {
+    int fd = open(PACK_FILE, O_RDONLY);
+    ASSERT_ERROR_MESSAGE(fd >= 0 || errno == ENOENT, "couldn't open pack");
+
+    struct stat s;
+    if (fd >= 0 && fstat(fd, &s) == 0 && s.st_size >= (off_t) sizeof(pack_header)) {
+      pack_size = s.st_size;
+      pack_base = mmap(NULL, pack_size, PROT_READ, MAP_SHARED, fd, 0);
+      ASSERT_ERROR_MESSAGE(pack_base != MAP_FAILED, "couldn't map pack");
+
+      const pack_header* header = (const pack_header*) pack_base;
+      ASSERT_ERROR_MESSAGE(memcmp(header->magic, PACK_MAGIC, 4) == 0 &&
+                           header->version == PACK_VERSION, "unsupported pack format");
+      ASSERT_ERROR_MESSAGE(header->index_offset + (uint64_t) header->count * sizeof(pack_index_entry)
+                           <= pack_size, "truncated pack");
+      pack_index = (const pack_index_entry*) (pack_base + header->index_offset);
+      pack_count = header->count;
+    }
+    if (fd >= 0)
+      close(fd);
+    __atomic_store_n(&pack_loaded, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&pack_lock);
+}
+
+static int compare_key(const char* id, int type, const pack_index_entry* entry) {
+  int cmp = memcmp(id, entry->id, sizeof(entry->id));
+  if (cmp)
+    return cmp;
+  return type - (int) entry->type;
+}
+
+static const pack_index_entry* pack_lookup(const char* id, int type) {
+  if (!__atomic_load_n(&pack_loaded, __ATOMIC_ACQUIRE))
+    pack_load();
+
+  uint32_t lo = 0, hi = pack_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = compare_key(id, type, &pack_index[mid]);
+    if (cmp == 0)
+      return &pack_index[mid];
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+int pack_find(const char* id, int type, const char** data, size_t* size) {
+  if (strlen(id) != sizeof(pack_index->id))
+    return 0;
+
+  const pack_index_entry* entry = pack_lookup(id, type);
+  if (entry == NULL)
+    return 0;
+  *data = pack_base + entry->offset;
+  *size = entry->size;
+  return 1;
+}
+
+/* Cache of rebuilt blobs, least recently used goes first */
+
+typedef struct {
+  char id[40];
+  char* data;
+  size_t size;
+  uint64_t used;
+} cached_blob;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_blob blob_cache[BLOB_CACHE_SLOTS];
+static size_t blob_cache_bytes;
+static uint64_t blob_cache_clock;
+
+// Returns a copy of the cached contents of <id>, or NULL.
+static char* cache_get(const char* id, size_t* size) {
+  char* copy = NULL;
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < BLOB_CACHE_SLOTS; i++) {
+    cached_blob* slot = &blob_cache[i];
+    if (slot->data && memcmp(slot->id, id, sizeof(slot->id)) == 0) {
+      copy = malloc(slot->size ? slot->size : 1);
+      ASSERT_ERROR_MESSAGE(copy != NULL, "out of memory");
+      memcpy(copy, slot->data, slot->size);
+      *size = slot->size;
+      slot->used = ++blob_cache_clock;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return copy;
+}
+
+static void cache_drop(cached_blob* slot) {
+  blob_cache_bytes -= slot->size;
+  free(slot->data);
+  memset(slot, 0, sizeof(*slot));
+}
+
+static void cache_put(const char* id, const char* data, size_t size) {
+  if (size > BLOB_CACHE_BYTES / 4)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+  for (;;) {
+    cached_blob* oldest = NULL;
+    cached_blob* free_slot = NULL;
+    for (int i = 0; i < BLOB_CACHE_SLOTS; i++) {
+      cached_blob* slot = &blob_cache[i];
+      if (slot->data && memcmp(slot->id, id, sizeof(slot->id)) == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+      }
+      if (!slot->data)
+        free_slot = free_slot ? free_slot : slot;
+      else if (!oldest || slot->used < oldest->used)
+        oldest = slot;
+    }
+
+    if (free_slot && blob_cache_bytes + size <= BLOB_CACHE_BYTES) {
+      free_slot->data = malloc(size ? size : 1);
+      ASSERT_ERROR_MESSAGE(free_slot->data != NULL, "out of memory");
+      memcpy(free_slot->data, data, size);
+      memcpy(free_slot->id, id, sizeof(free_slot->id));
+      free_slot->size = size;
+      free_slot->used = ++blob_cache_clock;
+      blob_cache_bytes += size;
+      break;
+    }
+    cache_drop(oldest);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_clear(void) {
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < BLOB_CACHE_SLOTS; i++) {
+    if (blob_cache[i].data)
+      cache_drop(&blob_cache[i]);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static int entry_depth(const pack_index_entry* entry) {
+  return entry->flags & PACK_DELTA ? (entry->flags >> PACK_DEPTH_SHIFT) & 0xff : 0;
+}
+
+int pack_read_blob(const char* blob_id, pack_blob* blob) {
+  memset(blob, 0, sizeof(*blob));
+  if (strlen(blob_id) != sizeof(pack_index->id))
+    return 0;
+
+  const pack_index_entry* entry = pack_lookup(blob_id, PACK_BLOB);
+  if (entry == NULL)
+    return 0;
+  if (!(entry->flags & (PACK_DELTA | PACK_COMPRESSED))) {
+    blob->data = pack_base + entry->offset;
+    blob->size = entry->size;
+    blob->chunked = (entry->flags & PACK_CHUNKED) != 0;
+    return 1;
+  }
+
+  // Follow the chain down to a whole blob or one that was rebuilt recently...
+  const pack_index_entry* chain[PACK_MAX_DEPTH + 1];
+  int depth = 0;
+  char* data = NULL;
+  size_t size = 0;
+  while ((entry->flags & (PACK_DELTA | PACK_COMPRESSED)) &&
+         (data = cache_get(entry->id, &size)) == NULL) {
+    if (!(entry->flags & PACK_DELTA))
+      break;
+    ASSERT_ERROR_MESSAGE(depth <= PACK_MAX_DEPTH && entry->size >= sizeof(entry->id),
+                         "corrupt delta chain in pack");
+    chain[depth++] = entry;
+    entry = pack_lookup(pack_base + entry->offset, PACK_BLOB);
+    ASSERT_ERROR_MESSAGE(entry != NULL, "delta base missing from pack");
+  }
+
+  // ...decompress it if need be...
+  if (data == NULL && (entry->flags & PACK_COMPRESSED)) {
+    data = decompress_buffer(pack_base + entry->offset, entry->size, SIZE_MAX, &size);
+    ASSERT_ERROR_MESSAGE(data != NULL, "corrupt compressed blob in pack");
+    cache_put(entry->id, data, size);
+  }
+
+  // ...then apply the deltas back up.
+  const char* base = data ? data : pack_base + entry->offset;
+  size_t base_size = data ? size : entry->size;
+  while (depth--) {
+    const pack_index_entry* delta = chain[depth];
+    char* rebuilt = delta_apply(base, base_size, pack_base + delta->offset + sizeof(delta->id),
+                                delta->size - sizeof(delta->id), &size);
+    ASSERT_ERROR_MESSAGE(rebuilt != NULL, "corrupt delta in pack");
+    free(data);
+    data = rebuilt;
+    base = data;
+    base_size = size;
+    cache_put(delta->id, data, size);
+  }
+
+  blob->buffer = data;
+  blob->data = base;
+  blob->size = base_size;
+  return 1;
+}
+
+void pack_blob_free(pack_blob* blob) {
+  free(blob->buffer);
+  memset(blob, 0, sizeof(*blob));
+}
+
+int pack_parse_commit(const char* data, size_t size, char* parent, char* msg, int msg_size,
+                      const char** manifest, size_t* manifest_size) {
+  if (size < COMMIT_ID_BYTES + 1 || data[COMMIT_ID_BYTES] != '\n')
+    return -1;
+  const char* msg_start = data + COMMIT_ID_BYTES + 1;
+  const char* msg_end = memchr(msg_start, '\0', size - COMMIT_ID_BYTES - 1);
+  if (msg_end == NULL)
+    return -1;
+
+  memcpy(parent, data, COMMIT_ID_BYTES);
+  parent[COMMIT_ID_BYTES] = '\0';
+  snprintf(msg, msg_size, "%s", msg_start);
+  *manifest = msg_end + 1;
+  *manifest_size = size - (msg_end + 1 - data);
+  return 0;
+}
+
+void pack_for_each(void (*fn)(const char* id, int type, int flags, const char* data,
+                              size_t size, void* arg), void* arg) {
+  if (!__atomic_load_n(&pack_loaded, __ATOMIC_ACQUIRE))
+    pack_load();
+
+  for (uint32_t i = 0; i < pack_count; i++) {
+    char id[sizeof(pack_index[i].id) + 1];
+    memcpy(id, pack_index[i].id, sizeof(pack_index[i].id));
+    id[sizeof(pack_index[i].id)] = '\0';
+    fn(id, pack_index[i].type, pack_index[i].flags, pack_base + pack_index[i].offset,
+       pack_index[i].size, arg);
+  }
+}
+
+void pack_close(void) {
+  pthread_mutex_lock(&pack_lock);
+  if (pack_base)
+    munmap(pack_base, pack_size);
+  pack_base = NULL;
+  pack_size = 0;
+  pack_index = NULL;
+  pack_count = 0;
+  __atomic_store_n(&pack_loaded, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pack_lock);
+
+  cache_clear();
+}
+
+/* Writing */
+
+struct pack_writer {
+  int fd;
+  uint64_t offset;
+  pack_index_entry* entries;
+  uint32_t count;
+  uint32_t capacity;
+
+  // Hash table over entries (entry position + 1, 0 for empty)
+  uint32_t* buckets;
+  uint32_t nbuckets;
+};
+
+static const char* pack_tmp_file = PACK_FILE ".tmp";
+
+static void write_all(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    ASSERT_ERROR_MESSAGE(n > 0 || errno == EINTR, "couldn't write pack");
+    if (n > 0) {
+      p += n;
+      len -= n;
+    }
+  }
+}
+
+// FNV-1a over the id and type
+static uint32_t entry_hash(const char* id, int type) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(pack_index->id); i++) {
+    hash ^= (unsigned char) id[i];
+    hash *= 16777619u;
+  }
+  return (hash ^ type) * 16777619u;
+}
+
+// Slot for <id> in the writer's table: the one holding it, or the empty
+// slot it would go in.
+static uint32_t* writer_slot(pack_writer* writer, const char* id, int type) {
+  uint32_t b = entry_hash(id, type) & (writer->nbuckets - 1);
+  while (writer->buckets[b] &&
+         compare_key(id, type, &writer->entries[writer->buckets[b] - 1]) != 0)
+    b = (b + 1) & (writer->nbuckets - 1);
+  return &writer->buckets[b];
+}
+
+static const pack_index_entry* writer_find(pack_writer* writer, const char* id, int type) {
+  uint32_t slot = *writer_slot(writer, id, type);
+  return slot ? &writer->entries[slot - 1] : NULL;
+}
+
+pack_writer* pack_writer_start(void) {
+  pack_writer* writer = calloc(1, sizeof(pack_writer));
+  ASSERT_ERROR_MESSAGE(writer != NULL, "out of memory");
+
+  writer->fd = open(pack_tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_ERROR_MESSAGE(writer->fd >= 0, "couldn't create pack");
+
+  writer->nbuckets = 512;
+  writer->buckets = calloc(writer->nbuckets, sizeof(uint32_t));
+  ASSERT_ERROR_MESSAGE(writer->buckets != NULL, "out of memory");
+
+  pack_header header = { 0 };
+  write_all(writer->fd, &header, sizeof(header));
+  writer->offset = sizeof(header);
+  return writer;
+}
+
+int pack_writer_has(pack_writer* writer, const char* id, int type) {
+  return writer_find(writer, id, type) != NULL;
+}
+
+static void pack_writer_add_entry(pack_writer* writer, const char* id, int type, int flags,
+                                  uint64_t size) {
+  if (writer->count == writer->capacity) {
+    writer->capacity = writer->capacity ? 2 * writer->capacity : 256;
+    writer->entries = realloc(writer->entries, writer->capacity * sizeof(pack_index_entry));
+    ASSERT_ERROR_MESSAGE(writer->entries != NULL, "out of memory");
+  }
+
+  pack_index_entry* entry = &writer->entries[writer->count++];
+  memset(entry, 0, sizeof(*entry));
+  memcpy(entry->id, id, sizeof(entry->id));
+  entry->type = type;
+  entry->flags = flags;
+  entry->offset = writer->offset;
+  entry->size = size;
+  writer->offset += size;
+
+  if (2 * writer->count > writer->nbuckets) {
+    free(writer->buckets);
+    writer->nbuckets *= 2;
+    writer->buckets = calloc(writer->nbuckets, sizeof(uint32_t));
+    ASSERT_ERROR_MESSAGE(writer->buckets != NULL, "out of memory");
+    for (uint32_t i = 0; i < writer->count; i++)
+      *writer_slot(writer, writer->entries[i].id, writer->entries[i].type) = i + 1;
+  } else {
+    *writer_slot(writer, id, type) = writer->count;
+  }
+}
+
+void pack_writer_add(pack_writer* writer, const char* id, int type, int flags,
+                     const void* data, size_t size) {
+  write_all(writer->fd, data, size);
+  pack_writer_add_entry(writer, id, type, flags, size);
+}
+
+// Reads a whole file into memory. Returns NULL if it can't be read or is
+// larger than PACK_DELTA_MAX_SIZE.
+static char* read_small_file(const char* filename, size_t* size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat s;
+  char* data = NULL;
+  if (fstat(fd, &s) == 0 && s.st_size <= PACK_DELTA_MAX_SIZE) {
+    data = malloc(s.st_size ? s.st_size : 1);
+    ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+    size_t done = 0;
+    while (done < (size_t) s.st_size) {
+      ssize_t n = read(fd, data + done, s.st_size - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    if (done != (size_t) s.st_size) {
+      free(data);
+      data = NULL;
+    }
+    *size = done;
+  }
+  close(fd);
+  return data;
+}
+
+// Contents of the loose object <blob_id>, decompressed if it is stored
+// compressed. Returns NULL under the same conditions as read_small_file.
+static char* read_loose_blob(const char* blob_id, size_t* size) {
+  char path[FILENAME_SIZE];
+  int format;
+  if (object_loose_file(blob_id, path, &format) != 0 || format == OBJECT_CHUNKED)
+    return NULL;
+
+  char* data = read_small_file(path, size);
+  if (data && format == OBJECT_COMPRESSED) {
+    char* raw = decompress_buffer(data, *size, PACK_DELTA_MAX_SIZE, size);
+    free(data);
+    data = raw;
+  }
+  return data;
+}
+
+// Contents of a blob that is going into the new pack: from the current pack
+// or from the loose object.
+static char* read_blob_for_delta(const char* blob_id, size_t* size) {
+  pack_blob blob;
+  if (pack_read_blob(blob_id, &blob)) {
+    char* data = NULL;
+    if (!blob.chunked && blob.size <= PACK_DELTA_MAX_SIZE) {
+      data = malloc(blob.size ? blob.size : 1);
+      ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+      memcpy(data, blob.data, blob.size);
+      *size = blob.size;
+    }
+    pack_blob_free(&blob);
+    return data;
+  }
+  return read_loose_blob(blob_id, size);
+}
+
+static void pack_writer_add_file(pack_writer* writer, const char* id, int type, int flags,
+                                 const char* filename) {
+  int in = open(filename, O_RDONLY);
+  ASSERT_ERROR_MESSAGE(in >= 0, "couldn't open file to pack");
+
+  char buffer[65536];
+  uint64_t size = 0;
+  ssize_t n;
+  while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+    ASSERT_ERROR_MESSAGE(n > 0 || errno == EINTR, "couldn't read file to pack");
+    if (n > 0) {
+      write_all(writer->fd, buffer, n);
+      size += n;
+    }
+  }
+  close(in);
+  pack_writer_add_entry(writer, id, type, flags, size);
+}
+
+int pack_writer_add_blob(pack_writer* writer, const char* blob_id, const char* base_id) {
+  char filename[FILENAME_SIZE];
+  int format;
+  ASSERT_ERROR_MESSAGE(object_loose_file(blob_id, filename, &format) == 0,
+                       "couldn't find object to pack");
+  int whole_flags = format == OBJECT_COMPRESSED ? PACK_COMPRESSED
+                  : format == OBJECT_CHUNKED ? PACK_CHUNKED : 0;
+
+  const pack_index_entry* base = base_id ? writer_find(writer, base_id, PACK_BLOB) : NULL;
+  if (base == NULL || format == OBJECT_CHUNKED || (base->flags & PACK_CHUNKED) ||
+      entry_depth(base) >= PACK_MAX_DEPTH) {
+    pack_writer_add_file(writer, blob_id, PACK_BLOB, whole_flags, filename);
+    return 0;
+  }
+  int depth = entry_depth(base) + 1;
+
+  size_t base_size, target_size, delta_size;
+  char* base_data = read_blob_for_delta(base_id, &base_size);
+  char* target = base_data ? read_loose_blob(blob_id, &target_size) : NULL;
+
+  // Only worth it if the delta is at most half the size of the blob.
+  char* delta = target ? delta_encode(base_data, base_size, target, target_size,
+                                      target_size / 2, &delta_size) : NULL;
+  if (delta) {
+    write_all(writer->fd, base_id, sizeof(pack_index->id));
+    write_all(writer->fd, delta, delta_size);
+    pack_writer_add_entry(writer, blob_id, PACK_BLOB,
+                          PACK_DELTA | (depth << PACK_DEPTH_SHIFT),
+                          sizeof(pack_index->id) + delta_size);
+  } else {
+    pack_writer_add_file(writer, blob_id, PACK_BLOB, whole_flags, filename);
+  }
+
+  int deltified = delta != NULL;
+  free(delta);
+  free(target);
+  free(base_data);
+  return deltified;
+}
+
+static int compare_entries(const void* a, const void* b) {
+  const pack_index_entry* entry = a;
+  return compare_key(entry->id, entry->type, b);
+}
+
+void pack_writer_finish(pack_writer* writer) {
+  qsort(writer->entries, writer->count, sizeof(pack_index_entry), compare_entries);
+  write_all(writer->fd, writer->entries, writer->count * sizeof(pack_index_entry));
+
+  pack_header header = { PACK_MAGIC, PACK_VERSION, writer->count, 0, writer->offset };
+  ASSERT_ERROR_MESSAGE(pwrite(writer->fd, &header, sizeof(header), 0) == sizeof(header),
+                       "couldn't write pack");
+  // The pack replaces loose files that repack deletes right after, so it
+  // has to be on disk before its name is.
+  ASSERT_ERROR_MESSAGE(fsync(writer->fd) == 0 || errno == EINVAL, "couldn't sync pack");
+  ASSERT_ERROR_MESSAGE(close(writer->fd) == 0, "couldn't write pack");
+
+  ASSERT_ERROR_MESSAGE(rename(pack_tmp_file, PACK_FILE) == 0, "couldn't replace pack");
+  pack_close();
+
+  free(writer->entries);
+  free(writer->buckets);
+  free(writer);
+}
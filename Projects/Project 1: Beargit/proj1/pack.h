@@ -0,0 +1,82 @@
+/**
+ * The packfile (.beargit/objects/pack) holds objects and commits that
+ * `beargit repack` moved out of their loose files and directories, so a long
+ * history doesn't need an inode per blob and a directory per commit. Readers
+ * map it once and find entries by binary search in its sorted index; loose
+ * objects and commit directories are still looked at for anything newer.
+ *
+ * A packed blob may be stored as a delta against an earlier version of the
+ * same file (see delta.h). Delta chains are at most PACK_MAX_DEPTH long, and
+ * recently rebuilt blobs are cached, so checking out neighbouring commits
+ * only applies a delta or two.
+ */
+
+#include <stddef.h>
+
+#ifndef PACK_H
+#define PACK_H
+
+#define PACK_FILE ".beargit/objects/pack"
+
+// Entry types
+#define PACK_BLOB 1
+#define PACK_COMMIT 2     // "<parent-id>\n<msg>\0<manifest lines>"
+
+// Entry flags. A delta's data is the base blob id followed by the delta;
+// bits 8-15 of its flags hold its depth in the delta chain. A compressed
+// blob's data is a compressed stream, a chunked one's the list of its chunks
+// (see objects.c).
+#define PACK_DELTA 0x1
+#define PACK_COMPRESSED 0x2
+#define PACK_CHUNKED 0x4
+#define PACK_DEPTH_SHIFT 8
+#define PACK_MAX_DEPTH 10
+
+// Points *data at the mapped contents of entry <id>. Returns 1 if the pack has
+// it, 0 otherwise. The pointer stays valid until pack_close. For deltified
+// blobs this is the raw delta; use pack_read_blob to get the contents.
+int pack_find(const char* id, int type, const char** data, size_t* size);
+
+// Contents of a packed blob. <buffer> is set if they had to be rebuilt from
+// deltas, and is freed by pack_blob_free. For a chunked blob, <chunked> is
+// set and the data is its chunk list.
+typedef struct {
+  const char* data;
+  size_t size;
+  char* buffer;
+  int chunked;
+} pack_blob;
+
+int pack_read_blob(const char* blob_id, pack_blob* blob);
+void pack_blob_free(pack_blob* blob);
+
+// Splits a PACK_COMMIT entry. <parent> gets COMMIT_ID_SIZE bytes, <msg> at most
+// <msg_size>. Returns 0, or -1 if the entry is malformed.
+int pack_parse_commit(const char* data, size_t size, char* parent, char* msg, int msg_size,
+                      const char** manifest, size_t* manifest_size);
+
+// Calls fn for every entry in the pack, with its raw data.
+void pack_for_each(void (*fn)(const char* id, int type, int flags, const char* data,
+                              size_t size, void* arg), void* arg);
+
+// Unmaps the pack and drops cached blobs. It is mapped again on the next lookup.
+void pack_close(void);
+
+// Writing a new pack. Entries must not be added twice (see pack_writer_has);
+// pack_writer_finish replaces the current pack with the new one in a single
+// rename.
+typedef struct pack_writer pack_writer;
+
+pack_writer* pack_writer_start(void);
+int pack_writer_has(pack_writer* writer, const char* id, int type);
+void pack_writer_add(pack_writer* writer, const char* id, int type, int flags,
+                     const void* data, size_t size);
+
+// Adds the loose object <blob_id>, as a delta against <base_id> if that is
+// already in the new pack, not too deep a delta itself, and similar enough.
+// <base_id> may be NULL. Returns 1 if the blob was stored as a delta.
+int pack_writer_add_blob(pack_writer* writer, const char* blob_id, const char* base_id);
+
+void pack_writer_finish(pack_writer* writer);
+
+#endif
@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "refs.h"
+#include "util.h"
+
+/* Refs file format
+ *
+ *   header    refs_header
+ *   slots     refs_header.capacity ref_slot records, a power of two
+ *
+ * A branch lives in the slot its name hashes to, or the next free one after
+ * it (wrapping around); a slot with an empty name is free. Branches are
+ * never removed, so lookups stop at the first free slot. The table is
+ * rebuilt twice as large, into a new file that is renamed over the old one,
+ * before it gets more than 3/4 full.
+ *
+ * Every slot has room for two heads and says which one is current. Moving a
+ * head writes the other one and then flips <active>, a single aligned 32-bit
+ * store, so the head read back is always either the old or the new commit id
+ * and never a mix of both. A new branch fills its slot before its name, and
+ * the name before the header's count.
+ *
+ * Between refs_open and refs_close the table stays mapped (<held>), and the
+ * functions below use that mapping instead of opening the file every time.
+ */
+
+#define REFS_MAGIC "BREF"
+#define REFS_VERSION 1
+#define REFS_MIN_CAPACITY 64
+
+#define LEGACY_BRANCHES ".beargit/.branches"
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t count;
+} refs_header;
+
+typedef struct {
+  char name[BRANCHNAME_SIZE];
+  char heads[2][COMMIT_ID_BYTES];
+  uint32_t active;
+  int32_t number;
+} ref_slot;
+
+typedef struct {
+  refs_header* header;
+  ref_slot* slots;
+  size_t size;
+} refs_table;
+
+// The table kept mapped by refs_open, if any
+static refs_table held;
+
+static uint32_t name_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (; *name; name++)
+    hash = (hash ^ (unsigned char) *name) * 16777619u;
+  return hash;
+}
+
+// Slot of branch <name>, or of the free slot where it would go.
+static ref_slot* find_slot(const refs_table* table, const char* name) {
+  uint32_t mask = table->header->capacity - 1;
+  for (uint32_t i = name_hash(name) & mask;; i = (i + 1) & mask) {
+    ref_slot* slot = &table->slots[i];
+    if (!slot->name[0] || strncmp(slot->name, name, BRANCHNAME_SIZE) == 0)
+      return slot;
+  }
+}
+
+static void set_slot(ref_slot* slot, const char* name, const char* head, int number) {
+  memcpy(slot->heads[0], head, COMMIT_ID_BYTES);
+  slot->active = 0;
+  slot->number = number;
+  snprintf(slot->name, BRANCHNAME_SIZE, "%s", name);
+}
+
+// Writes a new, empty table for <capacity> slots to <filename> and maps it.
+static void create_table(refs_table* table, const char* filename, uint32_t capacity) {
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't create refs database");
+  table->size = sizeof(refs_header) + (size_t) capacity * sizeof(ref_slot);
+  ASSERT_ERROR_MESSAGE(ftruncate(fd, table->size) == 0, "couldn't create refs database");
+
+  void* base = mmap(NULL, table->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ASSERT_ERROR_MESSAGE(base != MAP_FAILED, "couldn't map refs database");
+  close(fd);
+
+  table->header = base;
+  table->slots = (ref_slot*) ((char*) base + sizeof(refs_header));
+  memcpy(table->header->magic, REFS_MAGIC, 4);
+  table->header->version = REFS_VERSION;
+  table->header->capacity = capacity;
+  table->header->count = 0;
+}
+
+static void unmap_table(refs_table* table) {
+  munmap(table->header, table->size);
+  memset(table, 0, sizeof(*table));
+}
+
+// Done with a table from open_table; the held one stays mapped.
+static void close_table(refs_table* table) {
+  if (table->header != held.header)
+    unmap_table(table);
+}
+
+// Builds the database from .branches and the .branch_<name> files. Branch
+// numbers stay the line numbers in .branches.
+static void import_legacy(void) {
+  FILE* fbranches = fopen(LEGACY_BRANCHES, "r");
+  ASSERT_ERROR_MESSAGE(fbranches != NULL, "couldn't read .branches");
+  char line[FILENAME_SIZE];
+  uint32_t lines = 0, capacity = REFS_MIN_CAPACITY;
+  while (fgets(line, sizeof(line), fbranches))
+    lines++;
+  while ((lines + 1) * 4 > capacity * 3)
+    capacity *= 2;
+
+  refs_table table;
+  create_table(&table, REFS_FILE ".tmp", capacity);
+  rewind(fbranches);
+  for (int number = 0; fgets(line, sizeof(line), fbranches); number++) {
+    strtok(line, "\n");
+    ref_slot* slot = find_slot(&table, line);
+    if (!line[0] || strlen(line) >= BRANCHNAME_SIZE || slot->name[0])
+      continue;
+
+    // The current branch's head was only written out when switching away.
+    char branch_file[FILENAME_SIZE + 32];
+    char head[COMMIT_ID_SIZE] = "0000000000000000000000000000000000000000";
+    sprintf(branch_file, ".beargit/.branch_%s", line);
+    if (access(branch_file, F_OK) == 0)
+      read_string_from_file(branch_file, head, COMMIT_ID_SIZE);
+    set_slot(slot, line, head, number);
+  }
+  table.header->count = lines;
+  fclose(fbranches);
+
+  unmap_table(&table);
+  ASSERT_ERROR_MESSAGE(rename(REFS_FILE ".tmp", REFS_FILE) == 0, "couldn't create refs database");
+}
+
+static void open_table(refs_table* table) {
+  if (held.header) {
+    *table = held;
+    return;
+  }
+
+  int fd = open(REFS_FILE, O_RDWR);
+  if (fd < 0 && errno == ENOENT && access(LEGACY_BRANCHES, F_OK) == 0) {
+    import_legacy();
+    fd = open(REFS_FILE, O_RDWR);
+  }
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't open refs database");
+
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &s) == 0 && s.st_size >= (off_t) sizeof(refs_header),
+                       "truncated refs database");
+  void* base = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ASSERT_ERROR_MESSAGE(base != MAP_FAILED, "couldn't map refs database");
+  close(fd);
+
+  table->header = base;
+  table->slots = (ref_slot*) ((char*) base + sizeof(refs_header));
+  table->size = s.st_size;
+  uint32_t capacity = table->header->capacity;
+  ASSERT_ERROR_MESSAGE(memcmp(table->header->magic, REFS_MAGIC, 4) == 0, "not a refs database");
+  ASSERT_ERROR_MESSAGE(table->header->version == REFS_VERSION, "unsupported refs database version");
+  ASSERT_ERROR_MESSAGE(capacity && !(capacity & (capacity - 1)) &&
+                       table->size == sizeof(refs_header) + (size_t) capacity * sizeof(ref_slot),
+                       "corrupt refs database");
+}
+
+// Rehashes every branch into a table twice as large and puts it in place.
+static void grow_table(refs_table* table) {
+  refs_table grown;
+  create_table(&grown, REFS_FILE ".tmp", table->header->capacity * 2);
+  for (uint32_t i = 0; i < table->header->capacity; i++) {
+    const ref_slot* slot = &table->slots[i];
+    if (slot->name[0])
+      *find_slot(&grown, slot->name) = *slot;
+  }
+  grown.header->count = table->header->count;
+
+  int was_held = table->header == held.header;
+  unmap_table(table);
+  ASSERT_ERROR_MESSAGE(rename(REFS_FILE ".tmp", REFS_FILE) == 0, "couldn't grow refs database");
+  *table = grown;
+  if (was_held)
+    held = grown;
+}
+
+void refs_open(void) {
+  if (!held.header)
+    open_table(&held);
+}
+
+void refs_close(void) {
+  if (held.header)
+    unmap_table(&held);
+}
+
+void refs_init(const char* head) {
+  refs_close();
+  refs_table table;
+  create_table(&table, REFS_FILE ".tmp", REFS_MIN_CAPACITY);
+  set_slot(find_slot(&table, "master"), "master", head, 0);
+  table.header->count = 1;
+  unmap_table(&table);
+  ASSERT_ERROR_MESSAGE(rename(REFS_FILE ".tmp", REFS_FILE) == 0, "couldn't create refs database");
+}
+
+int refs_find(const char* name, char* head) {
+  refs_table table;
+  open_table(&table);
+  const ref_slot* slot = find_slot(&table, name);
+  int number = slot->name[0] ? slot->number : -1;
+  if (number >= 0 && head) {
+    memcpy(head, slot->heads[__atomic_load_n(&slot->active, __ATOMIC_ACQUIRE) & 1],
+           COMMIT_ID_BYTES);
+    head[COMMIT_ID_BYTES] = '\0';
+  }
+  close_table(&table);
+  return number;
+}
+
+int refs_add(const char* name, const char* head) {
+  ASSERT_ERROR_MESSAGE(name[0] && strlen(name) < BRANCHNAME_SIZE, "invalid branch name");
+
+  refs_table table;
+  open_table(&table);
+  if ((table.header->count + 1) * 4 > table.header->capacity * 3)
+    grow_table(&table);
+
+  ref_slot* slot = find_slot(&table, name);
+  ASSERT_ERROR_MESSAGE(!slot->name[0], "branch already exists");
+  int number = table.header->count;
+  set_slot(slot, name, head, number);
+  table.header->count = number + 1;
+  close_table(&table);
+  return number;
+}
+
+void refs_set_head(const char* name, const char* head) {
+  refs_table table;
+  open_table(&table);
+  ref_slot* slot = find_slot(&table, name);
+  ASSERT_ERROR_MESSAGE(slot->name[0], "no such branch");
+
+  uint32_t next = (slot->active & 1) ^ 1;
+  memcpy(slot->heads[next], head, COMMIT_ID_BYTES);
+  __atomic_store_n(&slot->active, next, __ATOMIC_RELEASE);
+  close_table(&table);
+}
+
+void refs_for_each(void (*fn)(const char* name, const char* head, void* arg), void* arg) {
+  refs_table table;
+  open_table(&table);
+
+  // Put the slots in creation order first.
+  uint32_t count = table.header->count;
+  const ref_slot** ordered = calloc(count ? count : 1, sizeof(ref_slot*));
+  ASSERT_ERROR_MESSAGE(ordered != NULL, "out of memory");
+  for (uint32_t i = 0; i < table.header->capacity; i++) {
+    const ref_slot* slot = &table.slots[i];
+    if (slot->name[0] && slot->number >= 0 && (uint32_t) slot->number < count)
+      ordered[slot->number] = slot;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (ordered[i] == NULL)
+      continue;
+    char head[COMMIT_ID_SIZE];
+    memcpy(head, ordered[i]->heads[ordered[i]->active & 1], COMMIT_ID_BYTES);
+    head[COMMIT_ID_BYTES] = '\0';
+    fn(ordered[i]->name, head, arg);
+  }
+
+  free(ordered);
+  close_table(&table);
+}
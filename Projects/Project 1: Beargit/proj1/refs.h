@@ -0,0 +1,41 @@
+/**
+ * The refs database (.beargit/.refs) maps every branch name to its branch
+ * number (the order branches were created in, which commit ids encode) and
+ * its head commit. It is an open-addressing hash table in a single mapped
+ * file, so finding a branch or moving its head touches one or two slots no
+ * matter how many branches there are.
+ *
+ * Repositories from before the database have .beargit/.branches and one
+ * .beargit/.branch_<name> file per branch; they are imported the first time
+ * the database is needed.
+ */
+
+#ifndef REFS_H
+#define REFS_H
+
+#define REFS_FILE ".beargit/.refs"
+
+// Keeps the database mapped until refs_close, for a process that looks up
+// or moves branches many times (see repo.h). No other process may change it
+// in the meantime.
+void refs_open(void);
+void refs_close(void);
+
+// Creates the database with just the "master" branch, heading <head>.
+void refs_init(const char* head);
+
+// Number of branch <name>, or -1 if there is no such branch. If <head> isn't
+// NULL and the branch exists, it gets the branch's head (COMMIT_ID_SIZE).
+int refs_find(const char* name, char* head);
+
+// Adds branch <name>, which must not exist yet, heading <head>. Returns its
+// number.
+int refs_add(const char* name, const char* head);
+
+// Moves the head of the existing branch <name> to <head>.
+void refs_set_head(const char* name, const char* head);
+
+// Calls fn for every branch, in the order they were created.
+void refs_for_each(void (*fn)(const char* name, const char* head, void* arg), void* arg);
+
+#endif
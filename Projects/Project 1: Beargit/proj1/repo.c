@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "refs.h"
+#include "repo.h"
+#include "util.h"
+
+// The handle that is open, if any (see repo.h).
+static beargit_repo_t* open_repo;
+
+beargit_repo_t* beargit_repo_open(void) {
+  struct stat s;
+  if (stat(".beargit", &s) != 0 || !S_ISDIR(s.st_mode))
+    return NULL;
+  ASSERT_ERROR_MESSAGE(open_repo == NULL, "another repository handle is open");
+
+  journal_recover();
+
+  beargit_repo_t* repo = calloc(1, sizeof(beargit_repo_t));
+  ASSERT_ERROR_MESSAGE(repo != NULL, "out of memory");
+  state_read(&repo->state);
+  refs_open();
+  open_repo = repo;
+  return repo;
+}
+
+void beargit_repo_flush(beargit_repo_t* repo) {
+  if (repo->index_changed)
+    index_write(&repo->index);
+  repo->index_changed = 0;
+}
+
+void beargit_repo_close(beargit_repo_t* repo) {
+  beargit_repo_flush(repo);
+  index_free(&repo->index);
+  commitgraph_close(&repo->graph);
+  msgindex_close(&repo->msgs);
+  commitlog_close(&repo->log);
+  sparse_free(&repo->sparse);
+  if (repo->watch)
+    watch_stop(repo->watch);
+  refs_close();
+  open_repo = NULL;
+  free(repo);
+}
+
+beargit_index* beargit_repo_index(beargit_repo_t* repo) {
+  if (!repo->index_loaded) {
+    index_read(&repo->index);
+    repo->index_loaded = 1;
+  }
+  return &repo->index;
+}
+
+const commit_log* beargit_repo_commit_log(beargit_repo_t* repo) {
+  if (!repo->log_open) {
+    commitlog_open(&repo->log);
+    repo->log_open = 1;
+  }
+  return &repo->log;
+}
+
+const commit_graph* beargit_repo_commit_graph(beargit_repo_t* repo) {
+  if (!repo->graph_open) {
+    commitgraph_open(&repo->graph, beargit_repo_commit_log(repo));
+    repo->graph_open = 1;
+  }
+  return &repo->graph;
+}
+
+const msg_index* beargit_repo_msg_index(beargit_repo_t* repo) {
+  if (!repo->msgs_open) {
+    msgindex_open(&repo->msgs, beargit_repo_commit_log(repo));
+    repo->msgs_open = 1;
+  }
+  return &repo->msgs;
+}
+
+const sparse_patterns* beargit_repo_sparse(beargit_repo_t* repo) {
+  if (!repo->sparse_loaded) {
+    sparse_read(&repo->sparse);
+    repo->sparse_loaded = 1;
+  }
+  return &repo->sparse;
+}
+
+int beargit_repo_refresh(beargit_repo_t* repo, index_entry* entry) {
+  int state = index_entry_refresh(beargit_repo_index(repo), entry);
+  if (state == ENTRY_MISSING && entry->blob_id[0] && !sparse_includes(beargit_repo_sparse(repo), entry->path))
+    return ENTRY_UNCHANGED;
+  return state;
+}
+
+// Marks every tracked path dirty and watches every directory holding one.
+static void watch_everything(beargit_repo_t* repo) {
+  beargit_index* index = beargit_repo_index(repo);
+  for (int i = 0; i < index->count; i++) {
+    watch_add_dir_of(repo->watch, index->entries[i].path);
+    watch_mark(repo->watch, index->entries[i].path);
+  }
+}
+
+int beargit_repo_watch(beargit_repo_t* repo) {
+  if (repo->watch)
+    return 0;
+  repo->watch = watch_start();
+  if (repo->watch == NULL)
+    return -1;
+  // Watching starts before the first look at the files, so nothing changed
+  // in between goes unnoticed.
+  watch_everything(repo);
+  return 0;
+}
+
+beargit_repo_t* beargit_repo_reopen(beargit_repo_t* repo) {
+  file_watch* watch = repo->watch;
+  beargit_index old = { 0 };
+  if (repo->index_loaded) {
+    old = repo->index;
+    memset(&repo->index, 0, sizeof(repo->index));
+  }
+  repo->watch = NULL;
+  repo->index_changed = 0;
+  beargit_repo_close(repo);
+
+  repo = beargit_repo_open();
+  repo->watch = watch;
+  if (watch) {
+    // Changed files were seen by the watch; newly tracked ones may be in
+    // directories it didn't watch yet.
+    beargit_index* index = beargit_repo_index(repo);
+    for (int i = 0; i < index->count; i++) {
+      watch_add_dir_of(watch, index->entries[i].path);
+      if (index_find(&old, index->entries[i].path) < 0)
+        watch_mark(watch, index->entries[i].path);
+    }
+  }
+  index_free(&old);
+  return repo;
+}
+
+void beargit_repo_poll(beargit_repo_t* repo) {
+  if (repo->watch == NULL)
+    return;
+
+  int ret = watch_poll(repo->watch);
+  if (ret < 0) {
+    watch_stop(repo->watch);
+    repo->watch = NULL;
+    return;
+  }
+  if (ret > 0)
+    watch_everything(repo);
+
+  beargit_index* index = beargit_repo_index(repo);
+  char** paths;
+  int count = watch_dirty_paths(repo->watch, &paths);
+  for (int i = 0; i < count; i++) {
+    int pos = index_find(index, paths[i]);
+    if (pos < 0) {
+      watch_clear(repo->watch, paths[i]);
+      continue;
+    }
+    int state = beargit_repo_refresh(repo, &index->entries[pos]);
+    if (state == ENTRY_REFRESHED)
+      repo->index_changed = 1;
+    if (state == ENTRY_UNCHANGED || state == ENTRY_REFRESHED)
+      watch_clear(repo->watch, paths[i]);
+  }
+  watch_free_paths(paths, count);
+}
+
+static int compare_ints(const void* a, const void* b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+int beargit_repo_dirty_entries(beargit_repo_t* repo, int** positions) {
+  beargit_index* index = beargit_repo_index(repo);
+  *positions = malloc((index->count + 1) * sizeof(int));
+  ASSERT_ERROR_MESSAGE(*positions != NULL, "out of memory");
+
+  if (repo->watch == NULL) {
+    for (int i = 0; i < index->count; i++)
+      (*positions)[i] = i;
+    return index->count;
+  }
+
+  char** paths;
+  int npaths = watch_dirty_paths(repo->watch, &paths);
+  int count = 0;
+  for (int i = 0; i < npaths; i++) {
+    int pos = index_find(index, paths[i]);
+    if (pos >= 0)
+      (*positions)[count++] = pos;
+  }
+  watch_free_paths(paths, npaths);
+  qsort(*positions, count, sizeof(int), compare_ints);
+  return count;
+}
+
+void beargit_repo_touch(beargit_repo_t* repo, const char* path) {
+  if (repo->watch == NULL)
+    return;
+  watch_add_dir_of(repo->watch, path);
+  watch_mark(repo->watch, path);
+}
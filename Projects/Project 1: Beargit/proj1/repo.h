@@ -0,0 +1,134 @@
+/**
+ * Repository handles, for running many commands against one repository
+ * without starting a process and re-reading its files for each of them.
+ *
+ * A handle holds the repository state, the index, the refs database and the
+ * commit log in memory from beargit_repo_open to beargit_repo_close. Changes
+ * reach the disk at these points:
+ *
+ *   add, rm, status     only change the index in memory; it is written by
+ *                       beargit_repo_flush, beargit_repo_close or the next
+ *                       commit or checkout
+ *   commit, checkout    write everything they change before returning
+ *
+ * With beargit_repo_watch, the handle also follows changes to tracked files
+ * through inotify (see watch.h), and status and commit only look at the
+ * files that changed instead of stat-ing every tracked file.
+ *
+ * The commands work on the repository in the current working directory and
+ * behave and print exactly like their command line versions (beargit.h),
+ * which are one-shot wrappers around them. While a handle is open, no other
+ * process may change the repository.
+ *
+ * Only one handle may be open per process at a time: the refs mapping, the
+ * pack, the blob cache and the object batch of a commit are process-wide,
+ * not part of the handle. beargit_repo_open fails with an internal error
+ * while another handle is open, so the one-shot wrappers can't be used
+ * while a handle is open either.
+ */
+
+#include "commitgraph.h"
+#include "commitlog.h"
+#include "index.h"
+#include "msgindex.h"
+#include "sparse.h"
+#include "state.h"
+#include "watch.h"
+
+#ifndef REPO_H
+#define REPO_H
+
+typedef struct beargit_repo {
+  repo_state state;
+
+  beargit_index index;
+  int index_loaded;     // <index> was read; until then commands use the file
+  int index_changed;    // <index> has changes that aren't written yet
+
+  commit_log log;
+  int log_open;
+  commit_graph graph;
+  int graph_open;
+  msg_index msgs;
+  int msgs_open;
+
+  sparse_patterns sparse;
+  int sparse_loaded;
+
+  file_watch* watch;    // NULL unless watching
+} beargit_repo_t;
+
+// Opens the repository in the current directory, first finishing or undoing
+// a commit a crash interrupted (see journal.h). Returns NULL if there is no
+// repository. No other handle may be open.
+beargit_repo_t* beargit_repo_open(void);
+
+// Writes the index if it changed.
+void beargit_repo_flush(beargit_repo_t* repo);
+
+// Flushes the handle and frees it.
+void beargit_repo_close(beargit_repo_t* repo);
+
+// The index, read on first use.
+beargit_index* beargit_repo_index(beargit_repo_t* repo);
+
+// The commit log, mapped on first use and remapped after every commit.
+const commit_log* beargit_repo_commit_log(beargit_repo_t* repo);
+
+// The commit graph over that log (see commitgraph.h), for ancestry queries.
+const commit_graph* beargit_repo_commit_graph(beargit_repo_t* repo);
+
+// The index of the messages in that log (see msgindex.h), for searches.
+const msg_index* beargit_repo_msg_index(beargit_repo_t* repo);
+
+// The sparse checkout patterns (see sparse.h), read on first use.
+const sparse_patterns* beargit_repo_sparse(beargit_repo_t* repo);
+
+// index_entry_refresh, except that a file outside the sparse checkout that
+// isn't in the working directory is ENTRY_UNCHANGED.
+int beargit_repo_refresh(beargit_repo_t* repo, index_entry* entry);
+
+// Starts following changes to tracked files. Returns 0, or -1 if inotify
+// isn't available; commands then keep checking every file.
+int beargit_repo_watch(beargit_repo_t* repo);
+
+// Drops everything <repo> holds, without writing it, and reads the
+// repository again, keeping the watch. For when another process (such as a
+// child running a command) changed it. Returns the new handle.
+beargit_repo_t* beargit_repo_reopen(beargit_repo_t* repo);
+
+// Catches up with the changes since the last call and re-checks the files
+// they touched, so that only files that really differ from the index stay
+// dirty.
+void beargit_repo_poll(beargit_repo_t* repo);
+
+// Positions in the index, in order, of the entries that may differ from
+// the working directory: the dirty ones when watching, all of them
+// otherwise. Free <*positions>.
+int beargit_repo_dirty_entries(beargit_repo_t* repo, int** positions);
+
+// Notes that <path> may not match its index entry anymore (it was just
+// added, for instance).
+void beargit_repo_touch(beargit_repo_t* repo, const char* path);
+
+int beargit_repo_add(beargit_repo_t* repo, int npaths, char* const* paths);
+int beargit_repo_add_all(beargit_repo_t* repo);
+int beargit_repo_rm(beargit_repo_t* repo, int npaths, char* const* paths);
+int beargit_repo_commit(beargit_repo_t* repo, const char* message);
+int beargit_repo_status(beargit_repo_t* repo);
+// <from> is the commit to start from, NULL for the current one.
+int beargit_repo_log(beargit_repo_t* repo, int limit, const char* from);
+int beargit_repo_log_grep(beargit_repo_t* repo, int limit, const char* from,
+                          int nterms, char* const* terms);
+int beargit_repo_branch(beargit_repo_t* repo);
+int beargit_repo_checkout(beargit_repo_t* repo, const char* arg, int new_branch);
+int beargit_repo_diff(beargit_repo_t* repo, const char* from, const char* to);
+int beargit_repo_merge(beargit_repo_t* repo, const char* arg);
+int beargit_repo_sparse_list(beargit_repo_t* repo);
+int beargit_repo_sparse_set(beargit_repo_t* repo, int npatterns, char* const* patterns);
+
+// Runs a whole command line (argv[1] is the command, as for main) against
+// the handle.
+int beargit_repo_run(beargit_repo_t* repo, int argc, char** argv);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "ignore.h"
+#include "scan.h"
+#include "util.h"
+#include "workers.h"
+
+typedef struct {
+  worker_pool* pool;
+  pthread_mutex_t lock;
+  const ignore_rules* ignore;   // NULL for none
+  scan_result* result;
+} scan_state;
+
+typedef struct {
+  scan_state* state;
+  char* dir;
+  int ignore_state;   // of the ignore rules, after "<dir>/"
+} scan_task;
+
+static void scan_append(scan_result* result, const char* path, const struct stat* st) {
+  if (result->count == result->capacity) {
+    result->capacity = result->capacity ? 2 * result->capacity : 256;
+    result->entries = realloc(result->entries, result->capacity * sizeof(scan_entry));
+    ASSERT_ERROR_MESSAGE(result->entries != NULL, "out of memory");
+  }
+
+  scan_entry* entry = &result->entries[result->count++];
+  entry->path = malloc(strlen(path) + 1);
+  ASSERT_ERROR_MESSAGE(entry->path != NULL, "out of memory");
+  strcpy(entry->path, path);
+  entry->st = *st;
+}
+
+static void scan_one_directory(void* arg);
+
+static void scan_queue_directory(scan_state* state, const char* dir, int ignore_state) {
+  scan_task* task = malloc(sizeof(scan_task));
+  ASSERT_ERROR_MESSAGE(task != NULL, "out of memory");
+  task->state = state;
+  task->ignore_state = ignore_state;
+  task->dir = malloc(strlen(dir) + 1);
+  ASSERT_ERROR_MESSAGE(task->dir != NULL, "out of memory");
+  strcpy(task->dir, dir);
+  workers_submit(state->pool, scan_one_directory, task);
+}
+
+// Lists one directory: subdirectories become new tasks, regular files are
+// collected locally and merged into the shared result in one go. Ignored
+// files are left out and ignored directories never become tasks.
+static void scan_one_directory(void* arg) {
+  scan_task* task = arg;
+  scan_state* state = task->state;
+  scan_result files = { 0 };
+
+  DIR* dir = opendir(task->dir);
+  if (dir == NULL) {
+    fprintf(stderr, "ERROR: Couldn't read directory %s\n", task->dir);
+  } else {
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+      if (de->d_name[0] == '.')
+        continue;
+
+      // Scanning "." yields "name" rather than "./name".
+      char path[FILENAME_SIZE];
+      int len = strcmp(task->dir, ".") == 0
+        ? snprintf(path, sizeof(path), "%s", de->d_name)
+        : snprintf(path, sizeof(path), "%s/%s", task->dir, de->d_name);
+      if (len >= (int) sizeof(path)) {
+        fprintf(stderr, "ERROR: Path too long, skipping %s/%s\n", task->dir, de->d_name);
+        continue;
+      }
+
+      struct stat st;
+      if (lstat(path, &st) != 0)
+        continue;
+
+      int ignore_state = 0;
+      if (state->ignore != NULL)
+        ignore_state = ignore_walk(state->ignore, task->ignore_state, de->d_name);
+      int is_dir = S_ISDIR(st.st_mode);
+      if (state->ignore != NULL && ignore_state_ignored(state->ignore, ignore_state, is_dir))
+        continue;
+
+      if (is_dir)
+        scan_queue_directory(state, path,
+                             state->ignore != NULL ? ignore_walk(state->ignore, ignore_state, "/") : 0);
+      else if (S_ISREG(st.st_mode))
+        scan_append(&files, path, &st);
+    }
+    closedir(dir);
+  }
+
+  if (files.count) {
+    pthread_mutex_lock(&state->lock);
+    for (int i = 0; i < files.count; i++) {
+      scan_append(state->result, files.entries[i].path, &files.entries[i].st);
+    }
+    pthread_mutex_unlock(&state->lock);
+  }
+
+  scan_result_free(&files);
+  free(task->dir);
+  free(task);
+}
+
+static int compare_scan_paths(const void* a, const void* b) {
+  return strcmp(((const scan_entry*) a)->path, ((const scan_entry*) b)->path);
+}
+
+void scan_directory(const char* dir, const ignore_rules* ignore, scan_result* result) {
+  scan_state state;
+  state.pool = workers_start(workers_default_count(), 0);
+  pthread_mutex_init(&state.lock, NULL);
+  state.result = result;
+  state.ignore = ignore;
+
+  int ignore_state = 0;
+  if (ignore != NULL) {
+    ignore_state = ignore->start;
+    if (strcmp(dir, ".") != 0) {
+      ignore_state = ignore_walk(ignore, ignore_state, dir);
+      ignore_state = ignore_walk(ignore, ignore_state, "/");
+    }
+  }
+
+  int first = result->count;
+  scan_queue_directory(&state, dir, ignore_state);
+  workers_stop(state.pool);
+  pthread_mutex_destroy(&state.lock);
+
+  qsort(result->entries + first, result->count - first, sizeof(scan_entry),
+        compare_scan_paths);
+}
+
+void scan_result_free(scan_result* result) {
+  for (int i = 0; i < result->count; i++)
+    free(result->entries[i].path);
+  free(result->entries);
+  memset(result, 0, sizeof(*result));
+}
@@ -0,0 +1,30 @@
+/**
+ * Parallel directory scanner. Walks a directory tree with a pool of worker
+ * threads and collects every regular file below it, together with its stat
+ * data. Names starting with '.' (including .beargit) are skipped.
+ */
+#include <sys/stat.h>
+
+#include "ignore.h"
+
+#ifndef SCAN_H
+#define SCAN_H
+
+typedef struct {
+  char* path;
+  struct stat st;
+} scan_entry;
+
+typedef struct {
+  scan_entry* entries;
+  int count;
+  int capacity;
+} scan_result;
+
+// Appends the files below <dir> to <result>, sorted by path, leaving out
+// what <ignore> ignores (NULL for nothing). <dir> is relative to the top of
+// the working directory.
+void scan_directory(const char* dir, const ignore_rules* ignore, scan_result* result);
+void scan_result_free(scan_result* result);
+
+#endif
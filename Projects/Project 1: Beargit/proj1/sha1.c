@@ -0,0 +1,109 @@
+#include <string.h>
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(sha1_ctx* ctx, const unsigned char* block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[4*i] << 24) | ((uint32_t) block[4*i+1] << 16) |
+           ((uint32_t) block[4*i+2] << 8) | (uint32_t) block[4*i+3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+  }
+
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2];
+  uint32_t d = ctx->state[3], e = ctx->state[4];
+
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t t = ROL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ROL(b, 30);
+    b = a;
+    a = t;
+  }
+
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+}
+
+void sha1_init(sha1_ctx* ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xEFCDAB89;
+  ctx->state[2] = 0x98BADCFE;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xC3D2E1F0;
+  ctx->count = 0;
+}
+
+void sha1_update(sha1_ctx* ctx, const void* data, size_t len) {
+  const unsigned char* p = data;
+  size_t used = ctx->count % 64;
+  ctx->count += len;
+
+  if (used) {
+    size_t take = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->buffer + used, p, take);
+    p += take;
+    len -= take;
+    if (used + take < 64)
+      return;
+    sha1_block(ctx, ctx->buffer);
+  }
+
+  while (len >= 64) {
+    sha1_block(ctx, p);
+    p += 64;
+    len -= 64;
+  }
+  memcpy(ctx->buffer, p, len);
+}
+
+void sha1_final(sha1_ctx* ctx, unsigned char digest[SHA1_DIGEST_BYTES]) {
+  uint64_t bits = ctx->count * 8;
+  unsigned char pad[72] = { 0x80 };
+  size_t used = ctx->count % 64;
+  size_t padlen = (used < 56) ? 56 - used : 120 - used;
+
+  unsigned char len_be[8];
+  for (int i = 0; i < 8; i++)
+    len_be[i] = (unsigned char) (bits >> (56 - 8*i));
+
+  sha1_update(ctx, pad, padlen);
+  sha1_update(ctx, len_be, 8);
+
+  for (int i = 0; i < 5; i++) {
+    digest[4*i] = (unsigned char) (ctx->state[i] >> 24);
+    digest[4*i+1] = (unsigned char) (ctx->state[i] >> 16);
+    digest[4*i+2] = (unsigned char) (ctx->state[i] >> 8);
+    digest[4*i+3] = (unsigned char) ctx->state[i];
+  }
+}
+
+void sha1_to_hex(const unsigned char digest[SHA1_DIGEST_BYTES], char* hex) {
+  const char* hexdigits = "0123456789abcdef";
+  for (int i = 0; i < SHA1_DIGEST_BYTES; i++) {
+    hex[2*i] = hexdigits[digest[i] >> 4];
+    hex[2*i+1] = hexdigits[digest[i] & 0xf];
+  }
+  hex[2*SHA1_DIGEST_BYTES] = '\0';
+}
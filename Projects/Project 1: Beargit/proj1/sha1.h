@@ -0,0 +1,25 @@
+/**
+ * Minimal SHA-1 implementation used to name blobs in the object store.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef SHA1_H
+#define SHA1_H
+
+#define SHA1_DIGEST_BYTES 20
+
+typedef struct {
+  uint32_t state[5];
+  uint64_t count;
+  unsigned char buffer[64];
+} sha1_ctx;
+
+void sha1_init(sha1_ctx* ctx);
+void sha1_update(sha1_ctx* ctx, const void* data, size_t len);
+void sha1_final(sha1_ctx* ctx, unsigned char digest[SHA1_DIGEST_BYTES]);
+
+// Writes the 40 hex characters of digest (plus a NULL terminator) into hex.
+void sha1_to_hex(const unsigned char digest[SHA1_DIGEST_BYTES], char* hex);
+
+#endif
@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "beargit.h"
+#include "sparse.h"
+#include "util.h"
+
+// Adds <pattern>, unless it's empty. "dir/" means the same as "dir".
+static void add_pattern(sparse_patterns* sparse, int* capacity, const char* pattern) {
+  size_t len = strlen(pattern);
+  while (len > 1 && pattern[len - 1] == '/')
+    len--;
+  if (len == 0)
+    return;
+
+  if (sparse->count == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 8;
+    sparse->patterns = realloc(sparse->patterns, *capacity * sizeof(char*));
+    ASSERT_ERROR_MESSAGE(sparse->patterns != NULL, "out of memory");
+  }
+  sparse->patterns[sparse->count] = strndup(pattern, len);
+  ASSERT_ERROR_MESSAGE(sparse->patterns[sparse->count] != NULL, "out of memory");
+  sparse->count++;
+}
+
+void sparse_read(sparse_patterns* sparse) {
+  memset(sparse, 0, sizeof(*sparse));
+  FILE* f = fopen(SPARSE_FILE, "r");
+  if (f == NULL) {
+    ASSERT_ERROR_MESSAGE(errno == ENOENT, "couldn't read sparse patterns");
+    return;
+  }
+
+  int capacity = 0;
+  char line[FILENAME_SIZE + 2];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    add_pattern(sparse, &capacity, line);
+  }
+  fclose(f);
+}
+
+void sparse_init(sparse_patterns* sparse, int count, char* const* patterns) {
+  memset(sparse, 0, sizeof(*sparse));
+  int capacity = 0;
+  for (int i = 0; i < count; i++)
+    add_pattern(sparse, &capacity, patterns[i]);
+}
+
+void sparse_free(sparse_patterns* sparse) {
+  for (int i = 0; i < sparse->count; i++)
+    free(sparse->patterns[i]);
+  free(sparse->patterns);
+  memset(sparse, 0, sizeof(*sparse));
+}
+
+void sparse_write(const sparse_patterns* sparse) {
+  if (sparse->count == 0) {
+    ASSERT_ERROR_MESSAGE(unlink(SPARSE_FILE) == 0 || errno == ENOENT,
+                         "couldn't remove sparse patterns");
+    return;
+  }
+
+  FILE* f = fopen(SPARSE_FILE ".new", "w");
+  ASSERT_ERROR_MESSAGE(f != NULL, "couldn't write sparse patterns");
+  for (int i = 0; i < sparse->count; i++)
+    fprintf(f, "%s\n", sparse->patterns[i]);
+  ASSERT_ERROR_MESSAGE(fclose(f) == 0 && rename(SPARSE_FILE ".new", SPARSE_FILE) == 0,
+                       "couldn't write sparse patterns");
+}
+
+int sparse_includes(const sparse_patterns* sparse, const char* path) {
+  if (sparse->count == 0)
+    return 1;
+  for (int i = 0; i < sparse->count; i++) {
+    if (fnmatch(sparse->patterns[i], path, FNM_PATHNAME | FNM_LEADING_DIR) == 0)
+      return 1;
+  }
+  return 0;
+}
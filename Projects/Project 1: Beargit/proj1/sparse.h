@@ -0,0 +1,37 @@
+/**
+ * Sparse checkout (.beargit/.sparse): patterns, one per line, naming the
+ * tracked files that are written to the working directory. A pattern is a
+ * glob over the whole path ('*' and '?' don't match '/'), and also matches
+ * everything under a directory it matches: "docs" works, and so does a
+ * pattern like "src/" + "*.c".
+ * Without patterns, every tracked file is checked out.
+ *
+ * The index and the commits still list every tracked file. A file outside
+ * the patterns that isn't in the working directory counts as unchanged, so
+ * status doesn't report it and commits keep the version they had.
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#define SPARSE_FILE ".beargit/.sparse"
+
+typedef struct {
+  char** patterns;
+  int count;
+} sparse_patterns;
+
+void sparse_read(sparse_patterns* sparse);
+void sparse_free(sparse_patterns* sparse);
+
+// Fills <sparse> with copies of <patterns>.
+void sparse_init(sparse_patterns* sparse, int count, char* const* patterns);
+
+// Replaces the patterns in the repository. No patterns turns sparse
+// checkout off.
+void sparse_write(const sparse_patterns* sparse);
+
+// Whether <path> is checked out.
+int sparse_includes(const sparse_patterns* sparse, const char* path);
+
+#endif
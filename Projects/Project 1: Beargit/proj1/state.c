@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "state.h"
+#include "util.h"
+
+/* State file format
+ *
+ * A single state_record. The checksum (FNV-1a over everything before it)
+ * catches a file that a crash left empty or garbled despite the rename.
+ * Version 1 records have no merge head; they are still read.
+ */
+
+#define STATE_MAGIC "BHED"
+#define STATE_VERSION 2
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t seq;
+  uint64_t unused;                    // was the index generation; written as 0
+  char head[COMMIT_ID_BYTES];
+  char branch[BRANCHNAME_SIZE];
+  char merge_head[COMMIT_ID_BYTES];   // all zero if none
+  uint32_t reserved;
+  uint32_t checksum;
+} state_record;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t seq;
+  uint64_t unused;
+  char head[COMMIT_ID_BYTES];
+  char branch[BRANCHNAME_SIZE];
+  uint32_t reserved;
+  uint32_t checksum;
+} state_record_v1;
+
+static uint32_t record_checksum(const void* record, size_t size) {
+  const unsigned char* p = record;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  return hash;
+}
+
+// .prev and .current_branch, for repositories that have no state file yet.
+static void read_legacy(repo_state* state) {
+  read_string_from_file(".beargit/.prev", state->head, COMMIT_ID_SIZE);
+  state->head[COMMIT_ID_BYTES] = '\0';
+  read_string_from_file(".beargit/.current_branch", state->branch, BRANCHNAME_SIZE);
+  state->branch[BRANCHNAME_SIZE - 1] = '\0';
+}
+
+void state_read(repo_state* state) {
+  memset(state, 0, sizeof(*state));
+
+  int fd = open(STATE_FILE, O_RDONLY);
+  if (fd < 0) {
+    ASSERT_ERROR_MESSAGE(errno == ENOENT, "couldn't open " STATE_FILE);
+    read_legacy(state);
+    return;
+  }
+
+  state_record record;
+  ssize_t n;
+  while ((n = pread(fd, &record, sizeof(record), 0)) < 0 && errno == EINTR)
+    ;
+  close(fd);
+  ASSERT_ERROR_MESSAGE(n >= (ssize_t) sizeof(state_record_v1) &&
+                       memcmp(record.magic, STATE_MAGIC, 4) == 0,
+                       "corrupt " STATE_FILE);
+  if (record.version == 1) {
+    const state_record_v1* old = (const state_record_v1*) &record;
+    ASSERT_ERROR_MESSAGE(n == sizeof(*old) &&
+                         old->checksum == record_checksum(old, offsetof(state_record_v1, checksum)),
+                         "corrupt " STATE_FILE);
+    memset(record.merge_head, 0, COMMIT_ID_BYTES);
+  } else {
+    ASSERT_ERROR_MESSAGE(record.version == STATE_VERSION, "unsupported " STATE_FILE " version");
+    ASSERT_ERROR_MESSAGE(n == sizeof(record) &&
+                         record.checksum == record_checksum(&record, offsetof(state_record, checksum)),
+                         "corrupt " STATE_FILE);
+  }
+
+  memcpy(state->head, record.head, COMMIT_ID_BYTES);
+  memcpy(state->merge_head, record.merge_head, COMMIT_ID_BYTES);
+  memcpy(state->branch, record.branch, BRANCHNAME_SIZE);
+  state->branch[BRANCHNAME_SIZE - 1] = '\0';
+  state->seq = record.seq;
+}
+
+void state_write(repo_state* state) {
+  state->seq++;
+
+  state_record record;
+  memset(&record, 0, sizeof(record));
+  memcpy(record.magic, STATE_MAGIC, 4);
+  record.version = STATE_VERSION;
+  record.seq = state->seq;
+  memcpy(record.head, state->head, COMMIT_ID_BYTES);
+  snprintf(record.branch, BRANCHNAME_SIZE, "%s", state->branch);
+  if (state->merge_head[0])
+    memcpy(record.merge_head, state->merge_head, COMMIT_ID_BYTES);
+  record.checksum = record_checksum(&record, offsetof(state_record, checksum));
+
+  int fd = open(STATE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_ERROR_MESSAGE(fd >= 0, "couldn't create " STATE_FILE ".tmp");
+  ssize_t n;
+  while ((n = write(fd, &record, sizeof(record))) < 0 && errno == EINTR)
+    ;
+  ASSERT_ERROR_MESSAGE(n == sizeof(record), "couldn't write " STATE_FILE ".tmp");
+  close(fd);
+  ASSERT_ERROR_MESSAGE(rename(STATE_FILE ".tmp", STATE_FILE) == 0, "couldn't replace " STATE_FILE);
+}
@@ -0,0 +1,35 @@
+/**
+ * The repository state (.beargit/.state) is one small record holding the
+ * current commit, the current branch and the commit being merged in (see
+ * beargit merge). Commands read it with a single pread and replace it with
+ * a single write and rename, so a crash leaves either the old state or the
+ * new one, never half of each. Writing the state is what makes a commit or
+ * a checkout take effect.
+ *
+ * Repositories from before the state record keep the same information in
+ * .beargit/.prev and .beargit/.current_branch; it is read from there until
+ * the state is written for the first time.
+ */
+
+#include <stdint.h>
+
+#include "beargit.h"
+
+#ifndef STATE_H
+#define STATE_H
+
+#define STATE_FILE ".beargit/.state"
+
+typedef struct {
+  char head[COMMIT_ID_SIZE];        // current commit
+  char branch[BRANCHNAME_SIZE];     // current branch, empty when detached
+  char merge_head[COMMIT_ID_SIZE];  // second parent of the next commit, empty if none
+  uint64_t seq;                     // number of times the state was written
+} repo_state;
+
+void state_read(repo_state* state);
+
+// Writes <state> back with the next sequence number.
+void state_write(repo_state* state);
+
+#endif
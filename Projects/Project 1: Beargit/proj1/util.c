@@ -2,6 +2,12 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "beargit.h"
 #include "util.h"
 const char * file_stdout = "TEST_STDOUT";
 const char * file_stderr = "TEST_STDERR";
@@ -13,6 +19,24 @@ void fs_mkdir(const char* dirname) {
   ASSERT_ERROR_MESSAGE(ret == 0, "creating directory failed");
 }
 
+// Creates the missing parent directories of <filename>. Safe to call from
+// several threads at once: a directory someone else just created is fine.
+void fs_mkdir_parents(const char* filename) {
+  ASSERT_ERROR_MESSAGE(filename != NULL, "filename is not a valid string");
+  ASSERT_ERROR_MESSAGE(is_sane_path(filename), "filename is not a valid path within .beargit");
+
+  char parent[513];
+  strcpy(parent, filename);
+  for (char* slash = strchr(parent + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (!fs_check_dir_exists(parent)) {
+      int ret = mkdir(parent, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+      ASSERT_ERROR_MESSAGE(ret == 0 || errno == EEXIST, "creating directory failed");
+    }
+    *slash = '/';
+  }
+}
+
 void fs_rm(const char* filename) {
   ASSERT_ERROR_MESSAGE(filename != NULL, "filename is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(filename), "filename is not a valid path within .beargit");
@@ -35,25 +59,109 @@ void fs_mv(const char* src, const char* dst) {
   ASSERT_ERROR_MESSAGE(ret == 0, "renaming file failed");
 }
 
+/* Copy engine
+ *
+ * fs_cp moves data without a round trip through user space where it can:
+ * first it asks the filesystem for a reflink (FICLONE, shared extents, no
+ * data copied at all), then for an in-kernel copy (copy_file_range, then
+ * sendfile), and only then falls back to a large user-space buffer. Every
+ * step continues from the file offsets the previous one stopped at.
+ */
+
+#define COPY_BUFFER_SIZE (1 << 20)
+
+static int copy_reflink(int in, int out) {
+#ifdef FICLONE
+  return ioctl(out, FICLONE, in) == 0;
+#else
+  return 0;
+#endif
+}
+
+static int copy_file_range_all(int in, int out) {
+  ssize_t ret;
+  while ((ret = copy_file_range(in, NULL, out, NULL, COPY_BUFFER_SIZE * 64, 0)) > 0)
+    ;
+  return ret == 0;
+}
+
+static int sendfile_all(int in, int out) {
+  ssize_t ret;
+  while ((ret = sendfile(out, in, NULL, COPY_BUFFER_SIZE * 64)) > 0)
+    ;
+  return ret == 0;
+}
+
+static int copy_buffered(int in, int out) {
+  char* buffer = malloc(COPY_BUFFER_SIZE);
+  if (buffer == NULL)
+    return 0;
+
+  ssize_t size;
+  while ((size = read(in, buffer, COPY_BUFFER_SIZE)) > 0) {
+    for (ssize_t done = 0; done < size; ) {
+      ssize_t ret = write(out, buffer + done, size - done);
+      if (ret <= 0) {
+        free(buffer);
+        return 0;
+      }
+      done += ret;
+    }
+  }
+  free(buffer);
+  return size == 0;
+}
+
+// Copies <src> to <dst>. Returns NULL on success, or a description of what
+// failed (with errno set).
+static const char* copy_file(const char* src, const char* dst) {
+  int in = open(src, O_RDONLY);
+  if (in < 0)
+    return "couldn't open source file";
+
+  // Never write through a hard link: <dst> may share its inode with an
+  // object, in repositories whose objects were hard links.
+  struct stat s;
+  if (lstat(dst, &s) == 0 && s.st_nlink > 1)
+    unlink(dst);
+
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out < 0) {
+    int saved_errno = errno;
+    close(in);
+    errno = saved_errno;
+    return "couldn't open destination file";
+  }
+
+  int copied = copy_reflink(in, out) || copy_file_range_all(in, out) ||
+               sendfile_all(in, out) || copy_buffered(in, out);
+  int saved_errno = errno;
+  close(in);
+  if (close(out) != 0 || !copied) {
+    errno = copied ? errno : saved_errno;
+    return "copying file failed";
+  }
+  return NULL;
+}
+
 void fs_cp(const char* src, const char* dst) {
   ASSERT_ERROR_MESSAGE(src != NULL, "src is not a valid string");
   ASSERT_ERROR_MESSAGE(dst != NULL, "dst is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(dst), "dst is not a valid path within .beargit");
 
-  FILE* fin = fopen(src, "r");
-  ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open source file");
-  FILE* fout = fopen(dst, "w");
-  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't open destination file");
-
-  char buffer[4096];
-  int size;
+  const char* error = copy_file(src, dst);
+  ASSERT_ERROR_MESSAGE(error == NULL, error);
+}
 
-  while ((size = fread(buffer, 1, 4096, fin)) > 0) {
-    fwrite(buffer, 1, size, fout);
+// Like fs_cp, but reports failure instead of exiting: returns 0 on success
+// and -1 (with errno set) otherwise. For callers that have to clean up, such
+// as worker threads.
+int fs_try_cp(const char* src, const char* dst) {
+  if (src == NULL || dst == NULL || !is_sane_path(dst)) {
+    errno = EINVAL;
+    return -1;
   }
-
-  fclose(fin);
-  fclose(fout);
+  return copy_file(src, dst) == NULL ? 0 : -1;
 }
 
 void write_string_to_file(const char* filename, const char* str) {
@@ -117,6 +225,44 @@ int fake_fprint(FILE* stream, char* fmt, ...) {
     return 0;
 }
 
+// Resolves "." and ".." and drops repeated and trailing slashes, so
+// "./src/", "src/../src" and "src" all become "src" ("." for the working
+// directory itself). Returns 0, or -1 if <path> leaves the working
+// directory, names something hidden at its top (such as .beargit) or is too
+// long.
+int normalize_path(const char* path, char* normalized) {
+  if (strlen(path) >= FILENAME_SIZE)
+    return -1;
+
+  int len = 0;
+  while (*path) {
+    size_t n = strcspn(path, "/");
+    if (n == 2 && path[0] == '.' && path[1] == '.') {
+      if (len == 0)
+        return -1;
+      while (len > 0 && normalized[len - 1] != '/')
+        len--;
+      if (len > 0)
+        len--;
+    } else if (n > 0 && !(n == 1 && path[0] == '.')) {
+      if (len > 0)
+        normalized[len++] = '/';
+      memcpy(normalized + len, path, n);
+      len += n;
+    }
+    path += n;
+    while (*path == '/')
+      path++;
+  }
+
+  if (len == 0)
+    normalized[len++] = '.';
+  normalized[len] = '\0';
+  if (normalized[0] == '.' && len > 1)
+    return -1;
+  return 0;
+}
+
 int is_sane_path(const char* path) {
   if (strlen(path) > 512)
     return 0;
@@ -12,6 +12,7 @@
 int fake_print(char* fmt, ...);
 int fake_fprint(FILE* stream, char* fmt, ...);
 int is_sane_path(const char* path);
+int normalize_path(const char* path, char* normalized);
 
 /* In testing mode (initialized with -DTESTING fed to gcc and done automatically
  * when you run make beargit-unittest), we need to replace printf and fprintf 
@@ -55,10 +56,12 @@ static const char* dst = "";
   }
 
  void fs_mkdir(const char* dirname);
+ void fs_mkdir_parents(const char* filename);
  void fs_rm(const char* filename);
  void fs_force_rm_beargit_dir();
  void fs_mv(const char* src, const char* dst);
  void fs_cp(const char* src, const char* dst);
+ int fs_try_cp(const char* src, const char* dst);
  void write_string_to_file(const char* filename, const char* str);
  void read_string_from_file(const char* filename, char* str, int size);
  int fs_check_dir_exists(const char* dirname);
@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "beargit.h"
+#include "util.h"
+#include "watch.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* Path sets
+ *
+ * Open addressing with linear probing over owned strings. Removed paths
+ * leave a tombstone, so probing goes on past them; the table is rebuilt
+ * without tombstones when it grows.
+ */
+
+#define TOMBSTONE ((char*) 1)
+
+typedef struct {
+  char** slots;
+  int capacity;     // power of two
+  int count;        // live paths
+  int used;         // live paths and tombstones
+} path_set;
+
+static uint32_t path_hash(const char* path) {
+  uint32_t hash = 2166136261u;
+  for (; *path; path++)
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  return hash;
+}
+
+// Slot holding <path>, or -1.
+static int set_find(const path_set* set, const char* path) {
+  if (!set->capacity)
+    return -1;
+  for (uint32_t i = path_hash(path) & (set->capacity - 1); set->slots[i];
+       i = (i + 1) & (set->capacity - 1)) {
+    if (set->slots[i] != TOMBSTONE && strcmp(set->slots[i], path) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void set_insert_owned(path_set* set, char* path) {
+  uint32_t i = path_hash(path) & (set->capacity - 1);
+  while (set->slots[i] && set->slots[i] != TOMBSTONE)
+    i = (i + 1) & (set->capacity - 1);
+  if (!set->slots[i])
+    set->used++;
+  set->slots[i] = path;
+  set->count++;
+}
+
+static void set_add(path_set* set, const char* path) {
+  if (set_find(set, path) >= 0)
+    return;
+
+  if (2 * (set->used + 1) > set->capacity) {
+    path_set grown = { 0 };
+    grown.capacity = set->capacity ? set->capacity : 64;
+    while (4 * (set->count + 1) > grown.capacity)
+      grown.capacity *= 2;
+    grown.slots = calloc(grown.capacity, sizeof(char*));
+    ASSERT_ERROR_MESSAGE(grown.slots != NULL, "out of memory");
+    for (int i = 0; i < set->capacity; i++) {
+      if (set->slots[i] && set->slots[i] != TOMBSTONE)
+        set_insert_owned(&grown, set->slots[i]);
+    }
+    free(set->slots);
+    *set = grown;
+  }
+
+  char* copy = strdup(path);
+  ASSERT_ERROR_MESSAGE(copy != NULL, "out of memory");
+  set_insert_owned(set, copy);
+}
+
+static void set_remove(path_set* set, const char* path) {
+  int i = set_find(set, path);
+  if (i < 0)
+    return;
+  free(set->slots[i]);
+  set->slots[i] = TOMBSTONE;
+  set->count--;
+}
+
+static void set_free(path_set* set) {
+  for (int i = 0; i < set->capacity; i++) {
+    if (set->slots[i] && set->slots[i] != TOMBSTONE)
+      free(set->slots[i]);
+  }
+  free(set->slots);
+  memset(set, 0, sizeof(*set));
+}
+
+/* Watches */
+
+struct file_watch {
+  int fd;
+  pid_t owner;          // only this process reads events; children share the queue
+  path_set dirty;
+  path_set watched;     // directories with a watch
+  char** dirs;          // directory of every watch descriptor
+  int ndirs;
+  int rescan;
+  int failed;
+};
+
+file_watch* watch_start(void) {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  file_watch* watch = calloc(1, sizeof(file_watch));
+  ASSERT_ERROR_MESSAGE(watch != NULL, "out of memory");
+  watch->fd = fd;
+  watch->owner = getpid();
+  return watch;
+}
+
+void watch_stop(file_watch* watch) {
+  close(watch->fd);
+  set_free(&watch->dirty);
+  set_free(&watch->watched);
+  for (int i = 0; i < watch->ndirs; i++)
+    free(watch->dirs[i]);
+  free(watch->dirs);
+  free(watch);
+}
+
+void watch_add_dir_of(file_watch* watch, const char* path) {
+  char dir[FILENAME_SIZE];
+  const char* slash = strrchr(path, '/');
+  if (slash)
+    snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+  else
+    strcpy(dir, ".");
+  if (set_find(&watch->watched, dir) >= 0)
+    return;
+
+  int wd = inotify_add_watch(watch->fd, dir, WATCH_MASK);
+  if (wd < 0) {
+    // A missing directory is watched once a rescan finds it again.
+    if (errno != ENOENT && errno != ENOTDIR)
+      watch->failed = 1;
+    return;
+  }
+
+  if (wd >= watch->ndirs) {
+    int ndirs = watch->ndirs ? watch->ndirs : 16;
+    while (wd >= ndirs)
+      ndirs *= 2;
+    watch->dirs = realloc(watch->dirs, ndirs * sizeof(char*));
+    ASSERT_ERROR_MESSAGE(watch->dirs != NULL, "out of memory");
+    memset(watch->dirs + watch->ndirs, 0, (ndirs - watch->ndirs) * sizeof(char*));
+    watch->ndirs = ndirs;
+  }
+  free(watch->dirs[wd]);
+  watch->dirs[wd] = strdup(dir);
+  ASSERT_ERROR_MESSAGE(watch->dirs[wd] != NULL, "out of memory");
+  set_add(&watch->watched, dir);
+}
+
+void watch_mark(file_watch* watch, const char* path) {
+  set_add(&watch->dirty, path);
+}
+
+void watch_clear(file_watch* watch, const char* path) {
+  set_remove(&watch->dirty, path);
+}
+
+static void handle_event(file_watch* watch, const struct inotify_event* event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    watch->rescan = 1;
+    return;
+  }
+
+  const char* dir = event->wd >= 0 && event->wd < watch->ndirs ? watch->dirs[event->wd] : NULL;
+  if (dir == NULL)
+    return;
+
+  // The directory itself went away, or a directory appeared that may hold
+  // tracked files.
+  if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+    if (event->mask & IN_IGNORED) {
+      set_remove(&watch->watched, dir);
+      free(watch->dirs[event->wd]);
+      watch->dirs[event->wd] = NULL;
+    }
+    watch->rescan = 1;
+    return;
+  }
+  if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+    watch->rescan = 1;
+    return;
+  }
+
+  if (event->len == 0 || (event->mask & IN_ISDIR))
+    return;
+  char path[2 * FILENAME_SIZE];
+  if (strcmp(dir, ".") == 0)
+    snprintf(path, sizeof(path), "%s", event->name);
+  else
+    snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+  set_add(&watch->dirty, path);
+}
+
+int watch_poll(file_watch* watch) {
+  if (getpid() != watch->owner)
+    return 0;
+
+  char buffer[64 << 10] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t n = read(watch->fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    for (char* p = buffer; p < buffer + n;) {
+      const struct inotify_event* event = (const struct inotify_event*) p;
+      handle_event(watch, event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  if (watch->failed)
+    return -1;
+  int rescan = watch->rescan;
+  watch->rescan = 0;
+  return rescan;
+}
+
+int watch_dirty_paths(file_watch* watch, char*** paths) {
+  *paths = malloc((watch->dirty.count + 1) * sizeof(char*));
+  ASSERT_ERROR_MESSAGE(*paths != NULL, "out of memory");
+  int count = 0;
+  for (int i = 0; i < watch->dirty.capacity; i++) {
+    char* path = watch->dirty.slots[i];
+    if (path && path != TOMBSTONE) {
+      (*paths)[count] = strdup(path);
+      ASSERT_ERROR_MESSAGE((*paths)[count] != NULL, "out of memory");
+      count++;
+    }
+  }
+  return count;
+}
+
+void watch_free_paths(char** paths, int count) {
+  for (int i = 0; i < count; i++)
+    free(paths[i]);
+  free(paths);
+}
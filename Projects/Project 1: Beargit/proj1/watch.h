@@ -0,0 +1,41 @@
+/**
+ * Change tracking for tracked files with inotify. A file_watch watches the
+ * directories holding tracked files and keeps the set of paths that may
+ * have changed since they were last checked ("dirty"), so status and commit
+ * only need to look at those instead of stat-ing every tracked file.
+ *
+ * Paths get dirty through watch_mark or through an event for them;
+ * whoever checked a path against the index and found it clean clears it
+ * again. Events that can't be mapped to paths (a watched directory went
+ * away, the event queue overflowed) make watch_poll ask for a rescan, after
+ * which the caller marks every tracked path again.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+typedef struct file_watch file_watch;
+
+// Returns NULL if inotify isn't available.
+file_watch* watch_start(void);
+void watch_stop(file_watch* watch);
+
+// Watches the directory holding <path> ("." for top-level files).
+void watch_add_dir_of(file_watch* watch, const char* path);
+
+void watch_mark(file_watch* watch, const char* path);
+void watch_clear(file_watch* watch, const char* path);
+
+// Reads the pending events without blocking. Returns 0, 1 if the caller
+// must rescan, or -1 if the watch can't keep up anymore (it ran out of
+// inotify watches) and should be stopped. In a child forked off the process
+// that started the watch it does nothing, since reading the shared queue
+// would take the events away from the parent.
+int watch_poll(file_watch* watch);
+
+// Copies the dirty paths into <*paths>. Returns their number. Free them with
+// watch_free_paths.
+int watch_dirty_paths(file_watch* watch, char*** paths);
+void watch_free_paths(char** paths, int count);
+
+#endif
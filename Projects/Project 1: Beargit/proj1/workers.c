@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "workers.h"
+
+typedef struct worker_task {
+  worker_fn fn;
+  void* arg;
+  struct worker_task* next;
+} worker_task;
+
+struct worker_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t task_ready;
+  pthread_cond_t task_taken;
+  pthread_cond_t all_done;
+
+  worker_task* head;
+  worker_task* tail;
+  int queued;         // submitted tasks no worker has picked up yet
+  int queue_limit;    // 0 for unbounded
+  int pending;        // submitted tasks that haven't finished yet
+  int stopping;
+
+  int nthreads;
+  pthread_t* threads;
+};
+
+int workers_default_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+}
+
+static void* worker_main(void* arg) {
+  worker_pool* pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->head && !pool->stopping)
+      pthread_cond_wait(&pool->task_ready, &pool->lock);
+    if (!pool->head)
+      break;
+
+    worker_task* task = pool->head;
+    pool->head = task->next;
+    if (!pool->head)
+      pool->tail = NULL;
+    pool->queued--;
+    pthread_cond_signal(&pool->task_taken);
+    pthread_mutex_unlock(&pool->lock);
+
+    task->fn(task->arg);
+    free(task);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_broadcast(&pool->all_done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+worker_pool* workers_start(int nthreads, int queue_limit) {
+  worker_pool* pool = calloc(1, sizeof(worker_pool));
+  ASSERT_ERROR_MESSAGE(pool != NULL, "out of memory");
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->task_ready, NULL);
+  pthread_cond_init(&pool->task_taken, NULL);
+  pthread_cond_init(&pool->all_done, NULL);
+
+  pool->queue_limit = queue_limit;
+  pool->nthreads = nthreads > 0 ? nthreads : 1;
+  pool->threads = malloc(pool->nthreads * sizeof(pthread_t));
+  ASSERT_ERROR_MESSAGE(pool->threads != NULL, "out of memory");
+  for (int i = 0; i < pool->nthreads; i++) {
+    int ret = pthread_create(&pool->threads[i], NULL, worker_main, pool);
+    ASSERT_ERROR_MESSAGE(ret == 0, "couldn't start worker thread");
+  }
+
+  return pool;
+}
+
+void workers_submit(worker_pool* pool, worker_fn fn, void* arg) {
+  worker_task* task = malloc(sizeof(worker_task));
+  ASSERT_ERROR_MESSAGE(task != NULL, "out of memory");
+  task->fn = fn;
+  task->arg = arg;
+  task->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->queue_limit > 0 && pool->queued >= pool->queue_limit)
+    pthread_cond_wait(&pool->task_taken, &pool->lock);
+
+  if (pool->tail)
+    pool->tail->next = task;
+  else
+    pool->head = task;
+  pool->tail = task;
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&pool->task_ready);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void workers_wait(worker_pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->all_done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void workers_stop(worker_pool* pool) {
+  workers_wait(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->task_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->task_ready);
+  pthread_cond_destroy(&pool->task_taken);
+  pthread_cond_destroy(&pool->all_done);
+  free(pool->threads);
+  free(pool);
+}
@@ -0,0 +1,24 @@
+/**
+ * A small pool of worker threads that run submitted tasks. Tasks may submit
+ * further tasks; workers_wait returns once every submitted task finished.
+ *
+ * With a queue limit, workers_submit blocks while that many tasks are
+ * waiting, so a producer can't queue up the whole job in memory. Pools whose
+ * tasks submit tasks themselves must be unbounded (limit 0).
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+typedef void (*worker_fn)(void* arg);
+
+typedef struct worker_pool worker_pool;
+
+int workers_default_count(void);
+
+worker_pool* workers_start(int nthreads, int queue_limit);
+void workers_submit(worker_pool* pool, worker_fn fn, void* arg);
+void workers_wait(worker_pool* pool);
+void workers_stop(worker_pool* pool);
+
+#endif